@@ -0,0 +1,801 @@
+#include <boost/predef.h> // Tools to identify the OS.
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/noncopyable.hpp>
+
+#if BOOST_OS_LINUX
+#include <sys/socket.h> // sendmmsg() and recvmmsg().
+#include <cstring>
+#include <cerrno>
+#endif
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <deque>
+#include <unordered_map>
+#include <functional>
+#include <iostream>
+
+using namespace boost;
+
+// Hierarchical timing wheel sharing a single asio::steady_timer among any
+// number of deadlines. Time is divided into ticks; a deadline is kept in one of
+// the 64 slots of the level covering its distance from the current tick, and
+// the deadlines of the higher levels are cascaded down as the wheel turns, so
+// arming and cancelling a deadline take constant time. The steady_timer only
+// runs while deadlines are armed, in order not to keep the event loop busy.
+class TimerWheel : public boost::noncopyable
+{
+public:
+    // A deadline embedded in the object it belongs to. Destroying it cancels it,
+    // waiting for its callback if the callback is running on another thread, so
+    // the owner may capture itself in the callback as long as the Timer member
+    // is declared after everything the callback uses.
+    class Timer : public boost::noncopyable
+    {
+    public:
+        Timer() : m_wheel(nullptr),
+                  m_prev(nullptr),
+                  m_next(nullptr),
+                  m_slot(nullptr),
+                  m_expiry(0),
+                  m_armed(false)
+        {
+        }
+
+        ~Timer()
+        {
+            if (m_wheel != nullptr)
+                m_wheel->Cancel(*this);
+        }
+
+    private:
+        friend class TimerWheel;
+
+        TimerWheel *m_wheel;
+        Timer *m_prev;
+        Timer *m_next;
+        Timer **m_slot;         // Head of the list the timer is in.
+        std::uint64_t m_expiry; // Tick to expire at.
+        bool m_armed;
+        std::function<void()> m_callback;
+    };
+
+    TimerWheel(asio::io_service &ios,
+               std::chrono::milliseconds tick = std::chrono::milliseconds(10)) : m_timer(ios),
+                                                                                  m_tick(tick),
+                                                                                  m_origin(std::chrono::steady_clock::now()),
+                                                                                  m_current_tick(0),
+                                                                                  m_num_armed(0),
+                                                                                  m_ticking(false),
+                                                                                  m_running(nullptr)
+    {
+        for (auto &level : m_slots)
+        {
+            for (auto &slot : level)
+            {
+                slot = nullptr;
+            }
+        }
+    }
+
+    ~TimerWheel()
+    {
+        boost::system::error_code ignored_ec;
+        m_timer.cancel(ignored_ec);
+    }
+
+    // Calls the callback on a thread running the event loop once the timeout
+    // has elapsed, rounded up to the tick. Re-arming an armed timer moves it.
+    void Arm(Timer &timer,
+             std::chrono::steady_clock::duration timeout,
+             std::function<void()> callback)
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        if (timer.m_armed)
+        {
+            Unlink(timer);
+            m_num_armed--;
+        }
+
+        if (!m_ticking)
+        {
+            // The wheel has been idle, catch up with the current time.
+            m_current_tick = GetTickAt(std::chrono::steady_clock::now());
+        }
+
+        std::uint64_t expiry = GetTickAt(std::chrono::steady_clock::now() + timeout + m_tick -
+                                         std::chrono::steady_clock::duration(1));
+
+        timer.m_wheel = this;
+        timer.m_expiry = expiry > m_current_tick ? expiry : m_current_tick + 1;
+        timer.m_callback = std::move(callback);
+        Link(timer);
+        m_num_armed++;
+
+        if (!m_ticking)
+        {
+            m_ticking = true;
+            ScheduleTick();
+        }
+    }
+
+    // Disarms the timer. If its callback is running on another
+    // thread, waits for the callback to return.
+    void Cancel(Timer &timer)
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        while (m_running == &timer && m_running_thread != std::this_thread::get_id())
+        {
+            m_callback_done.wait(lock);
+        }
+
+        if (timer.m_armed)
+        {
+            Unlink(timer);
+            m_num_armed--;
+            timer.m_callback = nullptr;
+        }
+    }
+
+private:
+    static const unsigned int LEVEL_BITS = 6;
+    static const unsigned int SLOT_COUNT = 1 << LEVEL_BITS;
+    static const unsigned int LEVEL_COUNT = 4;
+    static const std::uint64_t MAX_DISTANCE = (std::uint64_t(1) << (LEVEL_BITS * LEVEL_COUNT)) - 1;
+
+    std::uint64_t GetTickAt(std::chrono::steady_clock::time_point time) const
+    {
+        return static_cast<std::uint64_t>((time - m_origin) / m_tick);
+    }
+
+    // Puts the timer into the slot of the level covering its distance from
+    // the current tick. Timers further away than the last level covers are
+    // parked at its far end and placed again when cascaded.
+    void Link(Timer &timer)
+    {
+        std::uint64_t distance = timer.m_expiry - m_current_tick;
+        std::uint64_t expiry = distance > MAX_DISTANCE ? m_current_tick + MAX_DISTANCE
+                                                       : timer.m_expiry;
+
+        unsigned int level = 0;
+        while (level < LEVEL_COUNT - 1 &&
+               distance >= (std::uint64_t(1) << (LEVEL_BITS * (level + 1))))
+        {
+            level++;
+        }
+
+        Timer *&head = m_slots[level][(expiry >> (LEVEL_BITS * level)) & (SLOT_COUNT - 1)];
+
+        timer.m_prev = nullptr;
+        timer.m_next = head;
+        if (head != nullptr)
+            head->m_prev = &timer;
+        head = &timer;
+
+        timer.m_armed = true;
+        timer.m_slot = &head;
+    }
+
+    void Unlink(Timer &timer)
+    {
+        if (timer.m_prev != nullptr)
+            timer.m_prev->m_next = timer.m_next;
+        else
+            *timer.m_slot = timer.m_next;
+
+        if (timer.m_next != nullptr)
+            timer.m_next->m_prev = timer.m_prev;
+
+        timer.m_prev = nullptr;
+        timer.m_next = nullptr;
+        timer.m_armed = false;
+    }
+
+    void ScheduleTick()
+    {
+        m_timer.expires_at(m_origin + m_tick * static_cast<std::int64_t>(m_current_tick + 1));
+        m_timer.async_wait([this](const boost::system::error_code &ec)
+                           {
+                               if (ec != asio::error::operation_aborted)
+                                   onTick();
+                           });
+    }
+
+    // Advances the wheel up to the current time, firing the timers
+    // that have expired. The callbacks are called without holding the lock,
+    // so that they may arm and cancel timers themselves.
+    void onTick()
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        std::uint64_t now_tick = GetTickAt(std::chrono::steady_clock::now());
+
+        while (m_current_tick < now_tick && m_num_armed > 0)
+        {
+            m_current_tick++;
+
+            // Cascade the slots of the higher levels whose time has come.
+            for (unsigned int level = 1; level < LEVEL_COUNT; level++)
+            {
+                if ((m_current_tick & ((std::uint64_t(1) << (LEVEL_BITS * level)) - 1)) != 0)
+                    break;
+
+                Cascade(level, (m_current_tick >> (LEVEL_BITS * level)) & (SLOT_COUNT - 1));
+            }
+
+            Timer *&head = m_slots[0][m_current_tick & (SLOT_COUNT - 1)];
+            while (head != nullptr)
+            {
+                Timer &timer = *head;
+                Unlink(timer);
+
+                if (timer.m_expiry > m_current_tick)
+                {
+                    // Parked at the far end of the last level.
+                    Link(timer);
+                    continue;
+                }
+
+                m_num_armed--;
+                std::function<void()> callback = std::move(timer.m_callback);
+                timer.m_callback = nullptr;
+
+                m_running = &timer;
+                m_running_thread = std::this_thread::get_id();
+                lock.unlock();
+
+                callback();
+
+                lock.lock();
+                m_running = nullptr;
+                m_callback_done.notify_all();
+            }
+        }
+
+        if (m_num_armed > 0)
+        {
+            ScheduleTick();
+        }
+        else
+        {
+            m_ticking = false;
+        }
+    }
+
+    void Cascade(unsigned int level, std::uint64_t slot)
+    {
+        Timer *head = m_slots[level][slot];
+        m_slots[level][slot] = nullptr;
+
+        while (head != nullptr)
+        {
+            Timer *next = head->m_next;
+            Link(*head);
+            head = next;
+        }
+    }
+
+private:
+    asio::steady_timer m_timer;
+    std::chrono::steady_clock::duration m_tick;
+    std::chrono::steady_clock::time_point m_origin;
+
+    Timer *m_slots[LEVEL_COUNT][SLOT_COUNT];
+    std::uint64_t m_current_tick;
+    std::size_t m_num_armed;
+    bool m_ticking;
+
+    // The timer whose callback is running, if any.
+    Timer *m_running;
+    std::thread::id m_running_thread;
+    std::condition_variable m_callback_done;
+
+    std::mutex m_guard;
+};
+
+// Function pointer type that points to the callback
+// function which is called when a request is complete.
+// Callbacks are called on the client's I/O thread.
+typedef void (*Callback)(unsigned int request_id,        // unique identifier of the request is assigned to the request when it was initiated.
+                         const std::string &response,    // the response data
+                         const system::error_code &ec);  // error information
+
+// Asynchronous UDP client multiplexing any number of outstanding requests
+// to any number of servers over a single socket. Each request datagram is
+// prefixed with the request's ID, which the server echoes at the beginning
+// of its response, e.g. "7 EMULATE_LONG_COMP_OP 10\n" is answered with
+// "7 OK\n". A request not answered within the timeout is sent again, up to
+// max_retransmits times, and then completes with asio::error::timed_out.
+//
+// The socket is non-blocking and all the processing happens on a single
+// I/O thread: once the socket becomes readable or writable, as many
+// datagrams as possible are received or sent, BATCH_SIZE at a time,
+// with one recvmmsg() or sendmmsg() call per batch on Linux.
+class AsyncUDPClient : public boost::noncopyable
+{
+public:
+    AsyncUDPClient(std::chrono::milliseconds timeout = std::chrono::seconds(1),
+                   unsigned int max_retransmits = 2) : m_sock(m_ios),
+                                                       m_wheel(m_ios),
+                                                       m_timeout(timeout),
+                                                       m_max_retransmits(max_retransmits),
+                                                       m_waiting_write(false),
+                                                       m_closing(false)
+    {
+        m_sock.open(asio::ip::udp::v4());
+        m_sock.non_blocking(true);
+
+        m_work.reset(new boost::asio::io_service::work(m_ios));
+
+        startReceive();
+
+        m_thread.reset(new std::thread([this]()
+                                       { m_ios.run(); }));
+    }
+
+    // Initiates a request to the server. Request IDs must be unique
+    // among the outstanding requests.
+    void emulateLongComputationOp(unsigned int duration_sec,
+                                  const std::string &raw_ip_address,
+                                  unsigned short port_num,
+                                  Callback callback,
+                                  unsigned int request_id)
+    {
+        std::shared_ptr<Request> request(new Request());
+
+        request->m_id = request_id;
+        request->m_ep = asio::ip::udp::endpoint(asio::ip::address::from_string(raw_ip_address),
+                                                port_num);
+        request->m_datagram = std::to_string(request_id) + " EMULATE_LONG_COMP_OP " +
+                              std::to_string(duration_sec) + "\n";
+        request->m_callback = callback;
+
+        asio::post(m_ios, [this, request]()
+                   { startRequest(request); });
+    }
+
+    // Completes the request with asio::error::operation_aborted
+    // if it is still outstanding.
+    void cancelRequest(unsigned int request_id)
+    {
+        asio::post(m_ios, [this, request_id]()
+                   {
+                       auto it = m_requests.find(request_id);
+                       if (it != m_requests.end())
+                           onRequestComplete(it, std::string(), asio::error::operation_aborted);
+                   });
+    }
+
+    // Blocks until all the outstanding requests complete,
+    // then closes the socket and stops the I/O thread.
+    void close()
+    {
+        asio::post(m_ios, [this]()
+                   {
+                       m_closing = true;
+                       closeIfIdle();
+                   });
+
+        m_work.reset(NULL);
+        m_thread->join();
+    }
+
+private:
+    static const std::size_t BATCH_SIZE = 32;
+    static const std::size_t MAX_DATAGRAM_SIZE = 1472; // Fits an Ethernet frame.
+
+    struct Request
+    {
+        Request() : m_callback(nullptr),
+                    m_transmissions(0),
+                    m_queued(false) {}
+
+        unsigned int m_id;
+        asio::ip::udp::endpoint m_ep;
+        std::string m_datagram;
+        Callback m_callback;
+        unsigned int m_transmissions;
+        bool m_queued; // Whether the datagram is in the send queue.
+        TimerWheel::Timer m_timeout; // Declared last to be cancelled first.
+    };
+
+    typedef std::unordered_map<unsigned int, std::shared_ptr<Request>> RequestMap;
+
+    void startRequest(std::shared_ptr<Request> request)
+    {
+        if (m_requests.find(request->m_id) != m_requests.end())
+        {
+            request->m_callback(request->m_id, std::string(), asio::error::already_started);
+            return;
+        }
+
+        m_requests[request->m_id] = request;
+        transmit(request);
+    }
+
+    // Queues the request's datagram and arms the timeout of this transmission.
+    // A datagram still queued from the previous transmission, because the
+    // socket's send buffer has been full since, is not queued twice.
+    void transmit(std::shared_ptr<Request> request)
+    {
+        request->m_transmissions++;
+
+        unsigned int request_id = request->m_id;
+        m_wheel.Arm(request->m_timeout,
+                    m_timeout,
+                    [this, request_id]()
+                    { onTimeout(request_id); });
+
+        if (request->m_queued)
+            return;
+
+        request->m_queued = true;
+        m_send_queue.push_back(request);
+        sendPending();
+    }
+
+    void onTimeout(unsigned int request_id)
+    {
+        auto it = m_requests.find(request_id);
+        if (it == m_requests.end())
+            return;
+
+        if (it->second->m_transmissions <= m_max_retransmits)
+        {
+            transmit(it->second);
+            return;
+        }
+
+        onRequestComplete(it, std::string(), asio::error::timed_out);
+    }
+
+    // A queued datagram is only sent if its request is still outstanding.
+    bool isOutstanding(const std::shared_ptr<Request> &request) const
+    {
+        auto it = m_requests.find(request->m_id);
+        return it != m_requests.end() && it->second == request;
+    }
+
+    // Sends the queued datagrams until the queue is empty or the socket's
+    // send buffer is full, in which case the rest is sent once the socket
+    // becomes writable.
+    void sendPending()
+    {
+        if (m_waiting_write)
+            return;
+
+        while (!m_send_queue.empty())
+        {
+            std::size_t count = 0;
+            while (count < BATCH_SIZE && count < m_send_queue.size())
+            {
+                if (isOutstanding(m_send_queue[count]))
+                {
+                    count++;
+                }
+                else
+                {
+                    m_send_queue[count]->m_queued = false;
+                    m_send_queue.erase(m_send_queue.begin() + count);
+                }
+            }
+
+            if (count == 0)
+                break;
+
+            system::error_code ec;
+            std::size_t sent = sendBatch(count, ec);
+            for (std::size_t i = 0; i < sent; i++)
+            {
+                m_send_queue[i]->m_queued = false;
+            }
+            m_send_queue.erase(m_send_queue.begin(), m_send_queue.begin() + sent);
+
+            if (ec == asio::error::would_block)
+            {
+                startWaitWritable();
+                return;
+            }
+
+            if (ec.value() != 0)
+            {
+                // The first datagram not sent cannot be sent at all,
+                // e.g. because its destination is unreachable.
+                std::shared_ptr<Request> request = m_send_queue.front();
+                request->m_queued = false;
+                m_send_queue.pop_front();
+                onRequestComplete(m_requests.find(request->m_id), std::string(), ec);
+            }
+        }
+    }
+
+    // Sends the first count datagrams of the queue and returns the number of
+    // datagrams sent. ec designates why the next datagram could not be sent.
+    std::size_t sendBatch(std::size_t count, system::error_code &ec)
+    {
+#if BOOST_OS_LINUX
+        mmsghdr messages[BATCH_SIZE];
+        iovec buffers[BATCH_SIZE];
+
+        for (std::size_t i = 0; i < count; i++)
+        {
+            Request &request = *m_send_queue[i];
+
+            buffers[i].iov_base = &request.m_datagram[0];
+            buffers[i].iov_len = request.m_datagram.size();
+
+            std::memset(&messages[i], 0, sizeof(messages[i]));
+            messages[i].msg_hdr.msg_name = request.m_ep.data();
+            messages[i].msg_hdr.msg_namelen = request.m_ep.size();
+            messages[i].msg_hdr.msg_iov = &buffers[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int sent = ::sendmmsg(m_sock.native_handle(), messages, count, 0);
+        if (sent < 0)
+        {
+            ec = system::error_code(errno, asio::error::get_system_category());
+            return 0;
+        }
+
+        return sent;
+#else
+        std::size_t sent = 0;
+        for (; sent < count; sent++)
+        {
+            Request &request = *m_send_queue[sent];
+
+            m_sock.send_to(asio::buffer(request.m_datagram), request.m_ep, 0, ec);
+            if (ec.value() != 0)
+                break;
+        }
+
+        return sent;
+#endif
+    }
+
+    void startWaitWritable()
+    {
+        m_waiting_write = true;
+
+        m_sock.async_wait(asio::ip::udp::socket::wait_write,
+                          [this](const system::error_code &ec)
+                          {
+                              m_waiting_write = false;
+
+                              if (ec.value() == 0)
+                                  sendPending();
+                          });
+    }
+
+    void startReceive()
+    {
+        if (!m_sock.is_open())
+            return;
+
+        m_sock.async_wait(asio::ip::udp::socket::wait_read,
+                          [this](const system::error_code &ec)
+                          {
+                              // The socket has been closed.
+                              if (ec.value() != 0)
+                                  return;
+
+                              receivePending();
+                              startReceive();
+                          });
+    }
+
+    // Receives the datagrams until there are no more of them.
+    void receivePending()
+    {
+        while (true)
+        {
+            system::error_code ec;
+            std::size_t received = receiveBatch(ec);
+
+            for (std::size_t i = 0; i < received; i++)
+            {
+                onDatagramReceived(i);
+            }
+
+            // A failure other than having nothing to receive, e.g. an ICMP
+            // error reported for an earlier datagram, does not prevent
+            // receiving further datagrams once the socket is readable again.
+            if (ec.value() != 0 || received < BATCH_SIZE)
+                break;
+        }
+    }
+
+    // Receives up to BATCH_SIZE datagrams into the receive buffers and returns
+    // their number. ec designates why no more datagrams could be received.
+    std::size_t receiveBatch(system::error_code &ec)
+    {
+#if BOOST_OS_LINUX
+        mmsghdr messages[BATCH_SIZE];
+        iovec buffers[BATCH_SIZE];
+
+        for (std::size_t i = 0; i < BATCH_SIZE; i++)
+        {
+            buffers[i].iov_base = m_recv_bufs[i];
+            buffers[i].iov_len = MAX_DATAGRAM_SIZE;
+
+            std::memset(&messages[i], 0, sizeof(messages[i]));
+            messages[i].msg_hdr.msg_name = m_recv_eps[i].data();
+            messages[i].msg_hdr.msg_namelen = m_recv_eps[i].capacity();
+            messages[i].msg_hdr.msg_iov = &buffers[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int received = ::recvmmsg(m_sock.native_handle(), messages, BATCH_SIZE, 0, nullptr);
+        if (received < 0)
+        {
+            ec = system::error_code(errno, asio::error::get_system_category());
+            return 0;
+        }
+
+        for (int i = 0; i < received; i++)
+        {
+            m_recv_eps[i].resize(messages[i].msg_hdr.msg_namelen);
+            m_recv_sizes[i] = messages[i].msg_len;
+        }
+
+        return received;
+#else
+        std::size_t received = 0;
+        for (; received < BATCH_SIZE; received++)
+        {
+            m_recv_sizes[received] = m_sock.receive_from(asio::buffer(m_recv_bufs[received]),
+                                                         m_recv_eps[received], 0, ec);
+            if (ec.value() != 0)
+                break;
+        }
+
+        return received;
+#endif
+    }
+
+    // Matches the i-th received datagram to the outstanding request
+    // by the ID it begins with and by the endpoint it came from.
+    void onDatagramReceived(std::size_t i)
+    {
+        const char *data = m_recv_bufs[i];
+        std::size_t size = m_recv_sizes[i];
+
+        std::size_t pos = 0;
+        unsigned int request_id = 0;
+        while (pos < size && data[pos] >= '0' && data[pos] <= '9')
+        {
+            request_id = request_id * 10 + (data[pos] - '0');
+            pos++;
+        }
+
+        if (pos == 0 || pos == size || data[pos] != ' ')
+            return;
+
+        // Replies to the requests that have completed
+        // meanwhile, e.g. to a retransmission, are dropped.
+        auto it = m_requests.find(request_id);
+        if (it == m_requests.end() || it->second->m_ep != m_recv_eps[i])
+            return;
+
+        std::string response(data + pos + 1, size - pos - 1);
+        if (!response.empty() && response.back() == '\n')
+            response.pop_back();
+
+        onRequestComplete(it, response, system::error_code());
+    }
+
+    void onRequestComplete(RequestMap::iterator it,
+                           const std::string &response,
+                           const system::error_code &ec)
+    {
+        std::shared_ptr<Request> request = it->second;
+        m_requests.erase(it);
+
+        m_wheel.Cancel(request->m_timeout);
+
+        request->m_callback(request->m_id, response, ec);
+
+        closeIfIdle();
+    }
+
+    // Closing the socket cancels the waits, letting the I/O thread exit.
+    void closeIfIdle()
+    {
+        if (!m_closing || !m_requests.empty())
+            return;
+
+        boost::system::error_code ignored_ec;
+        m_sock.close(ignored_ec);
+    }
+
+private:
+    asio::io_service m_ios;
+    asio::ip::udp::socket m_sock;
+    TimerWheel m_wheel;
+
+    std::chrono::milliseconds m_timeout;
+    unsigned int m_max_retransmits;
+
+    // Outstanding requests and the datagrams waiting to be sent.
+    RequestMap m_requests;
+    std::deque<std::shared_ptr<Request>> m_send_queue;
+    bool m_waiting_write;
+    bool m_closing;
+
+    char m_recv_bufs[BATCH_SIZE][MAX_DATAGRAM_SIZE];
+    asio::ip::udp::endpoint m_recv_eps[BATCH_SIZE];
+    std::size_t m_recv_sizes[BATCH_SIZE];
+
+    std::unique_ptr<boost::asio::io_service::work> m_work;
+    std::unique_ptr<std::thread> m_thread;
+};
+
+void handler(unsigned int request_id,
+             const std::string &response,
+             const system::error_code &ec)
+{
+    if (ec.value() == 0)
+    {
+        std::cout << "Request #" << request_id
+                  << " has completed. Response: "
+                  << response << std::endl;
+    }
+    else if (ec == asio::error::operation_aborted)
+    {
+        std::cout << "Request #" << request_id
+                  << " has been cancelled by the user."
+                  << std::endl;
+    }
+    else
+    {
+        std::cout << "Request #" << request_id
+                  << " failed! Error code = " << ec.value()
+                  << ". Error message = " << ec.message()
+                  << std::endl;
+    }
+}
+
+int main()
+{
+    const std::string server1_raw_ip_address = "127.0.0.1";
+    const unsigned short server1_port_num = 5000;
+
+    const std::string server2_raw_ip_address = "192.168.1.10";
+    const unsigned short server2_port_num = 3334;
+
+    try
+    {
+        // Each attempt waits for 12 seconds, enough for the server
+        // to perform the 10 seconds long operation, and a lost
+        // datagram is retransmitted once.
+        AsyncUDPClient client(std::chrono::seconds(12), 1);
+
+        // Both requests are outstanding at the same time, a slow
+        // or unresponsive server does not delay the other one.
+        client.emulateLongComputationOp(10, server1_raw_ip_address, server1_port_num,
+                                        handler, 1);
+        client.emulateLongComputationOp(10, server2_raw_ip_address, server2_port_num,
+                                        handler, 2);
+
+        // Waits for both requests to complete.
+        client.close();
+    }
+    catch (system::system_error &e)
+    {
+        std::cout << "Error occured! Error code = " << e.code()
+                  << ". Message: " << e.what();
+
+        return e.code().value();
+    }
+
+    return 0;
+}
@@ -14,6 +14,7 @@
 #endif
 #endif
 
+#include <utility> // Some Boost.Asio versions use std::exchange in awaitable.hpp without including it.
 #include <boost/asio.hpp>
 #include <boost/noncopyable.hpp>
 
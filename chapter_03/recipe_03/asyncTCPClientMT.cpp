@@ -1,332 +1,2293 @@
-#include <boost/predef.h> // Tools to identify the OS.
-
-// We need this to enable cancelling of I/O operations on
-// Windows XP, Windows Server 2003 and earlier.
-// Refer to "http://www.boost.org/doc/libs/1_58_0/
-// doc/html/boost_asio/reference/basic_stream_socket/
-// cancel/overload1.html" for details.
-#ifdef BOOST_OS_WINDOWS
-#define _WIN32_WINNT 0x0501
-
-#if _WIN32_WINNT <= 0x0502 // Windows Server 2003 or earlier.
-#define BOOST_ASIO_DISABLE_IOCP
-#define BOOST_ASIO_ENABLE_CANCELIO
-#endif
-#endif
-
-#include <boost/asio.hpp>
-#include <boost/noncopyable.hpp>
-
-#include <thread>
-#include <mutex>
-#include <memory>
-#include <list>
-#include <iostream>
-
-using namespace boost;
-
-// Function pointer type that points to the callback
-// function which is called when a request is complete.
-// Based on the values of the parameters passed to it, it outputs information about the finished request.
-typedef void (*Callback)(unsigned int request_id,        // unique identifier of the request is assigned to the request when it was initiated.
-                         const std::string &response,    // the response data
-                         const system::error_code &ec);  // error information
-
-// data structure whose purpose is to keep the data related to a particular request while it is being executed
-struct Session
-{
-    Session(asio::io_service &ios,
-            const std::string &raw_ip_address,
-            unsigned short port_num,
-            const std::string &request,
-            unsigned int id,
-            Callback callback) : m_sock(ios),
-                                 m_ep(asio::ip::address::from_string(raw_ip_address),
-                                      port_num),
-                                 m_request(request),
-                                 m_id(id),
-                                 m_callback(callback),
-                                 m_was_cancelled(false) {}
-
-    asio::ip::tcp::socket m_sock; // Socket used for communication
-    asio::ip::tcp::endpoint m_ep; // Remote endpoint.
-    std::string m_request;        // Request string.
-
-    // streambuf where the response will be stored.
-    asio::streambuf m_response_buf;
-    std::string m_response; // Response represented as a string.
-
-    // Contains the description of an error if one occurs during
-    // the request lifecycle.
-    system::error_code m_ec;
-
-    unsigned int m_id; // Unique ID assigned to the request.
-
-    // Pointer to the function to be called when the request
-    // completes.
-    Callback m_callback;
-
-    bool m_was_cancelled;
-    std::mutex m_cancel_guard;
-};
-
-// class that provides the asynchronous communication functionality.
-class AsyncTCPClient : public boost::noncopyable
-{
-public:
-    AsyncTCPClient(unsigned char num_of_threads)
-    {
-
-        //instantiates an object of the asio::io_service::work class
-        // passing an instance of the asio::io_service class named m_ios to its constructor
-        m_work.reset(new boost::asio::io_service::work(m_ios));
-
-        for (unsigned char i = 1; i <= num_of_threads; i++)
-        {
-            //spawns a thread that calls the run() method of the m_ios object.
-            std::unique_ptr<std::thread> th(
-                new std::thread([this]()
-                                { m_ios.run(); }));
-
-            m_threads.push_back(std::move(th));
-        }
-    }
-    // initiates a request to the server
-    void emulateLongComputationOp(
-        unsigned int duration_sec,          //represents the request parameter according to the application layer protocol
-        const std::string &raw_ip_address,  //specify the server to which the request should be sent.
-        unsigned short port_num,            //specify the server to which the request should be sent.
-        Callback callback,                  //callback function, which will be called when the request is complete.
-        unsigned int request_id)    // unique identifier of the request
-    {
-
-        // preparing a request string and allocating an instance of the Session structure
-        // that keeps the data associated with the request including a socket object
-        // that is used to communicate with the server.
-        std::string request = "EMULATE_LONG_CALC_OP " + std::to_string(duration_sec) + "\n";
-        std::shared_ptr<Session> session =
-            std::shared_ptr<Session>(new Session(m_ios,
-                                                 raw_ip_address,
-                                                 port_num,
-                                                 request,
-                                                 request_id,
-                                                 callback));
-
-        //opened socket and the pointer to the Session object is added to the m_active_sessions map
-        session->m_sock.open(session->m_ep.protocol());
-
-        // Add new session to the list of active sessions so
-        // that we can access it if the user decides to cancel
-        // the corresponding request before it completes.
-        // Because active sessions list can be accessed from
-        // multiple threads, we guard it with a mutex to avoid
-        // data corruption.
-        std::unique_lock<std::mutex> lock(m_active_sessions_guard);
-        m_active_sessions[request_id] = session;
-        lock.unlock();
-
-        //connect the socket to the server
-        session->m_sock.async_connect(session->m_ep,
-                                      [this, session](const system::error_code &ec)
-                                      {
-                                          //checking the error code passed to it as the ec argument
-                                          if (ec.value() != 0)
-                                          {
-                                              //we store the ec value in the corresponding Session object,
-                                              session->m_ec = ec;
-                                              //call the class's onRequestComplete() private method passing the Session object to it as an argument
-                                              onRequestComplete(session);
-                                              //then return.
-                                              return;
-                                          }
-
-                                          // lock the m_cancel_guard mutex (the member of the request descriptor object)
-                                          std::unique_lock<std::mutex> cancel_lock(session->m_cancel_guard);
-
-                                          //check whether the request has not been canceled yet. 
-                                          if (session->m_was_cancelled)
-                                          {
-                                              onRequestComplete(session);
-                                              return;
-                                          }
-
-                                          //If we see that the request has not been canceled
-                                          //we initiate the next asynchronous operation calling the Boost.Asio free function async_write()
-                                          // to send the request data to the server.
-                                          asio::async_write(session->m_sock,
-                                                            asio::buffer(session->m_request),
-                                                            [this, session](const boost::system::error_code &ec,
-                                                                            std::size_t bytes_transferred)
-                                                            {
-                                                                // check the error code
-                                                                if (ec.value() != 0)
-                                                                {
-                                                                    session->m_ec = ec;
-                                                                    onRequestComplete(session);
-                                                                    return;
-                                                                }
-
-                                                                //// lock the m_cancel_guard mutex (the member of the request descriptor object)
-                                                                std::unique_lock<std::mutex> cancel_lock(session->m_cancel_guard);
-
-                                                                // check whether or not the request has been canceled. 
-                                                                if (session->m_was_cancelled)
-                                                                {
-                                                                    onRequestComplete(session);
-                                                                    return;
-                                                                }
-
-                                                                // initiate the next asynchronous operation—async_read_until()—in order to receive a response from the server
-                                                                asio::async_read_until(session->m_sock,
-                                                                                       session->m_response_buf,
-                                                                                       '\n',
-                                                                                       [this, session](const boost::system::error_code &ec,
-                                                                                                       std::size_t bytes_transferred)
-                                                                                       {
-                                                                                           //checks the error code
-                                                                                           if (ec.value() != 0)
-                                                                                           {
-                                                                                               session->m_ec = ec;
-                                                                                           }
-                                                                                           else
-                                                                                           {
-                                                                                               std::istream strm(&session->m_response_buf);
-                                                                                               std::getline(strm, session->m_response);
-                                                                                           }
-
-                                                                                           // the AsyncTCPClient class's private method onRequestComplete() is called
-                                                                                           // and the Session object is passed to it as an argument.
-                                                                                           onRequestComplete(session);
-                                                                                       });
-                                                            });
-                                      });
-    };
-
-    // cancels the previously initiated request designated by the request_id argument
-    void cancelRequest(unsigned int request_id) //accepts an identifier of the request to be canceled as an argument.
-    {
-        std::unique_lock<std::mutex>
-            lock(m_active_sessions_guard);
-
-        //looking for the Session object corresponding to the specified request in the m_active_sessions map.
-        auto it = m_active_sessions.find(request_id);
-        if (it != m_active_sessions.end())
-        {
-            std::unique_lock<std::mutex>
-                cancel_lock(it->second->m_cancel_guard);
-
-            it->second->m_was_cancelled = true;
-            it->second->m_sock.cancel();
-        }
-    }
-
-    // blocks the calling thread until all the currently running requests complete and deinitializes the client.
-    void close()
-    {
-        // Destroy work object. This allows the I/O threads to
-        // exit the event loop when there are no more pending
-        // asynchronous operations.
-        m_work.reset(NULL);
-
-        // Waiting for the I/O threads to exit.
-        for (auto &thread : m_threads)
-        {
-            thread->join();
-        }
-    }
-
-private:
-    // method is called whenever the request completes with any result.
-    void onRequestComplete(std::shared_ptr<Session> session)
-    {
-        // Shutting down the connection. This method may
-        // fail in case socket is not connected. We don�t care
-        // about the error code if this function fails.
-        boost::system::error_code ignored_ec;
-
-        session->m_sock.shutdown( asio::ip::tcp::socket::shutdown_both, ignored_ec);
-
-        // Remove session form the map of active sessions.
-        std::unique_lock<std::mutex>
-            lock(m_active_sessions_guard);
-
-        auto it = m_active_sessions.find(session->m_id);
-        if (it != m_active_sessions.end())
-            m_active_sessions.erase(it);
-
-        lock.unlock();
-
-        boost::system::error_code ec;
-
-        if (session->m_ec.value() == 0 && session->m_was_cancelled)
-            ec = asio::error::operation_aborted;
-        else
-            ec = session->m_ec;
-
-        // Call the callback provided by the user.
-        session->m_callback(session->m_id,
-                            session->m_response, ec);
-    };
-
-private:
-    asio::io_service m_ios;
-    std::map<int, std::shared_ptr<Session>> m_active_sessions;
-    std::mutex m_active_sessions_guard;
-    std::unique_ptr<boost::asio::io_service::work> m_work;
-    std::list<std::unique_ptr<std::thread>> m_threads;
-};
-
-// a function that will serve as a callback, which we'll pass to the AsyncTCPClient::emulateLongComputationOp() method
-// It outputs the result of the request execution and the response message to the standard output stream if the request is completed successfully
-void handler(unsigned int request_id,
-             const std::string &response,
-             const system::error_code &ec)
-{
-    if (ec.value() == 0)
-    {
-        std::cout << "Request #" << request_id
-                  << " has completed. Response: "
-                  << response << std::endl;
-    }
-    else if (ec == asio::error::operation_aborted)
-    {
-        std::cout << "Request #" << request_id
-                  << " has been cancelled by the user."
-                  << std::endl;
-    }
-    else
-    {
-        std::cout << "Request #" << request_id
-                  << " failed! Error code = " << ec.value()
-                  << ". Error message = " << ec.message()
-                  << std::endl;
-    }
-
-    return;
-}
-
-int main()
-{
-    try
-    {
-        AsyncTCPClient client(4);
-
-        // Here we emulate the user's behavior.
-
-        // creates an instance of the AsyncTCPClient class and then calls its emulateLongComputationOp() method to initiate three asynchronous requests
-        // User initiates a request with id 1.
-        client.emulateLongComputationOp(10, "127.0.0.1", 3333, handler, 1);
-
-        // Decides to exit the application.
-        client.close();
-    }
-    catch (system::system_error &e)
-    {
-        std::cout << "Error occured! Error code = " << e.code()
-                  << ". Message: " << e.what();
-
-        return e.code().value();
-    }
-
-    return 0;
-};
+#include <boost/predef.h> // Tools to identify the OS.
+
+// We need this to enable cancelling of I/O operations on
+// Windows XP, Windows Server 2003 and earlier.
+// Refer to "http://www.boost.org/doc/libs/1_58_0/
+// doc/html/boost_asio/reference/basic_stream_socket/
+// cancel/overload1.html" for details.
+#ifdef BOOST_OS_WINDOWS
+#define _WIN32_WINNT 0x0501
+
+#if _WIN32_WINNT <= 0x0502 // Windows Server 2003 or earlier.
+#define BOOST_ASIO_DISABLE_IOCP
+#define BOOST_ASIO_ENABLE_CANCELIO
+#endif
+#endif
+
+#include <utility> // Some Boost.Asio versions use std::exchange in awaitable.hpp without including it.
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/noncopyable.hpp>
+
+#if BOOST_OS_LINUX
+#include <unistd.h>
+#include <netinet/tcp.h>
+#endif
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <type_traits>
+#include <algorithm>
+#include <iterator>
+#include <string>
+#include <stdexcept>
+#include <iostream>
+
+using namespace boost;
+
+// Small fixed-size arena used to allocate the memory associated with
+// asynchronous operations. A session runs its connect, write and read
+// operations one after another, so a single block is enough; larger or
+// overlapping requests fall back to the global operator new.
+class HandlerMemory
+{
+public:
+    HandlerMemory() : m_in_use(false)
+    {
+    }
+
+    HandlerMemory(const HandlerMemory &) = delete;
+    HandlerMemory &operator=(const HandlerMemory &) = delete;
+
+    void *allocate(std::size_t size)
+    {
+        if (!m_in_use && size <= sizeof(m_storage))
+        {
+            m_in_use = true;
+            return &m_storage;
+        }
+
+        return ::operator new(size);
+    }
+
+    void deallocate(void *pointer)
+    {
+        if (pointer == &m_storage)
+        {
+            m_in_use = false;
+            return;
+        }
+
+        ::operator delete(pointer);
+    }
+
+private:
+    typename std::aligned_storage<1024>::type m_storage;
+    bool m_in_use;
+};
+
+// Allocator satisfying the standard allocator requirements that
+// hands out the memory of a HandlerMemory arena.
+template <typename T>
+class HandlerAllocator
+{
+public:
+    typedef T value_type;
+
+    explicit HandlerAllocator(HandlerMemory &memory) : m_memory(memory)
+    {
+    }
+
+    template <typename U>
+    HandlerAllocator(const HandlerAllocator<U> &other) noexcept : m_memory(other.m_memory)
+    {
+    }
+
+    bool operator==(const HandlerAllocator &other) const noexcept
+    {
+        return &m_memory == &other.m_memory;
+    }
+
+    bool operator!=(const HandlerAllocator &other) const noexcept
+    {
+        return &m_memory != &other.m_memory;
+    }
+
+    T *allocate(std::size_t n) const
+    {
+        return static_cast<T *>(m_memory.allocate(sizeof(T) * n));
+    }
+
+    void deallocate(T *p, std::size_t /*n*/) const
+    {
+        return m_memory.deallocate(p);
+    }
+
+private:
+    template <typename>
+    friend class HandlerAllocator;
+
+    HandlerMemory &m_memory;
+};
+
+// Wraps a completion handler so that Boost.Asio finds its associated
+// allocator and allocates the operation's memory from the arena.
+template <typename Handler>
+class CustomAllocHandler
+{
+public:
+    typedef HandlerAllocator<Handler> allocator_type;
+
+    CustomAllocHandler(HandlerMemory &memory, Handler handler) : m_memory(memory),
+                                                                 m_handler(handler)
+    {
+    }
+
+    allocator_type get_allocator() const noexcept
+    {
+        return allocator_type(m_memory);
+    }
+
+    template <typename... Args>
+    void operator()(Args &&...args)
+    {
+        m_handler(std::forward<Args>(args)...);
+    }
+
+private:
+    HandlerMemory &m_memory;
+    Handler m_handler;
+};
+
+template <typename Handler>
+inline CustomAllocHandler<Handler> MakeCustomAllocHandler(
+    HandlerMemory &memory, Handler handler)
+{
+    return CustomAllocHandler<Handler>(memory, handler);
+}
+
+// Hierarchical timing wheel sharing a single asio::steady_timer among any
+// number of deadlines. Time is divided into ticks; a deadline is kept in one of
+// the 64 slots of the level covering its distance from the current tick, and
+// the deadlines of the higher levels are cascaded down as the wheel turns, so
+// arming and cancelling a deadline take constant time. The steady_timer only
+// runs while deadlines are armed, in order not to keep the event loop busy.
+class TimerWheel : public boost::noncopyable
+{
+public:
+    // A deadline embedded in the object it belongs to. Destroying it cancels it,
+    // waiting for its callback if the callback is running on another thread, so
+    // the owner may capture itself in the callback as long as the Timer member
+    // is declared after everything the callback uses.
+    class Timer : public boost::noncopyable
+    {
+    public:
+        Timer() : m_wheel(nullptr),
+                  m_prev(nullptr),
+                  m_next(nullptr),
+                  m_slot(nullptr),
+                  m_expiry(0),
+                  m_armed(false)
+        {
+        }
+
+        ~Timer()
+        {
+            if (m_wheel != nullptr)
+                m_wheel->Cancel(*this);
+        }
+
+    private:
+        friend class TimerWheel;
+
+        TimerWheel *m_wheel;
+        Timer *m_prev;
+        Timer *m_next;
+        Timer **m_slot;         // Head of the list the timer is in.
+        std::uint64_t m_expiry; // Tick to expire at.
+        bool m_armed;
+        std::function<void()> m_callback;
+    };
+
+    TimerWheel(asio::io_service &ios,
+               std::chrono::milliseconds tick = std::chrono::milliseconds(10)) : m_timer(ios),
+                                                                                  m_tick(tick),
+                                                                                  m_origin(std::chrono::steady_clock::now()),
+                                                                                  m_current_tick(0),
+                                                                                  m_num_armed(0),
+                                                                                  m_ticking(false),
+                                                                                  m_running(nullptr)
+    {
+        for (auto &level : m_slots)
+        {
+            for (auto &slot : level)
+            {
+                slot = nullptr;
+            }
+        }
+    }
+
+    ~TimerWheel()
+    {
+        boost::system::error_code ignored_ec;
+        m_timer.cancel(ignored_ec);
+    }
+
+    // Calls the callback on a thread running the event loop once the timeout
+    // has elapsed, rounded up to the tick. Re-arming an armed timer moves it.
+    void Arm(Timer &timer,
+             std::chrono::steady_clock::duration timeout,
+             std::function<void()> callback)
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        if (timer.m_armed)
+        {
+            Unlink(timer);
+            m_num_armed--;
+        }
+
+        if (!m_ticking)
+        {
+            // The wheel has been idle, catch up with the current time.
+            m_current_tick = GetTickAt(std::chrono::steady_clock::now());
+        }
+
+        std::uint64_t expiry = GetTickAt(std::chrono::steady_clock::now() + timeout + m_tick -
+                                         std::chrono::steady_clock::duration(1));
+
+        timer.m_wheel = this;
+        timer.m_expiry = expiry > m_current_tick ? expiry : m_current_tick + 1;
+        timer.m_callback = std::move(callback);
+        Link(timer);
+        m_num_armed++;
+
+        if (!m_ticking)
+        {
+            m_ticking = true;
+            ScheduleTick();
+        }
+    }
+
+    // Disarms the timer. If its callback is running on another
+    // thread, waits for the callback to return.
+    void Cancel(Timer &timer)
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        while (m_running == &timer && m_running_thread != std::this_thread::get_id())
+        {
+            m_callback_done.wait(lock);
+        }
+
+        if (timer.m_armed)
+        {
+            Unlink(timer);
+            m_num_armed--;
+            timer.m_callback = nullptr;
+        }
+    }
+
+private:
+    static const unsigned int LEVEL_BITS = 6;
+    static const unsigned int SLOT_COUNT = 1 << LEVEL_BITS;
+    static const unsigned int LEVEL_COUNT = 4;
+    static const std::uint64_t MAX_DISTANCE = (std::uint64_t(1) << (LEVEL_BITS * LEVEL_COUNT)) - 1;
+
+    std::uint64_t GetTickAt(std::chrono::steady_clock::time_point time) const
+    {
+        return static_cast<std::uint64_t>((time - m_origin) / m_tick);
+    }
+
+    // Puts the timer into the slot of the level covering its distance from
+    // the current tick. Timers further away than the last level covers are
+    // parked at its far end and placed again when cascaded.
+    void Link(Timer &timer)
+    {
+        std::uint64_t distance = timer.m_expiry - m_current_tick;
+        std::uint64_t expiry = distance > MAX_DISTANCE ? m_current_tick + MAX_DISTANCE
+                                                       : timer.m_expiry;
+
+        unsigned int level = 0;
+        while (level < LEVEL_COUNT - 1 &&
+               distance >= (std::uint64_t(1) << (LEVEL_BITS * (level + 1))))
+        {
+            level++;
+        }
+
+        Timer *&head = m_slots[level][(expiry >> (LEVEL_BITS * level)) & (SLOT_COUNT - 1)];
+
+        timer.m_prev = nullptr;
+        timer.m_next = head;
+        if (head != nullptr)
+            head->m_prev = &timer;
+        head = &timer;
+
+        timer.m_armed = true;
+        timer.m_slot = &head;
+    }
+
+    void Unlink(Timer &timer)
+    {
+        if (timer.m_prev != nullptr)
+            timer.m_prev->m_next = timer.m_next;
+        else
+            *timer.m_slot = timer.m_next;
+
+        if (timer.m_next != nullptr)
+            timer.m_next->m_prev = timer.m_prev;
+
+        timer.m_prev = nullptr;
+        timer.m_next = nullptr;
+        timer.m_armed = false;
+    }
+
+    void ScheduleTick()
+    {
+        m_timer.expires_at(m_origin + m_tick * static_cast<std::int64_t>(m_current_tick + 1));
+        m_timer.async_wait([this](const boost::system::error_code &ec)
+                           {
+                               if (ec != asio::error::operation_aborted)
+                                   onTick();
+                           });
+    }
+
+    // Advances the wheel up to the current time, firing the timers
+    // that have expired. The callbacks are called without holding the lock,
+    // so that they may arm and cancel timers themselves.
+    void onTick()
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        std::uint64_t now_tick = GetTickAt(std::chrono::steady_clock::now());
+
+        while (m_current_tick < now_tick && m_num_armed > 0)
+        {
+            m_current_tick++;
+
+            // Cascade the slots of the higher levels whose time has come.
+            for (unsigned int level = 1; level < LEVEL_COUNT; level++)
+            {
+                if ((m_current_tick & ((std::uint64_t(1) << (LEVEL_BITS * level)) - 1)) != 0)
+                    break;
+
+                Cascade(level, (m_current_tick >> (LEVEL_BITS * level)) & (SLOT_COUNT - 1));
+            }
+
+            Timer *&head = m_slots[0][m_current_tick & (SLOT_COUNT - 1)];
+            while (head != nullptr)
+            {
+                Timer &timer = *head;
+                Unlink(timer);
+
+                if (timer.m_expiry > m_current_tick)
+                {
+                    // Parked at the far end of the last level.
+                    Link(timer);
+                    continue;
+                }
+
+                m_num_armed--;
+                std::function<void()> callback = std::move(timer.m_callback);
+                timer.m_callback = nullptr;
+
+                m_running = &timer;
+                m_running_thread = std::this_thread::get_id();
+                lock.unlock();
+
+                callback();
+
+                lock.lock();
+                m_running = nullptr;
+                m_callback_done.notify_all();
+            }
+        }
+
+        if (m_num_armed > 0)
+        {
+            ScheduleTick();
+        }
+        else
+        {
+            m_ticking = false;
+        }
+    }
+
+    void Cascade(unsigned int level, std::uint64_t slot)
+    {
+        Timer *head = m_slots[level][slot];
+        m_slots[level][slot] = nullptr;
+
+        while (head != nullptr)
+        {
+            Timer *next = head->m_next;
+            Link(*head);
+            head = next;
+        }
+    }
+
+private:
+    asio::steady_timer m_timer;
+    std::chrono::steady_clock::duration m_tick;
+    std::chrono::steady_clock::time_point m_origin;
+
+    Timer *m_slots[LEVEL_COUNT][SLOT_COUNT];
+    std::uint64_t m_current_tick;
+    std::size_t m_num_armed;
+    bool m_ticking;
+
+    // The timer whose callback is running, if any.
+    Timer *m_running;
+    std::thread::id m_running_thread;
+    std::condition_variable m_callback_done;
+
+    std::mutex m_guard;
+};
+
+// Outbound queue of a connection. Messages may be queued from any thread,
+// but a single write operation is outstanding at a time: when it completes,
+// everything queued meanwhile is sent with one gather write of at most
+// max_batch_size bytes (a larger message is sent alone). The socket is only
+// touched through the executor, which must be the strand the connection's
+// other operations run through. The queue must not be destroyed while
+// IsIdle() returns false. Its containers keep their capacity, so once warm
+// it sends messages without allocating memory.
+template <typename Executor>
+class WriteQueue
+{
+public:
+    // Called on the executor once the message has been written or the write has failed.
+    typedef std::function<void(const boost::system::error_code &ec)> Callback;
+
+    WriteQueue(asio::ip::tcp::socket &sock,
+               Executor executor,
+               std::size_t max_batch_size = 64 * 1024) : m_sock(sock),
+                                                         m_executor(executor),
+                                                         m_max_batch_size(max_batch_size),
+                                                         m_writing(false),
+                                                         m_num_writes(0),
+                                                         m_num_messages(0)
+    {
+    }
+
+    WriteQueue(const WriteQueue &) = delete;
+    WriteQueue &operator=(const WriteQueue &) = delete;
+
+    void Write(std::string message, Callback callback = nullptr)
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        m_queue.push_back(Message{std::move(message), std::move(callback)});
+
+        if (m_writing)
+            return;
+
+        m_writing = true;
+        lock.unlock();
+
+        asio::post(m_executor,
+                   MakeCustomAllocHandler(m_post_memory,
+                                          [this]()
+                                          { Flush(); }));
+    }
+
+    bool IsIdle()
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        return !m_writing;
+    }
+
+    // Number of write operations issued and of messages they have sent,
+    // the ratio telling how well the messages are coalesced.
+    unsigned long long GetWriteCount()
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        return m_num_writes;
+    }
+
+    unsigned long long GetMessageCount()
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        return m_num_messages;
+    }
+
+private:
+    struct Message
+    {
+        std::string m_data;
+        Callback m_callback;
+    };
+
+    // Non-owning view of m_buffers, so that the write
+    // operation does not copy the vector.
+    struct BufferRange
+    {
+        typedef asio::const_buffer value_type;
+        typedef const asio::const_buffer *const_iterator;
+
+        const_iterator begin() const
+        {
+            return m_begin;
+        }
+
+        const_iterator end() const
+        {
+            return m_end;
+        }
+
+        const_iterator m_begin;
+        const_iterator m_end;
+    };
+
+    // Runs on the executor when no write operation is outstanding.
+    void Flush()
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        std::size_t batch_size = 0;
+        std::size_t count = 0;
+        while (count < m_queue.size() &&
+               (count == 0 || batch_size + m_queue[count].m_data.size() <= m_max_batch_size))
+        {
+            batch_size += m_queue[count].m_data.size();
+            count++;
+        }
+
+        // The batch is usually the whole queue, whose vector is then swapped
+        // with the empty one of the batch instead of moving the messages.
+        if (count == m_queue.size())
+        {
+            m_batch.swap(m_queue);
+        }
+        else
+        {
+            std::move(m_queue.begin(), m_queue.begin() + count, std::back_inserter(m_batch));
+            m_queue.erase(m_queue.begin(), m_queue.begin() + count);
+        }
+
+        m_num_writes++;
+        m_num_messages += m_batch.size();
+        lock.unlock();
+
+        m_buffers.clear();
+        for (const Message &message : m_batch)
+        {
+            m_buffers.push_back(asio::buffer(message.m_data));
+        }
+
+        asio::async_write(m_sock,
+                          BufferRange{m_buffers.data(), m_buffers.data() + m_buffers.size()},
+                          asio::bind_executor(m_executor,
+                                              MakeCustomAllocHandler(m_write_memory,
+                                                                     [this](const boost::system::error_code &ec,
+                                                                            std::size_t bytes_transferred)
+                                                                     {
+                                                                         onWritten(ec);
+                                                                     })));
+    }
+
+    // The callbacks are called last, as they may queue further messages.
+    // The callback of the batch's last message may also destroy the object
+    // owning the queue once it is idle, so nothing is touched after it.
+    // A failed write fails the messages queued meanwhile as well, so the
+    // broken socket gets no further writes and the queue is idle at once.
+    void onWritten(const boost::system::error_code &ec)
+    {
+        // The sent messages are moved aside, keeping the
+        // capacity of the batch's vector for the next one.
+        m_sent.swap(m_batch);
+
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        if (ec.value() != 0)
+        {
+            std::move(m_queue.begin(), m_queue.end(), std::back_inserter(m_sent));
+            m_queue.clear();
+        }
+
+        bool more = !m_queue.empty();
+        if (!more)
+            m_writing = false;
+
+        lock.unlock();
+
+        if (more)
+            Flush();
+
+        Callback last;
+        if (!m_sent.empty())
+        {
+            last = std::move(m_sent.back().m_callback);
+            m_sent.back().m_callback = nullptr;
+        }
+
+        for (Message &message : m_sent)
+        {
+            if (message.m_callback)
+                message.m_callback(ec);
+        }
+
+        m_sent.clear();
+
+        if (last)
+            last(ec);
+    }
+
+private:
+    asio::ip::tcp::socket &m_sock;
+    Executor m_executor;
+    std::size_t m_max_batch_size;
+
+    // Messages waiting for the next write operation.
+    std::vector<Message> m_queue;
+    bool m_writing;
+    unsigned long long m_num_writes;
+    unsigned long long m_num_messages;
+    std::mutex m_guard;
+
+    // Messages being sent by the outstanding write operation
+    // and those whose callbacks are being called.
+    std::vector<Message> m_batch;
+    std::vector<Message> m_sent;
+    std::vector<asio::const_buffer> m_buffers;
+
+    HandlerMemory m_post_memory;
+    HandlerMemory m_write_memory;
+};
+
+// Function pointer type that points to the callback
+// function which is called when a request is complete.
+// Based on the values of the parameters passed to it, it outputs information about the finished request.
+typedef void (*Callback)(unsigned int request_id,        // unique identifier of the request is assigned to the request when it was initiated.
+                         const std::string &response,    // the response data
+                         const system::error_code &ec);  // error information
+
+// Integer socket option meeting the Boost.Asio requirements for
+// socket options, for the options it provides no class for.
+template <int Level, int Name>
+class IntegerSocketOption
+{
+public:
+    IntegerSocketOption() : m_value(0)
+    {
+    }
+
+    explicit IntegerSocketOption(int value) : m_value(value)
+    {
+    }
+
+    int value() const
+    {
+        return m_value;
+    }
+
+    template <typename Protocol>
+    int level(const Protocol &) const
+    {
+        return Level;
+    }
+
+    template <typename Protocol>
+    int name(const Protocol &) const
+    {
+        return Name;
+    }
+
+    template <typename Protocol>
+    int *data(const Protocol &)
+    {
+        return &m_value;
+    }
+
+    template <typename Protocol>
+    const int *data(const Protocol &) const
+    {
+        return &m_value;
+    }
+
+    template <typename Protocol>
+    std::size_t size(const Protocol &) const
+    {
+        return sizeof(m_value);
+    }
+
+    template <typename Protocol>
+    void resize(const Protocol &, std::size_t size)
+    {
+        if (size != sizeof(m_value))
+            throw std::length_error("IntegerSocketOption resize");
+    }
+
+private:
+    int m_value;
+};
+
+// Socket options applied to every connection of the client.
+// Zero and false leave the system defaults in place, so a default
+// constructed profile changes nothing. The options are applied on a best
+// effort basis: one the system refuses or does not support is skipped,
+// which Log() makes visible by printing the values in effect.
+struct SocketProfile
+{
+    std::string name = "default";
+
+    bool no_delay = false;           // TCP_NODELAY: disable Nagle's algorithm.
+    int receive_buffer_size = 0;     // SO_RCVBUF in bytes.
+    int send_buffer_size = 0;        // SO_SNDBUF in bytes.
+    bool keep_alive = false;         // SO_KEEPALIVE together with the three below.
+    int keep_alive_idle_sec = 0;     // TCP_KEEPIDLE
+    int keep_alive_interval_sec = 0; // TCP_KEEPINTVL
+    int keep_alive_count = 0;        // TCP_KEEPCNT
+    bool quick_ack = false;          // TCP_QUICKACK, only in effect until the kernel leaves the quick ack mode.
+    int fast_open = 0;               // Non-zero enables TCP_FASTOPEN_CONNECT.
+    int busy_poll_us = 0;            // SO_BUSY_POLL; raising it above net.core.busy_read needs CAP_NET_ADMIN.
+
+    // Small request/response exchanges: segments go out at once, acks are
+    // not delayed, and the receiving thread spins briefly on the device queue.
+    static SocketProfile LowLatencyRpc()
+    {
+        SocketProfile profile;
+        profile.name = "low-latency-rpc";
+        profile.no_delay = true;
+        profile.keep_alive = true;
+        profile.keep_alive_idle_sec = 60;
+        profile.keep_alive_interval_sec = 10;
+        profile.keep_alive_count = 5;
+        profile.quick_ack = true;
+        profile.fast_open = 256;
+        profile.busy_poll_us = 50;
+
+        return profile;
+    }
+
+    // Large transfers: buffers big enough to keep a long fat pipe full.
+    static SocketProfile BulkTransfer()
+    {
+        SocketProfile profile;
+        profile.name = "bulk-transfer";
+        profile.receive_buffer_size = 4 * 1024 * 1024;
+        profile.send_buffer_size = 4 * 1024 * 1024;
+        profile.keep_alive = true;
+        profile.keep_alive_idle_sec = 60;
+        profile.keep_alive_interval_sec = 10;
+        profile.keep_alive_count = 5;
+
+        return profile;
+    }
+
+    // Called for a socket once it has been opened and before it is connected.
+    void ApplyToConnection(asio::ip::tcp::socket &sock) const
+    {
+        boost::system::error_code ignored_ec;
+
+        if (no_delay)
+            sock.set_option(asio::ip::tcp::no_delay(true), ignored_ec);
+
+        if (receive_buffer_size > 0)
+            sock.set_option(asio::socket_base::receive_buffer_size(receive_buffer_size), ignored_ec);
+
+        if (send_buffer_size > 0)
+            sock.set_option(asio::socket_base::send_buffer_size(send_buffer_size), ignored_ec);
+
+        if (keep_alive)
+            sock.set_option(asio::socket_base::keep_alive(true), ignored_ec);
+
+#if BOOST_OS_LINUX
+        if (keep_alive && keep_alive_idle_sec > 0)
+            sock.set_option(IntegerSocketOption<IPPROTO_TCP, TCP_KEEPIDLE>(keep_alive_idle_sec), ignored_ec);
+
+        if (keep_alive && keep_alive_interval_sec > 0)
+            sock.set_option(IntegerSocketOption<IPPROTO_TCP, TCP_KEEPINTVL>(keep_alive_interval_sec), ignored_ec);
+
+        if (keep_alive && keep_alive_count > 0)
+            sock.set_option(IntegerSocketOption<IPPROTO_TCP, TCP_KEEPCNT>(keep_alive_count), ignored_ec);
+
+        if (quick_ack)
+            sock.set_option(IntegerSocketOption<IPPROTO_TCP, TCP_QUICKACK>(1), ignored_ec);
+
+        if (busy_poll_us > 0)
+            sock.set_option(IntegerSocketOption<SOL_SOCKET, SO_BUSY_POLL>(busy_poll_us), ignored_ec);
+
+#if defined(TCP_FASTOPEN_CONNECT)
+        // The SYN carries the first write once the server has issued a cookie.
+        if (fast_open > 0)
+            sock.set_option(IntegerSocketOption<IPPROTO_TCP, TCP_FASTOPEN_CONNECT>(1), ignored_ec);
+#endif
+#endif
+    }
+
+    // Applies the profile to a scratch socket and outputs the values
+    // the system has put into effect next to the requested ones.
+    void Log(std::ostream &os) const
+    {
+        asio::io_service ios;
+        asio::ip::tcp::socket probe(ios);
+        boost::system::error_code ec;
+
+        probe.open(asio::ip::tcp::v4(), ec);
+        if (ec.value() != 0)
+        {
+            os << "Socket profile " << name << ": cannot open a socket. Message: "
+               << ec.message() << std::endl;
+            return;
+        }
+
+        ApplyToConnection(probe);
+
+        os << "Socket profile " << name << ':';
+
+        asio::ip::tcp::no_delay no_delay_value;
+        probe.get_option(no_delay_value, ec);
+        LogValue(os, "no_delay", ec ? -1 : no_delay_value.value(), no_delay);
+
+        asio::socket_base::receive_buffer_size receive_buffer_size_value;
+        probe.get_option(receive_buffer_size_value, ec);
+        LogValue(os, "receive_buffer_size", ec ? -1 : receive_buffer_size_value.value(), receive_buffer_size);
+
+        asio::socket_base::send_buffer_size send_buffer_size_value;
+        probe.get_option(send_buffer_size_value, ec);
+        LogValue(os, "send_buffer_size", ec ? -1 : send_buffer_size_value.value(), send_buffer_size);
+
+        asio::socket_base::keep_alive keep_alive_value;
+        probe.get_option(keep_alive_value, ec);
+        LogValue(os, "keep_alive", ec ? -1 : keep_alive_value.value(), keep_alive);
+
+#if BOOST_OS_LINUX
+        LogValue(os, "keep_alive_idle_sec", GetInteger<IPPROTO_TCP, TCP_KEEPIDLE>(probe), keep_alive_idle_sec);
+        LogValue(os, "keep_alive_interval_sec", GetInteger<IPPROTO_TCP, TCP_KEEPINTVL>(probe), keep_alive_interval_sec);
+        LogValue(os, "keep_alive_count", GetInteger<IPPROTO_TCP, TCP_KEEPCNT>(probe), keep_alive_count);
+        LogValue(os, "quick_ack", GetInteger<IPPROTO_TCP, TCP_QUICKACK>(probe), quick_ack);
+        LogValue(os, "busy_poll_us", GetInteger<SOL_SOCKET, SO_BUSY_POLL>(probe), busy_poll_us);
+#if defined(TCP_FASTOPEN_CONNECT)
+        LogValue(os, "fast_open", GetInteger<IPPROTO_TCP, TCP_FASTOPEN_CONNECT>(probe), fast_open > 0);
+#endif
+#endif
+        os << std::endl;
+    }
+
+private:
+    template <int Level, int Name>
+    static int GetInteger(asio::ip::tcp::socket &sock)
+    {
+        IntegerSocketOption<Level, Name> option;
+        boost::system::error_code ec;
+        sock.get_option(option, ec);
+
+        return ec ? -1 : option.value();
+    }
+
+    // A value of -1 means the option could not be read.
+    static void LogValue(std::ostream &os, const char *option, int effective, int requested)
+    {
+        os << ' ' << option << '=' << effective;
+        if (requested != 0 && effective != requested)
+            os << " (requested " << requested << ')';
+    }
+};
+
+// Phase timestamps of requests, telling where the time of a slow request
+// goes. A request records when each of its phases begins and ends into a
+// Trace embedded in the object handling it. Once the request completes, the
+// trace is copied into the ring buffer of the completing thread if the
+// request took at least the slow request threshold. While the threshold is
+// zero, the default, nothing is recorded and a request costs a single relaxed
+// load. Dump() outputs the sampled requests in the Chrome trace event format,
+// which chrome://tracing and Perfetto load. The timestamps are those of
+// std::chrono::steady_clock, so the dumps of clients and servers running on
+// the same host line up when loaded together.
+class RequestTracer : public boost::noncopyable
+{
+public:
+    enum Phase
+    {
+        Queue,    // Waiting for a connection to the server to be returned to the pool.
+        Connect,  // Connecting to the server.
+        Write,    // Sending the request.
+        Response, // Waiting for and receiving the response.
+        PHASE_COUNT
+    };
+
+    class Trace
+    {
+    public:
+        Trace() : m_active(false)
+        {
+        }
+
+    private:
+        friend class RequestTracer;
+
+        bool m_active;
+        std::uint64_t m_id;
+        std::int64_t m_started_at;
+        std::int64_t m_begin[PHASE_COUNT]; // Negative until recorded.
+        std::int64_t m_end[PHASE_COUNT];
+    };
+
+    // The name labels the process in the trace viewer.
+    explicit RequestTracer(const std::string &name) : m_name(name),
+                                                      m_threshold_ns(0),
+                                                      m_next_id(1),
+                                                      m_rings(RING_COUNT)
+    {
+    }
+
+    // Requests taking at least the threshold are sampled. Zero disables the tracing.
+    void SetSlowThreshold(std::chrono::microseconds threshold)
+    {
+        m_threshold_ns.store(std::chrono::duration_cast<std::chrono::nanoseconds>(threshold).count(),
+                             std::memory_order_relaxed);
+    }
+
+    // Starts tracing a request. The identifier, assigned by the tracer
+    // when it is zero, names the request's row in the trace viewer.
+    void Start(Trace &trace, std::uint64_t id = 0)
+    {
+        trace.m_active = m_threshold_ns.load(std::memory_order_relaxed) > 0;
+        if (!trace.m_active)
+            return;
+
+        trace.m_id = id != 0 ? id : m_next_id.fetch_add(1, std::memory_order_relaxed);
+        trace.m_started_at = Now();
+        std::fill(std::begin(trace.m_begin), std::end(trace.m_begin), -1);
+        std::fill(std::begin(trace.m_end), std::end(trace.m_end), -1);
+    }
+
+    // A phase repeated by a request, e.g. when it is retried, spans
+    // from the first time it begins to the last time it ends.
+    void Begin(Trace &trace, Phase phase)
+    {
+        if (trace.m_active && trace.m_begin[phase] < 0)
+            trace.m_begin[phase] = Now();
+    }
+
+    void End(Trace &trace, Phase phase)
+    {
+        if (trace.m_active)
+            trace.m_end[phase] = Now();
+    }
+
+    // Completes the trace and samples it if the request was slow.
+    void Finish(Trace &trace)
+    {
+        if (!trace.m_active)
+            return;
+
+        trace.m_active = false;
+
+        std::int64_t finished_at = Now();
+        std::int64_t threshold = m_threshold_ns.load(std::memory_order_relaxed);
+        if (threshold == 0 || finished_at - trace.m_started_at < threshold)
+            return;
+
+        std::int64_t values[VALUE_COUNT];
+        values[0] = static_cast<std::int64_t>(trace.m_id);
+        values[1] = trace.m_started_at;
+        values[2] = finished_at;
+        std::copy(std::begin(trace.m_begin), std::end(trace.m_begin), values + 3);
+        std::copy(std::begin(trace.m_end), std::end(trace.m_end), values + 3 + PHASE_COUNT);
+
+        GetRing().Push(values);
+    }
+
+    // Outputs the sampled requests as a JSON trace. Every request is a row of
+    // its own, where the event spanning the whole request encloses the events
+    // of its phases. The rings keep the last requests sampled by every thread.
+    void Dump(std::ostream &os) const
+    {
+        static const char *phase_names[PHASE_COUNT] = {"queue", "connect", "write", "response"};
+
+        int pid = GetProcessId();
+        os << "{\"traceEvents\":[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pid
+           << ",\"args\":{\"name\":\"" << m_name << "\"}}";
+
+        for (const Ring &ring : m_rings)
+        {
+            for (const Slot &slot : ring.m_slots)
+            {
+                std::int64_t values[VALUE_COUNT];
+                if (!ReadSlot(slot, values))
+                    continue;
+
+                std::int64_t id = values[0];
+                WriteEvent(os, "request", pid, id, values[1], values[2]);
+
+                for (int phase = 0; phase < PHASE_COUNT; phase++)
+                {
+                    std::int64_t begin = values[3 + phase];
+                    std::int64_t end = values[3 + PHASE_COUNT + phase];
+                    if (begin >= 0 && end >= begin)
+                        WriteEvent(os, phase_names[phase], pid, id, begin, end);
+                }
+            }
+        }
+
+        os << "]}" << std::endl;
+    }
+
+private:
+    static const unsigned int RING_COUNT = 16;
+    static const unsigned int RING_SIZE = 256;
+    static const unsigned int VALUE_COUNT = 3 + 2 * PHASE_COUNT; // Id, start, finish, phases.
+
+    // A slot guarded by a sequence lock. The sequence number is odd while the
+    // slot is written; a reader seeing it odd, or changed once the values are
+    // copied, skips the slot instead of waiting for the writer.
+    struct Slot
+    {
+        Slot() : m_sequence(0)
+        {
+            for (auto &value : m_values)
+            {
+                value.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        std::atomic<std::uint64_t> m_sequence;
+        std::atomic<std::int64_t> m_values[VALUE_COUNT];
+    };
+
+    // Ring buffer of the threads assigned to it, usually a single one.
+    // The slots are claimed with an atomic increment, so threads sharing
+    // a ring never wait for one another either.
+    struct Ring
+    {
+        Ring() : m_next(0)
+        {
+        }
+
+        void Push(const std::int64_t *values)
+        {
+            std::uint64_t ticket = m_next.fetch_add(1, std::memory_order_relaxed);
+            Slot &slot = m_slots[ticket % RING_SIZE];
+
+            slot.m_sequence.store(2 * ticket + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+
+            for (unsigned int i = 0; i < VALUE_COUNT; i++)
+            {
+                slot.m_values[i].store(values[i], std::memory_order_relaxed);
+            }
+
+            slot.m_sequence.store(2 * ticket + 2, std::memory_order_release);
+        }
+
+        std::atomic<std::uint64_t> m_next;
+        Slot m_slots[RING_SIZE];
+    };
+
+    static bool ReadSlot(const Slot &slot, std::int64_t *values)
+    {
+        std::uint64_t sequence = slot.m_sequence.load(std::memory_order_acquire);
+        if (sequence == 0 || sequence % 2 != 0)
+            return false;
+
+        for (unsigned int i = 0; i < VALUE_COUNT; i++)
+        {
+            values[i] = slot.m_values[i].load(std::memory_order_relaxed);
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return slot.m_sequence.load(std::memory_order_relaxed) == sequence;
+    }
+
+    // A complete event; the timestamps are converted to microseconds. Both
+    // ends are truncated rather than the duration, so that the events of the
+    // phases do not stick out of the event of the request.
+    static void WriteEvent(std::ostream &os, const char *name, int pid, std::int64_t id,
+                           std::int64_t begin, std::int64_t end)
+    {
+        os << ",{\"name\":\"" << name << "\",\"ph\":\"X\",\"pid\":" << pid
+           << ",\"tid\":" << id << ",\"ts\":" << begin / 1000
+           << ",\"dur\":" << end / 1000 - begin / 1000 << "}";
+    }
+
+    static std::int64_t Now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    static int GetProcessId()
+    {
+#if BOOST_OS_LINUX
+        return static_cast<int>(getpid());
+#else
+        return 0;
+#endif
+    }
+
+    // Every thread pushes into the ring it is assigned when it pushes for the first time.
+    Ring &GetRing()
+    {
+        static std::atomic<unsigned int> next_ring(0);
+        thread_local unsigned int ring = next_ring.fetch_add(1) % RING_COUNT;
+
+        return m_rings[ring];
+    }
+
+private:
+    std::string m_name;
+    std::atomic<std::int64_t> m_threshold_ns;
+    std::atomic<std::uint64_t> m_next_id;
+    std::vector<Ring> m_rings;
+};
+
+// How the requests and the responses are delimited on the wire.
+enum class Framing
+{
+    Newline,       // A message ends with '\n'.
+    LengthPrefixed // A 4-byte big-endian payload size precedes the payload.
+};
+
+// data structure whose purpose is to keep the data related to a particular request while it is being executed
+struct Session
+{
+    Session(asio::io_service &ios,
+            const std::string &raw_ip_address,
+            unsigned short port_num,
+            const std::string &request,
+            unsigned int id,
+            Callback callback) : m_sock(ios),
+                                 m_strand(asio::make_strand(ios)),
+                                 m_ep(asio::ip::address::from_string(raw_ip_address),
+                                      port_num),
+                                 m_request(request),
+                                 m_id(id),
+                                 m_callback(callback),
+                                 m_was_cancelled(false),
+                                 m_checked_out(false),
+                                 m_reused(false),
+                                 m_queued(false),
+                                 m_pool_ticket(0),
+                                 m_write_queue(m_sock, m_strand),
+                                 m_wheel(nullptr),
+                                 m_deadline_generation(0),
+                                 m_timed_out(false) {}
+
+    asio::ip::tcp::socket m_sock; // Socket used for communication
+    // All the session's handlers and the cancellation run through the
+    // strand, so they never touch the socket concurrently. It is an
+    // executor, so a request coroutine can be spawned on it as well.
+    asio::strand<asio::io_service::executor_type> m_strand;
+    asio::ip::tcp::endpoint m_ep; // Remote endpoint.
+    std::string m_request;        // Request string.
+
+    // streambuf where the response will be stored.
+    asio::streambuf m_response_buf;
+    std::string m_response; // Response represented as a string.
+
+    // Header of a length-prefixed response. Its payload
+    // is read straight into m_response.
+    unsigned char m_frame_header[4];
+
+    // Contains the description of an error if one occurs during
+    // the request lifecycle.
+    system::error_code m_ec;
+
+    unsigned int m_id; // Unique ID assigned to the request.
+
+    // Pointer to the function to be called when the request
+    // completes.
+    Callback m_callback;
+
+    // Set by the user's thread, checked by the handlers before
+    // every step of the request.
+    std::atomic<bool> m_was_cancelled;
+
+    // Whether the session holds a connection accounted for by the pool
+    // and whether it was taken from the pool rather than connected anew.
+    bool m_checked_out;
+    bool m_reused;
+
+    // Whether the request is waiting for the endpoint to drop below its
+    // connection limit, and the ticket of its waiter in the pool's queue,
+    // 0 once the waiter has been called.
+    bool m_queued;
+    std::uint64_t m_pool_ticket;
+
+    // Arena the memory of the session's asynchronous operations is allocated from.
+    HandlerMemory m_handler_memory;
+
+    // Outbound queue of the session's connection. Its write callback
+    // holds the session, which keeps the queue alive until it is idle.
+    WriteQueue<asio::strand<asio::io_service::executor_type>> m_write_queue;
+
+    // Phase timestamps of the request, sampled if it turns out slow.
+    RequestTracer::Trace m_trace;
+
+    // Deadline of the current step, connecting or receiving the response.
+    // The generation tells a deadline that expired from one armed later.
+    TimerWheel *m_wheel;
+    unsigned int m_deadline_generation;
+    bool m_timed_out;
+    TimerWheel::Timer m_deadline; // Declared last to be cancelled first.
+};
+
+// Per-endpoint pool of connected sockets. A session checks a socket out
+// instead of connecting and checks it back in once the response has been
+// read, so repeated requests to the same server skip the TCP handshake.
+// At most max_idle_per_host sockets are kept per endpoint and at most
+// max_per_host connections (0 meaning no limit) are open to it at a time;
+// requests over the limit wait until a connection is returned, or until
+// they are cancelled.
+class ConnectionPool : public boost::noncopyable
+{
+public:
+    enum class CheckOutResult
+    {
+        Reused,  // An idle socket has been moved to the caller.
+        Connect, // The caller may open a new connection.
+        Queued   // The limit is reached, the waiter is called later.
+    };
+
+    ConnectionPool(unsigned int max_idle_per_host,
+                   unsigned int max_per_host) : m_max_idle_per_host(max_idle_per_host),
+                                                m_max_per_host(max_per_host),
+                                                m_next_ticket(1),
+                                                m_wheel(nullptr),
+                                                m_idle_timeout(0),
+                                                m_closed(false)
+    {
+    }
+
+    // Closes the connections that stay idle for longer than the timeout.
+    // Must be called before any connection is checked in.
+    void SetIdleTimeout(TimerWheel *wheel, std::chrono::milliseconds idle_timeout)
+    {
+        m_wheel = wheel;
+        m_idle_timeout = idle_timeout;
+    }
+
+    // Moves a healthy idle socket connected to ep into sock if there is one.
+    // Otherwise either lets the caller connect or, when the endpoint has
+    // reached its limit, keeps the waiter to be called once a connection
+    // is returned or closed, so that the caller can retry. The waiter is
+    // identified by the ticket, which it can be cancelled with.
+    CheckOutResult CheckOut(const asio::ip::tcp::endpoint &ep,
+                            asio::ip::tcp::socket &sock,
+                            std::function<void()> waiter,
+                            std::uint64_t &ticket)
+    {
+        // The connections taken out of the pool are destroyed after the lock
+        // is released, since destroying them cancels their idle timers.
+        std::list<IdleConnection> taken;
+        std::unique_lock<std::mutex> lock(m_guard);
+        Host &host = m_hosts[ep];
+
+        while (!host.m_idle.empty())
+        {
+            taken.splice(taken.begin(), host.m_idle, std::prev(host.m_idle.end()));
+            IdleConnection &connection = taken.front();
+            connection.m_in_pool = false;
+
+            if (IsHealthy(connection.m_sock))
+            {
+                sock = std::move(connection.m_sock);
+                return CheckOutResult::Reused;
+            }
+
+            // The server has closed the connection meanwhile.
+            boost::system::error_code ignored_ec;
+            connection.m_sock.close(ignored_ec);
+            host.m_num_open--;
+        }
+
+        if (m_max_per_host == 0 || host.m_num_open < m_max_per_host)
+        {
+            host.m_num_open++;
+            return CheckOutResult::Connect;
+        }
+
+        ticket = m_next_ticket++;
+        host.m_waiters.push_back(Waiter{ticket, std::move(waiter)});
+        return CheckOutResult::Queued;
+    }
+
+    // Takes the waiter queued with the ticket out of the queue and calls it
+    // at once, so that a cancelled request does not wait for a connection.
+    // Does nothing if the waiter has been called already.
+    void CancelWaiter(const asio::ip::tcp::endpoint &ep, std::uint64_t ticket)
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+        Host &host = m_hosts[ep];
+
+        auto it = std::find_if(host.m_waiters.begin(),
+                               host.m_waiters.end(),
+                               [ticket](const Waiter &waiter)
+                               { return waiter.m_ticket == ticket; });
+        if (it == host.m_waiters.end())
+            return;
+
+        std::function<void()> callback = std::move(it->m_callback);
+        host.m_waiters.erase(it);
+        lock.unlock();
+
+        callback();
+    }
+
+    // Returns a socket whose request and response have been fully
+    // exchanged. It is closed if the endpoint has enough idle sockets.
+    void CheckIn(const asio::ip::tcp::endpoint &ep,
+                 asio::ip::tcp::socket &sock)
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+        Host &host = m_hosts[ep];
+
+        if (!m_closed && host.m_idle.size() < m_max_idle_per_host)
+        {
+            host.m_idle.emplace_back(std::move(sock));
+
+            if (m_wheel != nullptr && m_idle_timeout.count() > 0)
+            {
+                auto it = std::prev(host.m_idle.end());
+                m_wheel->Arm(it->m_idle_timer,
+                             m_idle_timeout,
+                             [this, &host, it]()
+                             { onIdleTimeout(host, it); });
+            }
+        }
+        else
+        {
+            boost::system::error_code ignored_ec;
+            sock.close(ignored_ec);
+            host.m_num_open--;
+        }
+
+        WakeWaiter(host, lock);
+    }
+
+    // Accounts for a connection checked out with CheckOutResult::Connect
+    // or CheckOutResult::Reused that the caller has closed.
+    void Discard(const asio::ip::tcp::endpoint &ep)
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+        Host &host = m_hosts[ep];
+
+        host.m_num_open--;
+
+        WakeWaiter(host, lock);
+    }
+
+    // Closes all the idle connections, cancelling their idle timers,
+    // and the connections checked in from now on.
+    void Close()
+    {
+        std::list<IdleConnection> closed;
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        m_closed = true;
+
+        for (auto &entry : m_hosts)
+        {
+            Host &host = entry.second;
+
+            for (auto &connection : host.m_idle)
+            {
+                connection.m_in_pool = false;
+            }
+
+            host.m_num_open -= host.m_idle.size();
+            closed.splice(closed.end(), host.m_idle);
+        }
+
+        lock.unlock();
+    }
+
+private:
+    struct IdleConnection
+    {
+        IdleConnection(asio::ip::tcp::socket &&sock) : m_sock(std::move(sock)),
+                                                       m_in_pool(true)
+        {
+        }
+
+        asio::ip::tcp::socket m_sock;
+        bool m_in_pool;
+        TimerWheel::Timer m_idle_timer; // Declared last to be cancelled first.
+    };
+
+    struct Waiter
+    {
+        std::uint64_t m_ticket;
+        std::function<void()> m_callback;
+    };
+
+    struct Host
+    {
+        Host() : m_num_open(0) {}
+
+        std::list<IdleConnection> m_idle; // Most recently returned last.
+        std::deque<Waiter> m_waiters;
+        unsigned int m_num_open; // Idle and checked out connections.
+    };
+
+    // An idle connection must have nothing to read: a zero-length
+    // read means the server has closed it, and unsolicited data means
+    // the connection is out of step with the protocol.
+    static bool IsHealthy(asio::ip::tcp::socket &sock)
+    {
+        boost::system::error_code ec;
+        char byte;
+
+        sock.non_blocking(true, ec);
+        if (ec.value() != 0)
+            return false;
+
+        sock.receive(asio::buffer(&byte, 1), asio::socket_base::message_peek, ec);
+
+        return ec == asio::error::would_block;
+    }
+
+    // The connection may have been checked out while the timer was expiring;
+    // its node is alive until the timer's callback returns, either in the pool
+    // or in the list being destroyed by CheckOut() or Close().
+    void onIdleTimeout(Host &host, std::list<IdleConnection>::iterator it)
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        if (!it->m_in_pool)
+            return;
+
+        boost::system::error_code ignored_ec;
+        it->m_sock.close(ignored_ec);
+        host.m_idle.erase(it);
+        host.m_num_open--;
+
+        WakeWaiter(host, lock);
+    }
+
+    // The waiter is called without holding the lock, since it checks
+    // a socket out again.
+    void WakeWaiter(Host &host, std::unique_lock<std::mutex> &lock)
+    {
+        if (host.m_waiters.empty())
+            return;
+
+        std::function<void()> waiter = std::move(host.m_waiters.front().m_callback);
+        host.m_waiters.pop_front();
+        lock.unlock();
+
+        waiter();
+    }
+
+private:
+    std::map<asio::ip::tcp::endpoint, Host> m_hosts;
+    std::mutex m_guard;
+    unsigned int m_max_idle_per_host;
+    unsigned int m_max_per_host;
+    std::uint64_t m_next_ticket;
+
+    TimerWheel *m_wheel;
+    std::chrono::milliseconds m_idle_timeout;
+    bool m_closed;
+};
+
+// Registry of the requests in progress, looked up to cancel them. The table
+// is split into shards, each guarded by a mutex of its own, so that
+// concurrent requests starting and completing rarely contend for a lock.
+// Request identifiers are usually sequential, which spreads them evenly.
+class SessionRegistry : public boost::noncopyable
+{
+public:
+    void Add(unsigned int id, std::shared_ptr<Session> session)
+    {
+        Shard &shard = GetShard(id);
+
+        std::unique_lock<std::mutex> lock(shard.m_guard);
+        shard.m_sessions[id] = std::move(session);
+    }
+
+    void Remove(unsigned int id)
+    {
+        Shard &shard = GetShard(id);
+
+        std::unique_lock<std::mutex> lock(shard.m_guard);
+        shard.m_sessions.erase(id);
+    }
+
+    // Returns nullptr if no such request is in progress.
+    std::shared_ptr<Session> Find(unsigned int id)
+    {
+        Shard &shard = GetShard(id);
+
+        std::unique_lock<std::mutex> lock(shard.m_guard);
+        auto it = shard.m_sessions.find(id);
+
+        return it != shard.m_sessions.end() ? it->second : nullptr;
+    }
+
+private:
+    static const unsigned int SHARD_COUNT = 64;
+
+    struct Shard
+    {
+        std::mutex m_guard;
+        std::unordered_map<unsigned int, std::shared_ptr<Session>> m_sessions;
+        char m_padding[64]; // Keeps neighbouring shards off each other's cache line.
+    };
+
+    Shard &GetShard(unsigned int id)
+    {
+        return m_shards[id % SHARD_COUNT];
+    }
+
+private:
+    Shard m_shards[SHARD_COUNT];
+};
+
+// class that provides the asynchronous communication functionality.
+class AsyncTCPClient : public boost::noncopyable
+{
+public:
+    // Connections are kept in a pool for reuse; max_idle_per_host
+    // of 0 disables the pooling.
+    AsyncTCPClient(unsigned char num_of_threads,
+                   unsigned int max_idle_per_host = 8,
+                   unsigned int max_per_host = 0) : m_pool(max_idle_per_host,
+                                                           max_per_host),
+                                                    m_connect_timeout(0),
+                                                    m_read_timeout(0),
+                                                    m_framing(Framing::Newline),
+                                                    m_tracer("client")
+    {
+
+        //instantiates an object of the asio::io_service::work class
+        // passing an instance of the asio::io_service class named m_ios to its constructor
+        m_work.reset(new boost::asio::io_service::work(m_ios));
+
+        for (unsigned char i = 1; i <= num_of_threads; i++)
+        {
+            // As many timing wheels as I/O threads. They all run on the shared
+            // m_ios, so a wheel's tick may run on any of the threads; spreading
+            // the sessions across the wheels only splits the lock contention.
+            m_wheels.emplace_back(new TimerWheel(m_ios));
+
+            //spawns a thread that calls the run() method of the m_ios object.
+            std::unique_ptr<std::thread> th(
+                new std::thread([this]()
+                                { m_ios.run(); }));
+
+            m_threads.push_back(std::move(th));
+        }
+    }
+    // Sets the deadlines for connecting to the server, for sending the request
+    // and receiving the response, and for a pooled connection to stay idle.
+    // A zero timeout disables the corresponding deadline. Requests that miss
+    // a deadline complete with asio::error::timed_out. Must be called before
+    // any request is initiated.
+    void setTimeouts(std::chrono::milliseconds connect_timeout,
+                     std::chrono::milliseconds read_timeout,
+                     std::chrono::milliseconds idle_timeout)
+    {
+        m_connect_timeout = connect_timeout;
+        m_read_timeout = read_timeout;
+        m_pool.SetIdleTimeout(m_wheels.front().get(), idle_timeout);
+    }
+
+    // Selects the framing the server expects. In the length-prefixed mode
+    // the response is read as a fixed-size header followed by exactly the
+    // announced number of bytes, without scanning them for a delimiter.
+    // Must be called before any request is initiated.
+    void setFraming(Framing framing)
+    {
+        m_framing = framing;
+    }
+
+    // Sets the options of the sockets the client connects and outputs the
+    // values in effect. Must be called before any request is initiated.
+    void setSocketProfile(const SocketProfile &profile)
+    {
+        m_socket_profile = profile;
+        m_socket_profile.Log(std::cout);
+    }
+
+    // Requests taking at least the threshold, from being initiated to the
+    // callback being called, are traced. Zero, the default, disables the tracing.
+    void setSlowRequestThreshold(std::chrono::microseconds threshold)
+    {
+        m_tracer.SetSlowThreshold(threshold);
+    }
+
+    // Outputs the traces of the slow requests in the Chrome trace event format.
+    void dumpSlowRequests(std::ostream &os) const
+    {
+        m_tracer.Dump(os);
+    }
+
+    // initiates a request to the server
+    void emulateLongComputationOp(
+        unsigned int duration_sec,          //represents the request parameter according to the application layer protocol
+        const std::string &raw_ip_address,  //specify the server to which the request should be sent.
+        unsigned short port_num,            //specify the server to which the request should be sent.
+        Callback callback,                  //callback function, which will be called when the request is complete.
+        unsigned int request_id)    // unique identifier of the request
+    {
+
+        // preparing a request string and allocating an instance of the Session structure
+        // that keeps the data associated with the request including a socket object
+        // that is used to communicate with the server.
+        std::string request = makeRequest("EMULATE_LONG_CALC_OP " + std::to_string(duration_sec));
+        std::shared_ptr<Session> session =
+            std::shared_ptr<Session>(new Session(m_ios,
+                                                 raw_ip_address,
+                                                 port_num,
+                                                 request,
+                                                 request_id,
+                                                 callback));
+        session->m_wheel = m_wheels[request_id % m_wheels.size()].get();
+
+        // Add new session to the registry of active sessions so
+        // that we can access it if the user decides to cancel
+        // the corresponding request before it completes.
+        m_active_sessions.Add(request_id, session);
+        m_tracer.Start(session->m_trace, request_id);
+
+        // The request is started on the session's strand, like all
+        // the other steps that touch its socket.
+        asio::post(session->m_strand,
+                   MakeCustomAllocHandler(session->m_handler_memory,
+                                          [this, session]()
+                                          { startRequest(session); }));
+    };
+
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+    // Same as emulateLongComputationOp(), but the request runs as a coroutine
+    // instead of a chain of callbacks. It shares the pool, the deadlines and
+    // the cancellation with the requests initiated the other way.
+    void emulateLongComputationOpCo(
+        unsigned int duration_sec,
+        const std::string &raw_ip_address,
+        unsigned short port_num,
+        Callback callback,
+        unsigned int request_id)
+    {
+        std::string request = makeRequest("EMULATE_LONG_CALC_OP " + std::to_string(duration_sec));
+        std::shared_ptr<Session> session =
+            std::shared_ptr<Session>(new Session(m_ios,
+                                                 raw_ip_address,
+                                                 port_num,
+                                                 request,
+                                                 request_id,
+                                                 callback));
+        session->m_wheel = m_wheels[request_id % m_wheels.size()].get();
+
+        m_active_sessions.Add(request_id, session);
+        m_tracer.Start(session->m_trace, request_id);
+
+        asio::co_spawn(session->m_strand, runRequest(session), asio::detached);
+    }
+#endif
+
+    // cancels the previously initiated request designated by the request_id argument
+    void cancelRequest(unsigned int request_id) //accepts an identifier of the request to be canceled as an argument.
+    {
+        //looking for the Session object corresponding to the specified request in the registry.
+        std::shared_ptr<Session> session = m_active_sessions.Find(request_id);
+        if (session)
+        {
+            // A step starting after the flag is set sees it and completes the request;
+            // the operation outstanding meanwhile is cancelled on the session's strand.
+            session->m_was_cancelled.store(true);
+
+            asio::post(session->m_strand,
+                       [this, session]()
+                       { abortStep(session); });
+        }
+    }
+
+    // blocks the calling thread until all the currently running requests complete and deinitializes the client.
+    void close()
+    {
+        // Stop pooling the connections, whose idle timeouts
+        // would keep the I/O threads running otherwise.
+        m_pool.Close();
+
+        // Destroy work object. This allows the I/O threads to
+        // exit the event loop when there are no more pending
+        // asynchronous operations.
+        m_work.reset(NULL);
+
+        // Waiting for the I/O threads to exit.
+        for (auto &thread : m_threads)
+        {
+            thread->join();
+        }
+    }
+
+private:
+    static const std::uint32_t MAX_FRAME_SIZE = 16 * 1024 * 1024;
+
+    // Delimits the request according to the framing.
+    std::string makeRequest(const std::string &payload) const
+    {
+        if (m_framing == Framing::Newline)
+            return payload + "\n";
+
+        std::uint32_t size = static_cast<std::uint32_t>(payload.size());
+        std::string request;
+        request.reserve(sizeof(Session::m_frame_header) + payload.size());
+        request.push_back(static_cast<char>(size >> 24));
+        request.push_back(static_cast<char>(size >> 16));
+        request.push_back(static_cast<char>(size >> 8));
+        request.push_back(static_cast<char>(size));
+        request += payload;
+
+        return request;
+    }
+
+    static std::uint32_t decodeFrameSize(const unsigned char *header)
+    {
+        return (std::uint32_t(header[0]) << 24) | (std::uint32_t(header[1]) << 16) |
+               (std::uint32_t(header[2]) << 8) | std::uint32_t(header[3]);
+    }
+
+    // Takes a connected socket from the pool or connects a new one.
+    void startRequest(std::shared_ptr<Session> session)
+    {
+        // The socket is only replaced while no operation is outstanding
+        // on it, on the strand the cancellation runs through.
+        session->m_pool_ticket = 0;
+
+        if (session->m_was_cancelled.load())
+        {
+            onRequestComplete(session);
+            return;
+        }
+
+        ConnectionPool::CheckOutResult result =
+            m_pool.CheckOut(session->m_ep,
+                            session->m_sock,
+                            [this, session]()
+                            {
+                                // A connection has been returned or closed, or the
+                                // request has been cancelled; the request is retried
+                                // on the session's strand.
+                                asio::post(session->m_strand,
+                                           MakeCustomAllocHandler(session->m_handler_memory,
+                                                                  [this, session]()
+                                                                  { startRequest(session); }));
+                            },
+                            session->m_pool_ticket);
+
+        if (result == ConnectionPool::CheckOutResult::Queued)
+        {
+            onQueued(session);
+            return;
+        }
+
+        m_tracer.End(session->m_trace, RequestTracer::Queue);
+        session->m_queued = false;
+
+        session->m_checked_out = true;
+        session->m_reused = (result == ConnectionPool::CheckOutResult::Reused);
+
+        if (session->m_reused)
+        {
+            //The pooled socket is already connected, skip straight to sending the request.
+            sendRequest(session);
+            return;
+        }
+
+        armDeadline(session, m_connect_timeout);
+
+        //opened socket
+        session->m_sock.open(session->m_ep.protocol(), session->m_ec);
+        if (session->m_ec.value() != 0)
+        {
+            onRequestComplete(session);
+            return;
+        }
+
+        m_socket_profile.ApplyToConnection(session->m_sock);
+
+        //connect the socket to the server
+        m_tracer.Begin(session->m_trace, RequestTracer::Connect);
+        session->m_sock.async_connect(session->m_ep,
+                                      asio::bind_executor(session->m_strand,
+                                                          MakeCustomAllocHandler(session->m_handler_memory,
+                                                                                 [this, session](const system::error_code &ec)
+                                                                                 {
+                                                                                     m_tracer.End(session->m_trace, RequestTracer::Connect);
+
+                                                                                     //checking the error code passed to it as the ec argument
+                                                                                     if (ec.value() != 0)
+                                                                                     {
+                                                                                         //we store the ec value in the corresponding Session object,
+                                                                                         session->m_ec = ec;
+                                                                                         //call the class's onRequestComplete() private method passing the Session object to it as an argument
+                                                                                         onRequestComplete(session);
+                                                                                         //then return.
+                                                                                         return;
+                                                                                     }
+
+                                                                                     sendRequest(session);
+                                                                                 })));
+    }
+
+    void sendRequest(std::shared_ptr<Session> session)
+    {
+        //check whether the request has not been canceled yet. 
+        if (session->m_was_cancelled.load())
+        {
+            onRequestComplete(session);
+            return;
+        }
+
+        // The read deadline covers sending the request and receiving the response.
+        armDeadline(session, m_read_timeout);
+
+        //If we see that the request has not been canceled
+        //we queue the request data on the connection's write queue,
+        //which sends it to the server with an asynchronous write operation.
+        m_tracer.Begin(session->m_trace, RequestTracer::Write);
+        session->m_write_queue.Write(session->m_request,
+                                     [this, session](const boost::system::error_code &ec)
+                                     {
+                                         m_tracer.End(session->m_trace, RequestTracer::Write);
+
+                                         // check the error code
+                                         if (ec.value() != 0)
+                                         {
+                                             session->m_ec = ec;
+                                             onRequestComplete(session);
+                                             return;
+                                         }
+
+                                         // check whether or not the request has been canceled. 
+                                         if (session->m_was_cancelled.load())
+                                         {
+                                             onRequestComplete(session);
+                                             return;
+                                         }
+
+                                         m_tracer.Begin(session->m_trace, RequestTracer::Response);
+
+                                         if (m_framing == Framing::LengthPrefixed)
+                                         {
+                                             receiveFramedResponse(session);
+                                             return;
+                                         }
+
+                                         // initiate the next asynchronous operation—async_read_until()—in order to receive a response from the server
+                                         asio::async_read_until(session->m_sock,
+                                                                session->m_response_buf,
+                                                                '\n',
+                                                                asio::bind_executor(session->m_strand,
+                                                                                    MakeCustomAllocHandler(session->m_handler_memory,
+                                                                                                           [this, session](const boost::system::error_code &ec,
+                                                                                                                           std::size_t bytes_transferred)
+                                                                                                           {
+                                                                                                               //checks the error code
+                                                                                                               if (ec.value() != 0)
+                                                                                                               {
+                                                                                                                   session->m_ec = ec;
+                                                                                                               }
+                                                                                                               else
+                                                                                                               {
+                                                                                                                   std::istream strm(&session->m_response_buf);
+                                                                                                                   std::getline(strm, session->m_response);
+                                                                                                               }
+
+                                                                                                               // the AsyncTCPClient class's private method onRequestComplete() is called
+                                                                                                               // and the Session object is passed to it as an argument.
+                                                                                                               onRequestComplete(session);
+                                                                                                           })));
+                                     });
+    }
+
+    // Reads the header of a length-prefixed response, then its payload
+    // straight into the response string.
+    void receiveFramedResponse(std::shared_ptr<Session> session)
+    {
+        asio::async_read(session->m_sock,
+                         asio::buffer(session->m_frame_header),
+                         asio::bind_executor(session->m_strand,
+                                             MakeCustomAllocHandler(session->m_handler_memory,
+                                                                    [this, session](const boost::system::error_code &ec,
+                                                                                    std::size_t bytes_transferred)
+                                                                    {
+                                                                        if (ec.value() != 0)
+                                                                        {
+                                                                            session->m_ec = ec;
+                                                                            onRequestComplete(session);
+                                                                            return;
+                                                                        }
+
+                                                                        std::uint32_t size = decodeFrameSize(session->m_frame_header);
+                                                                        if (size > MAX_FRAME_SIZE)
+                                                                        {
+                                                                            session->m_ec = asio::error::message_size;
+                                                                            onRequestComplete(session);
+                                                                            return;
+                                                                        }
+
+                                                                        session->m_response.resize(size);
+                                                                        asio::async_read(session->m_sock,
+                                                                                         asio::buffer(&session->m_response[0], size),
+                                                                                         asio::bind_executor(session->m_strand,
+                                                                                                             MakeCustomAllocHandler(session->m_handler_memory,
+                                                                                                                                    [this, session](const boost::system::error_code &ec,
+                                                                                                                                                    std::size_t bytes_transferred)
+                                                                                                                                    {
+                                                                                                                                        if (ec.value() != 0)
+                                                                                                                                        {
+                                                                                                                                            session->m_ec = ec;
+                                                                                                                                            session->m_response.clear();
+                                                                                                                                        }
+
+                                                                                                                                        onRequestComplete(session);
+                                                                                                                                    })));
+                                                                    })));
+    }
+
+    // The endpoint is at its connection limit. The first time the request is
+    // queued, the connect timeout is armed, so that it does not wait forever.
+    void onQueued(std::shared_ptr<Session> session)
+    {
+        if (session->m_queued)
+            return;
+
+        session->m_queued = true;
+        m_tracer.Begin(session->m_trace, RequestTracer::Queue);
+        armDeadline(session, m_connect_timeout);
+    }
+
+    // Cancels the operation the request is waiting for, on the session's strand.
+    // The socket is not open while the request waits for a connection to become
+    // available, so it is woken up through the pool instead.
+    void abortStep(std::shared_ptr<Session> session)
+    {
+        boost::system::error_code ignored_ec;
+        session->m_sock.cancel(ignored_ec);
+
+        if (session->m_pool_ticket != 0)
+            m_pool.CancelWaiter(session->m_ep, session->m_pool_ticket);
+    }
+
+    // Arms the session's deadline, replacing the one of the previous step. The
+    // wheel calls back on any I/O thread, so the expiry is handled on the session's
+    // strand, where it cancels the request like cancelRequest() does.
+    void armDeadline(std::shared_ptr<Session> session, std::chrono::milliseconds timeout)
+    {
+        unsigned int generation = ++session->m_deadline_generation;
+
+        if (timeout.count() == 0)
+        {
+            session->m_wheel->Cancel(session->m_deadline);
+            return;
+        }
+
+        std::weak_ptr<Session> weak_session = session;
+        session->m_wheel->Arm(session->m_deadline,
+                              timeout,
+                              [this, weak_session, generation]()
+                              {
+                                  std::shared_ptr<Session> session = weak_session.lock();
+                                  if (!session)
+                                      return;
+
+                                  asio::post(session->m_strand,
+                                             [this, session, generation]()
+                                             {
+                                                 if (session->m_deadline_generation != generation)
+                                                     return;
+
+                                                 session->m_timed_out = true;
+                                                 session->m_was_cancelled.store(true);
+
+                                                 abortStep(session);
+                                             });
+                              });
+    }
+
+    // A pooled connection may have been closed by the server after its health
+    // check passed. The request had not been answered, so it is safe to retry.
+    static bool IsStaleConnectionError(const system::error_code &ec)
+    {
+        return ec == asio::error::eof ||
+               ec == asio::error::connection_reset ||
+               ec == asio::error::broken_pipe;
+    }
+
+    // method is called whenever the request completes with any result.
+    void onRequestComplete(std::shared_ptr<Session> session)
+    {
+        if (releaseConnection(session))
+        {
+            startRequest(session);
+            return;
+        }
+
+        m_tracer.End(session->m_trace, RequestTracer::Response);
+        m_tracer.Finish(session->m_trace);
+
+        // Remove session form the registry of active sessions.
+        m_active_sessions.Remove(session->m_id);
+
+        // Call the callback provided by the user.
+        session->m_callback(session->m_id,
+                            session->m_response, completionError(session));
+    };
+
+    // Disarms the deadline of the last step and returns the session's
+    // connection to the pool, or closes it if the exchange did not complete.
+    // Returns true when the request failed on a stale pooled connection
+    // and should be retried.
+    bool releaseConnection(std::shared_ptr<Session> session)
+    {
+        ++session->m_deadline_generation;
+        session->m_wheel->Cancel(session->m_deadline);
+
+        if (session->m_checked_out &&
+            session->m_ec.value() == 0 && !session->m_was_cancelled &&
+            session->m_response_buf.size() == 0)
+        {
+            // The request and the response have been fully exchanged,
+            // the connection can serve the next request.
+            session->m_checked_out = false;
+            m_pool.CheckIn(session->m_ep, session->m_sock);
+        }
+        else if (session->m_checked_out)
+        {
+            // Shutting down the connection. This method may
+            // fail in case socket is not connected. We don’t care
+            // about the error code if this function fails.
+            boost::system::error_code ignored_ec;
+
+            session->m_sock.shutdown( asio::ip::tcp::socket::shutdown_both, ignored_ec);
+            session->m_sock.close(ignored_ec);
+
+            session->m_checked_out = false;
+            m_pool.Discard(session->m_ep);
+
+            if (session->m_reused && !session->m_was_cancelled &&
+                IsStaleConnectionError(session->m_ec))
+            {
+                session->m_ec = system::error_code();
+                session->m_response_buf.consume(session->m_response_buf.size());
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // The error code the request's callback is called with.
+    static system::error_code completionError(std::shared_ptr<Session> session)
+    {
+        if (session->m_timed_out)
+            return asio::error::timed_out;
+
+        if (session->m_ec.value() == 0 && session->m_was_cancelled)
+            return asio::error::operation_aborted;
+
+        return session->m_ec;
+    }
+
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+    // The whole request as a single coroutine running on the session's strand.
+    // Its frame keeps the session alive across the steps, so no handler is
+    // allocated and no reference count is touched per step. The socket
+    // operations report their errors into m_ec; a step that fails or finds
+    // the request cancelled skips to releasing the connection.
+    asio::awaitable<void> runRequest(std::shared_ptr<Session> session)
+    {
+        Session &s = *session;
+
+        // Woken up by the pool while the endpoint is at its connection limit.
+        asio::steady_timer connection_returned(s.m_strand);
+
+        do
+        {
+            ConnectionPool::CheckOutResult result = ConnectionPool::CheckOutResult::Queued;
+
+            while (!s.m_was_cancelled.load())
+            {
+                result = m_pool.CheckOut(s.m_ep,
+                                         s.m_sock,
+                                         [session, &connection_returned]()
+                                         {
+                                             asio::post(session->m_strand,
+                                                        [&connection_returned]()
+                                                        { connection_returned.cancel(); });
+                                         },
+                                         s.m_pool_ticket);
+
+                if (result != ConnectionPool::CheckOutResult::Queued)
+                    break;
+
+                onQueued(session);
+
+                system::error_code ignored_ec;
+                connection_returned.expires_at(asio::steady_timer::time_point::max());
+                co_await connection_returned.async_wait(
+                    asio::redirect_error(asio::use_awaitable, ignored_ec));
+                s.m_pool_ticket = 0;
+            }
+
+            if (result == ConnectionPool::CheckOutResult::Queued)
+                continue;
+
+            m_tracer.End(s.m_trace, RequestTracer::Queue);
+            s.m_queued = false;
+
+            s.m_checked_out = true;
+            s.m_reused = (result == ConnectionPool::CheckOutResult::Reused);
+
+            if (!s.m_reused)
+            {
+                armDeadline(session, m_connect_timeout);
+
+                s.m_sock.open(s.m_ep.protocol(), s.m_ec);
+                if (s.m_ec.value() != 0)
+                    continue;
+
+                m_socket_profile.ApplyToConnection(s.m_sock);
+
+                m_tracer.Begin(s.m_trace, RequestTracer::Connect);
+                co_await s.m_sock.async_connect(s.m_ep,
+                                                asio::redirect_error(asio::use_awaitable, s.m_ec));
+                m_tracer.End(s.m_trace, RequestTracer::Connect);
+                if (s.m_ec.value() != 0)
+                    continue;
+            }
+
+            if (s.m_was_cancelled.load())
+                continue;
+
+            armDeadline(session, m_read_timeout);
+
+            m_tracer.Begin(s.m_trace, RequestTracer::Write);
+            co_await asio::async_write(s.m_sock,
+                                       asio::buffer(s.m_request),
+                                       asio::redirect_error(asio::use_awaitable, s.m_ec));
+            m_tracer.End(s.m_trace, RequestTracer::Write);
+            if (s.m_ec.value() != 0 || s.m_was_cancelled.load())
+                continue;
+
+            m_tracer.Begin(s.m_trace, RequestTracer::Response);
+
+            if (m_framing == Framing::LengthPrefixed)
+            {
+                co_await asio::async_read(s.m_sock,
+                                          asio::buffer(s.m_frame_header),
+                                          asio::redirect_error(asio::use_awaitable, s.m_ec));
+                if (s.m_ec.value() != 0)
+                    continue;
+
+                std::uint32_t size = decodeFrameSize(s.m_frame_header);
+                if (size > MAX_FRAME_SIZE)
+                {
+                    s.m_ec = asio::error::message_size;
+                    continue;
+                }
+
+                s.m_response.resize(size);
+                co_await asio::async_read(s.m_sock,
+                                          asio::buffer(&s.m_response[0], size),
+                                          asio::redirect_error(asio::use_awaitable, s.m_ec));
+                if (s.m_ec.value() != 0)
+                    s.m_response.clear();
+
+                continue;
+            }
+
+            co_await asio::async_read_until(s.m_sock,
+                                            s.m_response_buf,
+                                            '\n',
+                                            asio::redirect_error(asio::use_awaitable, s.m_ec));
+            if (s.m_ec.value() == 0)
+            {
+                std::istream strm(&s.m_response_buf);
+                std::getline(strm, s.m_response);
+            }
+        } while (releaseConnection(session));
+
+        m_tracer.End(s.m_trace, RequestTracer::Response);
+        m_tracer.Finish(s.m_trace);
+
+        m_active_sessions.Remove(s.m_id);
+
+        s.m_callback(s.m_id, s.m_response, completionError(session));
+    }
+#endif
+
+private:
+    asio::io_service m_ios;
+    std::vector<std::unique_ptr<TimerWheel>> m_wheels;
+    SessionRegistry m_active_sessions;
+    ConnectionPool m_pool;
+    std::chrono::milliseconds m_connect_timeout;
+    std::chrono::milliseconds m_read_timeout;
+    Framing m_framing;
+    SocketProfile m_socket_profile;
+    RequestTracer m_tracer;
+    std::unique_ptr<boost::asio::io_service::work> m_work;
+    std::list<std::unique_ptr<std::thread>> m_threads;
+};
+
+// a function that will serve as a callback, which we'll pass to the AsyncTCPClient::emulateLongComputationOp() method
+// It outputs the result of the request execution and the response message to the standard output stream if the request is completed successfully
+void handler(unsigned int request_id,
+             const std::string &response,
+             const system::error_code &ec)
+{
+    if (ec.value() == 0)
+    {
+        std::cout << "Request #" << request_id
+                  << " has completed. Response: "
+                  << response << std::endl;
+    }
+    else if (ec == asio::error::operation_aborted)
+    {
+        std::cout << "Request #" << request_id
+                  << " has been cancelled by the user."
+                  << std::endl;
+    }
+    else
+    {
+        std::cout << "Request #" << request_id
+                  << " failed! Error code = " << ec.value()
+                  << ". Error message = " << ec.message()
+                  << std::endl;
+    }
+
+    return;
+}
+
+int main()
+{
+    try
+    {
+        AsyncTCPClient client(4);
+
+        // Here we emulate the user's behavior.
+
+        // creates an instance of the AsyncTCPClient class and then calls its emulateLongComputationOp() method to initiate three asynchronous requests
+        // User initiates a request with id 1.
+        client.emulateLongComputationOp(10, "127.0.0.1", 3333, handler, 1);
+
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+        // The same request run as a coroutine, with id 2.
+        client.emulateLongComputationOpCo(10, "127.0.0.1", 3333, handler, 2);
+#endif
+
+        // Decides to exit the application.
+        client.close();
+    }
+    catch (system::system_error &e)
+    {
+        std::cout << "Error occured! Error code = " << e.code()
+                  << ". Message: " << e.what();
+
+        return e.code().value();
+    }
+
+    return 0;
+};
@@ -0,0 +1,1049 @@
+#include <boost/predef.h> // Tools to identify the OS.
+
+// We need this to enable cancelling of I/O operations on
+// Windows XP, Windows Server 2003 and earlier.
+// Refer to "http://www.boost.org/doc/libs/1_58_0/
+// doc/html/boost_asio/reference/basic_stream_socket/
+// cancel/overload1.html" for details.
+#ifdef BOOST_OS_WINDOWS
+#define _WIN32_WINNT 0x0501
+
+#if _WIN32_WINNT <= 0x0502 // Windows Server 2003 or earlier.
+#define BOOST_ASIO_DISABLE_IOCP
+#define BOOST_ASIO_ENABLE_CANCELIO
+#endif
+#endif
+
+#include <utility> // Some Boost.Asio versions use std::exchange in awaitable.hpp without including it.
+#include <boost/asio.hpp>
+#include <boost/noncopyable.hpp>
+
+#if BOOST_OS_LINUX
+#include <netinet/tcp.h>
+#endif
+
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <list>
+#include <map>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <type_traits>
+#include <string>
+#include <stdexcept>
+#include <iostream>
+
+using namespace boost;
+
+// Small fixed-size arena used to allocate the memory associated with
+// asynchronous operations. A session runs its connect, write and read
+// operations one after another, so a single block is enough; larger or
+// overlapping requests fall back to the global operator new.
+class HandlerMemory
+{
+public:
+    HandlerMemory() : m_in_use(false)
+    {
+    }
+
+    HandlerMemory(const HandlerMemory &) = delete;
+    HandlerMemory &operator=(const HandlerMemory &) = delete;
+
+    void *allocate(std::size_t size)
+    {
+        if (!m_in_use && size <= sizeof(m_storage))
+        {
+            m_in_use = true;
+            return &m_storage;
+        }
+
+        return ::operator new(size);
+    }
+
+    void deallocate(void *pointer)
+    {
+        if (pointer == &m_storage)
+        {
+            m_in_use = false;
+            return;
+        }
+
+        ::operator delete(pointer);
+    }
+
+private:
+    typename std::aligned_storage<1024>::type m_storage;
+    bool m_in_use;
+};
+
+// Allocator satisfying the standard allocator requirements that
+// hands out the memory of a HandlerMemory arena.
+template <typename T>
+class HandlerAllocator
+{
+public:
+    typedef T value_type;
+
+    explicit HandlerAllocator(HandlerMemory &memory) : m_memory(memory)
+    {
+    }
+
+    template <typename U>
+    HandlerAllocator(const HandlerAllocator<U> &other) noexcept : m_memory(other.m_memory)
+    {
+    }
+
+    bool operator==(const HandlerAllocator &other) const noexcept
+    {
+        return &m_memory == &other.m_memory;
+    }
+
+    bool operator!=(const HandlerAllocator &other) const noexcept
+    {
+        return &m_memory != &other.m_memory;
+    }
+
+    T *allocate(std::size_t n) const
+    {
+        return static_cast<T *>(m_memory.allocate(sizeof(T) * n));
+    }
+
+    void deallocate(T *p, std::size_t /*n*/) const
+    {
+        return m_memory.deallocate(p);
+    }
+
+private:
+    template <typename>
+    friend class HandlerAllocator;
+
+    HandlerMemory &m_memory;
+};
+
+// Wraps a completion handler so that Boost.Asio finds its associated
+// allocator and allocates the operation's memory from the arena.
+template <typename Handler>
+class CustomAllocHandler
+{
+public:
+    typedef HandlerAllocator<Handler> allocator_type;
+
+    CustomAllocHandler(HandlerMemory &memory, Handler handler) : m_memory(memory),
+                                                                 m_handler(handler)
+    {
+    }
+
+    allocator_type get_allocator() const noexcept
+    {
+        return allocator_type(m_memory);
+    }
+
+    template <typename... Args>
+    void operator()(Args &&...args)
+    {
+        m_handler(std::forward<Args>(args)...);
+    }
+
+private:
+    HandlerMemory &m_memory;
+    Handler m_handler;
+};
+
+template <typename Handler>
+inline CustomAllocHandler<Handler> MakeCustomAllocHandler(
+    HandlerMemory &memory, Handler handler)
+{
+    return CustomAllocHandler<Handler>(memory, handler);
+}
+
+// Log-linear latency histogram in the spirit of HdrHistogram, the same
+// as the one the servers of chapter 4 report their statistics with. Values are
+// recorded in microseconds; below 64 every value has a bucket of its own,
+// above that every power of two is split into 32 buckets, so a reported
+// percentile is within about 3% of the recorded value. Recording is a
+// relaxed atomic increment, so readers may merge a histogram at any time.
+class LatencyHistogram
+{
+public:
+    static const unsigned int SUB_BUCKET_BITS = 5;
+    static const unsigned int SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+    static const unsigned int MAX_MAGNITUDE = 35; // About 9.5 hours.
+    static const unsigned int BUCKET_COUNT = (MAX_MAGNITUDE - SUB_BUCKET_BITS + 2) * SUB_BUCKET_COUNT;
+
+    LatencyHistogram()
+    {
+        for (auto &bucket : m_buckets)
+        {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void Record(std::uint64_t value_us)
+    {
+        m_buckets[GetBucketIndex(value_us)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Adds the counts of this histogram to the plain array of counts.
+    void MergeInto(std::vector<std::uint64_t> &counts) const
+    {
+        counts.resize(BUCKET_COUNT, 0);
+
+        for (std::size_t i = 0; i < BUCKET_COUNT; i++)
+        {
+            counts[i] += m_buckets[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    // Returns the value at the given percentile of the merged counts.
+    static std::uint64_t GetPercentile(const std::vector<std::uint64_t> &counts,
+                                       double percentile)
+    {
+        std::uint64_t total = 0;
+        for (std::uint64_t count : counts)
+        {
+            total += count;
+        }
+
+        if (total == 0)
+            return 0;
+
+        std::uint64_t rank = static_cast<std::uint64_t>(percentile / 100.0 * total + 0.5);
+        if (rank == 0)
+            rank = 1;
+
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < counts.size(); i++)
+        {
+            seen += counts[i];
+            if (seen >= rank)
+                return GetBucketValue(i);
+        }
+
+        return GetBucketValue(counts.size() - 1);
+    }
+
+private:
+    static unsigned int GetMagnitude(std::uint64_t value)
+    {
+        unsigned int magnitude = 0;
+        while (value >>= 1)
+            magnitude++;
+
+        return magnitude;
+    }
+
+    static std::size_t GetBucketIndex(std::uint64_t value)
+    {
+        if (value < 2 * SUB_BUCKET_COUNT)
+            return static_cast<std::size_t>(value);
+
+        unsigned int magnitude = GetMagnitude(value);
+        if (magnitude > MAX_MAGNITUDE)
+            return BUCKET_COUNT - 1;
+
+        unsigned int shift = magnitude - SUB_BUCKET_BITS;
+        return (magnitude - SUB_BUCKET_BITS) * SUB_BUCKET_COUNT +
+               static_cast<std::size_t>(value >> shift);
+    }
+
+    // Middle of the range of values counted by the bucket.
+    static std::uint64_t GetBucketValue(std::size_t index)
+    {
+        if (index < 2 * SUB_BUCKET_COUNT)
+            return index;
+
+        unsigned int shift = static_cast<unsigned int>(index / SUB_BUCKET_COUNT) - 1;
+        std::uint64_t lowest = static_cast<std::uint64_t>(index % SUB_BUCKET_COUNT + SUB_BUCKET_COUNT)
+                               << shift;
+
+        return lowest + ((std::uint64_t(1) << shift) >> 1);
+    }
+
+private:
+    std::atomic<std::uint64_t> m_buckets[BUCKET_COUNT];
+};
+
+// The benchmark's callbacks carry the time the request was scheduled
+// at, hence a std::function rather than a plain function pointer.
+typedef std::function<void(unsigned int request_id,        // unique identifier of the request is assigned to the request when it was initiated.
+                           const std::string &response,    // the response data
+                           const system::error_code &ec)>  // error information
+    Callback;
+
+// data structure whose purpose is to keep the data related to a particular request while it is being executed
+struct Session
+{
+    Session(asio::io_service &ios,
+            const std::string &raw_ip_address,
+            unsigned short port_num,
+            const std::string &request,
+            unsigned int id,
+            Callback callback) : m_sock(ios),
+                                 m_ep(asio::ip::address::from_string(raw_ip_address),
+                                      port_num),
+                                 m_request(request),
+                                 m_id(id),
+                                 m_callback(callback),
+                                 m_was_cancelled(false) {}
+
+    asio::ip::tcp::socket m_sock; // Socket used for communication
+    asio::ip::tcp::endpoint m_ep; // Remote endpoint.
+    std::string m_request;        // Request string.
+
+    // streambuf where the response will be stored.
+    asio::streambuf m_response_buf;
+    std::string m_response; // Response represented as a string.
+
+    // Contains the description of an error if one occurs during
+    // the request lifecycle.
+    system::error_code m_ec;
+
+    unsigned int m_id; // Unique ID assigned to the request.
+
+    // Pointer to the function to be called when the request
+    // completes.
+    Callback m_callback;
+
+    bool m_was_cancelled;
+    std::mutex m_cancel_guard;
+
+    // Arena the memory of the session's asynchronous operations is allocated from.
+    HandlerMemory m_handler_memory;
+};
+
+// Integer socket option meeting the Boost.Asio requirements for
+// socket options, for the options it provides no class for.
+template <int Level, int Name>
+class IntegerSocketOption
+{
+public:
+    IntegerSocketOption() : m_value(0)
+    {
+    }
+
+    explicit IntegerSocketOption(int value) : m_value(value)
+    {
+    }
+
+    int value() const
+    {
+        return m_value;
+    }
+
+    template <typename Protocol>
+    int level(const Protocol &) const
+    {
+        return Level;
+    }
+
+    template <typename Protocol>
+    int name(const Protocol &) const
+    {
+        return Name;
+    }
+
+    template <typename Protocol>
+    int *data(const Protocol &)
+    {
+        return &m_value;
+    }
+
+    template <typename Protocol>
+    const int *data(const Protocol &) const
+    {
+        return &m_value;
+    }
+
+    template <typename Protocol>
+    std::size_t size(const Protocol &) const
+    {
+        return sizeof(m_value);
+    }
+
+    template <typename Protocol>
+    void resize(const Protocol &, std::size_t size)
+    {
+        if (size != sizeof(m_value))
+            throw std::length_error("IntegerSocketOption resize");
+    }
+
+private:
+    int m_value;
+};
+
+// Socket options applied to every connection of the client.
+// Zero and false leave the system defaults in place, so a default
+// constructed profile changes nothing. The options are applied on a best
+// effort basis: one the system refuses or does not support is skipped,
+// which Log() makes visible by printing the values in effect.
+struct SocketProfile
+{
+    std::string name = "default";
+
+    bool no_delay = false;           // TCP_NODELAY: disable Nagle's algorithm.
+    int receive_buffer_size = 0;     // SO_RCVBUF in bytes.
+    int send_buffer_size = 0;        // SO_SNDBUF in bytes.
+    bool keep_alive = false;         // SO_KEEPALIVE together with the three below.
+    int keep_alive_idle_sec = 0;     // TCP_KEEPIDLE
+    int keep_alive_interval_sec = 0; // TCP_KEEPINTVL
+    int keep_alive_count = 0;        // TCP_KEEPCNT
+    bool quick_ack = false;          // TCP_QUICKACK, only in effect until the kernel leaves the quick ack mode.
+    int fast_open = 0;               // Non-zero enables TCP_FASTOPEN_CONNECT.
+    int busy_poll_us = 0;            // SO_BUSY_POLL; raising it above net.core.busy_read needs CAP_NET_ADMIN.
+
+    // Small request/response exchanges: segments go out at once, acks are
+    // not delayed, and the receiving thread spins briefly on the device queue.
+    static SocketProfile LowLatencyRpc()
+    {
+        SocketProfile profile;
+        profile.name = "low-latency-rpc";
+        profile.no_delay = true;
+        profile.keep_alive = true;
+        profile.keep_alive_idle_sec = 60;
+        profile.keep_alive_interval_sec = 10;
+        profile.keep_alive_count = 5;
+        profile.quick_ack = true;
+        profile.fast_open = 256;
+        profile.busy_poll_us = 50;
+
+        return profile;
+    }
+
+    // Large transfers: buffers big enough to keep a long fat pipe full.
+    static SocketProfile BulkTransfer()
+    {
+        SocketProfile profile;
+        profile.name = "bulk-transfer";
+        profile.receive_buffer_size = 4 * 1024 * 1024;
+        profile.send_buffer_size = 4 * 1024 * 1024;
+        profile.keep_alive = true;
+        profile.keep_alive_idle_sec = 60;
+        profile.keep_alive_interval_sec = 10;
+        profile.keep_alive_count = 5;
+
+        return profile;
+    }
+
+    // Called for a socket once it has been opened and before it is connected.
+    void ApplyToConnection(asio::ip::tcp::socket &sock) const
+    {
+        boost::system::error_code ignored_ec;
+
+        if (no_delay)
+            sock.set_option(asio::ip::tcp::no_delay(true), ignored_ec);
+
+        if (receive_buffer_size > 0)
+            sock.set_option(asio::socket_base::receive_buffer_size(receive_buffer_size), ignored_ec);
+
+        if (send_buffer_size > 0)
+            sock.set_option(asio::socket_base::send_buffer_size(send_buffer_size), ignored_ec);
+
+        if (keep_alive)
+            sock.set_option(asio::socket_base::keep_alive(true), ignored_ec);
+
+#if BOOST_OS_LINUX
+        if (keep_alive && keep_alive_idle_sec > 0)
+            sock.set_option(IntegerSocketOption<IPPROTO_TCP, TCP_KEEPIDLE>(keep_alive_idle_sec), ignored_ec);
+
+        if (keep_alive && keep_alive_interval_sec > 0)
+            sock.set_option(IntegerSocketOption<IPPROTO_TCP, TCP_KEEPINTVL>(keep_alive_interval_sec), ignored_ec);
+
+        if (keep_alive && keep_alive_count > 0)
+            sock.set_option(IntegerSocketOption<IPPROTO_TCP, TCP_KEEPCNT>(keep_alive_count), ignored_ec);
+
+        if (quick_ack)
+            sock.set_option(IntegerSocketOption<IPPROTO_TCP, TCP_QUICKACK>(1), ignored_ec);
+
+        if (busy_poll_us > 0)
+            sock.set_option(IntegerSocketOption<SOL_SOCKET, SO_BUSY_POLL>(busy_poll_us), ignored_ec);
+
+#if defined(TCP_FASTOPEN_CONNECT)
+        // The SYN carries the first write once the server has issued a cookie.
+        if (fast_open > 0)
+            sock.set_option(IntegerSocketOption<IPPROTO_TCP, TCP_FASTOPEN_CONNECT>(1), ignored_ec);
+#endif
+#endif
+    }
+
+    // Applies the profile to a scratch socket and outputs the values
+    // the system has put into effect next to the requested ones.
+    void Log(std::ostream &os) const
+    {
+        asio::io_service ios;
+        asio::ip::tcp::socket probe(ios);
+        boost::system::error_code ec;
+
+        probe.open(asio::ip::tcp::v4(), ec);
+        if (ec.value() != 0)
+        {
+            os << "Socket profile " << name << ": cannot open a socket. Message: "
+               << ec.message() << std::endl;
+            return;
+        }
+
+        ApplyToConnection(probe);
+
+        os << "Socket profile " << name << ':';
+
+        asio::ip::tcp::no_delay no_delay_value;
+        probe.get_option(no_delay_value, ec);
+        LogValue(os, "no_delay", ec ? -1 : no_delay_value.value(), no_delay);
+
+        asio::socket_base::receive_buffer_size receive_buffer_size_value;
+        probe.get_option(receive_buffer_size_value, ec);
+        LogValue(os, "receive_buffer_size", ec ? -1 : receive_buffer_size_value.value(), receive_buffer_size);
+
+        asio::socket_base::send_buffer_size send_buffer_size_value;
+        probe.get_option(send_buffer_size_value, ec);
+        LogValue(os, "send_buffer_size", ec ? -1 : send_buffer_size_value.value(), send_buffer_size);
+
+        asio::socket_base::keep_alive keep_alive_value;
+        probe.get_option(keep_alive_value, ec);
+        LogValue(os, "keep_alive", ec ? -1 : keep_alive_value.value(), keep_alive);
+
+#if BOOST_OS_LINUX
+        LogValue(os, "keep_alive_idle_sec", GetInteger<IPPROTO_TCP, TCP_KEEPIDLE>(probe), keep_alive_idle_sec);
+        LogValue(os, "keep_alive_interval_sec", GetInteger<IPPROTO_TCP, TCP_KEEPINTVL>(probe), keep_alive_interval_sec);
+        LogValue(os, "keep_alive_count", GetInteger<IPPROTO_TCP, TCP_KEEPCNT>(probe), keep_alive_count);
+        LogValue(os, "quick_ack", GetInteger<IPPROTO_TCP, TCP_QUICKACK>(probe), quick_ack);
+        LogValue(os, "busy_poll_us", GetInteger<SOL_SOCKET, SO_BUSY_POLL>(probe), busy_poll_us);
+#if defined(TCP_FASTOPEN_CONNECT)
+        LogValue(os, "fast_open", GetInteger<IPPROTO_TCP, TCP_FASTOPEN_CONNECT>(probe), fast_open > 0);
+#endif
+#endif
+        os << std::endl;
+    }
+
+private:
+    template <int Level, int Name>
+    static int GetInteger(asio::ip::tcp::socket &sock)
+    {
+        IntegerSocketOption<Level, Name> option;
+        boost::system::error_code ec;
+        sock.get_option(option, ec);
+
+        return ec ? -1 : option.value();
+    }
+
+    // A value of -1 means the option could not be read.
+    static void LogValue(std::ostream &os, const char *option, int effective, int requested)
+    {
+        os << ' ' << option << '=' << effective;
+        if (requested != 0 && effective != requested)
+            os << " (requested " << requested << ')';
+    }
+};
+
+// class that provides the asynchronous communication functionality.
+class AsyncTCPClient : public boost::noncopyable
+{
+public:
+    AsyncTCPClient(unsigned char num_of_threads)
+    {
+
+        //instantiates an object of the asio::io_service::work class
+        // passing an instance of the asio::io_service class named m_ios to its constructor
+        m_work.reset(new boost::asio::io_service::work(m_ios));
+
+        for (unsigned char i = 1; i <= num_of_threads; i++)
+        {
+            //spawns a thread that calls the run() method of the m_ios object.
+            std::unique_ptr<std::thread> th(
+                new std::thread([this]()
+                                { m_ios.run(); }));
+
+            m_threads.push_back(std::move(th));
+        }
+    }
+
+    // Sets the options of the sockets the client connects.
+    // Must be called before any request is initiated.
+    void setSocketProfile(const SocketProfile &profile)
+    {
+        m_socket_profile = profile;
+    }
+    // initiates a request to the server
+    void emulateLongComputationOp(
+        unsigned int duration_sec,          //represents the request parameter according to the application layer protocol
+        const std::string &raw_ip_address,  //specify the server to which the request should be sent.
+        unsigned short port_num,            //specify the server to which the request should be sent.
+        Callback callback,                  //callback function, which will be called when the request is complete.
+        unsigned int request_id)    // unique identifier of the request
+    {
+
+        // preparing a request string and allocating an instance of the Session structure
+        // that keeps the data associated with the request including a socket object
+        // that is used to communicate with the server.
+        std::string request = "EMULATE_LONG_CALC_OP " + std::to_string(duration_sec) + "\n";
+        std::shared_ptr<Session> session =
+            std::shared_ptr<Session>(new Session(m_ios,
+                                                 raw_ip_address,
+                                                 port_num,
+                                                 request,
+                                                 request_id,
+                                                 callback));
+
+        //opened socket and the pointer to the Session object is added to the m_active_sessions map
+        session->m_sock.open(session->m_ep.protocol());
+        m_socket_profile.ApplyToConnection(session->m_sock);
+
+        // Add new session to the list of active sessions so
+        // that we can access it if the user decides to cancel
+        // the corresponding request before it completes.
+        // Because active sessions list can be accessed from
+        // multiple threads, we guard it with a mutex to avoid
+        // data corruption.
+        std::unique_lock<std::mutex> lock(m_active_sessions_guard);
+        m_active_sessions[request_id] = session;
+        lock.unlock();
+
+        //connect the socket to the server
+        session->m_sock.async_connect(session->m_ep,
+                                      MakeCustomAllocHandler(session->m_handler_memory,
+                                                             [this, session](const system::error_code &ec)
+                                                             {
+                                                                 //checking the error code passed to it as the ec argument
+                                                                 if (ec.value() != 0)
+                                                                 {
+                                                                     //we store the ec value in the corresponding Session object,
+                                                                     session->m_ec = ec;
+                                                                     //call the class's onRequestComplete() private method passing the Session object to it as an argument
+                                                                     onRequestComplete(session);
+                                                                     //then return.
+                                                                     return;
+                                                                 }
+
+                                                                 // lock the m_cancel_guard mutex (the member of the request descriptor object)
+                                                                 std::unique_lock<std::mutex> cancel_lock(session->m_cancel_guard);
+
+                                                                 //check whether the request has not been canceled yet. 
+                                                                 if (session->m_was_cancelled)
+                                                                 {
+                                                                     onRequestComplete(session);
+                                                                     return;
+                                                                 }
+
+                                                                 //If we see that the request has not been canceled
+                                                                 //we initiate the next asynchronous operation calling the Boost.Asio free function async_write()
+                                                                 // to send the request data to the server.
+                                                                 asio::async_write(session->m_sock,
+                                                                                   asio::buffer(session->m_request),
+                                                                                   MakeCustomAllocHandler(session->m_handler_memory,
+                                                                                                          [this, session](const boost::system::error_code &ec,
+                                                                                                                          std::size_t bytes_transferred)
+                                                                                                          {
+                                                                                                              // check the error code
+                                                                                                              if (ec.value() != 0)
+                                                                                                              {
+                                                                                                                  session->m_ec = ec;
+                                                                                                                  onRequestComplete(session);
+                                                                                                                  return;
+                                                                                                              }
+
+                                                                                                              //// lock the m_cancel_guard mutex (the member of the request descriptor object)
+                                                                                                              std::unique_lock<std::mutex> cancel_lock(session->m_cancel_guard);
+
+                                                                                                              // check whether or not the request has been canceled. 
+                                                                                                              if (session->m_was_cancelled)
+                                                                                                              {
+                                                                                                                  onRequestComplete(session);
+                                                                                                                  return;
+                                                                                                              }
+
+                                                                                                              // initiate the next asynchronous operation—async_read_until()—in order to receive a response from the server
+                                                                                                              asio::async_read_until(session->m_sock,
+                                                                                                                                     session->m_response_buf,
+                                                                                                                                     '\n',
+                                                                                                                                     MakeCustomAllocHandler(session->m_handler_memory,
+                                                                                                                                                            [this, session](const boost::system::error_code &ec,
+                                                                                                                                                                            std::size_t bytes_transferred)
+                                                                                                                                                            {
+                                                                                                                                                                //checks the error code
+                                                                                                                                                                if (ec.value() != 0)
+                                                                                                                                                                {
+                                                                                                                                                                    session->m_ec = ec;
+                                                                                                                                                                }
+                                                                                                                                                                else
+                                                                                                                                                                {
+                                                                                                                                                                    std::istream strm(&session->m_response_buf);
+                                                                                                                                                                    std::getline(strm, session->m_response);
+                                                                                                                                                                }
+
+                                                                                                                                                                // the AsyncTCPClient class's private method onRequestComplete() is called
+                                                                                                                                                                // and the Session object is passed to it as an argument.
+                                                                                                                                                                onRequestComplete(session);
+                                                                                                                                                            }));
+                                                                                                          }));
+                                                             }));
+    };
+
+    // cancels the previously initiated request designated by the request_id argument
+    void cancelRequest(unsigned int request_id) //accepts an identifier of the request to be canceled as an argument.
+    {
+        std::unique_lock<std::mutex>
+            lock(m_active_sessions_guard);
+
+        //looking for the Session object corresponding to the specified request in the m_active_sessions map.
+        auto it = m_active_sessions.find(request_id);
+        if (it != m_active_sessions.end())
+        {
+            std::unique_lock<std::mutex>
+                cancel_lock(it->second->m_cancel_guard);
+
+            it->second->m_was_cancelled = true;
+            it->second->m_sock.cancel();
+        }
+    }
+
+    // blocks the calling thread until all the currently running requests complete and deinitializes the client.
+    void close()
+    {
+        // Destroy work object. This allows the I/O threads to
+        // exit the event loop when there are no more pending
+        // asynchronous operations.
+        m_work.reset(NULL);
+
+        // Waiting for the I/O threads to exit.
+        for (auto &thread : m_threads)
+        {
+            thread->join();
+        }
+    }
+
+private:
+    // method is called whenever the request completes with any result.
+    void onRequestComplete(std::shared_ptr<Session> session)
+    {
+        // Shutting down the connection. This method may
+        // fail in case socket is not connected. We don�t care
+        // about the error code if this function fails.
+        boost::system::error_code ignored_ec;
+
+        session->m_sock.shutdown( asio::ip::tcp::socket::shutdown_both, ignored_ec);
+
+        // Remove session form the map of active sessions.
+        std::unique_lock<std::mutex>
+            lock(m_active_sessions_guard);
+
+        auto it = m_active_sessions.find(session->m_id);
+        if (it != m_active_sessions.end())
+            m_active_sessions.erase(it);
+
+        lock.unlock();
+
+        boost::system::error_code ec;
+
+        if (session->m_ec.value() == 0 && session->m_was_cancelled)
+            ec = asio::error::operation_aborted;
+        else
+            ec = session->m_ec;
+
+        // Call the callback provided by the user.
+        session->m_callback(session->m_id,
+                            session->m_response, ec);
+    };
+
+private:
+    asio::io_service m_ios;
+    std::map<int, std::shared_ptr<Session>> m_active_sessions;
+    std::mutex m_active_sessions_guard;
+    SocketProfile m_socket_profile;
+    std::unique_ptr<boost::asio::io_service::work> m_work;
+    std::list<std::unique_ptr<std::thread>> m_threads;
+};
+
+// Parameters of a benchmark run, set from the command line arguments.
+struct BenchmarkConfig
+{
+    std::string host = "127.0.0.1";
+    unsigned short port = 3333;
+
+    // In the open-loop mode requests are started at a fixed rate no matter
+    // how fast the server responds; in the closed-loop mode a fixed number of
+    // sessions each start the next request as soon as the previous one completes.
+    bool open_loop = false;
+    unsigned int connections = 1000;
+    unsigned int rate = 1000;         // Requests per second in the open-loop mode.
+    unsigned int duration_sec = 10;
+    unsigned int threads = 4;
+
+    // Closed-loop mode only. When not zero, every latency longer than the interval
+    // is recorded together with the samples the stalled session could not take.
+    unsigned int expected_interval_us = 0;
+
+    unsigned int request_param = 0;   // Parameter of the EMULATE_LONG_CALC_OP request.
+    std::string label = "server";     // Echoed in the results to tell the runs apart.
+
+    SocketProfile socket_profile;     // Options of the client's sockets.
+};
+
+// Drives an AsyncTCPClient against a server and gathers the latencies of the requests.
+// The latency of a request is measured from the time it was scheduled at rather than
+// the time it was actually sent, so a stalled server or client is not hidden by
+// requests that were started late (coordinated omission).
+class Benchmark
+{
+public:
+    Benchmark(const BenchmarkConfig &config) : m_config(config),
+                                               m_client(static_cast<unsigned char>(config.threads)),
+                                               m_next_request_id(0),
+                                               m_num_completed(0),
+                                               m_num_errors(0),
+                                               m_num_outstanding(0),
+                                               m_max_outstanding(0),
+                                               m_stop(false)
+    {
+        m_client.setSocketProfile(config.socket_profile);
+    }
+
+    void Run()
+    {
+        m_started_at = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point deadline =
+            m_started_at + std::chrono::seconds(m_config.duration_sec);
+
+        if (m_config.open_loop)
+        {
+            RunOpenLoop(deadline);
+        }
+        else
+        {
+            for (unsigned int i = 0; i < m_config.connections; i++)
+            {
+                StartRequest(std::chrono::steady_clock::now());
+            }
+
+            std::this_thread::sleep_until(deadline);
+        }
+
+        // Let the outstanding requests complete.
+        m_stop.store(true);
+        m_client.close();
+
+        m_finished_at = std::chrono::steady_clock::now();
+    }
+
+    // Outputs the results as a single JSON object.
+    void PrintResults(std::ostream &os) const
+    {
+        std::vector<std::uint64_t> counts;
+        m_latencies.MergeInto(counts);
+
+        double elapsed_sec =
+            std::chrono::duration<double>(m_finished_at - m_started_at).count();
+        std::uint64_t completed = m_num_completed.load();
+
+        os << "{\"label\":\"" << m_config.label << "\""
+           << ",\"mode\":\"" << (m_config.open_loop ? "open" : "closed") << "\""
+           << ",\"connections\":" << (m_config.open_loop ? 0 : m_config.connections)
+           << ",\"rate\":" << (m_config.open_loop ? m_config.rate : 0)
+           << ",\"threads\":" << m_config.threads
+           << ",\"socket_profile\":\"" << m_config.socket_profile.name << "\""
+           << ",\"duration_sec\":" << elapsed_sec
+           << ",\"completed\":" << completed
+           << ",\"errors\":" << m_num_errors.load()
+           << ",\"max_outstanding\":" << m_max_outstanding.load()
+           << ",\"throughput_rps\":" << (elapsed_sec > 0 ? completed / elapsed_sec : 0)
+           << ",\"latency_us\":{"
+           << "\"p50\":" << LatencyHistogram::GetPercentile(counts, 50.0)
+           << ",\"p90\":" << LatencyHistogram::GetPercentile(counts, 90.0)
+           << ",\"p99\":" << LatencyHistogram::GetPercentile(counts, 99.0)
+           << ",\"p999\":" << LatencyHistogram::GetPercentile(counts, 99.9)
+           << ",\"max\":" << LatencyHistogram::GetPercentile(counts, 100.0)
+           << "}}" << std::endl;
+    }
+
+private:
+    // Requests are scheduled at fixed points in time. Sleeping past one
+    // does not shift the schedule: the late requests are started at once
+    // and keep their scheduled time.
+    void RunOpenLoop(std::chrono::steady_clock::time_point deadline)
+    {
+        std::chrono::nanoseconds interval(1000000000ull / (m_config.rate > 0 ? m_config.rate : 1));
+        std::chrono::steady_clock::time_point scheduled_at = m_started_at;
+
+        while (scheduled_at < deadline)
+        {
+            std::this_thread::sleep_until(scheduled_at);
+            StartRequest(scheduled_at);
+            scheduled_at += interval;
+        }
+    }
+
+    void StartRequest(std::chrono::steady_clock::time_point scheduled_at)
+    {
+        unsigned int request_id = m_next_request_id.fetch_add(1);
+
+        unsigned int outstanding = m_num_outstanding.fetch_add(1) + 1;
+        unsigned int max_outstanding = m_max_outstanding.load();
+        while (outstanding > max_outstanding &&
+               !m_max_outstanding.compare_exchange_weak(max_outstanding, outstanding))
+        {
+        }
+
+        try
+        {
+            m_client.emulateLongComputationOp(m_config.request_param,
+                                              m_config.host,
+                                              m_config.port,
+                                              [this, scheduled_at](unsigned int,
+                                                                   const std::string &,
+                                                                   const system::error_code &ec)
+                                              {
+                                                  onRequestComplete(scheduled_at, ec);
+                                              },
+                                              request_id);
+        }
+        catch (system::system_error &e)
+        {
+            // Most likely the process has run out of file descriptors.
+            m_num_errors.fetch_add(1);
+            m_num_outstanding.fetch_sub(1);
+        }
+    }
+
+    void onRequestComplete(std::chrono::steady_clock::time_point scheduled_at,
+                           const system::error_code &ec)
+    {
+        m_num_outstanding.fetch_sub(1);
+
+        if (ec.value() != 0)
+        {
+            m_num_errors.fetch_add(1);
+        }
+        else
+        {
+            std::int64_t latency_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                                          std::chrono::steady_clock::now() - scheduled_at)
+                                          .count();
+            RecordLatency(latency_us > 0 ? static_cast<std::uint64_t>(latency_us) : 0);
+            m_num_completed.fetch_add(1);
+        }
+
+        // In the closed-loop mode the session goes on with the next request.
+        if (!m_config.open_loop && !m_stop.load())
+        {
+            StartRequest(std::chrono::steady_clock::now());
+        }
+    }
+
+    void RecordLatency(std::uint64_t latency_us)
+    {
+        m_latencies.Record(latency_us);
+
+        // A closed-loop session waiting for a slow response does not take the samples
+        // it was expected to take meanwhile; they are filled in with the latencies
+        // they would have seen.
+        std::uint64_t interval_us = m_config.expected_interval_us;
+        if (m_config.open_loop || interval_us == 0)
+            return;
+
+        for (std::uint64_t missed_us = latency_us > interval_us ? latency_us - interval_us : 0;
+             missed_us >= interval_us;
+             missed_us -= interval_us)
+        {
+            m_latencies.Record(missed_us);
+        }
+    }
+
+private:
+    BenchmarkConfig m_config;
+    AsyncTCPClient m_client;
+    LatencyHistogram m_latencies;
+
+    std::atomic<unsigned int> m_next_request_id;
+    std::atomic<std::uint64_t> m_num_completed;
+    std::atomic<std::uint64_t> m_num_errors;
+    std::atomic<unsigned int> m_num_outstanding;
+    std::atomic<unsigned int> m_max_outstanding;
+    std::atomic<bool> m_stop;
+
+    std::chrono::steady_clock::time_point m_started_at;
+    std::chrono::steady_clock::time_point m_finished_at;
+};
+
+// Parses arguments of the form --name=value.
+bool ParseArguments(int argc, char *argv[], BenchmarkConfig &config)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg(argv[i]);
+        std::size_t eq = arg.find('=');
+        if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos)
+            return false;
+
+        std::string name = arg.substr(2, eq - 2);
+        std::string value = arg.substr(eq + 1);
+        unsigned long number = std::strtoul(value.c_str(), nullptr, 10);
+
+        if (name == "host")
+            config.host = value;
+        else if (name == "port")
+            config.port = static_cast<unsigned short>(number);
+        else if (name == "mode" && (value == "open" || value == "closed"))
+            config.open_loop = (value == "open");
+        else if (name == "connections")
+            config.connections = static_cast<unsigned int>(number);
+        else if (name == "rate")
+            config.rate = static_cast<unsigned int>(number);
+        else if (name == "duration")
+            config.duration_sec = static_cast<unsigned int>(number);
+        else if (name == "threads" && number > 0 && number < 256)
+            config.threads = static_cast<unsigned int>(number);
+        else if (name == "expected-interval-us")
+            config.expected_interval_us = static_cast<unsigned int>(number);
+        else if (name == "request-param")
+            config.request_param = static_cast<unsigned int>(number);
+        else if (name == "label")
+            config.label = value;
+        else if (name == "socket-profile" && value == "default")
+            config.socket_profile = SocketProfile();
+        else if (name == "socket-profile" && value == "low-latency-rpc")
+            config.socket_profile = SocketProfile::LowLatencyRpc();
+        else if (name == "socket-profile" && value == "bulk-transfer")
+            config.socket_profile = SocketProfile::BulkTransfer();
+        else
+            return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    BenchmarkConfig config;
+    if (!ParseArguments(argc, argv, config))
+    {
+        std::cout << "Usage: " << argv[0]
+                  << " [--host=127.0.0.1] [--port=3333] [--mode=closed|open]"
+                  << " [--connections=1000] [--rate=1000] [--duration=10]"
+                  << " [--threads=4] [--expected-interval-us=0]"
+                  << " [--request-param=0] [--label=server]"
+                  << " [--socket-profile=default|low-latency-rpc|bulk-transfer]" << std::endl;
+        return 1;
+    }
+
+    // The results go to the standard output stream, the log to the standard error stream.
+    config.socket_profile.Log(std::cerr);
+
+    try
+    {
+        Benchmark benchmark(config);
+        benchmark.Run();
+        benchmark.PrintResults(std::cout);
+    }
+    catch (system::system_error &e)
+    {
+        std::cout << "Error occured! Error code = " << e.code()
+                  << ". Message: " << e.what();
+
+        return e.code().value();
+    }
+
+    return 0;
+};
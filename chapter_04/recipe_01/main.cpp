@@ -3,32 +3,273 @@
 #include <thread>
 #include <atomic>
 #include <memory>
+#include <chrono>
+#include <cstdint>
+#include <vector>
 #include <iostream>
 
 using namespace boost;
 
+// Log-linear latency histogram in the spirit of HdrHistogram. Values are
+// recorded in microseconds; below 64 every value has a bucket of its own,
+// above that every power of two is split into 32 buckets, so a reported
+// percentile is within about 3% of the recorded value. Recording is a
+// relaxed atomic increment, so readers may merge a histogram at any time.
+class LatencyHistogram
+{
+public:
+    static const unsigned int SUB_BUCKET_BITS = 5;
+    static const unsigned int SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+    static const unsigned int MAX_MAGNITUDE = 35; // About 9.5 hours.
+    static const unsigned int BUCKET_COUNT = (MAX_MAGNITUDE - SUB_BUCKET_BITS + 2) * SUB_BUCKET_COUNT;
+
+    LatencyHistogram()
+    {
+        for (auto &bucket : m_buckets)
+        {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void Record(std::uint64_t value_us)
+    {
+        m_buckets[GetBucketIndex(value_us)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Adds the counts of this histogram to the plain array of counts.
+    void MergeInto(std::vector<std::uint64_t> &counts) const
+    {
+        counts.resize(BUCKET_COUNT, 0);
+
+        for (std::size_t i = 0; i < BUCKET_COUNT; i++)
+        {
+            counts[i] += m_buckets[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    // Returns the value at the given percentile of the merged counts.
+    static std::uint64_t GetPercentile(const std::vector<std::uint64_t> &counts,
+                                       double percentile)
+    {
+        std::uint64_t total = 0;
+        for (std::uint64_t count : counts)
+        {
+            total += count;
+        }
+
+        if (total == 0)
+            return 0;
+
+        std::uint64_t rank = static_cast<std::uint64_t>(percentile / 100.0 * total + 0.5);
+        if (rank == 0)
+            rank = 1;
+
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < counts.size(); i++)
+        {
+            seen += counts[i];
+            if (seen >= rank)
+                return GetBucketValue(i);
+        }
+
+        return GetBucketValue(counts.size() - 1);
+    }
+
+private:
+    static unsigned int GetMagnitude(std::uint64_t value)
+    {
+        unsigned int magnitude = 0;
+        while (value >>= 1)
+            magnitude++;
+
+        return magnitude;
+    }
+
+    static std::size_t GetBucketIndex(std::uint64_t value)
+    {
+        if (value < 2 * SUB_BUCKET_COUNT)
+            return static_cast<std::size_t>(value);
+
+        unsigned int magnitude = GetMagnitude(value);
+        if (magnitude > MAX_MAGNITUDE)
+            return BUCKET_COUNT - 1;
+
+        unsigned int shift = magnitude - SUB_BUCKET_BITS;
+        return (magnitude - SUB_BUCKET_BITS) * SUB_BUCKET_COUNT +
+               static_cast<std::size_t>(value >> shift);
+    }
+
+    // Middle of the range of values counted by the bucket.
+    static std::uint64_t GetBucketValue(std::size_t index)
+    {
+        if (index < 2 * SUB_BUCKET_COUNT)
+            return index;
+
+        unsigned int shift = static_cast<unsigned int>(index / SUB_BUCKET_COUNT) - 1;
+        std::uint64_t lowest = static_cast<std::uint64_t>(index % SUB_BUCKET_COUNT + SUB_BUCKET_COUNT)
+                               << shift;
+
+        return lowest + ((std::uint64_t(1) << shift) >> 1);
+    }
+
+private:
+    std::atomic<std::uint64_t> m_buckets[BUCKET_COUNT];
+};
+
+// Latency histograms and counters of the server. They are split into
+// stripes and every thread records into the stripe it is assigned when it
+// records for the first time, so recording takes no lock and threads rarely
+// share cache lines. The stripes are merged on demand when dumped.
+class ServerStats
+{
+public:
+    enum Metric
+    {
+        AcceptToFirstByte, // From accepting the connection to receiving the first request.
+        Read,              // Reading a request.
+        Process,           // Processing the requests.
+        Write,             // Sending the responses.
+        METRIC_COUNT
+    };
+
+    enum Counter
+    {
+        Connections,
+        BytesIn,
+        BytesOut,
+        COUNTER_COUNT
+    };
+
+    void Record(Metric metric, std::chrono::steady_clock::duration latency)
+    {
+        std::int64_t us =
+            std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+
+        GetStripe().m_histograms[metric].Record(us > 0 ? static_cast<std::uint64_t>(us) : 0);
+    }
+
+    void Add(Counter counter, std::uint64_t value)
+    {
+        GetStripe().m_counters[counter].fetch_add(value, std::memory_order_relaxed);
+    }
+
+    // Merges the statistics of all the threads and outputs them.
+    void Dump(std::ostream &os) const
+    {
+        static const char *metric_names[METRIC_COUNT] =
+            {"accept_to_first_byte", "read", "process", "write"};
+        static const char *counter_names[COUNTER_COUNT] =
+            {"connections", "bytes_in", "bytes_out"};
+
+        std::vector<std::uint64_t> counts[METRIC_COUNT];
+        std::uint64_t counters[COUNTER_COUNT] = {};
+
+        for (const Stripe &stripe : m_stripes)
+        {
+            for (int m = 0; m < METRIC_COUNT; m++)
+            {
+                stripe.m_histograms[m].MergeInto(counts[m]);
+            }
+
+            for (int c = 0; c < COUNTER_COUNT; c++)
+            {
+                counters[c] += stripe.m_counters[c].load(std::memory_order_relaxed);
+            }
+        }
+
+        for (int c = 0; c < COUNTER_COUNT; c++)
+        {
+            os << counter_names[c] << "=" << counters[c]
+               << (c + 1 < COUNTER_COUNT ? " " : "\n");
+        }
+
+        for (int m = 0; m < METRIC_COUNT; m++)
+        {
+            std::uint64_t total = 0;
+            for (std::uint64_t count : counts[m])
+            {
+                total += count;
+            }
+
+            os << metric_names[m] << "_us count=" << total
+               << " p50=" << LatencyHistogram::GetPercentile(counts[m], 50.0)
+               << " p99=" << LatencyHistogram::GetPercentile(counts[m], 99.0)
+               << " p999=" << LatencyHistogram::GetPercentile(counts[m], 99.9)
+               << " max=" << LatencyHistogram::GetPercentile(counts[m], 100.0)
+               << "\n";
+        }
+    }
+
+private:
+    static const unsigned int STRIPE_COUNT = 16;
+
+    struct Stripe
+    {
+        Stripe()
+        {
+            for (auto &counter : m_counters)
+            {
+                counter.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        LatencyHistogram m_histograms[METRIC_COUNT];
+        std::atomic<std::uint64_t> m_counters[COUNTER_COUNT];
+        char m_padding[64]; // Keeps the counters off the next stripe's cache line.
+    };
+
+    Stripe &GetStripe()
+    {
+        static std::atomic<unsigned int> next_stripe(0);
+        thread_local unsigned int stripe = next_stripe.fetch_add(1) % STRIPE_COUNT;
+
+        return m_stripes[stripe];
+    }
+
+private:
+    Stripe m_stripes[STRIPE_COUNT];
+};
+
 class Service
 {
 public:
-    Service() {}
+    Service(ServerStats &stats) : m_stats(stats) {}
 
     void StartHandligClient(
         std::shared_ptr<asio::ip::tcp::socket> sock)
     {
+        std::chrono::steady_clock::time_point accepted_at =
+            std::chrono::steady_clock::now();
 
-        std::thread th(([this, sock]()
-                        { HandleClient(sock); }));
+        std::thread th(([this, sock, accepted_at]()
+                        { HandleClient(sock, accepted_at); }));
 
         th.detach();
     }
 
 private:
-    void HandleClient(std::shared_ptr<asio::ip::tcp::socket> sock)
+    void HandleClient(std::shared_ptr<asio::ip::tcp::socket> sock,
+                      std::chrono::steady_clock::time_point accepted_at)
     {
+        m_stats.Add(ServerStats::Connections, 1);
+
         try
         {
+            // Wait for the first byte of the request separately
+            // to tell the client's delay from the time spent reading.
+            sock->wait(asio::ip::tcp::socket::wait_read);
+
+            std::chrono::steady_clock::time_point first_byte_at =
+                std::chrono::steady_clock::now();
+            m_stats.Record(ServerStats::AcceptToFirstByte, first_byte_at - accepted_at);
+
             asio::streambuf request;
-            asio::read_until(*sock.get(), request, '\n');
+            std::size_t bytes_read = asio::read_until(*sock.get(), request, '\n');
+
+            std::chrono::steady_clock::time_point read_at =
+                std::chrono::steady_clock::now();
+            m_stats.Record(ServerStats::Read, read_at - first_byte_at);
+            m_stats.Add(ServerStats::BytesIn, bytes_read);
 
             // Emulate request processing.
             int i = 0;
@@ -38,9 +279,17 @@ private:
             std::this_thread::sleep_for(
                 std::chrono::milliseconds(500));
 
+            std::chrono::steady_clock::time_point processed_at =
+                std::chrono::steady_clock::now();
+            m_stats.Record(ServerStats::Process, processed_at - read_at);
+
             // Sending response.
             std::string response = "Response\n";
-            asio::write(*sock.get(), asio::buffer(response));
+            std::size_t bytes_written = asio::write(*sock.get(), asio::buffer(response));
+
+            m_stats.Record(ServerStats::Write,
+                           std::chrono::steady_clock::now() - processed_at);
+            m_stats.Add(ServerStats::BytesOut, bytes_written);
         }
         catch (system::system_error &e)
         {
@@ -52,16 +301,21 @@ private:
         // Clean-up.
         delete this;
     }
+
+private:
+    ServerStats &m_stats;
 };
 
 class Acceptor
 {
 public:
-    Acceptor(asio::io_service &ios, unsigned short port_num) : m_ios(ios),
-                                                               m_acceptor(m_ios,
-                                                                          asio::ip::tcp::endpoint(
-                                                                              asio::ip::address_v4::any(),
-                                                                              port_num))
+    Acceptor(asio::io_service &ios, unsigned short port_num,
+             ServerStats &stats) : m_ios(ios),
+                                   m_acceptor(m_ios,
+                                              asio::ip::tcp::endpoint(
+                                                  asio::ip::address_v4::any(),
+                                                  port_num)),
+                                   m_stats(stats)
     {
         m_acceptor.listen();
     }
@@ -73,12 +327,13 @@ public:
 
         m_acceptor.accept(*sock.get());
 
-        (new Service)->StartHandligClient(sock);
+        (new Service(m_stats))->StartHandligClient(sock);
     }
 
 private:
     asio::io_service &m_ios;
     asio::ip::tcp::acceptor m_acceptor;
+    ServerStats &m_stats;
 };
 
 class Server
@@ -98,10 +353,16 @@ public:
         m_thread->join();
     }
 
+    // Outputs the latency percentiles and counters gathered so far.
+    void DumpStats(std::ostream &os) const
+    {
+        m_stats.Dump(os);
+    }
+
 private:
     void Run(unsigned short port_num)
     {
-        Acceptor acc(m_ios, port_num);
+        Acceptor acc(m_ios, port_num, m_stats);
 
         while (!m_stop.load())
         {
@@ -112,6 +373,7 @@ private:
     std::unique_ptr<std::thread> m_thread;
     std::atomic<bool> m_stop;
     asio::io_service m_ios;
+    ServerStats m_stats;
 };
 
 int main()
@@ -123,7 +385,12 @@ int main()
         Server srv;
         srv.Start(port_num);
 
-        std::this_thread::sleep_for(std::chrono::seconds(60));
+        // Dump the statistics every 10 seconds for a minute.
+        for (int i = 0; i < 6; i++)
+        {
+            std::this_thread::sleep_for(std::chrono::seconds(10));
+            srv.DumpStats(std::cout);
+        }
 
         srv.Stop();
     }
@@ -2,33 +2,414 @@
 
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include <memory>
+#include <vector>
+#include <cstdint>
 #include <iostream>
 
 using namespace boost;
 
+// Log-linear latency histogram in the spirit of HdrHistogram. Values are
+// recorded in microseconds; below 64 every value has a bucket of its own,
+// above that every power of two is split into 32 buckets, so a reported
+// percentile is within about 3% of the recorded value. Recording is a
+// relaxed atomic increment, so readers may merge a histogram at any time.
+class LatencyHistogram
+{
+public:
+    static const unsigned int SUB_BUCKET_BITS = 5;
+    static const unsigned int SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+    static const unsigned int MAX_MAGNITUDE = 35; // About 9.5 hours.
+    static const unsigned int BUCKET_COUNT = (MAX_MAGNITUDE - SUB_BUCKET_BITS + 2) * SUB_BUCKET_COUNT;
+
+    LatencyHistogram()
+    {
+        for (auto &bucket : m_buckets)
+        {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void Record(std::uint64_t value_us)
+    {
+        m_buckets[GetBucketIndex(value_us)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Adds the counts of this histogram to the plain array of counts.
+    void MergeInto(std::vector<std::uint64_t> &counts) const
+    {
+        counts.resize(BUCKET_COUNT, 0);
+
+        for (std::size_t i = 0; i < BUCKET_COUNT; i++)
+        {
+            counts[i] += m_buckets[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    // Returns the value at the given percentile of the merged counts.
+    static std::uint64_t GetPercentile(const std::vector<std::uint64_t> &counts,
+                                       double percentile)
+    {
+        std::uint64_t total = 0;
+        for (std::uint64_t count : counts)
+        {
+            total += count;
+        }
+
+        if (total == 0)
+            return 0;
+
+        std::uint64_t rank = static_cast<std::uint64_t>(percentile / 100.0 * total + 0.5);
+        if (rank == 0)
+            rank = 1;
+
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < counts.size(); i++)
+        {
+            seen += counts[i];
+            if (seen >= rank)
+                return GetBucketValue(i);
+        }
+
+        return GetBucketValue(counts.size() - 1);
+    }
+
+private:
+    static unsigned int GetMagnitude(std::uint64_t value)
+    {
+        unsigned int magnitude = 0;
+        while (value >>= 1)
+            magnitude++;
+
+        return magnitude;
+    }
+
+    static std::size_t GetBucketIndex(std::uint64_t value)
+    {
+        if (value < 2 * SUB_BUCKET_COUNT)
+            return static_cast<std::size_t>(value);
+
+        unsigned int magnitude = GetMagnitude(value);
+        if (magnitude > MAX_MAGNITUDE)
+            return BUCKET_COUNT - 1;
+
+        unsigned int shift = magnitude - SUB_BUCKET_BITS;
+        return (magnitude - SUB_BUCKET_BITS) * SUB_BUCKET_COUNT +
+               static_cast<std::size_t>(value >> shift);
+    }
+
+    // Middle of the range of values counted by the bucket.
+    static std::uint64_t GetBucketValue(std::size_t index)
+    {
+        if (index < 2 * SUB_BUCKET_COUNT)
+            return index;
+
+        unsigned int shift = static_cast<unsigned int>(index / SUB_BUCKET_COUNT) - 1;
+        std::uint64_t lowest = static_cast<std::uint64_t>(index % SUB_BUCKET_COUNT + SUB_BUCKET_COUNT)
+                               << shift;
+
+        return lowest + ((std::uint64_t(1) << shift) >> 1);
+    }
+
+private:
+    std::atomic<std::uint64_t> m_buckets[BUCKET_COUNT];
+};
+
+// Latency histograms and counters of the server. They are split into
+// stripes and every thread records into the stripe it is assigned when it
+// records for the first time, so recording takes no lock and threads rarely
+// share cache lines. The stripes are merged on demand when dumped.
+class ServerStats
+{
+public:
+    enum Metric
+    {
+        AcceptToFirstByte, // From accepting the connection to receiving the first request.
+        Read,              // Reading a request.
+        Process,           // Processing the requests.
+        Write,             // Sending the responses.
+        METRIC_COUNT
+    };
+
+    enum Counter
+    {
+        Connections,
+        BytesIn,
+        BytesOut,
+        COUNTER_COUNT
+    };
+
+    void Record(Metric metric, std::chrono::steady_clock::duration latency)
+    {
+        std::int64_t us =
+            std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+
+        GetStripe().m_histograms[metric].Record(us > 0 ? static_cast<std::uint64_t>(us) : 0);
+    }
+
+    void Add(Counter counter, std::uint64_t value)
+    {
+        GetStripe().m_counters[counter].fetch_add(value, std::memory_order_relaxed);
+    }
+
+    // Merges the statistics of all the threads and outputs them.
+    void Dump(std::ostream &os) const
+    {
+        static const char *metric_names[METRIC_COUNT] =
+            {"accept_to_first_byte", "read", "process", "write"};
+        static const char *counter_names[COUNTER_COUNT] =
+            {"connections", "bytes_in", "bytes_out"};
+
+        std::vector<std::uint64_t> counts[METRIC_COUNT];
+        std::uint64_t counters[COUNTER_COUNT] = {};
+
+        for (const Stripe &stripe : m_stripes)
+        {
+            for (int m = 0; m < METRIC_COUNT; m++)
+            {
+                stripe.m_histograms[m].MergeInto(counts[m]);
+            }
+
+            for (int c = 0; c < COUNTER_COUNT; c++)
+            {
+                counters[c] += stripe.m_counters[c].load(std::memory_order_relaxed);
+            }
+        }
+
+        for (int c = 0; c < COUNTER_COUNT; c++)
+        {
+            os << counter_names[c] << "=" << counters[c]
+               << (c + 1 < COUNTER_COUNT ? " " : "\n");
+        }
+
+        for (int m = 0; m < METRIC_COUNT; m++)
+        {
+            std::uint64_t total = 0;
+            for (std::uint64_t count : counts[m])
+            {
+                total += count;
+            }
+
+            os << metric_names[m] << "_us count=" << total
+               << " p50=" << LatencyHistogram::GetPercentile(counts[m], 50.0)
+               << " p99=" << LatencyHistogram::GetPercentile(counts[m], 99.0)
+               << " p999=" << LatencyHistogram::GetPercentile(counts[m], 99.9)
+               << " max=" << LatencyHistogram::GetPercentile(counts[m], 100.0)
+               << "\n";
+        }
+    }
+
+private:
+    static const unsigned int STRIPE_COUNT = 16;
+
+    struct Stripe
+    {
+        Stripe()
+        {
+            for (auto &counter : m_counters)
+            {
+                counter.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        LatencyHistogram m_histograms[METRIC_COUNT];
+        std::atomic<std::uint64_t> m_counters[COUNTER_COUNT];
+        char m_padding[64]; // Keeps the counters off the next stripe's cache line.
+    };
+
+    Stripe &GetStripe()
+    {
+        static std::atomic<unsigned int> next_stripe(0);
+        thread_local unsigned int stripe = next_stripe.fetch_add(1) % STRIPE_COUNT;
+
+        return m_stripes[stripe];
+    }
+
+private:
+    Stripe m_stripes[STRIPE_COUNT];
+};
+
+// Bounded lock-free multi-producer multi-consumer queue. Every cell of
+// the ring carries a sequence number telling producers and consumers
+// whether the cell is free to be written or ready to be read, so both
+// sides only contend on their own position counter.
+template <typename T>
+class BoundedMPMCQueue
+{
+public:
+    // Capacity is rounded up to the next power of two.
+    BoundedMPMCQueue(std::size_t capacity) : m_enqueue_pos(0),
+                                             m_dequeue_pos(0)
+    {
+        m_capacity = 1;
+        while (m_capacity < capacity)
+            m_capacity <<= 1;
+
+        m_mask = m_capacity - 1;
+        m_cells.reset(new Cell[m_capacity]);
+
+        for (std::size_t i = 0; i < m_capacity; i++)
+        {
+            m_cells[i].m_sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Returns false if the queue is full.
+    bool TryPush(T value)
+    {
+        std::size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        Cell *cell;
+
+        while (true)
+        {
+            cell = &m_cells[pos & m_mask];
+            std::size_t seq = cell->m_sequence.load(std::memory_order_acquire);
+            std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq) -
+                                  static_cast<std::ptrdiff_t>(pos);
+
+            if (diff == 0)
+            {
+                if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                                        std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = m_enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->m_value = std::move(value);
+        cell->m_sequence.store(pos + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    // Returns false if the queue is empty.
+    bool TryPop(T &value)
+    {
+        std::size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        Cell *cell;
+
+        while (true)
+        {
+            cell = &m_cells[pos & m_mask];
+            std::size_t seq = cell->m_sequence.load(std::memory_order_acquire);
+            std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq) -
+                                  static_cast<std::ptrdiff_t>(pos + 1);
+
+            if (diff == 0)
+            {
+                if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1,
+                                                        std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = m_dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        value = std::move(cell->m_value);
+        cell->m_value = T();
+        cell->m_sequence.store(pos + m_mask + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    // Approximate number of queued elements.
+    std::size_t GetSize() const
+    {
+        std::size_t enqueue_pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        std::size_t dequeue_pos = m_dequeue_pos.load(std::memory_order_relaxed);
+
+        return enqueue_pos > dequeue_pos ? enqueue_pos - dequeue_pos : 0;
+    }
+
+    std::size_t GetCapacity() const
+    {
+        return m_capacity;
+    }
+
+private:
+    static const std::size_t CACHE_LINE_SIZE = 64;
+
+    struct Cell
+    {
+        std::atomic<std::size_t> m_sequence;
+        T m_value;
+    };
+
+    std::unique_ptr<Cell[]> m_cells;
+    std::size_t m_capacity;
+    std::size_t m_mask;
+
+    // Kept on separate cache lines so that producers and consumers do not
+    // invalidate each other's line. The counters are padded rather than
+    // aligned, so that the objects embedding the queue can be allocated
+    // with new before C++17 without an over-aligned type.
+    char m_pad0[CACHE_LINE_SIZE];
+    std::atomic<std::size_t> m_enqueue_pos;
+    char m_pad1[CACHE_LINE_SIZE - sizeof(std::atomic<std::size_t>)];
+    std::atomic<std::size_t> m_dequeue_pos;
+    char m_pad2[CACHE_LINE_SIZE - sizeof(std::atomic<std::size_t>)];
+};
+
 class Service
 {
 public:
-    Service() {}
+    Service(ServerStats &stats) : m_stats(stats) {}
 
     void StartHandligClient(
         std::shared_ptr<asio::ip::tcp::socket> sock)
     {
+        std::chrono::steady_clock::time_point accepted_at =
+            std::chrono::steady_clock::now();
+
+        std::thread th(([this, sock, accepted_at]()
+                        {
+                            HandleClient(sock, accepted_at);
 
-        std::thread th(([this, sock]()
-                        { HandleClient(sock); }));
+                            // Clean-up.
+                            delete this;
+                        }));
 
         th.detach();
     }
 
-private:
-    void HandleClient(std::shared_ptr<asio::ip::tcp::socket> sock)
+    void HandleClient(std::shared_ptr<asio::ip::tcp::socket> sock,
+                      std::chrono::steady_clock::time_point accepted_at)
     {
+        m_stats.Add(ServerStats::Connections, 1);
+
         try
         {
+            // Wait for the first byte of the request separately
+            // to tell the client's delay from the time spent reading.
+            sock->wait(asio::ip::tcp::socket::wait_read);
+
+            std::chrono::steady_clock::time_point first_byte_at =
+                std::chrono::steady_clock::now();
+            m_stats.Record(ServerStats::AcceptToFirstByte, first_byte_at - accepted_at);
+
             asio::streambuf request;
-            asio::read_until(*sock.get(), request, '\n');
+            std::size_t bytes_read = asio::read_until(*sock.get(), request, '\n');
+
+            std::chrono::steady_clock::time_point read_at =
+                std::chrono::steady_clock::now();
+            m_stats.Record(ServerStats::Read, read_at - first_byte_at);
+            m_stats.Add(ServerStats::BytesIn, bytes_read);
 
             // Emulate request processing.
             int i = 0;
@@ -38,9 +419,17 @@ private:
             std::this_thread::sleep_for(
                 std::chrono::milliseconds(500));
 
+            std::chrono::steady_clock::time_point processed_at =
+                std::chrono::steady_clock::now();
+            m_stats.Record(ServerStats::Process, processed_at - read_at);
+
             // Sending response.
             std::string response = "Response\n";
-            asio::write(*sock.get(), asio::buffer(response));
+            std::size_t bytes_written = asio::write(*sock.get(), asio::buffer(response));
+
+            m_stats.Record(ServerStats::Write,
+                           std::chrono::steady_clock::now() - processed_at);
+            m_stats.Add(ServerStats::BytesOut, bytes_written);
         }
         catch (system::system_error &e)
         {
@@ -48,20 +437,202 @@ private:
                       << e.code() << ". Message: "
                       << e.what();
         }
+    }
 
-        // Clean-up.
-        delete this;
+private:
+    ServerStats &m_stats;
+};
+
+// Fixed pool of pre-started threads handling the clients whose sockets
+// the Acceptor pushes into a bounded queue, instead of starting
+// a thread per connection.
+class WorkerPool
+{
+public:
+    WorkerPool(unsigned int num_workers,
+               std::size_t queue_capacity,
+               ServerStats &stats) : m_queue(queue_capacity),
+                                     m_stats(stats),
+                                     m_num_queued(0),
+                                     m_num_sleeping(0),
+                                     m_num_free(m_queue.GetCapacity()),
+                                     m_num_blocked(0),
+                                     m_stop(false)
+    {
+        assert(num_workers > 0);
+
+        for (unsigned int i = 0; i < num_workers; i++)
+        {
+            std::unique_ptr<std::thread> th(
+                new std::thread([this]()
+                                { Run(); }));
+
+            m_workers.push_back(std::move(th));
+        }
+    }
+
+    ~WorkerPool()
+    {
+        Stop();
+    }
+
+    // Blocks while the queue is full, which in turn leaves
+    // new connections waiting in the kernel's backlog.
+    void Submit(std::shared_ptr<asio::ip::tcp::socket> sock)
+    {
+        PendingClient client{sock, std::chrono::steady_clock::now()};
+
+        if (!Claim(m_num_free))
+        {
+            // The queue is full. Sleep until a worker takes a client from
+            // it, using the same protocol as the workers waiting for one.
+            std::unique_lock<std::mutex> lock(m_space_guard);
+            m_num_blocked.fetch_add(1);
+            m_space_available.wait(lock, [this]()
+                                   { return Claim(m_num_free); });
+            m_num_blocked.fetch_sub(1);
+        }
+
+        // A slot is guaranteed to be free, but the worker that freed it
+        // may not have finished with its cell yet.
+        while (!m_queue.TryPush(client))
+            std::this_thread::yield();
+
+        // A worker going to sleep registers itself before it checks the
+        // counter, so either it sees the client or we see the worker.
+        // Taking the sleep mutex makes sure the worker is waiting on
+        // the condition variable when it is notified.
+        m_num_queued.fetch_add(1);
+        if (m_num_sleeping.load() > 0)
+        {
+            std::unique_lock<std::mutex> lock(m_sleep_guard);
+            lock.unlock();
+
+            m_wakeup.notify_one();
+        }
+    }
+
+    // Number of accepted clients waiting for a worker.
+    std::size_t GetQueueDepth() const
+    {
+        return m_queue.GetSize();
     }
+
+    // Lets the workers serve the clients already queued
+    // and blocks until all of them exit.
+    void Stop()
+    {
+        std::unique_lock<std::mutex> lock(m_sleep_guard);
+        m_stop.store(true);
+        lock.unlock();
+
+        m_wakeup.notify_all();
+
+        for (auto &th : m_workers)
+        {
+            if (th->joinable())
+                th->join();
+        }
+    }
+
+private:
+    void Run()
+    {
+        Service svc(m_stats);
+        PendingClient client;
+
+        while (true)
+        {
+            if (Claim(m_num_queued))
+            {
+                // A client is guaranteed to be queued for us, but the
+                // Acceptor may not have finished with its cell yet.
+                while (!m_queue.TryPop(client))
+                    std::this_thread::yield();
+
+                m_num_free.fetch_add(1);
+                if (m_num_blocked.load() > 0)
+                {
+                    std::unique_lock<std::mutex> lock(m_space_guard);
+                    lock.unlock();
+
+                    m_space_available.notify_one();
+                }
+
+                svc.HandleClient(client.sock, client.accepted_at);
+                client.sock.reset();
+                continue;
+            }
+
+            if (m_stop.load())
+                return;
+
+            std::unique_lock<std::mutex> lock(m_sleep_guard);
+            m_num_sleeping.fetch_add(1);
+            m_wakeup.wait(lock, [this]()
+                          { return m_stop.load() || m_num_queued.load() > 0; });
+            m_num_sleeping.fetch_sub(1);
+        }
+    }
+
+    // Decrements the counter unless it is zero.
+    static bool Claim(std::atomic<std::size_t> &counter)
+    {
+        std::size_t value = counter.load();
+        do
+        {
+            if (value == 0)
+                return false;
+        } while (!counter.compare_exchange_weak(value, value - 1));
+
+        return true;
+    }
+
+private:
+    // The time of accepting is kept, so that the time spent
+    // in the queue counts towards accept-to-first-byte.
+    struct PendingClient
+    {
+        std::shared_ptr<asio::ip::tcp::socket> sock;
+        std::chrono::steady_clock::time_point accepted_at;
+    };
+
+    BoundedMPMCQueue<PendingClient> m_queue;
+    ServerStats &m_stats;
+    std::vector<std::unique_ptr<std::thread>> m_workers;
+
+    // Number of clients queued but not yet claimed by a worker
+    // and number of workers waiting for a client.
+    std::atomic<std::size_t> m_num_queued;
+    std::atomic<unsigned int> m_num_sleeping;
+    std::mutex m_sleep_guard;
+    std::condition_variable m_wakeup;
+
+    // Number of free queue slots not yet claimed by the Acceptor.
+    // The Acceptor waits here while there are none.
+    std::atomic<std::size_t> m_num_free;
+    std::atomic<unsigned int> m_num_blocked;
+    std::mutex m_space_guard;
+    std::condition_variable m_space_available;
+
+    std::atomic<bool> m_stop;
 };
 
 class Acceptor
 {
 public:
-    Acceptor(asio::io_service &ios, unsigned short port_num) : m_ios(ios),
-                                                               m_acceptor(m_ios,
-                                                                          asio::ip::tcp::endpoint(
-                                                                              asio::ip::address_v4::any(),
-                                                                              port_num))
+    // Accepted clients are handed to the worker pool if
+    // one is given, otherwise each gets a thread of its own.
+    Acceptor(asio::io_service &ios,
+             unsigned short port_num,
+             ServerStats &stats,
+             WorkerPool *worker_pool = nullptr) : m_ios(ios),
+                                                  m_acceptor(m_ios,
+                                                             asio::ip::tcp::endpoint(
+                                                                 asio::ip::address_v4::any(),
+                                                                 port_num)),
+                                                  m_stats(stats),
+                                                  m_worker_pool(worker_pool)
     {
         m_acceptor.listen();
     }
@@ -73,12 +644,20 @@ public:
 
         m_acceptor.accept(*sock.get());
 
-        (new Service)->StartHandligClient(sock);
+        if (m_worker_pool != nullptr)
+        {
+            m_worker_pool->Submit(sock);
+            return;
+        }
+
+        (new Service(m_stats))->StartHandligClient(sock);
     }
 
 private:
     asio::io_service &m_ios;
     asio::ip::tcp::acceptor m_acceptor;
+    ServerStats &m_stats;
+    WorkerPool *m_worker_pool;
 };
 
 class Server
@@ -86,8 +665,18 @@ class Server
 public:
     Server() : m_stop(false) {}
 
-    void Start(unsigned short port_num)
+    // When num_workers is not zero, the clients are served by a pool
+    // of that many threads fed through a queue of queue_capacity
+    // sockets instead of a thread per connection.
+    void Start(unsigned short port_num,
+               unsigned int num_workers = 0,
+               std::size_t queue_capacity = 1024)
     {
+        if (num_workers > 0)
+        {
+            m_worker_pool.reset(new WorkerPool(num_workers, queue_capacity, m_stats));
+        }
+
         m_thread.reset(new std::thread([this, port_num]()
                                        { Run(port_num); }));
     }
@@ -96,12 +685,35 @@ public:
     {
         m_stop.store(true);
         m_thread->join();
+
+        if (m_worker_pool)
+        {
+            m_worker_pool->Stop();
+        }
+    }
+
+    // Number of accepted clients waiting for a worker.
+    std::size_t GetQueueDepth() const
+    {
+        return m_worker_pool ? m_worker_pool->GetQueueDepth() : 0;
+    }
+
+    // Outputs the latency percentiles and counters gathered so far,
+    // followed by the depth of the worker pool's queue if there is one.
+    void DumpStats(std::ostream &os) const
+    {
+        m_stats.Dump(os);
+
+        if (m_worker_pool)
+        {
+            os << "queue_depth=" << GetQueueDepth() << "\n";
+        }
     }
 
 private:
     void Run(unsigned short port_num)
     {
-        Acceptor acc(m_ios, port_num);
+        Acceptor acc(m_ios, port_num, m_stats, m_worker_pool.get());
 
         while (!m_stop.load())
         {
@@ -112,6 +724,8 @@ private:
     std::unique_ptr<std::thread> m_thread;
     std::atomic<bool> m_stop;
     asio::io_service m_ios;
+    ServerStats m_stats;
+    std::unique_ptr<WorkerPool> m_worker_pool;
 };
 
 int main()
@@ -123,7 +737,12 @@ int main()
         Server srv;
         srv.Start(port_num);
 
-        std::this_thread::sleep_for(std::chrono::seconds(60));
+        // Dump the statistics every 10 seconds for a minute.
+        for (int i = 0; i < 6; i++)
+        {
+            std::this_thread::sleep_for(std::chrono::seconds(10));
+            srv.DumpStats(std::cout);
+        }
 
         srv.Stop();
     }
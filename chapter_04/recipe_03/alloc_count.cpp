@@ -0,0 +1,182 @@
+// Checks that a warm server does not allocate memory while serving requests.
+// The global operator new is replaced with one counting the allocations made
+// by the server's threads. Clients are served until the pooled Service objects,
+// their buffers and the handler arenas are warm, then the allocations made while
+// serving more requests are counted. The program fails unless there are none,
+// both for requests on keep-alive connections and for short connections.
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+std::atomic<unsigned long long> g_allocations(0);
+
+// Only the allocations of the server's threads are counted,
+// those of the clients driving the test are left out.
+thread_local bool t_counted = true;
+
+void *Allocate(std::size_t size)
+{
+    if (t_counted)
+        g_allocations.fetch_add(1, std::memory_order_relaxed);
+
+    void *p = std::malloc(size != 0 ? size : 1);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+}
+
+void *operator new(std::size_t size)
+{
+    return Allocate(size);
+}
+
+void *operator new[](std::size_t size)
+{
+    return Allocate(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+// The server itself, without its sample main().
+#define main server_main
+#include "main.cpp"
+#undef main
+
+const unsigned short PORT_NUM = 3344;
+const unsigned int THREAD_POOL_SIZE = 4;
+const std::size_t SERVICE_POOL_SIZE = 8;
+const unsigned int KEEP_ALIVE_CLIENTS = 4;
+const unsigned int WARM_UP_ROUNDS = 3;
+const unsigned int COUNTED_ROUNDS = 5;
+
+// Every pooled Service object is expected to have served a client
+// before the short connections are counted.
+const unsigned int WARM_UP_CONNECTIONS = 3 * SERVICE_POOL_SIZE;
+const unsigned int COUNTED_CONNECTIONS = 5;
+
+asio::ip::tcp::endpoint ServerEndpoint()
+{
+    return asio::ip::tcp::endpoint(asio::ip::address::from_string("127.0.0.1"), PORT_NUM);
+}
+
+// Sends a request on the socket and reads the response.
+void Exchange(asio::ip::tcp::socket &sock)
+{
+    asio::write(sock, asio::buffer("Request\n", 8));
+
+    asio::streambuf response;
+    asio::read_until(sock, response, '\n');
+}
+
+// Sends a request on every keep-alive connection, then reads all the
+// responses, so that the server handles the requests concurrently.
+void Round(std::vector<std::unique_ptr<asio::ip::tcp::socket>> &socks)
+{
+    for (auto &sock : socks)
+        asio::write(*sock, asio::buffer("Request\n", 8));
+
+    for (auto &sock : socks)
+    {
+        asio::streambuf response;
+        asio::read_until(*sock, response, '\n');
+    }
+}
+
+// Serves one client on a connection of its own. The next connection
+// is made once the server has had the time to recycle the Service object.
+void ShortConnection(asio::io_service &ios)
+{
+    asio::ip::tcp::socket sock(ios);
+    sock.connect(ServerEndpoint());
+    Exchange(sock);
+    sock.close();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+}
+
+int main()
+{
+    t_counted = false;
+
+    bool passed = true;
+
+    try
+    {
+        ServerConfig config;
+        config.keep_alive = true;
+        config.service_pool_size = SERVICE_POOL_SIZE;
+
+        Server srv;
+        srv.Start(PORT_NUM, THREAD_POOL_SIZE, config);
+
+        asio::io_service ios;
+
+        std::vector<std::unique_ptr<asio::ip::tcp::socket>> socks;
+        for (unsigned int i = 0; i < KEEP_ALIVE_CLIENTS; i++)
+        {
+            socks.emplace_back(new asio::ip::tcp::socket(ios));
+            socks.back()->connect(ServerEndpoint());
+        }
+
+        for (unsigned int i = 0; i < WARM_UP_ROUNDS; i++)
+            Round(socks);
+
+        unsigned long long before = g_allocations.load();
+        for (unsigned int i = 0; i < COUNTED_ROUNDS; i++)
+            Round(socks);
+        unsigned long long keep_alive_allocations = g_allocations.load() - before;
+
+        for (auto &sock : socks)
+            sock->close();
+
+        for (unsigned int i = 0; i < WARM_UP_CONNECTIONS; i++)
+            ShortConnection(ios);
+
+        before = g_allocations.load();
+        for (unsigned int i = 0; i < COUNTED_CONNECTIONS; i++)
+            ShortConnection(ios);
+        unsigned long long connection_allocations = g_allocations.load() - before;
+
+        srv.Stop();
+
+        std::cout << "Allocations for "
+                  << COUNTED_ROUNDS * KEEP_ALIVE_CLIENTS
+                  << " keep-alive requests: " << keep_alive_allocations << std::endl;
+        std::cout << "Allocations for "
+                  << COUNTED_CONNECTIONS
+                  << " short connections: " << connection_allocations << std::endl;
+
+        passed = keep_alive_allocations == 0 && connection_allocations == 0;
+    }
+    catch (system::system_error &e)
+    {
+        std::cout << "Error occured! Error code = "
+                  << e.code() << ". Message: "
+                  << e.what();
+        passed = false;
+    }
+
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
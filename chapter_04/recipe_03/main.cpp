@@ -1,11 +1,1906 @@
+#include <boost/predef.h> // Tools to identify the OS.
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/noncopyable.hpp>
+
+#if BOOST_OS_LINUX
+#include <pthread.h>
+#include <unistd.h>
+#include <netinet/tcp.h>
+#endif
 
 #include <thread>
+#include <chrono>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 #include <memory>
+#include <vector>
+#include <deque>
+#include <type_traits>
+#include <algorithm>
+#include <iterator>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <stdexcept>
 #include <iostream>
 
-using namespace boost;
+using namespace boost;
+
+// Small fixed-size arena used to allocate the memory associated with
+// asynchronous operations. An object owning the arena runs one operation
+// of a kind at a time, so a single block is enough in the steady state;
+// larger or overlapping requests fall back to the global operator new.
+class HandlerMemory
+{
+public:
+    HandlerMemory() : m_in_use(false)
+    {
+    }
+
+    HandlerMemory(const HandlerMemory &) = delete;
+    HandlerMemory &operator=(const HandlerMemory &) = delete;
+
+    void *allocate(std::size_t size)
+    {
+        if (!m_in_use && size <= sizeof(m_storage))
+        {
+            m_in_use = true;
+            return &m_storage;
+        }
+
+        return ::operator new(size);
+    }
+
+    void deallocate(void *pointer)
+    {
+        if (pointer == &m_storage)
+        {
+            m_in_use = false;
+            return;
+        }
+
+        ::operator delete(pointer);
+    }
+
+private:
+    typename std::aligned_storage<1024>::type m_storage;
+    bool m_in_use;
+};
+
+// Allocator satisfying the standard allocator requirements that
+// hands out the memory of a HandlerMemory arena.
+template <typename T>
+class HandlerAllocator
+{
+public:
+    typedef T value_type;
+
+    explicit HandlerAllocator(HandlerMemory &memory) : m_memory(memory)
+    {
+    }
+
+    template <typename U>
+    HandlerAllocator(const HandlerAllocator<U> &other) noexcept : m_memory(other.m_memory)
+    {
+    }
+
+    bool operator==(const HandlerAllocator &other) const noexcept
+    {
+        return &m_memory == &other.m_memory;
+    }
+
+    bool operator!=(const HandlerAllocator &other) const noexcept
+    {
+        return &m_memory != &other.m_memory;
+    }
+
+    T *allocate(std::size_t n) const
+    {
+        return static_cast<T *>(m_memory.allocate(sizeof(T) * n));
+    }
+
+    void deallocate(T *p, std::size_t /*n*/) const
+    {
+        return m_memory.deallocate(p);
+    }
+
+private:
+    template <typename>
+    friend class HandlerAllocator;
+
+    HandlerMemory &m_memory;
+};
+
+// Wraps a completion handler so that Boost.Asio finds its associated
+// allocator and allocates the operation's memory from the arena.
+template <typename Handler>
+class CustomAllocHandler
+{
+public:
+    typedef HandlerAllocator<Handler> allocator_type;
+
+    CustomAllocHandler(HandlerMemory &memory, Handler handler) : m_memory(memory),
+                                                                 m_handler(handler)
+    {
+    }
+
+    allocator_type get_allocator() const noexcept
+    {
+        return allocator_type(m_memory);
+    }
+
+    template <typename... Args>
+    void operator()(Args &&...args)
+    {
+        m_handler(std::forward<Args>(args)...);
+    }
+
+private:
+    HandlerMemory &m_memory;
+    Handler m_handler;
+};
+
+template <typename Handler>
+inline CustomAllocHandler<Handler> MakeCustomAllocHandler(
+    HandlerMemory &memory, Handler handler)
+{
+    return CustomAllocHandler<Handler>(memory, handler);
+}
+
+// Log-linear latency histogram in the spirit of HdrHistogram. Values are
+// recorded in microseconds; below 64 every value has a bucket of its own,
+// above that every power of two is split into 32 buckets, so a reported
+// percentile is within about 3% of the recorded value. Recording is a
+// relaxed atomic increment, so readers may merge a histogram at any time.
+class LatencyHistogram
+{
+public:
+    static const unsigned int SUB_BUCKET_BITS = 5;
+    static const unsigned int SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+    static const unsigned int MAX_MAGNITUDE = 35; // About 9.5 hours.
+    static const unsigned int BUCKET_COUNT = (MAX_MAGNITUDE - SUB_BUCKET_BITS + 2) * SUB_BUCKET_COUNT;
+
+    LatencyHistogram()
+    {
+        for (auto &bucket : m_buckets)
+        {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void Record(std::uint64_t value_us)
+    {
+        m_buckets[GetBucketIndex(value_us)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Adds the counts of this histogram to the plain array of counts.
+    void MergeInto(std::vector<std::uint64_t> &counts) const
+    {
+        counts.resize(BUCKET_COUNT, 0);
+
+        for (std::size_t i = 0; i < BUCKET_COUNT; i++)
+        {
+            counts[i] += m_buckets[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    // Returns the value at the given percentile of the merged counts.
+    static std::uint64_t GetPercentile(const std::vector<std::uint64_t> &counts,
+                                       double percentile)
+    {
+        std::uint64_t total = 0;
+        for (std::uint64_t count : counts)
+        {
+            total += count;
+        }
+
+        if (total == 0)
+            return 0;
+
+        std::uint64_t rank = static_cast<std::uint64_t>(percentile / 100.0 * total + 0.5);
+        if (rank == 0)
+            rank = 1;
+
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < counts.size(); i++)
+        {
+            seen += counts[i];
+            if (seen >= rank)
+                return GetBucketValue(i);
+        }
+
+        return GetBucketValue(counts.size() - 1);
+    }
+
+private:
+    static unsigned int GetMagnitude(std::uint64_t value)
+    {
+        unsigned int magnitude = 0;
+        while (value >>= 1)
+            magnitude++;
+
+        return magnitude;
+    }
+
+    static std::size_t GetBucketIndex(std::uint64_t value)
+    {
+        if (value < 2 * SUB_BUCKET_COUNT)
+            return static_cast<std::size_t>(value);
+
+        unsigned int magnitude = GetMagnitude(value);
+        if (magnitude > MAX_MAGNITUDE)
+            return BUCKET_COUNT - 1;
+
+        unsigned int shift = magnitude - SUB_BUCKET_BITS;
+        return (magnitude - SUB_BUCKET_BITS) * SUB_BUCKET_COUNT +
+               static_cast<std::size_t>(value >> shift);
+    }
+
+    // Middle of the range of values counted by the bucket.
+    static std::uint64_t GetBucketValue(std::size_t index)
+    {
+        if (index < 2 * SUB_BUCKET_COUNT)
+            return index;
+
+        unsigned int shift = static_cast<unsigned int>(index / SUB_BUCKET_COUNT) - 1;
+        std::uint64_t lowest = static_cast<std::uint64_t>(index % SUB_BUCKET_COUNT + SUB_BUCKET_COUNT)
+                               << shift;
+
+        return lowest + ((std::uint64_t(1) << shift) >> 1);
+    }
+
+private:
+    std::atomic<std::uint64_t> m_buckets[BUCKET_COUNT];
+};
+
+// Latency histograms and counters of the server. They are split into
+// stripes and every thread records into the stripe it is assigned when it
+// records for the first time, so recording takes no lock and threads rarely
+// share cache lines. The stripes are merged on demand when dumped.
+class ServerStats
+{
+public:
+    enum Metric
+    {
+        AcceptToFirstByte, // From accepting the connection to receiving the first request.
+        Read,              // Reading a request.
+        Process,           // Processing the requests.
+        Write,             // Sending the responses.
+        METRIC_COUNT
+    };
+
+    enum Counter
+    {
+        Connections,
+        BytesIn,
+        BytesOut,
+        COUNTER_COUNT
+    };
+
+    void Record(Metric metric, std::chrono::steady_clock::duration latency)
+    {
+        std::int64_t us =
+            std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+
+        GetStripe().m_histograms[metric].Record(us > 0 ? static_cast<std::uint64_t>(us) : 0);
+    }
+
+    void Add(Counter counter, std::uint64_t value)
+    {
+        GetStripe().m_counters[counter].fetch_add(value, std::memory_order_relaxed);
+    }
+
+    // Merges the statistics of all the threads and outputs them.
+    void Dump(std::ostream &os) const
+    {
+        static const char *metric_names[METRIC_COUNT] =
+            {"accept_to_first_byte", "read", "process", "write"};
+        static const char *counter_names[COUNTER_COUNT] =
+            {"connections", "bytes_in", "bytes_out"};
+
+        std::vector<std::uint64_t> counts[METRIC_COUNT];
+        std::uint64_t counters[COUNTER_COUNT] = {};
+
+        for (const Stripe &stripe : m_stripes)
+        {
+            for (int m = 0; m < METRIC_COUNT; m++)
+            {
+                stripe.m_histograms[m].MergeInto(counts[m]);
+            }
+
+            for (int c = 0; c < COUNTER_COUNT; c++)
+            {
+                counters[c] += stripe.m_counters[c].load(std::memory_order_relaxed);
+            }
+        }
+
+        for (int c = 0; c < COUNTER_COUNT; c++)
+        {
+            os << counter_names[c] << "=" << counters[c]
+               << (c + 1 < COUNTER_COUNT ? " " : "\n");
+        }
+
+        for (int m = 0; m < METRIC_COUNT; m++)
+        {
+            std::uint64_t total = 0;
+            for (std::uint64_t count : counts[m])
+            {
+                total += count;
+            }
+
+            os << metric_names[m] << "_us count=" << total
+               << " p50=" << LatencyHistogram::GetPercentile(counts[m], 50.0)
+               << " p99=" << LatencyHistogram::GetPercentile(counts[m], 99.0)
+               << " p999=" << LatencyHistogram::GetPercentile(counts[m], 99.9)
+               << " max=" << LatencyHistogram::GetPercentile(counts[m], 100.0)
+               << "\n";
+        }
+    }
+
+private:
+    static const unsigned int STRIPE_COUNT = 16;
+
+    struct Stripe
+    {
+        Stripe()
+        {
+            for (auto &counter : m_counters)
+            {
+                counter.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        LatencyHistogram m_histograms[METRIC_COUNT];
+        std::atomic<std::uint64_t> m_counters[COUNTER_COUNT];
+        char m_padding[64]; // Keeps the counters off the next stripe's cache line.
+    };
+
+    Stripe &GetStripe()
+    {
+        static std::atomic<unsigned int> next_stripe(0);
+        thread_local unsigned int stripe = next_stripe.fetch_add(1) % STRIPE_COUNT;
+
+        return m_stripes[stripe];
+    }
+
+private:
+    Stripe m_stripes[STRIPE_COUNT];
+};
+
+// Phase timestamps of requests, telling where the time of a slow request
+// goes. A request records when each of its phases begins and ends into a
+// Trace embedded in the object handling it. Once the request completes, the
+// trace is copied into the ring buffer of the completing thread if the
+// request took at least the slow request threshold. While the threshold is
+// zero, the default, nothing is recorded and a request costs a single relaxed
+// load. Dump() outputs the sampled requests in the Chrome trace event format,
+// which chrome://tracing and Perfetto load. The timestamps are those of
+// std::chrono::steady_clock, so the dumps of clients and servers running on
+// the same host line up when loaded together.
+class RequestTracer : public boost::noncopyable
+{
+public:
+    enum Phase
+    {
+        Queue,   // Waiting for a thread of the compute pool.
+        Process, // Processing the requests.
+        Write,   // Sending the responses.
+        PHASE_COUNT
+    };
+
+    class Trace
+    {
+    public:
+        Trace() : m_active(false)
+        {
+        }
+
+    private:
+        friend class RequestTracer;
+
+        bool m_active;
+        std::uint64_t m_id;
+        std::int64_t m_started_at;
+        std::int64_t m_begin[PHASE_COUNT]; // Negative until recorded.
+        std::int64_t m_end[PHASE_COUNT];
+    };
+
+    // The name labels the process in the trace viewer.
+    explicit RequestTracer(const std::string &name) : m_name(name),
+                                                      m_threshold_ns(0),
+                                                      m_next_id(1),
+                                                      m_rings(RING_COUNT)
+    {
+    }
+
+    // Requests taking at least the threshold are sampled. Zero disables the tracing.
+    void SetSlowThreshold(std::chrono::microseconds threshold)
+    {
+        m_threshold_ns.store(std::chrono::duration_cast<std::chrono::nanoseconds>(threshold).count(),
+                             std::memory_order_relaxed);
+    }
+
+    // Starts tracing a request. The identifier, assigned by the tracer
+    // when it is zero, names the request's row in the trace viewer.
+    void Start(Trace &trace, std::uint64_t id = 0)
+    {
+        trace.m_active = m_threshold_ns.load(std::memory_order_relaxed) > 0;
+        if (!trace.m_active)
+            return;
+
+        trace.m_id = id != 0 ? id : m_next_id.fetch_add(1, std::memory_order_relaxed);
+        trace.m_started_at = Now();
+        std::fill(std::begin(trace.m_begin), std::end(trace.m_begin), -1);
+        std::fill(std::begin(trace.m_end), std::end(trace.m_end), -1);
+    }
+
+    // A phase repeated by a request, e.g. when it is retried, spans
+    // from the first time it begins to the last time it ends.
+    void Begin(Trace &trace, Phase phase)
+    {
+        if (trace.m_active && trace.m_begin[phase] < 0)
+            trace.m_begin[phase] = Now();
+    }
+
+    void End(Trace &trace, Phase phase)
+    {
+        if (trace.m_active)
+            trace.m_end[phase] = Now();
+    }
+
+    // Completes the trace and samples it if the request was slow.
+    void Finish(Trace &trace)
+    {
+        if (!trace.m_active)
+            return;
+
+        trace.m_active = false;
+
+        std::int64_t finished_at = Now();
+        std::int64_t threshold = m_threshold_ns.load(std::memory_order_relaxed);
+        if (threshold == 0 || finished_at - trace.m_started_at < threshold)
+            return;
+
+        std::int64_t values[VALUE_COUNT];
+        values[0] = static_cast<std::int64_t>(trace.m_id);
+        values[1] = trace.m_started_at;
+        values[2] = finished_at;
+        std::copy(std::begin(trace.m_begin), std::end(trace.m_begin), values + 3);
+        std::copy(std::begin(trace.m_end), std::end(trace.m_end), values + 3 + PHASE_COUNT);
+
+        GetRing().Push(values);
+    }
+
+    // Outputs the sampled requests as a JSON trace. Every request is a row of
+    // its own, where the event spanning the whole request encloses the events
+    // of its phases. The rings keep the last requests sampled by every thread.
+    void Dump(std::ostream &os) const
+    {
+        static const char *phase_names[PHASE_COUNT] = {"queue", "process", "write"};
+
+        int pid = GetProcessId();
+        os << "{\"traceEvents\":[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pid
+           << ",\"args\":{\"name\":\"" << m_name << "\"}}";
+
+        for (const Ring &ring : m_rings)
+        {
+            for (const Slot &slot : ring.m_slots)
+            {
+                std::int64_t values[VALUE_COUNT];
+                if (!ReadSlot(slot, values))
+                    continue;
+
+                std::int64_t id = values[0];
+                WriteEvent(os, "request", pid, id, values[1], values[2]);
+
+                for (int phase = 0; phase < PHASE_COUNT; phase++)
+                {
+                    std::int64_t begin = values[3 + phase];
+                    std::int64_t end = values[3 + PHASE_COUNT + phase];
+                    if (begin >= 0 && end >= begin)
+                        WriteEvent(os, phase_names[phase], pid, id, begin, end);
+                }
+            }
+        }
+
+        os << "]}" << std::endl;
+    }
+
+private:
+    static const unsigned int RING_COUNT = 16;
+    static const unsigned int RING_SIZE = 256;
+    static const unsigned int VALUE_COUNT = 3 + 2 * PHASE_COUNT; // Id, start, finish, phases.
+
+    // A slot guarded by a sequence lock. The sequence number is odd while the
+    // slot is written; a reader seeing it odd, or changed once the values are
+    // copied, skips the slot instead of waiting for the writer.
+    struct Slot
+    {
+        Slot() : m_sequence(0)
+        {
+            for (auto &value : m_values)
+            {
+                value.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        std::atomic<std::uint64_t> m_sequence;
+        std::atomic<std::int64_t> m_values[VALUE_COUNT];
+    };
+
+    // Ring buffer of the threads assigned to it, usually a single one.
+    // The slots are claimed with an atomic increment, so threads sharing
+    // a ring never wait for one another either.
+    struct Ring
+    {
+        Ring() : m_next(0)
+        {
+        }
+
+        void Push(const std::int64_t *values)
+        {
+            std::uint64_t ticket = m_next.fetch_add(1, std::memory_order_relaxed);
+            Slot &slot = m_slots[ticket % RING_SIZE];
+
+            slot.m_sequence.store(2 * ticket + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+
+            for (unsigned int i = 0; i < VALUE_COUNT; i++)
+            {
+                slot.m_values[i].store(values[i], std::memory_order_relaxed);
+            }
+
+            slot.m_sequence.store(2 * ticket + 2, std::memory_order_release);
+        }
+
+        std::atomic<std::uint64_t> m_next;
+        Slot m_slots[RING_SIZE];
+    };
+
+    static bool ReadSlot(const Slot &slot, std::int64_t *values)
+    {
+        std::uint64_t sequence = slot.m_sequence.load(std::memory_order_acquire);
+        if (sequence == 0 || sequence % 2 != 0)
+            return false;
+
+        for (unsigned int i = 0; i < VALUE_COUNT; i++)
+        {
+            values[i] = slot.m_values[i].load(std::memory_order_relaxed);
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return slot.m_sequence.load(std::memory_order_relaxed) == sequence;
+    }
+
+    // A complete event; the timestamps are converted to microseconds. Both
+    // ends are truncated rather than the duration, so that the events of the
+    // phases do not stick out of the event of the request.
+    static void WriteEvent(std::ostream &os, const char *name, int pid, std::int64_t id,
+                           std::int64_t begin, std::int64_t end)
+    {
+        os << ",{\"name\":\"" << name << "\",\"ph\":\"X\",\"pid\":" << pid
+           << ",\"tid\":" << id << ",\"ts\":" << begin / 1000
+           << ",\"dur\":" << end / 1000 - begin / 1000 << "}";
+    }
+
+    static std::int64_t Now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    static int GetProcessId()
+    {
+#if BOOST_OS_LINUX
+        return static_cast<int>(getpid());
+#else
+        return 0;
+#endif
+    }
+
+    // Same assignment of the threads as for the statistics' stripes.
+    Ring &GetRing()
+    {
+        static std::atomic<unsigned int> next_ring(0);
+        thread_local unsigned int ring = next_ring.fetch_add(1) % RING_COUNT;
+
+        return m_rings[ring];
+    }
+
+private:
+    std::string m_name;
+    std::atomic<std::int64_t> m_threshold_ns;
+    std::atomic<std::uint64_t> m_next_id;
+    std::vector<Ring> m_rings;
+};
+
+// Shared pool of fixed-size memory blocks (slabs) in a few size classes.
+// A released slab is kept on the free list of its class to be handed out
+// again instead of being freed, up to max_free_per_class slabs per class.
+class BufferPool : public boost::noncopyable
+{
+public:
+    static const unsigned int SIZE_CLASS_COUNT = 3;
+
+    // 512 bytes, 4KB and 32KB.
+    static std::size_t GetClassSize(unsigned int size_class)
+    {
+        return std::size_t(512) << (3 * size_class);
+    }
+
+    // Owns a slab until it is moved from or destroyed,
+    // then returns it to the pool it came from.
+    class Slab
+    {
+    public:
+        Slab() : m_pool(nullptr),
+                 m_data(nullptr),
+                 m_size_class(0)
+        {
+        }
+
+        Slab(Slab &&other) : m_pool(other.m_pool),
+                             m_data(other.m_data),
+                             m_size_class(other.m_size_class)
+        {
+            other.m_pool = nullptr;
+            other.m_data = nullptr;
+        }
+
+        Slab &operator=(Slab &&other)
+        {
+            if (this != &other)
+            {
+                Reset();
+                std::swap(m_pool, other.m_pool);
+                std::swap(m_data, other.m_data);
+                m_size_class = other.m_size_class;
+            }
+
+            return *this;
+        }
+
+        Slab(const Slab &) = delete;
+        Slab &operator=(const Slab &) = delete;
+
+        ~Slab()
+        {
+            Reset();
+        }
+
+        char *Data() const
+        {
+            return m_data;
+        }
+
+        std::size_t Size() const
+        {
+            return m_data != nullptr ? GetClassSize(m_size_class) : 0;
+        }
+
+        void Reset()
+        {
+            if (m_pool != nullptr)
+                m_pool->Release(m_data, m_size_class);
+
+            m_pool = nullptr;
+            m_data = nullptr;
+        }
+
+    private:
+        friend class BufferPool;
+
+        Slab(BufferPool *pool, char *data, unsigned int size_class) : m_pool(pool),
+                                                                      m_data(data),
+                                                                      m_size_class(size_class)
+        {
+        }
+
+        BufferPool *m_pool;
+        char *m_data;
+        unsigned int m_size_class;
+    };
+
+    BufferPool(std::size_t max_free_per_class = 256) : m_max_free_per_class(max_free_per_class),
+                                                       m_allocated(0),
+                                                       m_reused(0)
+    {
+    }
+
+    // All the slabs must have been returned by now.
+    ~BufferPool()
+    {
+        for (auto &free_list : m_free)
+        {
+            for (char *data : free_list)
+            {
+                delete[] data;
+            }
+        }
+    }
+
+    // Returns a slab of the smallest class holding size bytes,
+    // or of the largest class if none does.
+    Slab Acquire(std::size_t size)
+    {
+        unsigned int size_class = 0;
+        while (size_class < SIZE_CLASS_COUNT - 1 && GetClassSize(size_class) < size)
+        {
+            size_class++;
+        }
+
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        std::vector<char *> &free_list = m_free[size_class];
+        if (!free_list.empty())
+        {
+            char *data = free_list.back();
+            free_list.pop_back();
+            m_reused++;
+
+            return Slab(this, data, size_class);
+        }
+
+        m_allocated++;
+        lock.unlock();
+
+        return Slab(this, new char[GetClassSize(size_class)], size_class);
+    }
+
+    // Number of slabs currently allocated, in use or free, and of
+    // slabs handed out from the free lists so far.
+    std::size_t GetAllocatedCount()
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        return m_allocated;
+    }
+
+    std::size_t GetReusedCount()
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        return m_reused;
+    }
+
+private:
+    void Release(char *data, unsigned int size_class)
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        std::vector<char *> &free_list = m_free[size_class];
+        if (free_list.size() < m_max_free_per_class)
+        {
+            free_list.push_back(data);
+            return;
+        }
+
+        m_allocated--;
+        lock.unlock();
+
+        delete[] data;
+    }
+
+private:
+    std::size_t m_max_free_per_class;
+    std::vector<char *> m_free[SIZE_CLASS_COUNT];
+    std::size_t m_allocated;
+    std::size_t m_reused;
+    std::mutex m_guard;
+};
+
+// Message held in a chain of pooled slabs, so that a large message never
+// needs one contiguous allocation. Data() describes the message as a
+// composite buffer for a single gather write; Prepare() describes free space
+// at its end as a composite buffer for a single scatter read, and Commit()
+// appends the bytes read into it.
+class SlabChain : public boost::noncopyable
+{
+public:
+    SlabChain(BufferPool &pool) : m_pool(pool),
+                                  m_begin(0),
+                                  m_size(0)
+    {
+    }
+
+    std::size_t Size() const
+    {
+        return m_size;
+    }
+
+    void Append(const void *data, std::size_t size)
+    {
+        const char *src = static_cast<const char *>(data);
+
+        for (auto &buffer : Prepare(size))
+        {
+            std::memcpy(asio::buffer_cast<char *>(buffer), src, asio::buffer_size(buffer));
+            src += asio::buffer_size(buffer);
+        }
+
+        Commit(size);
+    }
+
+    std::vector<asio::const_buffer> Data() const
+    {
+        std::vector<asio::const_buffer> buffers;
+        std::size_t offset = m_begin;
+        std::size_t left = m_size;
+
+        for (const auto &slab : m_slabs)
+        {
+            if (left == 0)
+                break;
+
+            std::size_t size = slab.Size() - offset;
+            if (size > left)
+                size = left;
+
+            buffers.push_back(asio::const_buffer(slab.Data() + offset, size));
+            offset = 0;
+            left -= size;
+        }
+
+        return buffers;
+    }
+
+    // Grows the chain to have room for size more bytes
+    // and returns exactly size bytes of that room.
+    std::vector<asio::mutable_buffer> Prepare(std::size_t size)
+    {
+        // Slabs are sized after the room still missing, so
+        // that small messages do not take up large slabs.
+        std::size_t capacity = GetCapacity();
+        while (capacity < m_begin + m_size + size)
+        {
+            m_slabs.push_back(m_pool.Acquire(m_begin + m_size + size - capacity));
+            capacity += m_slabs.back().Size();
+        }
+
+        std::vector<asio::mutable_buffer> buffers;
+        std::size_t offset = m_begin + m_size;
+
+        for (const auto &slab : m_slabs)
+        {
+            if (size == 0)
+                break;
+
+            if (offset >= slab.Size())
+            {
+                offset -= slab.Size();
+                continue;
+            }
+
+            std::size_t chunk = slab.Size() - offset;
+            if (chunk > size)
+                chunk = size;
+
+            buffers.push_back(asio::mutable_buffer(slab.Data() + offset, chunk));
+            offset = 0;
+            size -= chunk;
+        }
+
+        return buffers;
+    }
+
+    // Makes size bytes written into the room returned by Prepare() part of the message.
+    void Commit(std::size_t size)
+    {
+        m_size += size;
+    }
+
+    // Drops size bytes from the front of the message,
+    // returning the slabs emptied to the pool.
+    void Consume(std::size_t size)
+    {
+        if (size >= m_size)
+        {
+            Clear();
+            return;
+        }
+
+        m_size -= size;
+        m_begin += size;
+
+        std::size_t emptied = 0;
+        while (m_begin >= m_slabs[emptied].Size())
+        {
+            m_begin -= m_slabs[emptied].Size();
+            emptied++;
+        }
+
+        m_slabs.erase(m_slabs.begin(), m_slabs.begin() + emptied);
+    }
+
+    void Clear()
+    {
+        m_slabs.clear();
+        m_begin = 0;
+        m_size = 0;
+    }
+
+private:
+    std::size_t GetCapacity() const
+    {
+        std::size_t capacity = 0;
+        for (const auto &slab : m_slabs)
+        {
+            capacity += slab.Size();
+        }
+
+        return capacity;
+    }
+
+private:
+    BufferPool &m_pool;
+    std::vector<BufferPool::Slab> m_slabs;
+    std::size_t m_begin; // Offset of the message in the first slab.
+    std::size_t m_size;
+};
+
+// Outbound queue of a connection. Messages may be queued from any thread,
+// but a single write operation is outstanding at a time: when it completes,
+// everything queued meanwhile is sent with one gather write of at most
+// max_batch_size bytes (a larger message is sent alone). The socket is only
+// touched through the executor, which must be the strand the connection's
+// other operations run through. The queue must not be destroyed while
+// IsIdle() returns false. Its containers keep their capacity, so once warm
+// it sends messages without allocating memory.
+template <typename Executor>
+class WriteQueue
+{
+public:
+    // Called on the executor once the message has been written or the write has failed.
+    typedef std::function<void(const boost::system::error_code &ec)> Callback;
+
+    WriteQueue(asio::ip::tcp::socket &sock,
+               Executor executor,
+               std::size_t max_batch_size = 64 * 1024) : m_sock(sock),
+                                                         m_executor(executor),
+                                                         m_max_batch_size(max_batch_size),
+                                                         m_writing(false),
+                                                         m_num_writes(0),
+                                                         m_num_messages(0)
+    {
+    }
+
+    WriteQueue(const WriteQueue &) = delete;
+    WriteQueue &operator=(const WriteQueue &) = delete;
+
+    void Write(std::string message, Callback callback = nullptr)
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        m_queue.push_back(Message{std::move(message), std::move(callback)});
+
+        if (m_writing)
+            return;
+
+        m_writing = true;
+        lock.unlock();
+
+        asio::post(m_executor,
+                   MakeCustomAllocHandler(m_post_memory,
+                                          [this]()
+                                          { Flush(); }));
+    }
+
+    bool IsIdle()
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        return !m_writing;
+    }
+
+    // Number of write operations issued and of messages they have sent,
+    // the ratio telling how well the messages are coalesced.
+    unsigned long long GetWriteCount()
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        return m_num_writes;
+    }
+
+    unsigned long long GetMessageCount()
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        return m_num_messages;
+    }
+
+private:
+    struct Message
+    {
+        std::string m_data;
+        Callback m_callback;
+    };
+
+    // Non-owning view of m_buffers, so that the write
+    // operation does not copy the vector.
+    struct BufferRange
+    {
+        typedef asio::const_buffer value_type;
+        typedef const asio::const_buffer *const_iterator;
+
+        const_iterator begin() const
+        {
+            return m_begin;
+        }
+
+        const_iterator end() const
+        {
+            return m_end;
+        }
+
+        const_iterator m_begin;
+        const_iterator m_end;
+    };
+
+    // Runs on the executor when no write operation is outstanding.
+    void Flush()
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        std::size_t batch_size = 0;
+        std::size_t count = 0;
+        while (count < m_queue.size() &&
+               (count == 0 || batch_size + m_queue[count].m_data.size() <= m_max_batch_size))
+        {
+            batch_size += m_queue[count].m_data.size();
+            count++;
+        }
+
+        // The batch is usually the whole queue, whose vector is then swapped
+        // with the empty one of the batch instead of moving the messages.
+        if (count == m_queue.size())
+        {
+            m_batch.swap(m_queue);
+        }
+        else
+        {
+            std::move(m_queue.begin(), m_queue.begin() + count, std::back_inserter(m_batch));
+            m_queue.erase(m_queue.begin(), m_queue.begin() + count);
+        }
+
+        m_num_writes++;
+        m_num_messages += m_batch.size();
+        lock.unlock();
+
+        m_buffers.clear();
+        for (const Message &message : m_batch)
+        {
+            m_buffers.push_back(asio::buffer(message.m_data));
+        }
+
+        asio::async_write(m_sock,
+                          BufferRange{m_buffers.data(), m_buffers.data() + m_buffers.size()},
+                          asio::bind_executor(m_executor,
+                                              MakeCustomAllocHandler(m_write_memory,
+                                                                     [this](const boost::system::error_code &ec,
+                                                                            std::size_t bytes_transferred)
+                                                                     {
+                                                                         onWritten(ec);
+                                                                     })));
+    }
+
+    // The callbacks are called last, as they may queue further messages.
+    // The callback of the batch's last message may also destroy the object
+    // owning the queue once it is idle, so nothing is touched after it.
+    // A failed write fails the messages queued meanwhile as well, so the
+    // broken socket gets no further writes and the queue is idle at once.
+    void onWritten(const boost::system::error_code &ec)
+    {
+        // The sent messages are moved aside, keeping the
+        // capacity of the batch's vector for the next one.
+        m_sent.swap(m_batch);
+
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        if (ec.value() != 0)
+        {
+            std::move(m_queue.begin(), m_queue.end(), std::back_inserter(m_sent));
+            m_queue.clear();
+        }
+
+        bool more = !m_queue.empty();
+        if (!more)
+            m_writing = false;
+
+        lock.unlock();
+
+        if (more)
+            Flush();
+
+        Callback last;
+        if (!m_sent.empty())
+        {
+            last = std::move(m_sent.back().m_callback);
+            m_sent.back().m_callback = nullptr;
+        }
+
+        for (Message &message : m_sent)
+        {
+            if (message.m_callback)
+                message.m_callback(ec);
+        }
+
+        m_sent.clear();
+
+        if (last)
+            last(ec);
+    }
+
+private:
+    asio::ip::tcp::socket &m_sock;
+    Executor m_executor;
+    std::size_t m_max_batch_size;
+
+    // Messages waiting for the next write operation.
+    std::vector<Message> m_queue;
+    bool m_writing;
+    unsigned long long m_num_writes;
+    unsigned long long m_num_messages;
+    std::mutex m_guard;
+
+    // Messages being sent by the outstanding write operation
+    // and those whose callbacks are being called.
+    std::vector<Message> m_batch;
+    std::vector<Message> m_sent;
+    std::vector<asio::const_buffer> m_buffers;
+
+    HandlerMemory m_post_memory;
+    HandlerMemory m_write_memory;
+};
+
+// How the requests and the responses are delimited on the wire.
+enum class Framing
+{
+    Newline,       // A message ends with '\n'.
+    LengthPrefixed // A 4-byte big-endian payload size precedes the payload.
+};
+
+// Integer socket option meeting the Boost.Asio requirements for socket
+// options, for the options it provides no class for, such as SO_REUSEPORT.
+template <int Level, int Name>
+class IntegerSocketOption
+{
+public:
+    IntegerSocketOption() : m_value(0)
+    {
+    }
+
+    explicit IntegerSocketOption(int value) : m_value(value)
+    {
+    }
+
+    int value() const
+    {
+        return m_value;
+    }
+
+    template <typename Protocol>
+    int level(const Protocol &) const
+    {
+        return Level;
+    }
+
+    template <typename Protocol>
+    int name(const Protocol &) const
+    {
+        return Name;
+    }
+
+    template <typename Protocol>
+    int *data(const Protocol &)
+    {
+        return &m_value;
+    }
+
+    template <typename Protocol>
+    const int *data(const Protocol &) const
+    {
+        return &m_value;
+    }
+
+    template <typename Protocol>
+    std::size_t size(const Protocol &) const
+    {
+        return sizeof(m_value);
+    }
+
+    template <typename Protocol>
+    void resize(const Protocol &, std::size_t size)
+    {
+        if (size != sizeof(m_value))
+            throw std::length_error("IntegerSocketOption resize");
+    }
+
+private:
+    int m_value;
+};
+
+// Socket options applied to every connection of a server or a client.
+// Zero and false leave the system defaults in place, so a default
+// constructed profile changes nothing. The options are applied on a best
+// effort basis: one the system refuses or does not support is skipped,
+// which Log() makes visible by printing the values in effect.
+struct SocketProfile
+{
+    std::string name = "default";
+
+    bool no_delay = false;           // TCP_NODELAY: disable Nagle's algorithm.
+    int receive_buffer_size = 0;     // SO_RCVBUF in bytes.
+    int send_buffer_size = 0;        // SO_SNDBUF in bytes.
+    bool keep_alive = false;         // SO_KEEPALIVE together with the three below.
+    int keep_alive_idle_sec = 0;     // TCP_KEEPIDLE
+    int keep_alive_interval_sec = 0; // TCP_KEEPINTVL
+    int keep_alive_count = 0;        // TCP_KEEPCNT
+    bool quick_ack = false;          // TCP_QUICKACK, only in effect until the kernel leaves the quick ack mode.
+    int fast_open = 0;               // TCP_FASTOPEN queue length of a listener; clients use TCP_FASTOPEN_CONNECT.
+    int busy_poll_us = 0;            // SO_BUSY_POLL; raising it above net.core.busy_read needs CAP_NET_ADMIN.
+
+    // Small request/response exchanges: segments go out at once, acks are
+    // not delayed, and the receiving thread spins briefly on the device queue.
+    static SocketProfile LowLatencyRpc()
+    {
+        SocketProfile profile;
+        profile.name = "low-latency-rpc";
+        profile.no_delay = true;
+        profile.keep_alive = true;
+        profile.keep_alive_idle_sec = 60;
+        profile.keep_alive_interval_sec = 10;
+        profile.keep_alive_count = 5;
+        profile.quick_ack = true;
+        profile.fast_open = 256;
+        profile.busy_poll_us = 50;
+
+        return profile;
+    }
+
+    // Large transfers: buffers big enough to keep a long fat pipe full.
+    static SocketProfile BulkTransfer()
+    {
+        SocketProfile profile;
+        profile.name = "bulk-transfer";
+        profile.receive_buffer_size = 4 * 1024 * 1024;
+        profile.send_buffer_size = 4 * 1024 * 1024;
+        profile.keep_alive = true;
+        profile.keep_alive_idle_sec = 60;
+        profile.keep_alive_interval_sec = 10;
+        profile.keep_alive_count = 5;
+
+        return profile;
+    }
+
+    // Called before the listening socket is bound. The buffer sizes are
+    // inherited by the accepted sockets and have to be set before listening
+    // for the TCP window scale to be negotiated accordingly.
+    void ApplyToListener(asio::ip::tcp::acceptor &acceptor) const
+    {
+        boost::system::error_code ignored_ec;
+
+        if (receive_buffer_size > 0)
+            acceptor.set_option(asio::socket_base::receive_buffer_size(receive_buffer_size), ignored_ec);
+
+        if (send_buffer_size > 0)
+            acceptor.set_option(asio::socket_base::send_buffer_size(send_buffer_size), ignored_ec);
+
+#if defined(TCP_FASTOPEN)
+        if (fast_open > 0)
+            acceptor.set_option(IntegerSocketOption<IPPROTO_TCP, TCP_FASTOPEN>(fast_open), ignored_ec);
+#endif
+    }
+
+    // Called for an accepted socket, or for a client socket once it has been
+    // opened and before it is connected.
+    void ApplyToConnection(asio::ip::tcp::socket &sock, bool is_client) const
+    {
+        boost::system::error_code ignored_ec;
+
+        if (no_delay)
+            sock.set_option(asio::ip::tcp::no_delay(true), ignored_ec);
+
+        if (receive_buffer_size > 0)
+            sock.set_option(asio::socket_base::receive_buffer_size(receive_buffer_size), ignored_ec);
+
+        if (send_buffer_size > 0)
+            sock.set_option(asio::socket_base::send_buffer_size(send_buffer_size), ignored_ec);
+
+        if (keep_alive)
+            sock.set_option(asio::socket_base::keep_alive(true), ignored_ec);
+
+#if BOOST_OS_LINUX
+        if (keep_alive && keep_alive_idle_sec > 0)
+            sock.set_option(IntegerSocketOption<IPPROTO_TCP, TCP_KEEPIDLE>(keep_alive_idle_sec), ignored_ec);
+
+        if (keep_alive && keep_alive_interval_sec > 0)
+            sock.set_option(IntegerSocketOption<IPPROTO_TCP, TCP_KEEPINTVL>(keep_alive_interval_sec), ignored_ec);
+
+        if (keep_alive && keep_alive_count > 0)
+            sock.set_option(IntegerSocketOption<IPPROTO_TCP, TCP_KEEPCNT>(keep_alive_count), ignored_ec);
+
+        if (quick_ack)
+            sock.set_option(IntegerSocketOption<IPPROTO_TCP, TCP_QUICKACK>(1), ignored_ec);
+
+        if (busy_poll_us > 0)
+            sock.set_option(IntegerSocketOption<SOL_SOCKET, SO_BUSY_POLL>(busy_poll_us), ignored_ec);
+
+#if defined(TCP_FASTOPEN_CONNECT)
+        // The SYN carries the first write once the server has issued a cookie.
+        if (is_client && fast_open > 0)
+            sock.set_option(IntegerSocketOption<IPPROTO_TCP, TCP_FASTOPEN_CONNECT>(1), ignored_ec);
+#endif
+#endif
+    }
+
+    // Applies the profile to a scratch socket and outputs the values
+    // the system has put into effect next to the requested ones.
+    void Log(std::ostream &os, bool is_client) const
+    {
+        asio::io_service ios;
+        asio::ip::tcp::socket probe(ios);
+        boost::system::error_code ec;
+
+        probe.open(asio::ip::tcp::v4(), ec);
+        if (ec.value() != 0)
+        {
+            os << "Socket profile " << name << ": cannot open a socket. Message: "
+               << ec.message() << std::endl;
+            return;
+        }
+
+        ApplyToConnection(probe, is_client);
+
+        os << "Socket profile " << name << ':';
+
+        asio::ip::tcp::no_delay no_delay_value;
+        probe.get_option(no_delay_value, ec);
+        LogValue(os, "no_delay", ec ? -1 : no_delay_value.value(), no_delay);
+
+        asio::socket_base::receive_buffer_size receive_buffer_size_value;
+        probe.get_option(receive_buffer_size_value, ec);
+        LogValue(os, "receive_buffer_size", ec ? -1 : receive_buffer_size_value.value(), receive_buffer_size);
+
+        asio::socket_base::send_buffer_size send_buffer_size_value;
+        probe.get_option(send_buffer_size_value, ec);
+        LogValue(os, "send_buffer_size", ec ? -1 : send_buffer_size_value.value(), send_buffer_size);
+
+        asio::socket_base::keep_alive keep_alive_value;
+        probe.get_option(keep_alive_value, ec);
+        LogValue(os, "keep_alive", ec ? -1 : keep_alive_value.value(), keep_alive);
+
+#if BOOST_OS_LINUX
+        LogValue(os, "keep_alive_idle_sec", GetInteger<IPPROTO_TCP, TCP_KEEPIDLE>(probe), keep_alive_idle_sec);
+        LogValue(os, "keep_alive_interval_sec", GetInteger<IPPROTO_TCP, TCP_KEEPINTVL>(probe), keep_alive_interval_sec);
+        LogValue(os, "keep_alive_count", GetInteger<IPPROTO_TCP, TCP_KEEPCNT>(probe), keep_alive_count);
+        LogValue(os, "quick_ack", GetInteger<IPPROTO_TCP, TCP_QUICKACK>(probe), quick_ack);
+        LogValue(os, "busy_poll_us", GetInteger<SOL_SOCKET, SO_BUSY_POLL>(probe), busy_poll_us);
+#if defined(TCP_FASTOPEN_CONNECT)
+        if (is_client)
+            LogValue(os, "fast_open", GetInteger<IPPROTO_TCP, TCP_FASTOPEN_CONNECT>(probe), fast_open > 0);
+#endif
+#endif
+        if (!is_client)
+            os << " fast_open=" << fast_open;
+
+        os << std::endl;
+    }
+
+private:
+    template <int Level, int Name>
+    static int GetInteger(asio::ip::tcp::socket &sock)
+    {
+        IntegerSocketOption<Level, Name> option;
+        boost::system::error_code ec;
+        sock.get_option(option, ec);
+
+        return ec ? -1 : option.value();
+    }
+
+    // A value of -1 means the option could not be read.
+    static void LogValue(std::ostream &os, const char *option, int effective, int requested)
+    {
+        os << ' ' << option << '=' << effective;
+        if (requested != 0 && effective != requested)
+            os << " (requested " << requested << ')';
+    }
+};
+
+// Strategy used by the Acceptor to choose the event loop
+// that will own a newly accepted connection.
+enum class DispatchPolicy
+{
+    RoundRobin, // Hand connections to the event loops in turn.
+    LeastLoaded // Pick the event loop serving the fewest clients.
+};
+
+// What the Acceptor does when the server serves as many
+// clients as ServerConfig::max_in_flight allows.
+enum class OverloadPolicy
+{
+    PauseAccepting, // Stop accepting until a client is served.
+    RejectBusy      // Accept and reply "Busy" right away.
+};
+
+// Server settings. The default values reproduce the classic
+// behaviour where all the threads of the pool run the event
+// loop of one shared asio::io_service object.
+struct ServerConfig
+{
+    // When set, every thread of the pool runs an asio::io_service
+    // of its own and is pinned to a CPU core, so a client stays on
+    // the core it was handed to for its whole life.
+    bool per_core_shards = false;
+    DispatchPolicy dispatch_policy = DispatchPolicy::RoundRobin;
+
+    // When set, every shard listens on a socket of its own bound to
+    // the same port with SO_REUSEPORT and keeps the connections the
+    // kernel hands to it, instead of sharing a single acceptor socket.
+    bool reuse_port_listeners = false;
+
+    // Number of asynchronous accept operations kept outstanding on
+    // every listening socket.
+    unsigned int accepts_per_listener = 1;
+
+    // Maximum number of finished Service objects every shard keeps
+    // for reuse instead of deleting them. Zero disables pooling.
+    unsigned int service_pool_size = 0;
+
+    // When set, a connection is kept open after the response is sent
+    // and serves further requests. Requests pipelined by the client
+    // are answered in order with a single gather write.
+    bool keep_alive = false;
+
+    // A keep-alive connection that does not deliver a complete request
+    // within this period is closed. Zero disables the timeout.
+    std::chrono::milliseconds idle_timeout = std::chrono::milliseconds(0);
+
+    // Number of threads processing requests away from the event loops.
+    // Zero makes the event loop threads process the requests themselves.
+    unsigned int compute_pool_size = 0;
+
+    // Maximum number of clients served at the same time.
+    // Zero means no limit.
+    unsigned int max_in_flight = 0;
+    OverloadPolicy overload_policy = OverloadPolicy::PauseAccepting;
+
+    // In the length-prefixed mode a request is read as a fixed-size header
+    // followed by exactly the announced number of bytes, which land in slabs
+    // of the server's buffer pool without being scanned for a delimiter.
+    // Requests are not pipelined in this mode. Connections announcing a
+    // payload larger than max_frame_size are closed.
+    Framing framing = Framing::Newline;
+    std::uint32_t max_frame_size = 16 * 1024 * 1024;
+
+    // Options of the listening sockets and of every accepted connection.
+    SocketProfile socket_profile;
+
+    // Requests taking at least this long, from being received to the
+    // response being sent, are traced. Zero disables the tracing.
+    std::chrono::microseconds slow_request_threshold = std::chrono::microseconds(0);
+};
+
+// Counts the clients being served across all the shards and enforces
+// the ServerConfig::max_in_flight limit.
+class AdmissionControl
+{
+public:
+    AdmissionControl(unsigned int max_in_flight) : m_max_in_flight(max_in_flight),
+                                                   m_in_flight(0),
+                                                   m_rejected(0)
+    {
+    }
+
+    // Registers the function called whenever a client has been served,
+    // used by the Acceptor to resume accepting.
+    void SetOnClientFinished(std::function<void()> callback)
+    {
+        m_on_client_finished = callback;
+    }
+
+    // Admits a client unless the limit has been reached.
+    bool TryAdmit()
+    {
+        unsigned int in_flight = m_in_flight.load();
+        do
+        {
+            if (m_max_in_flight > 0 && in_flight >= m_max_in_flight)
+                return false;
+        } while (!m_in_flight.compare_exchange_weak(in_flight, in_flight + 1));
+
+        return true;
+    }
+
+    // Admits a client regardless of the limit.
+    void Admit()
+    {
+        m_in_flight.fetch_add(1);
+    }
+
+    void OnRejected()
+    {
+        m_rejected.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void OnFinished()
+    {
+        m_in_flight.fetch_sub(1);
+
+        if (m_on_client_finished)
+            m_on_client_finished();
+    }
+
+    bool IsSaturated() const
+    {
+        return m_max_in_flight > 0 && m_in_flight.load() >= m_max_in_flight;
+    }
+
+    // Whether a limit is enforced at all.
+    bool IsLimited() const
+    {
+        return m_max_in_flight > 0;
+    }
+
+    unsigned int GetInFlightCount() const
+    {
+        return m_in_flight.load(std::memory_order_relaxed);
+    }
+
+    unsigned long long GetRejectedCount() const
+    {
+        return m_rejected.load(std::memory_order_relaxed);
+    }
+
+private:
+    unsigned int m_max_in_flight;
+    std::atomic<unsigned int> m_in_flight;
+    std::atomic<unsigned long long> m_rejected;
+    std::function<void()> m_on_client_finished;
+};
+
+// Pool of threads running CPU-bound request processing so that slow
+// requests never block the threads running the event loops. Every worker
+// owns a task queue; tasks are distributed across the queues in turn and
+// a worker that runs out of tasks steals them from the other queues.
+// Tasks are counted and claimed with atomic operations, so the sleep mutex
+// is only taken when a worker has run out of tasks and may be sleeping.
+class ComputePool
+{
+public:
+    typedef std::function<void()> Task;
+
+    ComputePool(unsigned int num_threads) : m_queues(num_threads),
+                                            m_num_tasks(0),
+                                            m_num_sleepers(0),
+                                            m_next_queue(0),
+                                            m_stop(false)
+    {
+        assert(num_threads > 0);
+
+        for (unsigned int i = 0; i < num_threads; i++)
+        {
+            std::unique_ptr<std::thread> th(
+                new std::thread([this, i]()
+                                { Run(i); }));
+
+            m_threads.push_back(std::move(th));
+        }
+    }
+
+    ~ComputePool()
+    {
+        Stop();
+    }
+
+    void Submit(Task task)
+    {
+        WorkerQueue &queue =
+            m_queues[m_next_queue.fetch_add(1, std::memory_order_relaxed) % m_queues.size()];
+
+        std::unique_lock<std::mutex> queue_lock(queue.m_guard);
+        queue.m_tasks.push_back(std::move(task));
+        queue_lock.unlock();
+
+        // A worker going to sleep registers itself before it checks the
+        // counter, so either it sees the task or the task's submitter sees
+        // the worker. Taking the sleep mutex makes sure the worker is waiting
+        // on the condition variable when it is notified.
+        m_num_tasks.fetch_add(1);
+        if (m_num_sleepers.load() > 0)
+        {
+            std::unique_lock<std::mutex> sleep_lock(m_sleep_guard);
+            sleep_lock.unlock();
+
+            m_wakeup.notify_one();
+        }
+    }
+
+    // Blocks until all the worker threads exit. Tasks which
+    // have not been started yet are discarded.
+    void Stop()
+    {
+        std::unique_lock<std::mutex> sleep_lock(m_sleep_guard);
+        m_stop.store(true);
+        sleep_lock.unlock();
+
+        m_wakeup.notify_all();
+
+        for (auto &th : m_threads)
+        {
+            if (th->joinable())
+                th->join();
+        }
+    }
+
+private:
+    struct WorkerQueue
+    {
+        std::deque<Task> m_tasks;
+        std::mutex m_guard;
+    };
+
+    void Run(unsigned int own_queue)
+    {
+        while (!m_stop.load(std::memory_order_relaxed))
+        {
+            if (!ClaimTask())
+            {
+                std::unique_lock<std::mutex> sleep_lock(m_sleep_guard);
+                m_num_sleepers.fetch_add(1);
+                m_wakeup.wait(sleep_lock, [this]()
+                              { return m_stop.load() || m_num_tasks.load() > 0; });
+                m_num_sleepers.fetch_sub(1);
+                continue;
+            }
+
+            // A task is guaranteed to be queued for us. Take it from the
+            // back of our own queue or steal it from the front of another.
+            Task task;
+            for (unsigned int i = 0; !task; i++)
+            {
+                unsigned int queue_index = (own_queue + i) % m_queues.size();
+                WorkerQueue &queue = m_queues[queue_index];
+
+                std::unique_lock<std::mutex> queue_lock(queue.m_guard);
+                if (queue.m_tasks.empty())
+                    continue;
+
+                if (queue_index == own_queue)
+                {
+                    task = std::move(queue.m_tasks.back());
+                    queue.m_tasks.pop_back();
+                }
+                else
+                {
+                    task = std::move(queue.m_tasks.front());
+                    queue.m_tasks.pop_front();
+                }
+            }
+
+            task();
+        }
+    }
+
+    // Decrements the number of queued tasks unless it is zero.
+    bool ClaimTask()
+    {
+        unsigned int num_tasks = m_num_tasks.load();
+        do
+        {
+            if (num_tasks == 0)
+                return false;
+        } while (!m_num_tasks.compare_exchange_weak(num_tasks, num_tasks - 1));
+
+        return true;
+    }
+
+private:
+    std::vector<WorkerQueue> m_queues;
+    std::vector<std::unique_ptr<std::thread>> m_threads;
+
+    // Number of tasks queued but not yet claimed by a worker
+    // and number of workers waiting for a task.
+    std::atomic<unsigned int> m_num_tasks;
+    std::atomic<unsigned int> m_num_sleepers;
+    std::mutex m_sleep_guard;
+    std::condition_variable m_wakeup;
+
+    std::atomic<unsigned int> m_next_queue;
+    std::atomic<bool> m_stop;
+};
+
+class Service;
+
+// Represents an event loop: an asio::io_service object together with
+// the threads running it. In the classic mode the server has a single
+// shard run by the whole pool; in the per-core mode every thread runs
+// a shard of its own.
+class Shard
+{
+public:
+    Shard(const ServerConfig &config,
+          ComputePool *compute_pool,
+          AdmissionControl &admission,
+          ServerStats &stats,
+          RequestTracer &tracer,
+          BufferPool &buffer_pool) : m_config(config),
+                                     m_compute_pool(compute_pool),
+                                     m_admission(admission),
+                                     m_stats(stats),
+                                     m_tracer(tracer),
+                                     m_buffer_pool(buffer_pool),
+                                     m_num_services(0),
+                                     m_draining(false),
+                                     m_closing(false),
+                                     m_service_pool_size(config.service_pool_size),
+                                     m_pool_hits(0),
+                                     m_pool_misses(0)
+    {
+        m_work.reset(new asio::io_service::work(m_ios));
+    }
+
+    ~Shard();
+
+    // Spawns num_threads threads running the event loop. When core_id
+    // is not negative the threads are pinned to that CPU core.
+    void Start(unsigned int num_threads, int core_id)
+    {
+        for (unsigned int i = 0; i < num_threads; i++)
+        {
+            std::unique_ptr<std::thread> th(
+                new std::thread([this, core_id]()
+                                {
+                                    if (core_id >= 0)
+                                        PinToCore(core_id);
+                                    m_ios.run();
+                                }));
+
+            m_threads.push_back(std::move(th));
+        }
+    }
+
+    // Blocks until all the threads running the event loop exit.
+    void Stop()
+    {
+        m_ios.stop();
+
+        for (auto &th : m_threads)
+        {
+            th->join();
+        }
+    }
+
+    asio::io_service &GetIOService()
+    {
+        return m_ios;
+    }
+
+    const ServerConfig &GetConfig() const
+    {
+        return m_config;
+    }
+
+    // Pool processing the requests or nullptr if they are
+    // processed by the threads running the event loop.
+    ComputePool *GetComputePool()
+    {
+        return m_compute_pool;
+    }
+
+    AdmissionControl &GetAdmissionControl()
+    {
+        return m_admission;
+    }
+
+    ServerStats &GetStats()
+    {
+        return m_stats;
+    }
+
+    RequestTracer &GetTracer()
+    {
+        return m_tracer;
+    }
+
+    // Pool of the buffers length-prefixed requests are read into,
+    // shared by all the shards.
+    BufferPool &GetBufferPool()
+    {
+        return m_buffer_pool;
+    }
+
+    // Number of clients currently served by this event loop.
+    unsigned int GetServicesCount() const
+    {
+        return m_num_services.load(std::memory_order_relaxed);
+    }
+
+    // Registers a Service object that starts handling a client. A client
+    // accepted while the server is draining is notified right away.
+    void OnServiceStarted(Service *service);
+
+    // Unregisters a Service object that has finished handling its client.
+    // Returns false, leaving the object registered, while a notification
+    // is pending for it; the object is then released once it is handled.
+    bool OnServiceFinished(Service *service);
+
+    // Notifies every client served by this event loop that the server is
+    // draining, or that its connection has to be closed when force is set.
+    void NotifyServices(bool force);
+
+    // Called by a Service object once it has handled a notification.
+    // Returns true if no other notification is pending for it.
+    bool OnServiceNotified(Service *service);
+
+    // Returns a Service object whose socket belongs to this shard,
+    // taking it from the free list when possible.
+    Service *AcquireService();
+
+    // Puts a Service object that has finished handling its client
+    // back on the free list or deletes it if the list is full.
+    void ReleaseService(Service *service);
+
+    // Number of Service objects taken from the free list and
+    // number of them that had to be allocated.
+    unsigned long long GetPoolHits() const
+    {
+        return m_pool_hits.load(std::memory_order_relaxed);
+    }
+
+    unsigned long long GetPoolMisses() const
+    {
+        return m_pool_misses.load(std::memory_order_relaxed);
+    }
+
+private:
+    static void PinToCore(int core_id)
+    {
+#if BOOST_OS_LINUX
+        unsigned int num_cores = std::thread::hardware_concurrency();
+        if (num_cores == 0)
+            return;
+
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(core_id % num_cores, &cpuset);
+
+        // Failing to pin the thread is not fatal, the
+        // shard just keeps running wherever it is scheduled.
+        pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+#endif
+    }
+
+private:
+    asio::io_service m_ios;
+    std::unique_ptr<asio::io_service::work> m_work;
+    std::vector<std::unique_ptr<std::thread>> m_threads;
+    ServerConfig m_config;
+    ComputePool *m_compute_pool;
+    AdmissionControl &m_admission;
+    ServerStats &m_stats;
+    RequestTracer &m_tracer;
+    BufferPool &m_buffer_pool;
+    std::atomic<unsigned int> m_num_services;
+
+    // Service objects handling a client. Every object knows its position
+    // in the list, so it is removed without a search or a memory allocation.
+    std::vector<Service *> m_active_services;
+    std::mutex m_active_services_guard;
+    bool m_draining;
+    bool m_closing;
+
+    // Free list of recycled Service objects. The Acceptor may acquire
+    // objects from a thread of another shard, hence the mutex.
+    std::vector<Service *> m_service_pool;
+    std::mutex m_service_pool_guard;
+    unsigned int m_service_pool_size;
+    std::atomic<unsigned long long> m_pool_hits;
+    std::atomic<unsigned long long> m_pool_misses;
+};
 
 //responsible for handling a single client by reading the request message, processing it, and then sending back the response message.
 //Each instance of the Service class is intended to handle one connected client
@@ -13,82 +1908,495 @@ using namespace boost;
 class Service
 {
 public:
-    //The class's constructor accepts a shared pointer to an object representing a socket connected to a particular client as an argument
-    // and caches this pointer. This socket will be used later to communicate with the client application.
-    Service(std::shared_ptr<asio::ip::tcp::socket> sock) : m_sock(sock)
+    //The class's constructor accepts the shard that owns the object. The object's socket belongs
+    //to the shard's io_service; it is connected to a client by the Acceptor and used later to communicate
+    //with the client application. The shard is notified when the client handling is over.
+    Service(Shard &shard) : m_sock(shard.GetIOService()),
+                            m_shard(shard),
+                            m_strand(shard.GetIOService()),
+                            m_frame(shard.GetBufferPool()),
+                            m_write_queue(m_sock, m_strand),
+                            m_idle_timer(shard.GetIOService()),
+                            m_idle_timer_pending(false),
+                            m_buffered_size(0),
+                            m_first_request(true),
+                            m_busy(false),
+                            m_finished(false),
+                            m_admitted(false),
+                            m_draining(false),
+                            m_half_closed(false),
+                            m_active_index(0),
+                            m_pending_notifications(0)
+    {
+    }
+
+    asio::ip::tcp::socket &GetSocket()
     {
+        return m_sock;
+    }
+
+    //The strand all the handlers of the object run through.
+    asio::io_service::strand &GetStrand()
+    {
+        return m_strand;
+    }
+
+    //Arena for the accept operation connecting the socket, which
+    //completes before the object starts reading from the socket.
+    HandlerMemory &GetAcceptHandlerMemory()
+    {
+        return m_read_handler_memory;
+    }
+
+    //Prepares the object to serve another client. The buffers are emptied
+    //but keep the memory they have already allocated.
+    void Reset()
+    {
+        boost::system::error_code ignored_ec;
+        m_sock.close(ignored_ec);
+
+        m_request.consume(m_request.size());
+        m_frame.Clear();
+        m_responses.clear();
+        m_first_request = true;
+        m_busy = false;
+        m_finished = false;
+        m_admitted = false;
+        m_draining = false;
+        m_half_closed = false;
+    }
+
+    //Called by the shard, which guarantees that the object is not released
+    //before the notification is handled on its strand.
+    void Notify(bool force)
+    {
+        asio::post(m_strand,
+                   [this, force]()
+                   { onNotified(force); });
     }
 
     //This method starts handling the client by initiating the asynchronous reading operation
     //to read the request message from the client specifying the onRequestReceived() method as a callback.
-    void StartHandling()
+    //The time the connection was accepted at is kept to measure the delay to its first request.
+    void StartHandling(std::chrono::steady_clock::time_point accepted_at)
+    {
+        m_admitted = true;
+        m_accepted_at = accepted_at;
+
+        //Keep-alive connections are watched by the idle timer for their whole life.
+        if (m_shard.GetConfig().keep_alive &&
+            m_shard.GetConfig().idle_timeout.count() > 0)
+        {
+            m_idle_deadline = std::chrono::steady_clock::now() +
+                              m_shard.GetConfig().idle_timeout;
+            StartIdleTimer();
+        }
+
+        ReadRequest();
+    }
+
+    //Used instead of StartHandling() when the server has no capacity for the client:
+    //a short busy reply is sent and the connection is closed without reading the request.
+    void StartRejecting()
+    {
+        static const char busy_reply[] = "Busy\n";
+
+        asio::async_write(m_sock,
+                          asio::buffer(busy_reply, sizeof(busy_reply) - 1),
+                          asio::bind_executor(m_strand,
+                                              MakeCustomAllocHandler(m_write_handler_memory,
+                                                                     [this](
+                                                                         const boost::system::error_code &ec,
+                                                                         std::size_t bytes_transferred)
+                                                                     {
+                                                                         onFinish();
+                                                                     })));
+    }
+
+private:
+    void ReadRequest()
     {
+        //A connection is considered idle while it waits for a request.
+        m_busy = false;
+        m_read_started_at = std::chrono::steady_clock::now();
+        m_idle_deadline = m_read_started_at + m_shard.GetConfig().idle_timeout;
+        m_buffered_size = m_request.size();
+
+        //A draining server answers no further requests on a keep-alive connection.
+        //Once its last response is sent, the sending side of the socket is shut down
+        //to tell the client, and the connection is read until the client closes it.
+        if (m_draining && !m_first_request && !m_half_closed)
+            HalfClose();
+
+        if (m_shard.GetConfig().framing == Framing::LengthPrefixed)
+        {
+            ReadFrameHeader();
+            return;
+        }
 
-        asio::async_read_until(*m_sock.get(),
+        //The memory of the operation is taken from the arena embedded in the object.
+        //All the handlers of the object run through its strand, so the idle timer
+        //never races with the reading and writing operations.
+        asio::async_read_until(m_sock,
                                m_request,
                                '\n',
-                               [this](
-                                   const boost::system::error_code &ec,
-                                   std::size_t bytes_transferred)
-                               {
-                                   //When the request reading completes, or an error occurs, the callback method onRequestReceived() is called.
-                                   onRequestReceived(ec,
-                                                     bytes_transferred);
-                               });
+                               asio::bind_executor(m_strand,
+                                                   MakeCustomAllocHandler(m_read_handler_memory,
+                                                                          [this](
+                                                                              const boost::system::error_code &ec,
+                                                                              std::size_t bytes_transferred)
+                                                                          {
+                                                                              //When the request reading completes, or an error occurs, the callback method onRequestReceived() is called.
+                                                                              onRequestReceived(ec,
+                                                                                                bytes_transferred);
+                                                                          })));
+    }
+
+    //In the length-prefixed mode the header is read first. Until it arrives
+    //the connection is idle, as it is while waiting for a newline-delimited request.
+    void ReadFrameHeader()
+    {
+        asio::async_read(m_sock,
+                         asio::buffer(m_frame_header),
+                         asio::bind_executor(m_strand,
+                                             MakeCustomAllocHandler(m_read_handler_memory,
+                                                                    [this](
+                                                                        const boost::system::error_code &ec,
+                                                                        std::size_t bytes_transferred)
+                                                                    {
+                                                                        onFrameHeaderReceived(ec);
+                                                                    })));
+    }
+
+    void onFrameHeaderReceived(const boost::system::error_code &ec)
+    {
+        if (ec.value() != 0)
+        {
+            onRequestReceived(ec, 0);
+            return;
+        }
+
+        std::uint32_t payload_size = DecodeFrameSize(m_frame_header);
+        if (payload_size > m_shard.GetConfig().max_frame_size)
+        {
+            std::cout << "Error occured! Frame of " << payload_size
+                      << " bytes exceeds the limit of "
+                      << m_shard.GetConfig().max_frame_size << " bytes.";
+            onFinish();
+            return;
+        }
+
+        //The payload is read with a single scatter read straight into the slabs.
+        m_frame.Clear();
+        asio::async_read(m_sock,
+                         m_frame.Prepare(payload_size),
+                         asio::bind_executor(m_strand,
+                                             MakeCustomAllocHandler(m_read_handler_memory,
+                                                                    [this](
+                                                                        const boost::system::error_code &ec,
+                                                                        std::size_t bytes_transferred)
+                                                                    {
+                                                                        m_frame.Commit(bytes_transferred);
+                                                                        onRequestReceived(ec,
+                                                                                          FRAME_HEADER_SIZE + bytes_transferred);
+                                                                    })));
+    }
+
+    void onRequestReceived(const boost::system::error_code &ec,
+                           std::size_t bytes_transferred)
+    {
+        //This method first checks whether the reading succeeded by testing the ec argument that contains the operation completion status code.
+        if (ec.value() != 0)
+        {
+            //A keep-alive client closing the connection, or the idle timer
+            //closing it, is the normal way for the connection to end.
+            if (!m_shard.GetConfig().keep_alive ||
+                (ec != asio::error::eof && ec != asio::error::operation_aborted))
+            {
+                std::cout << "Error occured! Error code = "
+                          << ec.value()
+                          << ". Message: " << ec.message();
+            }
+            //reading finished with an error, the corresponding message is output to the standard output stream
+            //and then the onFinish() method is called.
+            onFinish();
+            return;
+        }
+
+        if (m_half_closed)
+        {
+            //No response can be sent any more, so whatever the client sends
+            //before closing its side of the connection is dropped.
+            m_request.consume(m_request.size());
+            m_frame.Clear();
+            ReadRequest();
+            return;
+        }
+
+        //The read latency includes the time the client takes to send the request;
+        //for the first request it is also reported as accept-to-first-byte.
+        //Pipelined requests may arrive with one read, so the incoming bytes
+        //are counted as the growth of the buffer rather than bytes_transferred.
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        ServerStats &stats = m_shard.GetStats();
+        if (m_first_request)
+        {
+            stats.Record(ServerStats::AcceptToFirstByte, now - m_accepted_at);
+            m_first_request = false;
+        }
+        stats.Record(ServerStats::Read, now - m_read_started_at);
+        stats.Add(ServerStats::BytesIn,
+                  m_shard.GetConfig().framing == Framing::LengthPrefixed ? bytes_transferred
+                                                                          : m_request.size() - m_buffered_size);
+
+        //The connection is busy until the responses are sent.
+        m_busy = true;
+
+        RequestTracer &tracer = m_shard.GetTracer();
+        tracer.Start(m_trace);
+
+        ComputePool *compute_pool = m_shard.GetComputePool();
+        if (compute_pool == nullptr)
+        {
+            ProcessRequests();
+            SendResponses();
+            return;
+        }
+
+        // The requests are processed by the compute pool, which queues the
+        // responses itself; the write queue hands them over to the strand.
+        // The object's members are not touched by other handlers meanwhile,
+        // as no reading or writing operation is outstanding.
+        tracer.Begin(m_trace, RequestTracer::Queue);
+        compute_pool->Submit([this]()
+                             {
+                                 m_shard.GetTracer().End(m_trace, RequestTracer::Queue);
+                                 ProcessRequests();
+                                 SendResponses();
+                             });
+    }
+
+    void ProcessRequests()
+    {
+        // Process the request. In the keep-alive mode every complete request
+        // found in the buffer is processed, so that requests pipelined by the client
+        // are answered in the order they arrived.
+        std::chrono::steady_clock::time_point started_at = std::chrono::steady_clock::now();
+        m_shard.GetTracer().Begin(m_trace, RequestTracer::Process);
+
+        m_responses.clear();
+        if (m_shard.GetConfig().framing == Framing::LengthPrefixed)
+        {
+            m_responses.push_back(ProcessRequest(m_frame));
+        }
+        else
+        {
+            do
+            {
+                m_responses.push_back(ProcessRequest(m_request));
+            } while (m_shard.GetConfig().keep_alive && HasCompleteRequest());
+        }
+
+        m_shard.GetStats().Record(ServerStats::Process,
+                                  std::chrono::steady_clock::now() - started_at);
+        m_shard.GetTracer().End(m_trace, RequestTracer::Process);
+    }
+
+    void SendResponses()
+    {
+        // Once the last response is queued, its callback may release the
+        // object on another thread, so no member is touched after that.
+        // ProcessRequests() clears the vector, keeping its capacity.
+        std::size_t count = m_responses.size();
+
+        std::size_t size = 0;
+        for (const std::string &response : m_responses)
+        {
+            size += response.size();
+        }
+
+        m_write_started_at = std::chrono::steady_clock::now();
+        m_shard.GetTracer().Begin(m_trace, RequestTracer::Write);
+
+        // When the ProcessRequest() method completes and returns the string containing the response message,
+        // the response is queued on the connection's write queue to be sent back to the client.
+        // The responses queued together are coalesced into a single gather write, and the
+        // callback of the last one continues the client handling.
+        for (std::size_t i = 0; i < count; i++)
+        {
+            WriteQueue<asio::io_service::strand>::Callback callback;
+            if (i + 1 == count)
+            {
+                callback = [this, size](const boost::system::error_code &ec)
+                {
+                    //The onResponseSent() method is specified as a callback.
+                    onResponseSent(ec, ec.value() == 0 ? size : 0);
+                };
+            }
+
+            m_write_queue.Write(std::move(m_responses[i]), std::move(callback));
+        }
+    }
+
+    void onResponseSent(const boost::system::error_code &ec,
+                        std::size_t bytes_transferred)
+    {
+        ServerStats &stats = m_shard.GetStats();
+        stats.Record(ServerStats::Write, std::chrono::steady_clock::now() - m_write_started_at);
+        stats.Add(ServerStats::BytesOut, bytes_transferred);
+
+        RequestTracer &tracer = m_shard.GetTracer();
+        tracer.End(m_trace, RequestTracer::Write);
+        tracer.Finish(m_trace);
+
+        // This method first checks whether the operation succeeded.
+        if (ec.value() != 0)
+        {
+            // If the operation failed, the corresponding message is output to the standard output stream.
+            std::cout << "Error occured! Error code = "
+                      << ec.value()
+                      << ". Message: " << ec.message();
+        }
+        else if (m_shard.GetConfig().keep_alive)
+        {
+            // Keep-alive connection loops back to read the next request.
+            ReadRequest();
+            return;
+        }
+
+        //method is called to perform the cleanup.
+        onFinish();
+    }
+
+    // Checks whether the buffer holds another request delimited by '\n'.
+    bool HasCompleteRequest() const
+    {
+        auto begin = asio::buffers_begin(m_request.data());
+        auto end = asio::buffers_end(m_request.data());
+
+        return std::find(begin, end, '\n') != end;
+    }
+
+    // A single wait operation is kept outstanding on the idle timer. When it
+    // completes, the connection is closed if it has been idle past its deadline;
+    // otherwise the timer is restarted to expire at the current deadline.
+    void StartIdleTimer()
+    {
+        m_idle_timer_pending = true;
+        m_idle_timer.expires_at(m_idle_deadline);
+        m_idle_timer.async_wait(asio::bind_executor(m_strand,
+                                                    MakeCustomAllocHandler(m_timer_handler_memory,
+                                                                           [this](const boost::system::error_code &ec)
+                                                                           {
+                                                                               onIdleTimer(ec);
+                                                                           })));
+    }
+
+    void onIdleTimer(const boost::system::error_code &ec)
+    {
+        m_idle_timer_pending = false;
+
+        if (m_finished)
+        {
+            // The client handling has finished while the timer was
+            // running, the cleanup has been left to us.
+            Release();
+            return;
+        }
+
+        if (m_busy)
+        {
+            // Requests are being processed, the connection is not idle.
+            m_idle_deadline = std::chrono::steady_clock::now() +
+                              m_shard.GetConfig().idle_timeout;
+        }
+        else if (std::chrono::steady_clock::now() >= m_idle_deadline)
+        {
+            // Closing the socket makes the outstanding read
+            // complete with an error, which ends the client handling.
+            boost::system::error_code ignored_ec;
+            m_sock.close(ignored_ec);
+            return;
+        }
+
+        StartIdleTimer();
+    }
+
+    // A connection is idle while a keep-alive client has been answered
+    // and the next request has not arrived yet.
+    bool IsIdle() const
+    {
+        return m_admitted && !m_busy && !m_first_request;
+    }
+
+    void HalfClose()
+    {
+        m_half_closed = true;
+
+        boost::system::error_code ignored_ec;
+        m_sock.shutdown(asio::ip::tcp::socket::shutdown_send, ignored_ec);
     }
 
-private:
-    void onRequestReceived(const boost::system::error_code &ec,
-                           std::size_t bytes_transferred)
+    // The server is draining. An idle connection is half-closed at once, a
+    // busy one after its response is sent. A forced notification closes the
+    // socket, making the outstanding operations complete with an error.
+    void onNotified(bool force)
     {
-        //This method first checks whether the reading succeeded by testing the ec argument that contains the operation completion status code.
-        if (ec.value() != 0)
+        bool last = m_shard.OnServiceNotified(this);
+
+        if (m_finished)
         {
-            std::cout << "Error occured! Error code = "
-                      << ec.value()
-                      << ". Message: " << ec.message();
-            //reading finished with an error, the corresponding message is output to the standard output stream
-            //and then the onFinish() method is called.
-            onFinish();
+            // The client handling has finished meanwhile. Unless the idle
+            // timer's handler is pending, the cleanup falls to the last
+            // notification handled.
+            if (last && !m_idle_timer_pending)
+                Release();
             return;
         }
 
-        // Process the request.
-        m_response = ProcessRequest(m_request);
+        m_draining = true;
 
-        // When the ProcessRequest() method completes and returns the string containing the response message,
-        // the asynchronous writing operation is initiated to send this response message back to the client.
-        asio::async_write(*m_sock.get(),
-                          asio::buffer(m_response),
-                          [this](
-                              const boost::system::error_code &ec,
-                              std::size_t bytes_transferred)
-                          {
-                              //The onResponseSent() method is specified as a callback.
-                              onResponseSent(ec, bytes_transferred);
-                          });
+        if (force)
+        {
+            boost::system::error_code ignored_ec;
+            m_sock.close(ignored_ec);
+            return;
+        }
+
+        if (IsIdle() && !m_half_closed)
+            HalfClose();
     }
 
-    void onResponseSent(const boost::system::error_code &ec,
-                        std::size_t bytes_transferred)
+    // Here we perform the cleanup.
+    void onFinish()
     {
-        // This method first checks whether the operation succeeded.
-        if (ec.value() != 0)
+        m_finished = true;
+
+        if (m_idle_timer_pending)
         {
-            // If the operation failed, the corresponding message is output to the standard output stream.
-            std::cout << "Error occured! Error code = "
-                      << ec.value()
-                      << ". Message: " << ec.message();
+            // Let the timer's handler complete the cleanup
+            // once it is called with operation_aborted.
+            m_idle_timer.cancel();
+            return;
         }
 
-        //method is called to perform the cleanup.
-        onFinish();
+        Release();
     }
 
-    // Here we perform the cleanup.
-    void onFinish()
+    void Release()
     {
-        delete this;
+        //Instead of deleting itself the object is handed back to its shard,
+        //which either keeps it for the next client or deletes it. A notification
+        //posted to the object meanwhile completes the cleanup instead.
+        if (!m_shard.OnServiceFinished(this))
+            return;
+
+        if (m_admitted)
+        {
+            m_shard.GetAdmissionControl().OnFinished();
+        }
+
+        m_shard.ReleaseService(this);
     }
 
     //To keep things simple,  we implement a dummy service which only emulates the execution of certain operations
@@ -98,8 +2406,35 @@ private:
     {
 
         // In this method we parse the request, process it
-        // and prepare the request.
+        // and prepare the request. The request line is consumed
+        // from the buffer, leaving any pipelined requests in place.
+        auto begin = asio::buffers_begin(request.data());
+        auto end = asio::buffers_end(request.data());
+        auto delimiter = std::find(begin, end, '\n');
+        request.consume(delimiter == end ? request.size()
+                                         : std::distance(begin, delimiter) + 1);
+
+        return ExecuteRequest() + "\n";
+    }
 
+    // The length-prefixed counterpart of the method above. The payload
+    // is dropped, returning its slabs to the pool, and the response
+    // is framed the same way as the request.
+    std::string ProcessRequest(SlabChain &request)
+    {
+        request.Clear();
+
+        std::string payload = ExecuteRequest();
+
+        std::string response(FRAME_HEADER_SIZE, '\0');
+        EncodeFrameSize(static_cast<std::uint32_t>(payload.size()), &response[0]);
+        response += payload;
+        return response;
+    }
+
+    // The processing common to both framings, returning the response payload.
+    std::string ExecuteRequest()
+    {
         // Emulate CPU-consuming operations.
         int i = 0;
         while (i != 1000000){
@@ -112,155 +2447,732 @@ private:
             std::chrono::milliseconds(100));
 
         // Prepare and return the response message.
-        std::string response = "Response\n";
+        std::string response = "Response";
         return response;
     }
 
+    static const std::size_t FRAME_HEADER_SIZE = 4;
+
+    static std::uint32_t DecodeFrameSize(const unsigned char *header)
+    {
+        return (std::uint32_t(header[0]) << 24) | (std::uint32_t(header[1]) << 16) |
+               (std::uint32_t(header[2]) << 8) | std::uint32_t(header[3]);
+    }
+
+    static void EncodeFrameSize(std::uint32_t size, char *header)
+    {
+        header[0] = static_cast<char>(size >> 24);
+        header[1] = static_cast<char>(size >> 16);
+        header[2] = static_cast<char>(size >> 8);
+        header[3] = static_cast<char>(size);
+    }
+
 private:
-    std::shared_ptr<asio::ip::tcp::socket> m_sock;
-    std::string m_response;
+    asio::ip::tcp::socket m_sock;
+    Shard &m_shard;
+    asio::io_service::strand m_strand;
     asio::streambuf m_request;
+
+    // Header and payload of the length-prefixed request being read.
+    unsigned char m_frame_header[FRAME_HEADER_SIZE];
+    SlabChain m_frame;
+
+    // Responses to the requests received by the last read and the
+    // queue sending them, which any thread may write to the client through.
+    std::vector<std::string> m_responses;
+    WriteQueue<asio::io_service::strand> m_write_queue;
+
+    // Keep-alive connection idle timeout.
+    asio::steady_timer m_idle_timer;
+    std::chrono::steady_clock::time_point m_idle_deadline;
+    bool m_idle_timer_pending;
+
+    // Points in time the latencies reported to the shard's statistics are measured from.
+    std::chrono::steady_clock::time_point m_accepted_at;
+    std::chrono::steady_clock::time_point m_read_started_at;
+    std::chrono::steady_clock::time_point m_write_started_at;
+    RequestTracer::Trace m_trace;
+    std::size_t m_buffered_size;
+    bool m_first_request;
+
+    bool m_busy;
+    bool m_finished;
+    bool m_admitted;
+
+    // Set once the server drains, and once the sending side of the
+    // socket has been shut down after the last response.
+    bool m_draining;
+    bool m_half_closed;
+
+    // Position in the shard's list of active objects and number of
+    // notifications posted to the object and not handled yet. Both
+    // are only touched by the shard, under its lock.
+    friend class Shard;
+    std::size_t m_active_index;
+    unsigned int m_pending_notifications;
+
+    // Arenas the memory of the asynchronous operations is allocated from.
+    HandlerMemory m_read_handler_memory;
+    HandlerMemory m_write_handler_memory;
+    HandlerMemory m_timer_handler_memory;
 };
 
+Shard::~Shard()
+{
+    for (Service *service : m_service_pool)
+    {
+        delete service;
+    }
+}
+
+Service *Shard::AcquireService()
+{
+    std::unique_lock<std::mutex> lock(m_service_pool_guard);
+
+    if (!m_service_pool.empty())
+    {
+        Service *service = m_service_pool.back();
+        m_service_pool.pop_back();
+        lock.unlock();
+
+        m_pool_hits.fetch_add(1, std::memory_order_relaxed);
+        return service;
+    }
+
+    lock.unlock();
+
+    m_pool_misses.fetch_add(1, std::memory_order_relaxed);
+    return new Service(*this);
+}
+
+void Shard::OnServiceStarted(Service *service)
+{
+    m_num_services.fetch_add(1, std::memory_order_relaxed);
+
+    std::unique_lock<std::mutex> lock(m_active_services_guard);
+
+    service->m_active_index = m_active_services.size();
+    service->m_pending_notifications = 0;
+    m_active_services.push_back(service);
+
+    if (m_draining || m_closing)
+    {
+        service->m_pending_notifications++;
+        service->Notify(m_closing);
+    }
+}
+
+bool Shard::OnServiceFinished(Service *service)
+{
+    std::unique_lock<std::mutex> lock(m_active_services_guard);
+
+    if (service->m_pending_notifications > 0)
+        return false;
+
+    // The last object in the list takes the place of the one removed.
+    Service *last = m_active_services.back();
+    m_active_services[service->m_active_index] = last;
+    last->m_active_index = service->m_active_index;
+    m_active_services.pop_back();
+    lock.unlock();
+
+    m_num_services.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
+void Shard::NotifyServices(bool force)
+{
+    std::unique_lock<std::mutex> lock(m_active_services_guard);
+
+    m_draining = true;
+    m_closing = m_closing || force;
+
+    for (Service *active : m_active_services)
+    {
+        active->m_pending_notifications++;
+        active->Notify(force);
+    }
+}
+
+bool Shard::OnServiceNotified(Service *service)
+{
+    std::unique_lock<std::mutex> lock(m_active_services_guard);
+
+    return --service->m_pending_notifications == 0;
+}
+
+void Shard::ReleaseService(Service *service)
+{
+    service->Reset();
+
+    std::unique_lock<std::mutex> lock(m_service_pool_guard);
+
+    if (m_service_pool.size() < m_service_pool_size)
+    {
+        m_service_pool.push_back(service);
+        return;
+    }
+
+    lock.unlock();
+
+    delete service;
+}
+
 //responsible for accepting the connection requests arriving from clients and instantiating the objects of the Service class,
 // which will provide the service to connected clients.
 class Acceptor
 {
 public:
     //Its constructor accepts a port number on which it will listen for the incoming connection requests as its input argument. 
-    Acceptor(asio::io_service &ios, unsigned short port_num) : m_ios(ios),
-                                                               //The object of this class contains an instance of the asio::ip::tcp::acceptor class as its member named m_acceptor,
-                                                               //which is constructed in the Acceptor class's constructor.
-                                                               m_acceptor(m_ios,
-                                                                          asio::ip::tcp::endpoint(
-                                                                              asio::ip::address_v4::any(),
-                                                                              port_num)),
-                                                               m_isStopped(false)
+    //Accepted sockets are handed to the shards according to the server configuration.
+    Acceptor(unsigned short port_num,
+             std::vector<std::unique_ptr<Shard>> &shards,
+             AdmissionControl &admission,
+             const ServerConfig &config) : m_isStopped(false),
+                                           m_shards(shards),
+                                           m_policy(config.dispatch_policy),
+                                           m_accepts_per_listener(config.accepts_per_listener),
+                                           m_next_shard(0),
+                                           m_pending_accepts(0),
+                                           m_admission(admission),
+                                           m_overload_policy(config.overload_policy),
+                                           m_socket_profile(config.socket_profile),
+                                           m_num_parked(0)
     {
+        assert(m_accepts_per_listener > 0);
+
+        // Without a limit the accepting is never paused, so neither the accept
+        // path nor the clients being served have to deal with parked listeners.
+        m_park_accepts = m_overload_policy == OverloadPolicy::PauseAccepting &&
+                         m_admission.IsLimited();
+        if (m_park_accepts)
+        {
+            m_admission.SetOnClientFinished([this]()
+                                            { ResumeAccepting(); });
+        }
+
+        asio::ip::tcp::endpoint ep(asio::ip::address_v4::any(),
+                                   port_num);
+
+        //The object of this class contains instances of the asio::ip::tcp::acceptor class,
+        //which are constructed in the Acceptor class's constructor.
+        //In the SO_REUSEPORT mode every shard gets a listening socket of its own
+        //bound to the same port and the kernel spreads new connections across them.
+        //Otherwise a single acceptor socket feeds all the shards.
+        if (config.reuse_port_listeners)
+        {
+            for (auto &shard : m_shards)
+            {
+                m_listeners.emplace_back(
+                    new Listener(shard->GetIOService(), ep, true, shard.get(), m_socket_profile));
+            }
+        }
+        else
+        {
+            m_listeners.emplace_back(
+                new Listener(m_shards.front()->GetIOService(), ep, false, nullptr, m_socket_profile));
+        }
     }
 
     //The Start() method is intended to instruct an object of the Acceptor class to start listening and accepting incoming connection requests.
     void Start()
     {
-        //It puts the m_acceptor acceptor socket into listening mode
-        m_acceptor.listen();
-        InitAccept();
+        for (auto &listener : m_listeners)
+        {
+            //It puts the acceptor sockets into listening mode
+            listener->m_acceptor.listen();
+
+            //Several accept operations may be outstanding on each listening socket,
+            //so that connection bursts do not queue behind a single accept chain.
+            for (unsigned int i = 0; i < m_accepts_per_listener; i++)
+            {
+                InitAccept(*listener);
+            }
+        }
     }
 
-    // Stop accepting incoming connection requests.
+    // Stop accepting incoming connection requests. The listening sockets
+    // are closed on their strands, which makes the accept operations
+    // outstanding on them complete with operation_aborted.
     void Stop()
     {
         m_isStopped.store(true);
+
+        std::unique_lock<std::mutex> lock(m_parked_guard);
+        m_parked.clear();
+        m_num_parked.store(0);
+        lock.unlock();
+
+        for (auto &listener : m_listeners)
+        {
+            Listener *l = listener.get();
+            asio::post(l->m_strand,
+                       [l]()
+                       {
+                           boost::system::error_code ignored_ec;
+                           l->m_acceptor.close(ignored_ec);
+                       });
+        }
+    }
+
+    // Number of accept operations outstanding, each holding a Service object.
+    unsigned int GetPendingAcceptsCount() const
+    {
+        return m_pending_accepts.load();
     }
 
 private:
-    void InitAccept()
+    // Listening socket together with the strand serializing the accept operations outstanding on it.
+    struct Listener
+    {
+        Listener(asio::io_service &ios,
+                 const asio::ip::tcp::endpoint &ep,
+                 bool reuse_port,
+                 Shard *shard,
+                 const SocketProfile &profile) : m_acceptor(ios),
+                                                 m_strand(ios),
+                                                 m_shard(shard)
+        {
+            m_acceptor.open(ep.protocol());
+            m_acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+
+            if (reuse_port)
+            {
+#ifdef SO_REUSEPORT
+                typedef IntegerSocketOption<SOL_SOCKET, SO_REUSEPORT>
+                    reuse_port_option;
+                m_acceptor.set_option(reuse_port_option(1));
+#else
+                throw system::system_error(asio::error::operation_not_supported);
+#endif
+            }
+
+            profile.ApplyToListener(m_acceptor);
+
+            m_acceptor.bind(ep);
+        }
+
+        //used to asynchronously accept the incoming connection requests.
+        asio::ip::tcp::acceptor m_acceptor;
+        asio::io_service::strand m_strand;
+
+        // Shard owning all the connections accepted on this socket
+        // or nullptr if they are dispatched across all the shards.
+        Shard *m_shard;
+    };
+
+    // Chooses the shard that will own the next accepted connection.
+    Shard &PickShard(Listener &listener)
+    {
+        if (listener.m_shard != nullptr)
+            return *listener.m_shard;
+
+        if (m_policy == DispatchPolicy::LeastLoaded)
+        {
+            Shard *least_loaded = m_shards.front().get();
+            for (auto &shard : m_shards)
+            {
+                if (shard->GetServicesCount() < least_loaded->GetServicesCount())
+                    least_loaded = shard.get();
+            }
+
+            return *least_loaded;
+        }
+
+        return *m_shards[m_next_shard.fetch_add(1) % m_shards.size()];
+    }
+
+    void InitAccept(Listener &listener)
     {
-        //constructs an active socket object and initiates the asynchronous accept operation
-        std::shared_ptr<asio::ip::tcp::socket>
-            sock(new asio::ip::tcp::socket(m_ios));
+        //constructs an active socket object and initiates the asynchronous accept operation.
+        //The socket is bound to the io_service of the chosen shard so that all
+        //the operations on it are completed by that shard's threads.
+        //The Service object owning the socket is taken from the shard's pool of recycled objects.
+        Shard &shard = PickShard(listener);
+        Service *service = shard.AcquireService();
+        m_pending_accepts.fetch_add(1);
 
         //calling the async_accept() method on the acceptor socket object
         // and passing the object representing an active socket to it as an argument.
-        m_acceptor.async_accept(*sock.get(),
-                                [this, sock](
-                                    const boost::system::error_code &error)
-                                {
-                                    //When the connection request is accepted or an error occurs, the callback method onAccept() is called.
-                                    onAccept(error, sock);
-                                });
+        //The handler is bound to the listener's strand rather than wrapped by it,
+        //so that the operation still allocates its memory from the object's arena.
+        listener.m_acceptor.async_accept(service->GetSocket(),
+                                         asio::bind_executor(listener.m_strand,
+                                                             MakeCustomAllocHandler(service->GetAcceptHandlerMemory(),
+                                                                                    [this, &listener, service, &shard](
+                                                                                        const boost::system::error_code &error)
+                                                                                    {
+                                                                                        //When the connection request is accepted or an error occurs, the callback method onAccept() is called.
+                                                                                        onAccept(error, listener, service, shard);
+                                                                                    })));
     }
 
     void onAccept(const boost::system::error_code &ec,
-                  std::shared_ptr<asio::ip::tcp::socket> sock)
+                  Listener &listener,
+                  Service *service,
+                  Shard &shard)
     {
         if (ec.value() == 0)
         {
-            //an instance of the Service class is created and its StartHandling() method is called
-            (new Service(sock))->StartHandling();
+            //the StartHandling() method of the Service object is called.
+            //This is done by the shard's own threads, so that the Service object
+            //never leaves the event loop it starts on.
+            //When the server is saturated and the policy says so, the client
+            //gets a busy reply instead.
+            shard.OnServiceStarted(service);
+            shard.GetStats().Add(ServerStats::Connections, 1);
+            m_socket_profile.ApplyToConnection(service->GetSocket(), false);
+            std::chrono::steady_clock::time_point accepted_at = std::chrono::steady_clock::now();
+
+            bool admitted = true;
+            if (m_overload_policy == OverloadPolicy::RejectBusy)
+            {
+                admitted = m_admission.TryAdmit();
+            }
+            else
+            {
+                // Up to one client per parked accept operation
+                // may be admitted above the limit.
+                m_admission.Admit();
+            }
+
+            if (admitted)
+            {
+                service->GetStrand().post(
+                    MakeCustomAllocHandler(service->GetAcceptHandlerMemory(),
+                                           [service, accepted_at]()
+                                           { service->StartHandling(accepted_at); }));
+            }
+            else
+            {
+                m_admission.OnRejected();
+                service->GetStrand().post(
+                    MakeCustomAllocHandler(service->GetAcceptHandlerMemory(),
+                                           [service]()
+                                           { service->StartRejecting(); }));
+            }
         }
         else
         {
-            //the corresponding message is output to the standard output stream.
-            std::cout << "Error occured! Error code = "
-                      << ec.value()
-                      << ". Message: " << ec.message();
+            //The unused Service object goes back to the pool.
+            shard.ReleaseService(service);
+
+            if (ec != asio::error::operation_aborted)
+            {
+                //the corresponding message is output to the standard output stream.
+                std::cout << "Error occured! Error code = "
+                          << ec.value()
+                          << ". Message: " << ec.message();
+            }
         }
 
         // Init next async accept operation if
         // acceptor has not been stopped yet.
         if (!m_isStopped.load())
         {
-            InitAccept();
+            if (m_park_accepts)
+            {
+                InitAcceptOrPark(listener);
+            }
+            else
+            {
+                InitAccept(listener);
+            }
         }
         else
         {
             // Stop accepting incoming connections
             // and free allocated resources.
-            m_acceptor.close();
+            // Other accept operations outstanding on this
+            // socket complete with operation_aborted.
+            boost::system::error_code ignored_ec;
+            listener.m_acceptor.close(ignored_ec);
+        }
+
+        m_pending_accepts.fetch_sub(1);
+    }
+
+    // While the server is saturated the accept operation is parked rather than
+    // initiated; new connections wait in the kernel's backlog meanwhile.
+    // The check is done under the lock so that a client finishing concurrently
+    // either sees the parked operation or lets us initiate it.
+    void InitAcceptOrPark(Listener &listener)
+    {
+        std::unique_lock<std::mutex> lock(m_parked_guard);
+
+        if (m_admission.IsSaturated())
+        {
+            m_parked.push_back(&listener);
+            m_num_parked.store(static_cast<unsigned int>(m_parked.size()));
+            lock.unlock();
+
+            // A client finishing meanwhile may have seen no parked listener,
+            // so the limit is checked again once the listener is counted.
+            if (!m_admission.IsSaturated())
+                ResumeAccepting();
+            return;
+        }
+
+        lock.unlock();
+
+        InitAccept(listener);
+    }
+
+    // Called whenever a client has been served. Parked accept operations are
+    // initiated again on their listener's strand.
+    void ResumeAccepting()
+    {
+        if (m_num_parked.load() == 0)
+            return;
+
+        std::unique_lock<std::mutex> lock(m_parked_guard);
+
+        while (!m_parked.empty() && !m_admission.IsSaturated() && !m_isStopped.load())
+        {
+            Listener *listener = m_parked.back();
+            m_parked.pop_back();
+
+            asio::post(listener->m_strand,
+                       [this, listener]()
+                       { InitAccept(*listener); });
         }
+
+        m_num_parked.store(static_cast<unsigned int>(m_parked.size()));
     }
 
 private:
-    asio::io_service &m_ios;
-    //used to asynchronously accept the incoming connection requests.
-    asio::ip::tcp::acceptor m_acceptor;
+    std::vector<std::unique_ptr<Listener>> m_listeners;
     std::atomic<bool> m_isStopped;
+
+    std::vector<std::unique_ptr<Shard>> &m_shards;
+    DispatchPolicy m_policy;
+    unsigned int m_accepts_per_listener;
+    std::atomic<unsigned int> m_next_shard;
+    std::atomic<unsigned int> m_pending_accepts;
+
+    AdmissionControl &m_admission;
+    OverloadPolicy m_overload_policy;
+    SocketProfile m_socket_profile;
+
+    // Listeners whose accept operation is parked until the server has capacity.
+    std::vector<Listener *> m_parked;
+    std::mutex m_parked_guard;
+
+    // Whether accept operations are parked while the server is saturated,
+    // and the number of listeners parked, read without taking the lock.
+    bool m_park_accepts;
+    std::atomic<unsigned int> m_num_parked;
 };
 
 //represents the server itself
 class Server
 {
 public:
-    Server()
-    {
-        m_work.reset(new asio::io_service::work(m_ios));
-    }
-
     // Start the server.
     // Accepts a protocol port number on which the server should listen for the incoming connection requests
     // and the number of threads to add to the pool as input arguments and starts the server
     // Nonblocking Method
     void Start(unsigned short port_num,
-               unsigned int thread_pool_size)
+               unsigned int thread_pool_size,
+               const ServerConfig &config = ServerConfig())
     {
 
         assert(thread_pool_size > 0);
 
+        config.socket_profile.Log(std::cout, false);
+
+        m_tracer.SetSlowThreshold(config.slow_request_threshold);
+        m_admission.reset(new AdmissionControl(config.max_in_flight));
+
+        // Requests are processed by a separate pool of
+        // threads, if the configuration asks for one.
+        if (config.compute_pool_size > 0)
+        {
+            m_compute_pool.reset(new ComputePool(config.compute_pool_size));
+        }
+
+        // In the per-core mode every thread gets an event loop
+        // of its own, otherwise all of them share a single one.
+        unsigned int num_shards =
+            config.per_core_shards ? thread_pool_size : 1;
+
+        for (unsigned int i = 0; i < num_shards; i++)
+        {
+            m_shards.emplace_back(new Shard(config, m_compute_pool.get(), *m_admission, m_stats, m_tracer, m_buffer_pool));
+        }
+
         // Create and start Acceptor.
-        acc.reset(new Acceptor(m_ios, port_num));
+        acc.reset(new Acceptor(port_num, m_shards, *m_admission, config));
         acc->Start();
 
         // Create specified number of threads and
         // add them to the pool.
-        for (unsigned int i = 0; i < thread_pool_size; i++)
+        if (config.per_core_shards)
         {
-            std::unique_ptr<std::thread> th(
-                new std::thread([this]()
-                                { m_ios.run(); }));
+            for (unsigned int i = 0; i < num_shards; i++)
+            {
+                m_shards[i]->Start(1, static_cast<int>(i));
+            }
+        }
+        else
+        {
+            m_shards.front()->Start(thread_pool_size, -1);
+        }
+    }
+
+    // Number of clients being served and number of connections refused
+    // with a busy reply, for load balancers to route around a saturated server.
+    unsigned int GetInFlightCount() const
+    {
+        return m_admission->GetInFlightCount();
+    }
+
+    unsigned long long GetRejectedCount() const
+    {
+        return m_admission->GetRejectedCount();
+    }
+
+    // Number of Service objects reused from the shards' pools
+    // and number of them allocated because the pools were empty.
+    unsigned long long GetPoolHits() const
+    {
+        unsigned long long hits = 0;
+        for (auto &shard : m_shards)
+        {
+            hits += shard->GetPoolHits();
+        }
+        return hits;
+    }
+
+    unsigned long long GetPoolMisses() const
+    {
+        unsigned long long misses = 0;
+        for (auto &shard : m_shards)
+        {
+            misses += shard->GetPoolMisses();
+        }
+        return misses;
+    }
+
+    // Outputs the latency percentiles and the counters of all the shards.
+    void DumpStats(std::ostream &os) const
+    {
+        m_stats.Dump(os);
+    }
+
+    // Outputs the traces of the slow requests in the Chrome trace event format.
+    void DumpSlowRequests(std::ostream &os) const
+    {
+        m_tracer.Dump(os);
+    }
+
+    // Number of clients connected, whether admitted or being
+    // refused with a busy reply.
+    unsigned int GetConnectionsCount() const
+    {
+        unsigned int connections = 0;
+        for (auto &shard : m_shards)
+        {
+            connections += shard->GetServicesCount();
+        }
+        return connections;
+    }
+
+    // Drains the server before it is stopped, e.g. for a rolling restart.
+    // New connections are no longer accepted, idle keep-alive connections
+    // are half-closed, and busy ones are half-closed once the requests in
+    // flight are answered, so that clients reconnect elsewhere without
+    // losing a response. Connections still open when the timeout runs out
+    // are closed. The progress is reported to os every second.
+    // Returns true if all the clients have been served in time.
+    bool Drain(std::chrono::milliseconds timeout, std::ostream &os)
+    {
+        std::chrono::steady_clock::time_point started_at = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point deadline = started_at + timeout;
+        std::chrono::steady_clock::time_point next_report = started_at;
+
+        acc->Stop();
+
+        for (auto &shard : m_shards)
+        {
+            shard->NotifyServices(false);
+        }
 
-            m_thread_pool.push_back(std::move(th));
+        unsigned int connections = GetConnectionsCount();
+        while (connections > 0 && std::chrono::steady_clock::now() < deadline)
+        {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (now >= next_report)
+            {
+                os << "Draining: " << connections << " connections left, "
+                   << std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count()
+                   << " ms to the deadline." << std::endl;
+                next_report += std::chrono::seconds(1);
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            connections = GetConnectionsCount();
+        }
+
+        if (connections > 0)
+        {
+            os << "Drain timed out: closing " << connections << " connections." << std::endl;
+            CloseConnections();
+            return false;
         }
+
+        os << "Drained in "
+           << std::chrono::duration_cast<std::chrono::milliseconds>(
+                  std::chrono::steady_clock::now() - started_at)
+                  .count()
+           << " ms." << std::endl;
+        return true;
     }
 
     // Stop the server.
     // Blocks the caller thread until the server is stopped and all the threads running the event loop exit.
+    // Connections left open, unless the server has been drained, are closed first.
     void Stop()
     {
         acc->Stop();
-        m_ios.stop();
+        CloseConnections();
 
-        for (auto &th : m_thread_pool)
+        for (auto &shard : m_shards)
         {
-            th->join();
+            shard->Stop();
+        }
+
+        if (m_compute_pool)
+        {
+            m_compute_pool->Stop();
         }
     }
 
 private:
-    asio::io_service m_ios;
-    std::unique_ptr<asio::io_service::work> m_work;
+    // Closes all the connections and waits until their Service objects, and
+    // those held by the aborted accept operations, are released, so that
+    // none is left behind when the event loops stop.
+    void CloseConnections()
+    {
+        for (auto &shard : m_shards)
+        {
+            shard->NotifyServices(true);
+        }
+
+        while (GetConnectionsCount() > 0 || acc->GetPendingAcceptsCount() > 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+private:
+    ServerStats m_stats;
+    RequestTracer m_tracer{"server"};
+    BufferPool m_buffer_pool;
+    std::unique_ptr<AdmissionControl> m_admission;
+    std::unique_ptr<ComputePool> m_compute_pool;
+    std::vector<std::unique_ptr<Shard>> m_shards;
     std::unique_ptr<Acceptor> acc;
-    std::vector<std::unique_ptr<std::thread>> m_thread_pool;
 };
 
 const unsigned int DEFAULT_THREAD_POOL_SIZE = 2;
@@ -287,8 +3199,15 @@ int main()
 
         srv.Start(port_num, thread_pool_size);
 
-        std::this_thread::sleep_for(std::chrono::seconds(60));
+        // Dump the statistics every 10 seconds for a minute.
+        for (int i = 0; i < 6; i++)
+        {
+            std::this_thread::sleep_for(std::chrono::seconds(10));
+            srv.DumpStats(std::cout);
+        }
 
+        // Let the clients being served finish before stopping.
+        srv.Drain(std::chrono::seconds(10), std::cout);
         srv.Stop();
     }
     catch (system::system_error &e)
@@ -14,11 +14,37 @@
 #endif
 #endif
 
+#include <utility> // Some Boost.Asio versions use std::exchange in awaitable.hpp without including it.
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/utility/string_view.hpp>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if BOOST_OS_LINUX
+#include <unistd.h>
+#include <netinet/tcp.h>
+#endif
 
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <string>
+#include <stdexcept>
+#include <vector>
+#include <list>
+#include <map>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
 #include <iostream>
 
 using namespace boost;
@@ -30,52 +56,1370 @@ namespace http_errors
         invalid_response = 1
     };
 
-    class http_errors_category
-        : public boost::system::error_category
+    class http_errors_category
+        : public boost::system::error_category
+    {
+    public:
+        const char *name() const BOOST_SYSTEM_NOEXCEPT { return "http_errors"; }
+
+        std::string message(int e) const
+        {
+            switch (e)
+            {
+            case invalid_response:
+                return "Server response cannot be parsed.";
+                break;
+            default:
+                return "Unknown error.";
+                break;
+            }
+        }
+    };
+
+    const boost::system::error_category &
+    get_http_errors_category()
+    {
+        static http_errors_category cat;
+        return cat;
+    }
+
+    boost::system::error_code
+    make_error_code(http_error_codes e)
+    {
+        return boost::system::error_code(
+            static_cast<int>(e), get_http_errors_category());
+    }
+} // namespace http_errors
+
+namespace boost
+{
+    namespace system
+    {
+        template <>
+        struct is_error_code_enum<http_errors::http_error_codes>
+        {
+            BOOST_STATIC_CONSTANT(bool, value = true);
+        };
+    } // namespace system
+} // namespace boost
+
+// Hierarchical timing wheel sharing a single asio::steady_timer among any
+// number of deadlines. Time is divided into ticks; a deadline is kept in one of
+// the 64 slots of the level covering its distance from the current tick, and
+// the deadlines of the higher levels are cascaded down as the wheel turns, so
+// arming and cancelling a deadline take constant time. The steady_timer only
+// runs while deadlines are armed, in order not to keep the event loop busy.
+class TimerWheel : public boost::noncopyable
+{
+public:
+    // A deadline embedded in the object it belongs to. Destroying it cancels it,
+    // waiting for its callback if the callback is running on another thread, so
+    // the owner may capture itself in the callback as long as the Timer member
+    // is declared after everything the callback uses.
+    class Timer : public boost::noncopyable
+    {
+    public:
+        Timer() : m_wheel(nullptr),
+                  m_prev(nullptr),
+                  m_next(nullptr),
+                  m_slot(nullptr),
+                  m_expiry(0),
+                  m_armed(false)
+        {
+        }
+
+        ~Timer()
+        {
+            if (m_wheel != nullptr)
+                m_wheel->Cancel(*this);
+        }
+
+    private:
+        friend class TimerWheel;
+
+        TimerWheel *m_wheel;
+        Timer *m_prev;
+        Timer *m_next;
+        Timer **m_slot;         // Head of the list the timer is in.
+        std::uint64_t m_expiry; // Tick to expire at.
+        bool m_armed;
+        std::function<void()> m_callback;
+    };
+
+    TimerWheel(asio::io_service &ios,
+               std::chrono::milliseconds tick = std::chrono::milliseconds(10)) : m_timer(ios),
+                                                                                  m_tick(tick),
+                                                                                  m_origin(std::chrono::steady_clock::now()),
+                                                                                  m_current_tick(0),
+                                                                                  m_num_armed(0),
+                                                                                  m_ticking(false),
+                                                                                  m_running(nullptr)
+    {
+        for (auto &level : m_slots)
+        {
+            for (auto &slot : level)
+            {
+                slot = nullptr;
+            }
+        }
+    }
+
+    ~TimerWheel()
+    {
+        boost::system::error_code ignored_ec;
+        m_timer.cancel(ignored_ec);
+    }
+
+    // Calls the callback on a thread running the event loop once the timeout
+    // has elapsed, rounded up to the tick. Re-arming an armed timer moves it.
+    void Arm(Timer &timer,
+             std::chrono::steady_clock::duration timeout,
+             std::function<void()> callback)
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        if (timer.m_armed)
+        {
+            Unlink(timer);
+            m_num_armed--;
+        }
+
+        if (!m_ticking)
+        {
+            // The wheel has been idle, catch up with the current time.
+            m_current_tick = GetTickAt(std::chrono::steady_clock::now());
+        }
+
+        std::uint64_t expiry = GetTickAt(std::chrono::steady_clock::now() + timeout + m_tick -
+                                         std::chrono::steady_clock::duration(1));
+
+        timer.m_wheel = this;
+        timer.m_expiry = expiry > m_current_tick ? expiry : m_current_tick + 1;
+        timer.m_callback = std::move(callback);
+        Link(timer);
+        m_num_armed++;
+
+        if (!m_ticking)
+        {
+            m_ticking = true;
+            ScheduleTick();
+        }
+    }
+
+    // Disarms the timer. If its callback is running on another
+    // thread, waits for the callback to return.
+    void Cancel(Timer &timer)
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        while (m_running == &timer && m_running_thread != std::this_thread::get_id())
+        {
+            m_callback_done.wait(lock);
+        }
+
+        if (timer.m_armed)
+        {
+            Unlink(timer);
+            m_num_armed--;
+            timer.m_callback = nullptr;
+        }
+    }
+
+private:
+    static const unsigned int LEVEL_BITS = 6;
+    static const unsigned int SLOT_COUNT = 1 << LEVEL_BITS;
+    static const unsigned int LEVEL_COUNT = 4;
+    static const std::uint64_t MAX_DISTANCE = (std::uint64_t(1) << (LEVEL_BITS * LEVEL_COUNT)) - 1;
+
+    std::uint64_t GetTickAt(std::chrono::steady_clock::time_point time) const
+    {
+        return static_cast<std::uint64_t>((time - m_origin) / m_tick);
+    }
+
+    // Puts the timer into the slot of the level covering its distance from
+    // the current tick. Timers further away than the last level covers are
+    // parked at its far end and placed again when cascaded.
+    void Link(Timer &timer)
+    {
+        std::uint64_t distance = timer.m_expiry - m_current_tick;
+        std::uint64_t expiry = distance > MAX_DISTANCE ? m_current_tick + MAX_DISTANCE
+                                                       : timer.m_expiry;
+
+        unsigned int level = 0;
+        while (level < LEVEL_COUNT - 1 &&
+               distance >= (std::uint64_t(1) << (LEVEL_BITS * (level + 1))))
+        {
+            level++;
+        }
+
+        Timer *&head = m_slots[level][(expiry >> (LEVEL_BITS * level)) & (SLOT_COUNT - 1)];
+
+        timer.m_prev = nullptr;
+        timer.m_next = head;
+        if (head != nullptr)
+            head->m_prev = &timer;
+        head = &timer;
+
+        timer.m_armed = true;
+        timer.m_slot = &head;
+    }
+
+    void Unlink(Timer &timer)
+    {
+        if (timer.m_prev != nullptr)
+            timer.m_prev->m_next = timer.m_next;
+        else
+            *timer.m_slot = timer.m_next;
+
+        if (timer.m_next != nullptr)
+            timer.m_next->m_prev = timer.m_prev;
+
+        timer.m_prev = nullptr;
+        timer.m_next = nullptr;
+        timer.m_armed = false;
+    }
+
+    void ScheduleTick()
+    {
+        m_timer.expires_at(m_origin + m_tick * static_cast<std::int64_t>(m_current_tick + 1));
+        m_timer.async_wait([this](const boost::system::error_code &ec)
+                           {
+                               if (ec != asio::error::operation_aborted)
+                                   onTick();
+                           });
+    }
+
+    // Advances the wheel up to the current time, firing the timers
+    // that have expired. The callbacks are called without holding the lock,
+    // so that they may arm and cancel timers themselves.
+    void onTick()
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        std::uint64_t now_tick = GetTickAt(std::chrono::steady_clock::now());
+
+        while (m_current_tick < now_tick && m_num_armed > 0)
+        {
+            m_current_tick++;
+
+            // Cascade the slots of the higher levels whose time has come.
+            for (unsigned int level = 1; level < LEVEL_COUNT; level++)
+            {
+                if ((m_current_tick & ((std::uint64_t(1) << (LEVEL_BITS * level)) - 1)) != 0)
+                    break;
+
+                Cascade(level, (m_current_tick >> (LEVEL_BITS * level)) & (SLOT_COUNT - 1));
+            }
+
+            Timer *&head = m_slots[0][m_current_tick & (SLOT_COUNT - 1)];
+            while (head != nullptr)
+            {
+                Timer &timer = *head;
+                Unlink(timer);
+
+                if (timer.m_expiry > m_current_tick)
+                {
+                    // Parked at the far end of the last level.
+                    Link(timer);
+                    continue;
+                }
+
+                m_num_armed--;
+                std::function<void()> callback = std::move(timer.m_callback);
+                timer.m_callback = nullptr;
+
+                m_running = &timer;
+                m_running_thread = std::this_thread::get_id();
+                lock.unlock();
+
+                callback();
+
+                lock.lock();
+                m_running = nullptr;
+                m_callback_done.notify_all();
+            }
+        }
+
+        if (m_num_armed > 0)
+        {
+            ScheduleTick();
+        }
+        else
+        {
+            m_ticking = false;
+        }
+    }
+
+    void Cascade(unsigned int level, std::uint64_t slot)
+    {
+        Timer *head = m_slots[level][slot];
+        m_slots[level][slot] = nullptr;
+
+        while (head != nullptr)
+        {
+            Timer *next = head->m_next;
+            Link(*head);
+            head = next;
+        }
+    }
+
+private:
+    asio::steady_timer m_timer;
+    std::chrono::steady_clock::duration m_tick;
+    std::chrono::steady_clock::time_point m_origin;
+
+    Timer *m_slots[LEVEL_COUNT][SLOT_COUNT];
+    std::uint64_t m_current_tick;
+    std::size_t m_num_armed;
+    bool m_ticking;
+
+    // The timer whose callback is running, if any.
+    Timer *m_running;
+    std::thread::id m_running_thread;
+    std::condition_variable m_callback_done;
+
+    std::mutex m_guard;
+};
+
+// Headers of an HTTP message kept as slices of the buffer the message head
+// was parsed from, in a flat array searched linearly; messages rarely carry
+// more than a few dozen headers. The slices are offsets into the buffer, so
+// the buffer may be moved as long as rebase() is called afterwards.
+class HTTPHeaders
+{
+    friend class HTTPParser;
+
+public:
+    static const std::size_t MAX_HEADERS = 64;
+
+    HTTPHeaders() : m_base(nullptr),
+                    m_count(0)
+    {
+    }
+
+    std::size_t size() const
+    {
+        return m_count;
+    }
+
+    boost::string_view name(std::size_t i) const
+    {
+        return view(m_names[i]);
+    }
+
+    boost::string_view value(std::size_t i) const
+    {
+        return view(m_values[i]);
+    }
+
+    // Value of the first header with the name, compared case-insensitively,
+    // without the surrounding whitespace. Empty if there is no such header.
+    boost::string_view find(boost::string_view name) const
+    {
+        for (std::size_t i = 0; i < m_count; i++)
+        {
+            if (equals_no_case(view(m_names[i]), name))
+                return view(m_values[i]);
+        }
+
+        return boost::string_view();
+    }
+
+    // Points the slices to a copy of the buffer they were parsed from.
+    void rebase(const char *base)
+    {
+        m_base = base;
+    }
+
+    static bool equals_no_case(boost::string_view a, boost::string_view b)
+    {
+        if (a.size() != b.size())
+            return false;
+
+        for (std::size_t i = 0; i < a.size(); i++)
+        {
+            if (std::tolower(static_cast<unsigned char>(a[i])) !=
+                std::tolower(static_cast<unsigned char>(b[i])))
+                return false;
+        }
+
+        return true;
+    }
+
+private:
+    struct Span
+    {
+        std::uint32_t m_offset;
+        std::uint32_t m_size;
+    };
+
+    boost::string_view view(const Span &span) const
+    {
+        return boost::string_view(m_base + span.m_offset, span.m_size);
+    }
+
+private:
+    const char *m_base;
+    Span m_names[MAX_HEADERS];
+    Span m_values[MAX_HEADERS];
+    std::size_t m_count;
+};
+
+// Incremental parser of the head of an HTTP/1.1 request or response: the
+// start line and the headers up to the empty line. It works in place on the
+// bytes received so far and is resumable; each call to parse() scans only the
+// bytes that have arrived since the previous call. The results are slices of
+// the buffer passed to the last call, valid while the buffer is unchanged.
+class HTTPParser
+{
+public:
+    enum class Kind
+    {
+        Request,
+        Response
+    };
+
+    enum class Result
+    {
+        Done,     // The whole head has been parsed.
+        NeedMore, // The head is incomplete, call again once more data arrives.
+        Invalid   // The head is malformed or has too many headers.
+    };
+
+    explicit HTTPParser(Kind kind) : m_kind(kind)
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        m_data = nullptr;
+        m_pos = 0;
+        m_scan = 0;
+        m_start_line_done = false;
+        m_done = false;
+        m_status_code = 0;
+        m_headers.m_base = nullptr;
+        m_headers.m_count = 0;
+    }
+
+    // data and size designate all the bytes of the message received so far.
+    // The buffer may have been moved since the previous call.
+    Result parse(const char *data, std::size_t size)
+    {
+        m_data = data;
+        m_headers.m_base = data;
+
+        while (!m_done)
+        {
+            const char *line_end = find_byte(data + m_scan, data + size, '\n');
+            if (line_end == data + size)
+            {
+                m_scan = size;
+                return Result::NeedMore;
+            }
+
+            std::size_t line_begin = m_pos;
+            std::size_t line_size = (line_end - data) - line_begin;
+            if (line_size > 0 && data[line_begin + line_size - 1] == '\r')
+                line_size--;
+
+            m_pos = m_scan = (line_end - data) + 1;
+
+            if (!m_start_line_done)
+            {
+                // Empty lines preceding a request are ignored.
+                if (line_size == 0 && m_kind == Kind::Request)
+                    continue;
+
+                if (!parse_start_line(line_begin, line_size))
+                    return Result::Invalid;
+
+                m_start_line_done = true;
+            }
+            else if (line_size == 0)
+            {
+                m_done = true;
+            }
+            else if (!parse_header(line_begin, line_size))
+            {
+                return Result::Invalid;
+            }
+        }
+
+        return Result::Done;
+    }
+
+    // Size of the head including the empty line, once parsed.
+    std::size_t head_size() const
+    {
+        return m_pos;
+    }
+
+    // Request line.
+    boost::string_view method() const
+    {
+        return view(m_first);
+    }
+
+    boost::string_view uri() const
+    {
+        return view(m_second);
+    }
+
+    // Status line.
+    unsigned int status_code() const
+    {
+        return m_status_code;
+    }
+
+    boost::string_view reason() const
+    {
+        return view(m_third);
+    }
+
+    boost::string_view version() const
+    {
+        return m_kind == Kind::Request ? view(m_third) : view(m_first);
+    }
+
+    const HTTPHeaders &headers() const
+    {
+        return m_headers;
+    }
+
+private:
+    typedef HTTPHeaders::Span Span;
+
+    boost::string_view view(const Span &span) const
+    {
+        return boost::string_view(m_data + span.m_offset, span.m_size);
+    }
+
+    static Span make_span(std::size_t offset, std::size_t size)
+    {
+        Span span;
+        span.m_offset = static_cast<std::uint32_t>(offset);
+        span.m_size = static_cast<std::uint32_t>(size);
+
+        return span;
+    }
+
+    // Returns the first occurrence of c in [begin, end), or end. Compares
+    // 16 bytes at a time with SSE2 where it is available.
+    static const char *find_byte(const char *begin, const char *end, char c)
+    {
+#if defined(__SSE2__)
+        const __m128i pattern = _mm_set1_epi8(c);
+
+        while (end - begin >= 16)
+        {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(begin));
+            int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, pattern));
+            if (mask != 0)
+                return begin + __builtin_ctz(mask);
+
+            begin += 16;
+        }
+#endif
+        const void *found = std::memchr(begin, c, end - begin);
+
+        return found != nullptr ? static_cast<const char *>(found) : end;
+    }
+
+    // "METHOD SP URI SP VERSION" or "VERSION SP CODE [SP REASON]".
+    bool parse_start_line(std::size_t begin, std::size_t size)
+    {
+        const char *line = m_data + begin;
+        const char *line_end = line + size;
+
+        const char *first_space = find_byte(line, line_end, ' ');
+        if (first_space == line || first_space == line_end)
+            return false;
+
+        m_first = make_span(begin, first_space - line);
+
+        if (m_kind == Kind::Request)
+        {
+            const char *uri = first_space + 1;
+            const char *second_space = find_byte(uri, line_end, ' ');
+            if (second_space == uri || second_space == line_end ||
+                second_space + 1 == line_end)
+                return false;
+
+            m_second = make_span(uri - m_data, second_space - uri);
+            m_third = make_span(second_space + 1 - m_data, line_end - second_space - 1);
+
+            return view(m_third).starts_with("HTTP/");
+        }
+
+        if (!view(m_first).starts_with("HTTP/"))
+            return false;
+
+        const char *code = first_space + 1;
+        if (line_end - code < 3 ||
+            (line_end - code > 3 && code[3] != ' '))
+            return false;
+
+        m_status_code = 0;
+        for (int i = 0; i < 3; i++)
+        {
+            if (code[i] < '0' || code[i] > '9')
+                return false;
+
+            m_status_code = m_status_code * 10 + (code[i] - '0');
+        }
+
+        m_second = make_span(code - m_data, 3);
+
+        const char *reason = line_end - code > 3 ? code + 4 : line_end;
+        m_third = make_span(reason - m_data, line_end - reason);
+
+        return true;
+    }
+
+    // "NAME: VALUE", the value surrounded by optional whitespace.
+    bool parse_header(std::size_t begin, std::size_t size)
+    {
+        if (m_headers.m_count == HTTPHeaders::MAX_HEADERS)
+            return false;
+
+        const char *line = m_data + begin;
+        const char *line_end = line + size;
+
+        // A line beginning with whitespace continues the previous header's
+        // value (obsolete line folding), which is no longer allowed.
+        if (line[0] == ' ' || line[0] == '\t')
+            return false;
+
+        const char *colon = find_byte(line, line_end, ':');
+        if (colon == line || colon == line_end ||
+            colon[-1] == ' ' || colon[-1] == '\t')
+            return false;
+
+        const char *value = colon + 1;
+        while (value < line_end && (*value == ' ' || *value == '\t'))
+            value++;
+
+        const char *value_end = line_end;
+        while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+            value_end--;
+
+        m_headers.m_names[m_headers.m_count] = make_span(begin, colon - line);
+        m_headers.m_values[m_headers.m_count] = make_span(value - m_data, value_end - value);
+        m_headers.m_count++;
+
+        return true;
+    }
+
+private:
+    Kind m_kind;
+
+    const char *m_data; // Buffer passed to the last call.
+    std::size_t m_pos;  // Beginning of the first line not parsed yet.
+    std::size_t m_scan; // Where to continue looking for the end of the line.
+    bool m_start_line_done;
+    bool m_done;
+
+    // Method, URI and version of a request;
+    // version, status code and reason of a response.
+    Span m_first;
+    Span m_second;
+    Span m_third;
+    unsigned int m_status_code;
+
+    HTTPHeaders m_headers;
+};
+
+// Cache of the endpoints the host names resolve to. The resolver does not
+// report the TTLs of the DNS records, so an entry is kept for a fixed time.
+class ResolverCache : public boost::noncopyable
+{
+public:
+    ResolverCache(std::chrono::seconds ttl) : m_ttl(ttl)
+    {
+    }
+
+    // Copies the endpoints of the host into endpoints if
+    // they have been resolved less than the TTL ago.
+    bool Find(const std::string &key,
+              std::vector<asio::ip::tcp::endpoint> &endpoints)
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        auto it = m_entries.find(key);
+        if (it == m_entries.end())
+            return false;
+
+        if (it->second.m_expiry <= std::chrono::steady_clock::now())
+        {
+            m_entries.erase(it);
+            return false;
+        }
+
+        endpoints = it->second.m_endpoints;
+        return true;
+    }
+
+    void Insert(const std::string &key,
+                const std::vector<asio::ip::tcp::endpoint> &endpoints)
+    {
+        if (m_ttl.count() == 0)
+            return;
+
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        Entry &entry = m_entries[key];
+        entry.m_endpoints = endpoints;
+        entry.m_expiry = std::chrono::steady_clock::now() + m_ttl;
+    }
+
+    // Forgets the endpoints of a host none of which could be connected to.
+    void Remove(const std::string &key)
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        m_entries.erase(key);
+    }
+
+private:
+    struct Entry
+    {
+        std::vector<asio::ip::tcp::endpoint> m_endpoints;
+        std::chrono::steady_clock::time_point m_expiry;
+    };
+
+    std::chrono::seconds m_ttl;
+    std::map<std::string, Entry> m_entries; // Keyed by host:port.
+    std::mutex m_guard;
+};
+
+// Per host:port pool of HTTP/1.1 keep-alive connections. A request checks a
+// connection out instead of connecting and checks it back in once the whole
+// response has been read. At most max_idle_per_host connections are kept
+// per host, each for at most idle_timeout.
+class ConnectionPool : public boost::noncopyable
+{
+public:
+    ConnectionPool(TimerWheel &wheel,
+                   unsigned int max_idle_per_host,
+                   std::chrono::milliseconds idle_timeout) : m_wheel(wheel),
+                                                             m_max_idle_per_host(max_idle_per_host),
+                                                             m_idle_timeout(idle_timeout),
+                                                             m_closed(false)
+    {
+    }
+
+    // Moves a healthy idle connection to the host into sock if there is one.
+    bool CheckOut(const std::string &key,
+                  asio::ip::tcp::socket &sock)
+    {
+        // The connections taken out of the pool are destroyed after the lock
+        // is released, since destroying them cancels their idle timers.
+        std::list<IdleConnection> taken;
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        auto host = m_hosts.find(key);
+        if (host == m_hosts.end())
+            return false;
+
+        while (!host->second.empty())
+        {
+            taken.splice(taken.begin(), host->second, std::prev(host->second.end()));
+            IdleConnection &connection = taken.front();
+            connection.m_in_pool = false;
+
+            if (IsHealthy(connection.m_sock))
+            {
+                sock = std::move(connection.m_sock);
+                return true;
+            }
+
+            // The server has closed the connection meanwhile.
+            boost::system::error_code ignored_ec;
+            connection.m_sock.close(ignored_ec);
+        }
+
+        return false;
+    }
+
+    // Returns a connection whose response has been fully read.
+    // It is closed if the host has enough idle connections.
+    void CheckIn(const std::string &key,
+                 asio::ip::tcp::socket &sock)
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+        std::list<IdleConnection> &idle = m_hosts[key];
+
+        if (m_closed || idle.size() >= m_max_idle_per_host)
+        {
+            boost::system::error_code ignored_ec;
+            sock.close(ignored_ec);
+            return;
+        }
+
+        idle.emplace_back(std::move(sock));
+
+        if (m_idle_timeout.count() > 0)
+        {
+            auto it = std::prev(idle.end());
+            m_wheel.Arm(it->m_idle_timer,
+                        m_idle_timeout,
+                        [this, &idle, it]()
+                        { onIdleTimeout(idle, it); });
+        }
+    }
+
+    // Closes all the idle connections, cancelling their idle timers,
+    // and the connections checked in from now on.
+    void Close()
+    {
+        std::map<std::string, std::list<IdleConnection>> hosts;
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        m_closed = true;
+
+        for (auto &host : m_hosts)
+        {
+            for (auto &connection : host.second)
+            {
+                connection.m_in_pool = false;
+            }
+        }
+
+        hosts.swap(m_hosts);
+        lock.unlock();
+    }
+
+private:
+    struct IdleConnection
+    {
+        IdleConnection(asio::ip::tcp::socket &&sock) : m_sock(std::move(sock)),
+                                                       m_in_pool(true)
+        {
+        }
+
+        asio::ip::tcp::socket m_sock;
+        bool m_in_pool;
+        TimerWheel::Timer m_idle_timer; // Declared last to be cancelled first.
+    };
+
+    // An idle connection must have nothing to read: a zero-length
+    // read means the server has closed it, and unsolicited data means
+    // the connection is out of step with the protocol.
+    static bool IsHealthy(asio::ip::tcp::socket &sock)
+    {
+        boost::system::error_code ec;
+        char byte;
+
+        sock.non_blocking(true, ec);
+        if (ec.value() != 0)
+            return false;
+
+        sock.receive(asio::buffer(&byte, 1), asio::socket_base::message_peek, ec);
+
+        return ec == asio::error::would_block;
+    }
+
+    // The connection may have been checked out while the timer was expiring;
+    // its node is alive until the timer's callback returns, either in the pool
+    // or in the list being destroyed by CheckOut() or Close().
+    void onIdleTimeout(std::list<IdleConnection> &idle,
+                       std::list<IdleConnection>::iterator it)
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        if (!it->m_in_pool)
+            return;
+
+        boost::system::error_code ignored_ec;
+        it->m_sock.close(ignored_ec);
+        idle.erase(it);
+    }
+
+private:
+    TimerWheel &m_wheel;
+    unsigned int m_max_idle_per_host;
+    std::chrono::milliseconds m_idle_timeout;
+
+    // Most recently returned connections last.
+    std::map<std::string, std::list<IdleConnection>> m_hosts;
+    bool m_closed;
+    std::mutex m_guard;
+};
+
+// Integer socket option meeting the Boost.Asio requirements for
+// socket options, for the options it provides no class for.
+template <int Level, int Name>
+class IntegerSocketOption
+{
+public:
+    IntegerSocketOption() : m_value(0)
+    {
+    }
+
+    explicit IntegerSocketOption(int value) : m_value(value)
+    {
+    }
+
+    int value() const
+    {
+        return m_value;
+    }
+
+    template <typename Protocol>
+    int level(const Protocol &) const
+    {
+        return Level;
+    }
+
+    template <typename Protocol>
+    int name(const Protocol &) const
+    {
+        return Name;
+    }
+
+    template <typename Protocol>
+    int *data(const Protocol &)
+    {
+        return &m_value;
+    }
+
+    template <typename Protocol>
+    const int *data(const Protocol &) const
+    {
+        return &m_value;
+    }
+
+    template <typename Protocol>
+    std::size_t size(const Protocol &) const
+    {
+        return sizeof(m_value);
+    }
+
+    template <typename Protocol>
+    void resize(const Protocol &, std::size_t size)
+    {
+        if (size != sizeof(m_value))
+            throw std::length_error("IntegerSocketOption resize");
+    }
+
+private:
+    int m_value;
+};
+
+// Socket options applied to every connection of the client.
+// Zero and false leave the system defaults in place, so a default
+// constructed profile changes nothing. The options are applied on a best
+// effort basis: one the system refuses or does not support is skipped,
+// which Log() makes visible by printing the values in effect.
+struct SocketProfile
+{
+    std::string name = "default";
+
+    bool no_delay = false;           // TCP_NODELAY: disable Nagle's algorithm.
+    int receive_buffer_size = 0;     // SO_RCVBUF in bytes.
+    int send_buffer_size = 0;        // SO_SNDBUF in bytes.
+    bool keep_alive = false;         // SO_KEEPALIVE together with the three below.
+    int keep_alive_idle_sec = 0;     // TCP_KEEPIDLE
+    int keep_alive_interval_sec = 0; // TCP_KEEPINTVL
+    int keep_alive_count = 0;        // TCP_KEEPCNT
+    bool quick_ack = false;          // TCP_QUICKACK, only in effect until the kernel leaves the quick ack mode.
+    int fast_open = 0;               // Non-zero enables TCP_FASTOPEN_CONNECT.
+    int busy_poll_us = 0;            // SO_BUSY_POLL; raising it above net.core.busy_read needs CAP_NET_ADMIN.
+
+    // Small request/response exchanges: segments go out at once, acks are
+    // not delayed, and the receiving thread spins briefly on the device queue.
+    static SocketProfile LowLatencyRpc()
+    {
+        SocketProfile profile;
+        profile.name = "low-latency-rpc";
+        profile.no_delay = true;
+        profile.keep_alive = true;
+        profile.keep_alive_idle_sec = 60;
+        profile.keep_alive_interval_sec = 10;
+        profile.keep_alive_count = 5;
+        profile.quick_ack = true;
+        profile.fast_open = 256;
+        profile.busy_poll_us = 50;
+
+        return profile;
+    }
+
+    // Large transfers: buffers big enough to keep a long fat pipe full.
+    static SocketProfile BulkTransfer()
+    {
+        SocketProfile profile;
+        profile.name = "bulk-transfer";
+        profile.receive_buffer_size = 4 * 1024 * 1024;
+        profile.send_buffer_size = 4 * 1024 * 1024;
+        profile.keep_alive = true;
+        profile.keep_alive_idle_sec = 60;
+        profile.keep_alive_interval_sec = 10;
+        profile.keep_alive_count = 5;
+
+        return profile;
+    }
+
+    // Called for a socket once it has been opened and before it is connected.
+    void ApplyToConnection(asio::ip::tcp::socket &sock) const
+    {
+        boost::system::error_code ignored_ec;
+
+        if (no_delay)
+            sock.set_option(asio::ip::tcp::no_delay(true), ignored_ec);
+
+        if (receive_buffer_size > 0)
+            sock.set_option(asio::socket_base::receive_buffer_size(receive_buffer_size), ignored_ec);
+
+        if (send_buffer_size > 0)
+            sock.set_option(asio::socket_base::send_buffer_size(send_buffer_size), ignored_ec);
+
+        if (keep_alive)
+            sock.set_option(asio::socket_base::keep_alive(true), ignored_ec);
+
+#if BOOST_OS_LINUX
+        if (keep_alive && keep_alive_idle_sec > 0)
+            sock.set_option(IntegerSocketOption<IPPROTO_TCP, TCP_KEEPIDLE>(keep_alive_idle_sec), ignored_ec);
+
+        if (keep_alive && keep_alive_interval_sec > 0)
+            sock.set_option(IntegerSocketOption<IPPROTO_TCP, TCP_KEEPINTVL>(keep_alive_interval_sec), ignored_ec);
+
+        if (keep_alive && keep_alive_count > 0)
+            sock.set_option(IntegerSocketOption<IPPROTO_TCP, TCP_KEEPCNT>(keep_alive_count), ignored_ec);
+
+        if (quick_ack)
+            sock.set_option(IntegerSocketOption<IPPROTO_TCP, TCP_QUICKACK>(1), ignored_ec);
+
+        if (busy_poll_us > 0)
+            sock.set_option(IntegerSocketOption<SOL_SOCKET, SO_BUSY_POLL>(busy_poll_us), ignored_ec);
+
+#if defined(TCP_FASTOPEN_CONNECT)
+        // The SYN carries the first write once the server has issued a cookie.
+        if (fast_open > 0)
+            sock.set_option(IntegerSocketOption<IPPROTO_TCP, TCP_FASTOPEN_CONNECT>(1), ignored_ec);
+#endif
+#endif
+    }
+
+    // Applies the profile to a scratch socket and outputs the values
+    // the system has put into effect next to the requested ones.
+    void Log(std::ostream &os) const
+    {
+        asio::io_service ios;
+        asio::ip::tcp::socket probe(ios);
+        boost::system::error_code ec;
+
+        probe.open(asio::ip::tcp::v4(), ec);
+        if (ec.value() != 0)
+        {
+            os << "Socket profile " << name << ": cannot open a socket. Message: "
+               << ec.message() << std::endl;
+            return;
+        }
+
+        ApplyToConnection(probe);
+
+        os << "Socket profile " << name << ':';
+
+        asio::ip::tcp::no_delay no_delay_value;
+        probe.get_option(no_delay_value, ec);
+        LogValue(os, "no_delay", ec ? -1 : no_delay_value.value(), no_delay);
+
+        asio::socket_base::receive_buffer_size receive_buffer_size_value;
+        probe.get_option(receive_buffer_size_value, ec);
+        LogValue(os, "receive_buffer_size", ec ? -1 : receive_buffer_size_value.value(), receive_buffer_size);
+
+        asio::socket_base::send_buffer_size send_buffer_size_value;
+        probe.get_option(send_buffer_size_value, ec);
+        LogValue(os, "send_buffer_size", ec ? -1 : send_buffer_size_value.value(), send_buffer_size);
+
+        asio::socket_base::keep_alive keep_alive_value;
+        probe.get_option(keep_alive_value, ec);
+        LogValue(os, "keep_alive", ec ? -1 : keep_alive_value.value(), keep_alive);
+
+#if BOOST_OS_LINUX
+        LogValue(os, "keep_alive_idle_sec", GetInteger<IPPROTO_TCP, TCP_KEEPIDLE>(probe), keep_alive_idle_sec);
+        LogValue(os, "keep_alive_interval_sec", GetInteger<IPPROTO_TCP, TCP_KEEPINTVL>(probe), keep_alive_interval_sec);
+        LogValue(os, "keep_alive_count", GetInteger<IPPROTO_TCP, TCP_KEEPCNT>(probe), keep_alive_count);
+        LogValue(os, "quick_ack", GetInteger<IPPROTO_TCP, TCP_QUICKACK>(probe), quick_ack);
+        LogValue(os, "busy_poll_us", GetInteger<SOL_SOCKET, SO_BUSY_POLL>(probe), busy_poll_us);
+#if defined(TCP_FASTOPEN_CONNECT)
+        LogValue(os, "fast_open", GetInteger<IPPROTO_TCP, TCP_FASTOPEN_CONNECT>(probe), fast_open > 0);
+#endif
+#endif
+        os << std::endl;
+    }
+
+private:
+    template <int Level, int Name>
+    static int GetInteger(asio::ip::tcp::socket &sock)
+    {
+        IntegerSocketOption<Level, Name> option;
+        boost::system::error_code ec;
+        sock.get_option(option, ec);
+
+        return ec ? -1 : option.value();
+    }
+
+    // A value of -1 means the option could not be read.
+    static void LogValue(std::ostream &os, const char *option, int effective, int requested)
+    {
+        os << ' ' << option << '=' << effective;
+        if (requested != 0 && effective != requested)
+            os << " (requested " << requested << ')';
+    }
+};
+
+// Phase timestamps of requests, telling where the time of a slow request
+// goes. A request records when each of its phases begins and ends into a
+// Trace embedded in the object handling it. Once the request completes, the
+// trace is copied into the ring buffer of the completing thread if the
+// request took at least the slow request threshold. While the threshold is
+// zero, the default, nothing is recorded and a request costs a single relaxed
+// load. Dump() outputs the sampled requests in the Chrome trace event format,
+// which chrome://tracing and Perfetto load. The timestamps are those of
+// std::chrono::steady_clock, so the dumps of clients and servers running on
+// the same host line up when loaded together.
+class RequestTracer : public boost::noncopyable
+{
+public:
+    enum Phase
+    {
+        Resolve, // Resolving the host name.
+        Connect, // Connecting to the server.
+        Write,   // Sending the request.
+        Wait,    // Waiting for the first byte of the response.
+        Read,    // Receiving the rest of the response.
+        PHASE_COUNT
+    };
+
+    class Trace
+    {
+    public:
+        Trace() : m_active(false)
+        {
+        }
+
+    private:
+        friend class RequestTracer;
+
+        bool m_active;
+        std::uint64_t m_id;
+        std::int64_t m_started_at;
+        std::int64_t m_begin[PHASE_COUNT]; // Negative until recorded.
+        std::int64_t m_end[PHASE_COUNT];
+    };
+
+    // The name labels the process in the trace viewer.
+    explicit RequestTracer(const std::string &name) : m_name(name),
+                                                      m_threshold_ns(0),
+                                                      m_next_id(1),
+                                                      m_rings(RING_COUNT)
+    {
+    }
+
+    // Requests taking at least the threshold are sampled. Zero disables the tracing.
+    void SetSlowThreshold(std::chrono::microseconds threshold)
+    {
+        m_threshold_ns.store(std::chrono::duration_cast<std::chrono::nanoseconds>(threshold).count(),
+                             std::memory_order_relaxed);
+    }
+
+    // Starts tracing a request. The identifier, assigned by the tracer
+    // when it is zero, names the request's row in the trace viewer.
+    void Start(Trace &trace, std::uint64_t id = 0)
+    {
+        trace.m_active = m_threshold_ns.load(std::memory_order_relaxed) > 0;
+        if (!trace.m_active)
+            return;
+
+        trace.m_id = id != 0 ? id : m_next_id.fetch_add(1, std::memory_order_relaxed);
+        trace.m_started_at = Now();
+        std::fill(std::begin(trace.m_begin), std::end(trace.m_begin), -1);
+        std::fill(std::begin(trace.m_end), std::end(trace.m_end), -1);
+    }
+
+    // A phase repeated by a request, e.g. when it is retried, spans
+    // from the first time it begins to the last time it ends.
+    void Begin(Trace &trace, Phase phase)
+    {
+        if (trace.m_active && trace.m_begin[phase] < 0)
+            trace.m_begin[phase] = Now();
+    }
+
+    void End(Trace &trace, Phase phase)
+    {
+        if (trace.m_active)
+            trace.m_end[phase] = Now();
+    }
+
+    // Completes the trace and samples it if the request was slow.
+    void Finish(Trace &trace)
+    {
+        if (!trace.m_active)
+            return;
+
+        trace.m_active = false;
+
+        std::int64_t finished_at = Now();
+        std::int64_t threshold = m_threshold_ns.load(std::memory_order_relaxed);
+        if (threshold == 0 || finished_at - trace.m_started_at < threshold)
+            return;
+
+        std::int64_t values[VALUE_COUNT];
+        values[0] = static_cast<std::int64_t>(trace.m_id);
+        values[1] = trace.m_started_at;
+        values[2] = finished_at;
+        std::copy(std::begin(trace.m_begin), std::end(trace.m_begin), values + 3);
+        std::copy(std::begin(trace.m_end), std::end(trace.m_end), values + 3 + PHASE_COUNT);
+
+        GetRing().Push(values);
+    }
+
+    // Outputs the sampled requests as a JSON trace. Every request is a row of
+    // its own, where the event spanning the whole request encloses the events
+    // of its phases. The rings keep the last requests sampled by every thread.
+    void Dump(std::ostream &os) const
+    {
+        static const char *phase_names[PHASE_COUNT] = {"resolve", "connect", "write", "wait", "read"};
+
+        int pid = GetProcessId();
+        os << "{\"traceEvents\":[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pid
+           << ",\"args\":{\"name\":\"" << m_name << "\"}}";
+
+        for (const Ring &ring : m_rings)
+        {
+            for (const Slot &slot : ring.m_slots)
+            {
+                std::int64_t values[VALUE_COUNT];
+                if (!ReadSlot(slot, values))
+                    continue;
+
+                std::int64_t id = values[0];
+                WriteEvent(os, "request", pid, id, values[1], values[2]);
+
+                for (int phase = 0; phase < PHASE_COUNT; phase++)
+                {
+                    std::int64_t begin = values[3 + phase];
+                    std::int64_t end = values[3 + PHASE_COUNT + phase];
+                    if (begin >= 0 && end >= begin)
+                        WriteEvent(os, phase_names[phase], pid, id, begin, end);
+                }
+            }
+        }
+
+        os << "]}" << std::endl;
+    }
+
+private:
+    static const unsigned int RING_COUNT = 16;
+    static const unsigned int RING_SIZE = 256;
+    static const unsigned int VALUE_COUNT = 3 + 2 * PHASE_COUNT; // Id, start, finish, phases.
+
+    // A slot guarded by a sequence lock. The sequence number is odd while the
+    // slot is written; a reader seeing it odd, or changed once the values are
+    // copied, skips the slot instead of waiting for the writer.
+    struct Slot
+    {
+        Slot() : m_sequence(0)
+        {
+            for (auto &value : m_values)
+            {
+                value.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        std::atomic<std::uint64_t> m_sequence;
+        std::atomic<std::int64_t> m_values[VALUE_COUNT];
+    };
+
+    // Ring buffer of the threads assigned to it, usually a single one.
+    // The slots are claimed with an atomic increment, so threads sharing
+    // a ring never wait for one another either.
+    struct Ring
     {
-    public:
-        const char *name() const BOOST_SYSTEM_NOEXCEPT { return "http_errors"; }
+        Ring() : m_next(0)
+        {
+        }
 
-        std::string message(int e) const
+        void Push(const std::int64_t *values)
         {
-            switch (e)
+            std::uint64_t ticket = m_next.fetch_add(1, std::memory_order_relaxed);
+            Slot &slot = m_slots[ticket % RING_SIZE];
+
+            slot.m_sequence.store(2 * ticket + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+
+            for (unsigned int i = 0; i < VALUE_COUNT; i++)
             {
-            case invalid_response:
-                return "Server response cannot be parsed.";
-                break;
-            default:
-                return "Unknown error.";
-                break;
+                slot.m_values[i].store(values[i], std::memory_order_relaxed);
             }
+
+            slot.m_sequence.store(2 * ticket + 2, std::memory_order_release);
         }
+
+        std::atomic<std::uint64_t> m_next;
+        Slot m_slots[RING_SIZE];
     };
 
-    const boost::system::error_category &
-    get_http_errors_category()
+    static bool ReadSlot(const Slot &slot, std::int64_t *values)
     {
-        static http_errors_category cat;
-        return cat;
+        std::uint64_t sequence = slot.m_sequence.load(std::memory_order_acquire);
+        if (sequence == 0 || sequence % 2 != 0)
+            return false;
+
+        for (unsigned int i = 0; i < VALUE_COUNT; i++)
+        {
+            values[i] = slot.m_values[i].load(std::memory_order_relaxed);
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return slot.m_sequence.load(std::memory_order_relaxed) == sequence;
     }
 
-    boost::system::error_code
-    make_error_code(http_error_codes e)
+    // A complete event; the timestamps are converted to microseconds. Both
+    // ends are truncated rather than the duration, so that the events of the
+    // phases do not stick out of the event of the request.
+    static void WriteEvent(std::ostream &os, const char *name, int pid, std::int64_t id,
+                           std::int64_t begin, std::int64_t end)
     {
-        return boost::system::error_code(
-            static_cast<int>(e), get_http_errors_category());
+        os << ",{\"name\":\"" << name << "\",\"ph\":\"X\",\"pid\":" << pid
+           << ",\"tid\":" << id << ",\"ts\":" << begin / 1000
+           << ",\"dur\":" << end / 1000 - begin / 1000 << "}";
     }
-} // namespace http_errors
 
-namespace boost
-{
-    namespace system
+    static std::int64_t Now()
     {
-        template <>
-        struct is_error_code_enum<http_errors::http_error_codes>
-        {
-            BOOST_STATIC_CONSTANT(bool, value = true);
-        };
-    } // namespace system
-} // namespace boost
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    static int GetProcessId()
+    {
+#if BOOST_OS_LINUX
+        return static_cast<int>(getpid());
+#else
+        return 0;
+#endif
+    }
+
+    // Every thread pushes into the ring it is assigned when it pushes for the first time.
+    Ring &GetRing()
+    {
+        static std::atomic<unsigned int> next_ring(0);
+        thread_local unsigned int ring = next_ring.fetch_add(1) % RING_COUNT;
+
+        return m_rings[ring];
+    }
+
+private:
+    std::string m_name;
+    std::atomic<std::int64_t> m_threshold_ns;
+    std::atomic<std::uint64_t> m_next_id;
+    std::vector<Ring> m_rings;
+};
 
 class HTTPClient;
 class HTTPRequest;
@@ -85,10 +1429,18 @@ typedef void (*Callback)(const HTTPRequest &request,
                          const HTTPResponse &response,
                          const system::error_code &ec);
 
+// Called with each piece of the response body as it is received, already
+// decoded from the chunked encoding. The data is only valid during the call.
+typedef void (*BodyCallback)(const HTTPRequest &request,
+                             const HTTPResponse &response,
+                             const char *data,
+                             std::size_t size);
+
 class HTTPResponse
 {
     friend class HTTPRequest;
-    HTTPResponse() : m_response_stream(&m_response_buf)
+    HTTPResponse() : m_status_code(0),
+                     m_response_stream(&m_response_buf)
     {
     }
 
@@ -103,11 +1455,18 @@ public:
         return m_status_message;
     }
 
-    const std::map<std::string, std::string> &get_headers()
+    // The headers are slices of the response's own copy of its head.
+    const HTTPHeaders &get_headers() const
     {
         return m_headers;
     }
 
+    // Value of the header with the name, compared case-insensitively.
+    boost::string_view get_header(boost::string_view name) const
+    {
+        return m_headers.find(name);
+    }
+
     const std::istream &get_response() const
     {
         return m_response_stream;
@@ -119,28 +1478,25 @@ private:
         return m_response_buf;
     }
 
-    void set_status_code(unsigned int status_code)
-    {
-        m_status_code = status_code;
-    }
-
-    void set_status_message(const std::string &status_message)
+    // Keeps the results of parsing the head, copying its bytes out
+    // of the connection's read buffer in a single piece.
+    void set_head(const HTTPParser &parser, const char *data)
     {
-        m_status_message = status_message;
-    }
+        m_status_code = parser.status_code();
+        m_status_message.assign(parser.reason().data(), parser.reason().size());
 
-    void add_header(const std::string &name,
-                    const std::string &value)
-    {
-        m_headers[name] = value;
+        m_head.assign(data, parser.head_size());
+        m_headers = parser.headers();
+        m_headers.rebase(m_head.data());
     }
 
 private:
     unsigned int m_status_code;   // HTTP status code.
     std::string m_status_message; // HTTP status message.
 
-    // Response headers.
-    std::map<std::string, std::string> m_headers;
+    // Status line and headers as received, and the headers parsed from them.
+    std::string m_head;
+    HTTPHeaders m_headers;
     asio::streambuf m_response_buf;
     std::istream m_response_stream;
 };
@@ -151,13 +1507,44 @@ class HTTPRequest
 
     static const unsigned int DEFAULT_PORT = 80;
 
-    HTTPRequest(asio::io_service &ios, unsigned int id) : m_port(DEFAULT_PORT),
-                                                          m_id(id),
-                                                          m_callback(nullptr),
-                                                          m_sock(ios),
-                                                          m_resolver(ios),
-                                                          m_was_cancelled(false),
-                                                          m_ios(ios)
+    // Data is read from the connection in blocks of this size at most.
+    static const std::size_t READ_BLOCK_SIZE = 4096;
+
+    // Responses with a longer status line and headers are rejected.
+    static const std::size_t MAX_HEAD_SIZE = 64 * 1024;
+
+    HTTPRequest(asio::io_service &ios,
+                TimerWheel &wheel,
+                ResolverCache &resolver_cache,
+                ConnectionPool &pool,
+                const SocketProfile &socket_profile,
+                RequestTracer &tracer,
+                unsigned int id) : m_port(DEFAULT_PORT),
+                                   m_id(id),
+                                   m_callback(nullptr),
+                                   m_body_callback(nullptr),
+                                   m_body_window(READ_BLOCK_SIZE),
+                                   m_connect_timeout(0),
+                                   m_read_timeout(0),
+                                   m_sock(ios),
+                                   m_resolver(ios),
+                                   m_connection_attempt_delay(250),
+                                   m_next_endpoint(0),
+                                   m_reused(false),
+                                   m_response_started(false),
+                                   m_parser(HTTPParser::Kind::Response),
+                                   m_keep_alive(false),
+                                   m_body_framing(BodyFraming::UntilEof),
+                                   m_body_remaining(0),
+                                   m_chunk_state(ChunkState::Size),
+                                   m_was_cancelled(false),
+                                   m_timed_out(false),
+                                   m_ios(ios),
+                                   m_resolver_cache(resolver_cache),
+                                   m_pool(pool),
+                                   m_socket_profile(socket_profile),
+                                   m_tracer(tracer),
+                                   m_wheel(wheel)
     {
     }
 
@@ -182,6 +1569,43 @@ public:
         m_callback = callback;
     }
 
+    // Streams the body to the callback instead of collecting it in the
+    // response. The body is read in blocks of at most window bytes, each
+    // passed on before the next one is read, so the memory used does not
+    // depend on the size of the body.
+    void set_body_callback(BodyCallback callback,
+                           std::size_t window = READ_BLOCK_SIZE)
+    {
+        assert(window > 0);
+
+        m_body_callback = callback;
+        m_body_window = window;
+    }
+
+    // Deadline for resolving the host name and connecting to it.
+    // A zero timeout, the default, disables the deadline.
+    void set_connect_timeout(std::chrono::milliseconds timeout)
+    {
+        m_connect_timeout = timeout;
+    }
+
+    // Deadline for sending the request and receiving the whole response.
+    void set_read_timeout(std::chrono::milliseconds timeout)
+    {
+        m_read_timeout = timeout;
+    }
+
+    // The endpoints are tried in turn, alternating between IPv6 and IPv4,
+    // starting the next attempt when an attempt fails or after the delay,
+    // whichever comes first. The first connection established wins and the
+    // other attempts are cancelled, so an unreachable address costs at most
+    // the delay instead of a whole connect timeout. RFC 8305 recommends the
+    // default of 250 ms.
+    void set_connection_attempt_delay(std::chrono::milliseconds delay)
+    {
+        m_connection_attempt_delay = delay;
+    }
+
     std::string get_host() const
     {
         return m_host;
@@ -210,95 +1634,542 @@ public:
         assert(m_uri.length() > 0);
         assert(m_callback != nullptr);
 
+        m_tracer.Start(m_trace, m_id);
+
+        std::unique_lock<std::mutex>
+            cancel_lock(m_cancel_mux);
+
+        if (m_was_cancelled)
+        {
+            cancel_lock.unlock();
+            on_finish(boost::system::error_code(
+                asio::error::operation_aborted));
+            return;
+        }
+
+        // A pooled connection to the host skips resolving
+        // the host name and connecting.
+        m_reused = m_pool.CheckOut(get_pool_key(), m_sock);
+        cancel_lock.unlock();
+
+        if (m_reused)
+            send_request();
+        else
+            open_connection();
+    }
+
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+    // Same as execute(), but the request runs as a single coroutine
+    // on the client's I/O thread instead of a chain of callbacks.
+    void execute_co()
+    {
+        // Ensure that precorditions hold.
+        assert(m_port > 0);
+        assert(m_host.length() > 0);
+        assert(m_uri.length() > 0);
+        assert(m_callback != nullptr);
+
+        asio::co_spawn(m_ios, run(), asio::detached);
+    }
+#endif
+
+    void cancel()
+    {
+        std::unique_lock<std::mutex>
+            cancel_lock(m_cancel_mux);
+
+        m_was_cancelled = true;
+
+        m_resolver.cancel();
+
+        if (m_sock.is_open())
+        {
+            m_sock.cancel();
+        }
+
+        for (auto &attempt : m_attempts)
+        {
+            boost::system::error_code ignored_ec;
+            attempt->m_sock.cancel(ignored_ec);
+        }
+    }
+
+private:
+    // A connection attempt racing the others. The attempt is shared with
+    // its handler, so that an attempt abandoned when another one wins can
+    // complete with operation_aborted without touching the request, which
+    // may be gone by then.
+    struct ConnectAttempt
+    {
+        ConnectAttempt(asio::io_service &ios) : m_sock(ios),
+                                                m_abandoned(false)
+        {
+        }
+
+        asio::ip::tcp::socket m_sock;
+        bool m_abandoned; // Only accessed by the client's I/O thread.
+    };
+
+    // How the end of the response body is found.
+    enum class BodyFraming
+    {
+        ContentLength, // After m_body_remaining more bytes.
+        Chunked,       // After the last chunk and the trailer.
+        UntilEof       // When the server closes the connection.
+    };
+
+    // The part of the chunked body expected next.
+    enum class ChunkState
+    {
+        Size,     // Chunk size line.
+        Data,     // m_body_remaining bytes of the chunk data.
+        DataCrlf, // CRLF terminating the chunk data.
+        Trailer,  // Trailer fields up to an empty line.
+        Done
+    };
+
+    // Replaces the deadline of the previous step. An expired deadline
+    // cancels the request, which then completes with asio::error::timed_out.
+    void arm_deadline(std::chrono::milliseconds timeout)
+    {
+        if (timeout.count() == 0)
+        {
+            m_wheel.Cancel(m_deadline);
+            return;
+        }
+
+        m_wheel.Arm(m_deadline,
+                    timeout,
+                    [this]()
+                    {
+                        std::unique_lock<std::mutex>
+                            cancel_lock(m_cancel_mux);
+
+                        m_timed_out = true;
+                        cancel_lock.unlock();
+
+                        cancel();
+                    });
+    }
+
+    // The connections and the resolved endpoints are shared
+    // by the requests to the same host and port.
+    std::string get_pool_key() const
+    {
+        return m_host + ":" + std::to_string(m_port);
+    }
+
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+    // Each step checks the cancellation flag before starting its operation
+    // and after the operation completes. A request cancelled between the
+    // two stops once the operation completes or the deadline expires.
+    asio::awaitable<void> run()
+    {
+        boost::system::error_code ec;
+
+        m_tracer.Start(m_trace, m_id);
+
+        if (is_cancelled())
+        {
+            on_finish(asio::error::operation_aborted);
+            co_return;
+        }
+
+        {
+            std::unique_lock<std::mutex>
+                cancel_lock(m_cancel_mux);
+
+            m_reused = m_pool.CheckOut(get_pool_key(), m_sock);
+        }
+
+        do
+        {
+            ec = boost::system::error_code();
+
+            if (!m_reused)
+            {
+                arm_deadline(m_connect_timeout);
+
+                std::vector<asio::ip::tcp::endpoint> endpoints;
+                if (!m_resolver_cache.Find(get_pool_key(), endpoints))
+                {
+                    asio::ip::tcp::resolver::query resolver_query(m_host,
+                                                                  std::to_string(m_port),
+                                                                  asio::ip::tcp::resolver::query::numeric_service);
+
+                    m_tracer.Begin(m_trace, RequestTracer::Resolve);
+                    asio::ip::tcp::resolver::results_type results =
+                        co_await m_resolver.async_resolve(resolver_query,
+                                                          asio::redirect_error(asio::use_awaitable, ec));
+                    m_tracer.End(m_trace, RequestTracer::Resolve);
+                    if (ec.value() == 0)
+                    {
+                        endpoints.assign(results.begin(), results.end());
+                        m_resolver_cache.Insert(get_pool_key(), endpoints);
+                    }
+                }
+
+                if (ec.value() == 0 && endpoints.empty())
+                    ec = asio::error::not_found;
+
+                if (ec.value() == 0 && !is_cancelled())
+                {
+                    // The attempts race as they do for execute(); the
+                    // coroutine waits on a timer that is never due, which
+                    // finish_connecting() cancels to resume it.
+                    asio::steady_timer connected(m_ios, asio::steady_timer::time_point::max());
+                    {
+                        std::unique_lock<std::mutex>
+                            cancel_lock(m_cancel_mux);
+
+                        m_endpoints = endpoints;
+                        m_connected_event = &connected;
+                        start_connecting();
+                    }
+
+                    co_await connected.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+                    m_connected_event = nullptr;
+                    ec = m_connect_error;
+
+                    if (ec.value() != 0)
+                        m_resolver_cache.Remove(get_pool_key());
+                }
+            }
+
+            if (ec.value() == 0 && !is_cancelled())
+            {
+                compose_request();
+                arm_deadline(m_read_timeout);
+
+                m_tracer.Begin(m_trace, RequestTracer::Write);
+                co_await asio::async_write(m_sock,
+                                           asio::buffer(m_request_buf),
+                                           asio::redirect_error(asio::use_awaitable, ec));
+                m_tracer.End(m_trace, RequestTracer::Write);
+                m_tracer.Begin(m_trace, RequestTracer::Wait);
+            }
+
+            while (ec.value() == 0 && !is_cancelled())
+            {
+                HTTPParser::Result result = parse_head();
+                if (result == HTTPParser::Result::Done)
+                {
+                    ec = start_body();
+                    break;
+                }
+
+                if (result == HTTPParser::Result::Invalid)
+                {
+                    ec = http_errors::invalid_response;
+                    break;
+                }
+
+                std::size_t bytes_transferred =
+                    co_await m_sock.async_read_some(m_read_buf.prepare(READ_BLOCK_SIZE),
+                                                    asio::redirect_error(asio::use_awaitable, ec));
+                m_read_buf.commit(bytes_transferred);
+
+                if (bytes_transferred > 0)
+                    start_response();
+            }
+
+            while (ec.value() == 0 && !is_cancelled())
+            {
+                if (consume_body(ec) || ec.value() != 0)
+                    break;
+
+                std::size_t bytes_transferred =
+                    co_await m_sock.async_read_some(m_read_buf.prepare(m_body_window),
+                                                    asio::redirect_error(asio::use_awaitable, ec));
+                m_read_buf.commit(bytes_transferred);
+
+                if (ec == asio::error::eof && m_body_framing == BodyFraming::UntilEof)
+                {
+                    consume_body(ec);
+                    ec = boost::system::error_code();
+                    break;
+                }
+            }
+        } while (retry_on_new_connection(ec));
+
+        if (ec.value() == 0 && is_cancelled())
+            ec = asio::error::operation_aborted;
+
+        on_finish(ec);
+    }
+
+    bool is_cancelled()
+    {
+        std::unique_lock<std::mutex>
+            cancel_lock(m_cancel_mux);
+
+        return m_was_cancelled;
+    }
+#endif
+
+    // Connects to one of the endpoints the host name resolves to,
+    // resolving it unless the endpoints are cached.
+    void open_connection()
+    {
+        std::unique_lock<std::mutex>
+            cancel_lock(m_cancel_mux);
+
+        if (m_was_cancelled)
+        {
+            cancel_lock.unlock();
+            on_finish(boost::system::error_code(
+                asio::error::operation_aborted));
+            return;
+        }
+
+        arm_deadline(m_connect_timeout);
+
+        if (m_resolver_cache.Find(get_pool_key(), m_endpoints))
+        {
+            connect();
+            return;
+        }
+
         // Prepare the resolving query.
         asio::ip::tcp::resolver::query resolver_query(m_host,
                                                       std::to_string(m_port),
                                                       asio::ip::tcp::resolver::query::numeric_service);
 
+        // Resolve the host name.
+        m_tracer.Begin(m_trace, RequestTracer::Resolve);
+        m_resolver.async_resolve(resolver_query,
+                                 [this](const boost::system::error_code &ec,
+                                        asio::ip::tcp::resolver::iterator iterator)
+                                 {
+                                     on_host_name_resolved(ec, iterator);
+                                 });
+    }
+
+    void on_host_name_resolved(
+        const boost::system::error_code &ec,
+        asio::ip::tcp::resolver::iterator iterator)
+    {
+        m_tracer.End(m_trace, RequestTracer::Resolve);
+
+        if (ec.value() != 0)
+        {
+            on_finish(ec);
+            return;
+        }
+
+        m_endpoints.assign(iterator, asio::ip::tcp::resolver::iterator());
+        m_resolver_cache.Insert(get_pool_key(), m_endpoints);
+
         std::unique_lock<std::mutex>
             cancel_lock(m_cancel_mux);
 
-        if (m_was_cancelled)
+        if (m_was_cancelled)
+        {
+            cancel_lock.unlock();
+            on_finish(boost::system::error_code(
+                asio::error::operation_aborted));
+            return;
+        }
+
+        connect();
+    }
+
+    // Must be called with m_cancel_mux locked.
+    void connect()
+    {
+        if (m_endpoints.empty())
+        {
+            asio::post(m_ios,
+                       [this]()
+                       {
+                           on_connection_established(asio::error::not_found);
+                       });
+            return;
+        }
+
+        start_connecting();
+    }
+
+    // Starts racing connection attempts to the endpoints in m_endpoints,
+    // which must not be empty, in the order recommended by RFC 8305.
+    // Must be called with m_cancel_mux locked.
+    void start_connecting()
+    {
+        m_tracer.Begin(m_trace, RequestTracer::Connect);
+
+        interleave_address_families(m_endpoints);
+        m_next_endpoint = 0;
+        m_connect_error = boost::system::error_code();
+
+        start_connection_attempt();
+    }
+
+    // The resolver returns the endpoints sorted by preference (RFC 6724); the
+    // families are alternated starting with that of the preferred endpoint,
+    // so that a broken family never holds up the other for long.
+    static void interleave_address_families(std::vector<asio::ip::tcp::endpoint> &endpoints)
+    {
+        std::vector<asio::ip::tcp::endpoint> preferred;
+        std::vector<asio::ip::tcp::endpoint> other;
+
+        for (const asio::ip::tcp::endpoint &endpoint : endpoints)
+        {
+            if (endpoint.protocol() == endpoints.front().protocol())
+                preferred.push_back(endpoint);
+            else
+                other.push_back(endpoint);
+        }
+
+        endpoints.clear();
+        for (std::size_t i = 0; i < preferred.size() || i < other.size(); i++)
+        {
+            if (i < preferred.size())
+                endpoints.push_back(preferred[i]);
+            if (i < other.size())
+                endpoints.push_back(other[i]);
+        }
+    }
+
+    // Starts an attempt to connect to the next endpoint and, if endpoints
+    // remain, schedules the next attempt after the connection attempt delay.
+    // Must be called with m_cancel_mux locked.
+    void start_connection_attempt()
+    {
+        asio::ip::tcp::endpoint endpoint = m_endpoints[m_next_endpoint++];
+
+        std::shared_ptr<ConnectAttempt> attempt = std::make_shared<ConnectAttempt>(m_ios);
+        open_socket(attempt->m_sock, endpoint.protocol());
+        m_attempts.push_back(attempt);
+
+        attempt->m_sock.async_connect(endpoint,
+                                      [this, attempt](const boost::system::error_code &ec)
+                                      {
+                                          if (attempt->m_abandoned)
+                                              return;
+
+                                          on_connection_attempt_completed(attempt, ec);
+                                      });
+
+        if (m_next_endpoint < m_endpoints.size())
         {
-            cancel_lock.unlock();
-            on_finish(boost::system::error_code(
-                asio::error::operation_aborted));
-            return;
+            m_wheel.Arm(m_attempt_timer,
+                        m_connection_attempt_delay,
+                        [this]()
+                        {
+                            std::unique_lock<std::mutex>
+                                cancel_lock(m_cancel_mux);
+
+                            if (!m_was_cancelled && !m_attempts.empty() &&
+                                m_next_endpoint < m_endpoints.size())
+                                start_connection_attempt();
+                        });
+        }
+        else
+        {
+            m_wheel.Cancel(m_attempt_timer);
         }
+    }
 
-        // Resolve the host name.
-        m_resolver.async_resolve(resolver_query,
-                                 [this](const boost::system::error_code &ec,
-                                        asio::ip::tcp::resolver::iterator iterator)
-                                 {
-                                     on_host_name_resolved(ec, iterator);
-                                 });
+    // The socket is opened here rather than by the connect operation, so
+    // that the client's socket profile is applied before connecting. If
+    // opening fails, the connect operation tries again and reports the error.
+    // Must be called with m_cancel_mux locked.
+    void open_socket(asio::ip::tcp::socket &sock, const asio::ip::tcp &protocol)
+    {
+        boost::system::error_code ignored_ec;
+        sock.close(ignored_ec);
+        sock.open(protocol, ignored_ec);
+
+        if (sock.is_open())
+            m_socket_profile.ApplyToConnection(sock);
     }
 
-    void cancel()
+    void on_connection_attempt_completed(const std::shared_ptr<ConnectAttempt> &attempt,
+                                         const boost::system::error_code &ec)
     {
         std::unique_lock<std::mutex>
             cancel_lock(m_cancel_mux);
 
-        m_was_cancelled = true;
-
-        m_resolver.cancel();
+        m_attempts.erase(std::find(m_attempts.begin(), m_attempts.end(), attempt));
 
-        if (m_sock.is_open())
+        if (ec.value() == 0)
         {
-            m_sock.cancel();
+            // The winner's socket becomes the request's connection and
+            // the attempts still in progress are closed.
+            m_sock = std::move(attempt->m_sock);
+
+            for (auto &loser : m_attempts)
+            {
+                loser->m_abandoned = true;
+
+                boost::system::error_code ignored_ec;
+                loser->m_sock.close(ignored_ec);
+            }
+            m_attempts.clear();
+            m_wheel.Cancel(m_attempt_timer);
+
+            cancel_lock.unlock();
+            finish_connecting(ec);
+            return;
         }
-    }
 
-private:
-    void on_host_name_resolved(
-        const boost::system::error_code &ec,
-        asio::ip::tcp::resolver::iterator iterator)
-    {
-        if (ec.value() != 0)
+        // The error of the first attempt is reported unless a later one
+        // has been cancelled, the cancellation being what the caller expects.
+        if (m_connect_error.value() == 0 || ec == asio::error::operation_aborted)
+            m_connect_error = ec;
+
+        // A failed attempt is followed by the next one right away.
+        if (!m_was_cancelled && m_next_endpoint < m_endpoints.size())
         {
-            on_finish(ec);
+            start_connection_attempt();
             return;
         }
 
-        std::unique_lock<std::mutex>
-            cancel_lock(m_cancel_mux);
+        if (!m_attempts.empty())
+            return;
 
-        if (m_was_cancelled)
+        m_wheel.Cancel(m_attempt_timer);
+
+        cancel_lock.unlock();
+        finish_connecting(m_was_cancelled ? boost::system::error_code(asio::error::operation_aborted)
+                                          : m_connect_error);
+    }
+
+    // Reports the outcome of the connection attempts to the coroutine
+    // awaiting it, if any, and continues the request otherwise.
+    void finish_connecting(const boost::system::error_code &ec)
+    {
+        m_tracer.End(m_trace, RequestTracer::Connect);
+
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+        if (m_connected_event != nullptr)
         {
-            cancel_lock.unlock();
-            on_finish(boost::system::error_code(
-                asio::error::operation_aborted));
+            m_connect_error = ec;
+            m_connected_event->cancel();
             return;
         }
+#endif
 
-        // Connect to the host.
-        asio::async_connect(m_sock,
-                            iterator,
-                            [this](const boost::system::error_code &ec,
-                                   asio::ip::tcp::resolver::iterator iterator)
-                            {
-                                on_connection_established(ec, iterator);
-                            });
+        on_connection_established(ec);
     }
 
-    void on_connection_established(
-        const boost::system::error_code &ec,
-        asio::ip::tcp::resolver::iterator iterator)
+    void on_connection_established(const boost::system::error_code &ec)
     {
         if (ec.value() != 0)
         {
+            // The cached endpoints may be out of date.
+            m_resolver_cache.Remove(get_pool_key());
+
             on_finish(ec);
             return;
         }
 
-        // Compose the request message.
-        m_request_buf += "GET " + m_uri + " HTTP/1.1\r\n";
-
-        // Add mandatory header.
-        m_request_buf += "Host: " + m_host + "\r\n";
+        send_request();
+    }
 
-        m_request_buf += "\r\n";
+    void send_request()
+    {
+        compose_request();
 
         std::unique_lock<std::mutex>
             cancel_lock(m_cancel_mux);
@@ -311,7 +2182,10 @@ private:
             return;
         }
 
+        arm_deadline(m_read_timeout);
+
         // Send the request message.
+        m_tracer.Begin(m_trace, RequestTracer::Write);
         asio::async_write(m_sock,
                           asio::buffer(m_request_buf),
                           [this](const boost::system::error_code &ec,
@@ -324,13 +2198,42 @@ private:
     void on_request_sent(const boost::system::error_code &ec,
                          std::size_t bytes_transferred)
     {
+        m_tracer.End(m_trace, RequestTracer::Write);
+
         if (ec.value() != 0)
         {
             on_finish(ec);
             return;
         }
 
-        m_sock.shutdown(asio::ip::tcp::socket::shutdown_send);
+        m_tracer.Begin(m_trace, RequestTracer::Wait);
+        read_head();
+    }
+
+    // Parses the part of the status line and headers that has already been
+    // received, then reads more of them unless the head is complete.
+    void read_head()
+    {
+        HTTPParser::Result result = parse_head();
+        if (result == HTTPParser::Result::Invalid)
+        {
+            // Response is incorrect.
+            on_finish(http_errors::invalid_response);
+            return;
+        }
+
+        if (result == HTTPParser::Result::Done)
+        {
+            boost::system::error_code framing_ec = start_body();
+            if (framing_ec.value() != 0)
+            {
+                on_finish(framing_ec);
+                return;
+            }
+
+            read_body();
+            return;
+        }
 
         std::unique_lock<std::mutex>
             cancel_lock(m_cancel_mux);
@@ -343,66 +2246,44 @@ private:
             return;
         }
 
-        // Read the status line.
-        asio::async_read_until(m_sock,
-                               m_response.get_response_buf(),
-                               "\r\n",
-                               [this](const boost::system::error_code &ec,
-                                      std::size_t bytes_transferred)
+        m_sock.async_read_some(m_read_buf.prepare(READ_BLOCK_SIZE),
+                               [this](
+                                   const boost::system::error_code &ec,
+                                   std::size_t bytes_transferred)
                                {
-                                   on_status_line_received(ec, bytes_transferred);
+                                   on_head_data_received(ec,
+                                                         bytes_transferred);
                                });
     }
 
-    void on_status_line_received(
-        const boost::system::error_code &ec,
-        std::size_t bytes_transferred)
+    void on_head_data_received(const boost::system::error_code &ec,
+                               std::size_t bytes_transferred)
     {
-        if (ec.value() != 0)
-        {
-            on_finish(ec);
-            return;
-        }
+        m_read_buf.commit(bytes_transferred);
 
-        // Parse the status line.
-        std::string http_version;
-        std::string str_status_code;
-        std::string status_message;
+        if (bytes_transferred > 0)
+            start_response();
 
-        std::istream response_stream(
-            &m_response.get_response_buf());
-        response_stream >> http_version;
-
-        if (http_version != "HTTP/1.1")
+        if (ec.value() != 0)
         {
-            // Response is incorrect.
-            on_finish(http_errors::invalid_response);
+            on_finish(ec);
             return;
         }
 
-        response_stream >> str_status_code;
-
-        // Convert status code to integer.
-        unsigned int status_code = 200;
+        read_head();
+    }
 
-        try
-        {
-            status_code = std::stoul(str_status_code);
-        }
-        catch (std::logic_error &)
+    // Consumes the part of the body that has already been received,
+    // then reads more of it unless the body is complete.
+    void read_body()
+    {
+        boost::system::error_code ec;
+        if (consume_body(ec) || ec.value() != 0)
         {
-            // Response is incorrect.
-            on_finish(http_errors::invalid_response);
+            on_finish(ec);
             return;
         }
 
-        std::getline(response_stream, status_message, '\r');
-        // Remove symbol '\n' from the buffer.
-        response_stream.get();
-
-        m_response.set_status_code(status_code);
-        m_response.set_status_message(status_message);
-
         std::unique_lock<std::mutex>
             cancel_lock(m_cancel_mux);
 
@@ -414,99 +2295,327 @@ private:
             return;
         }
 
-        // At this point the status line is successfully
-        // received and parsed.
-        // Now read the response headers.
-        asio::async_read_until(m_sock,
-                               m_response.get_response_buf(),
-                               "\r\n\r\n",
+        m_sock.async_read_some(m_read_buf.prepare(m_body_window),
                                [this](
                                    const boost::system::error_code &ec,
                                    std::size_t bytes_transferred)
                                {
-                                   on_headers_received(ec,
-                                                       bytes_transferred);
+                                   on_response_body_received(ec,
+                                                             bytes_transferred);
                                });
     }
 
-    void on_headers_received(const boost::system::error_code &ec,
-                             std::size_t bytes_transferred)
+    void on_response_body_received(
+        const boost::system::error_code &ec,
+        std::size_t bytes_transferred)
     {
-        if (ec.value() != 0)
+        m_read_buf.commit(bytes_transferred);
+
+        if (ec == asio::error::eof && m_body_framing == BodyFraming::UntilEof)
         {
+            boost::system::error_code ignored_ec;
+            consume_body(ignored_ec);
+            on_finish(boost::system::error_code());
+        }
+        else if (ec.value() != 0)
             on_finish(ec);
+        else
+            read_body();
+    }
+
+    void compose_request()
+    {
+        // Compose the request message.
+        m_request_buf = "GET " + m_uri + " HTTP/1.1\r\n";
+
+        // Add mandatory header.
+        m_request_buf += "Host: " + m_host + "\r\n";
+
+        m_request_buf += "\r\n";
+    }
+
+    // Runs the parser over the data received so far. Once the head is
+    // complete, it is stored in the response and removed from the read
+    // buffer, which is left holding the beginning of the body.
+    HTTPParser::Result parse_head()
+    {
+        const char *data = asio::buffer_cast<const char *>(m_read_buf.data());
+        HTTPParser::Result result = m_parser.parse(data, m_read_buf.size());
+
+        if (result == HTTPParser::Result::NeedMore)
+            return m_read_buf.size() < MAX_HEAD_SIZE ? result : HTTPParser::Result::Invalid;
+
+        if (result == HTTPParser::Result::Invalid || m_parser.version() != "HTTP/1.1")
+            return HTTPParser::Result::Invalid;
+
+        m_response.set_head(m_parser, data);
+        m_read_buf.consume(m_parser.head_size());
+
+        return result;
+    }
+
+    // Finds out from the headers how the body is framed and whether the
+    // connection can be kept open once the response has been read.
+    boost::system::error_code start_body()
+    {
+        m_keep_alive = !HTTPHeaders::equals_no_case(m_response.get_header("connection"), "close");
+
+        unsigned int status_code = m_response.get_status_code();
+        boost::string_view transfer_encoding = m_response.get_header("transfer-encoding");
+        boost::string_view content_length = m_response.get_header("content-length");
+
+        if (status_code == 204 || status_code == 304)
+        {
+            m_body_framing = BodyFraming::ContentLength;
+            m_body_remaining = 0;
+        }
+        else if (!transfer_encoding.empty())
+        {
+            // Chunked must be the last of the encodings applied.
+            if (transfer_encoding.size() < 7 ||
+                !HTTPHeaders::equals_no_case(transfer_encoding.substr(transfer_encoding.size() - 7), "chunked"))
+                return http_errors::invalid_response;
+
+            m_body_framing = BodyFraming::Chunked;
+            m_chunk_state = ChunkState::Size;
+        }
+        else if (!content_length.empty())
+        {
+            m_body_remaining = 0;
+
+            for (char c : content_length)
+            {
+                if (c < '0' || c > '9' ||
+                    m_body_remaining > (UINT64_MAX - 9) / 10)
+                    return http_errors::invalid_response;
+
+                m_body_remaining = m_body_remaining * 10 + (c - '0');
+            }
+
+            m_body_framing = BodyFraming::ContentLength;
+        }
+        else
+        {
+            // Only the server closing the connection ends the body.
+            m_body_framing = BodyFraming::UntilEof;
+            m_keep_alive = false;
+        }
+
+        return boost::system::error_code();
+    }
+
+    // Moves n bytes of the body from the read buffer to the response,
+    // or passes them to the body callback straight from the read buffer.
+    void move_to_response(std::size_t n)
+    {
+        if (n == 0)
             return;
+
+        if (m_body_callback != nullptr)
+        {
+            m_body_callback(*this,
+                            m_response,
+                            asio::buffer_cast<const char *>(m_read_buf.data()),
+                            n);
+        }
+        else
+        {
+            asio::streambuf &response_buf = m_response.get_response_buf();
+
+            asio::buffer_copy(response_buf.prepare(n), m_read_buf.data(), n);
+            response_buf.commit(n);
+        }
+
+        m_read_buf.consume(n);
+    }
+
+    // Consumes the body data in the read buffer, decoding the chunked
+    // encoding. Returns true once the whole body has been received.
+    bool consume_body(boost::system::error_code &ec)
+    {
+        if (m_body_framing == BodyFraming::UntilEof)
+        {
+            move_to_response(m_read_buf.size());
+            return false;
         }
 
-        // Parse and store headers.
-        std::string header, header_name, header_value;
-        std::istream response_stream(
-            &m_response.get_response_buf());
+        if (m_body_framing == BodyFraming::ContentLength)
+        {
+            std::size_t n = static_cast<std::size_t>(
+                std::min<std::uint64_t>(m_body_remaining, m_read_buf.size()));
+
+            move_to_response(n);
+            m_body_remaining -= n;
+
+            return m_body_remaining == 0;
+        }
 
-        while (true)
+        while (m_chunk_state != ChunkState::Done)
         {
-            std::getline(response_stream, header, '\r');
+            const char *data = asio::buffer_cast<const char *>(m_read_buf.data());
+            std::size_t size = m_read_buf.size();
+
+            if (m_chunk_state == ChunkState::Data)
+            {
+                std::size_t n = static_cast<std::size_t>(
+                    std::min<std::uint64_t>(m_body_remaining, size));
 
-            // Remove \n symbol from the stream.
-            response_stream.get();
+                move_to_response(n);
+                m_body_remaining -= n;
 
-            if (header == "")
-                break;
+                if (m_body_remaining > 0)
+                    return false;
+
+                m_chunk_state = ChunkState::DataCrlf;
+                continue;
+            }
+
+            if (m_chunk_state == ChunkState::DataCrlf)
+            {
+                if (size < 2)
+                    return false;
+
+                if (data[0] != '\r' || data[1] != '\n')
+                {
+                    ec = http_errors::invalid_response;
+                    return false;
+                }
+
+                m_read_buf.consume(2);
+                m_chunk_state = ChunkState::Size;
+                continue;
+            }
+
+            // The chunk size line and the trailer fields are CRLF terminated.
+            // Like the head, a line is not buffered beyond MAX_HEAD_SIZE.
+            const char *line_end = std::search(data, data + size, "\r\n", "\r\n" + 2);
+            std::size_t line_size = line_end - data;
+            if (line_size >= MAX_HEAD_SIZE)
+            {
+                ec = http_errors::invalid_response;
+                return false;
+            }
 
-            size_t separator_pos = header.find(':');
-            if (separator_pos != std::string::npos)
+            if (line_end == data + size)
+                return false;
+
+            if (m_chunk_state == ChunkState::Trailer)
             {
-                header_name = header.substr(0,
-                                            separator_pos);
+                if (line_size == 0)
+                    m_chunk_state = ChunkState::Done;
+
+                m_read_buf.consume(line_size + 2);
+                continue;
+            }
 
-                if (separator_pos < header.length() - 1)
-                    header_value =
-                        header.substr(separator_pos + 1);
-                else
-                    header_value = "";
+            // Chunk size in hex, optionally followed by chunk extensions.
+            std::uint64_t chunk_size = 0;
+            std::size_t digits = 0;
+            for (; digits < line_size && std::isxdigit(static_cast<unsigned char>(data[digits])); digits++)
+            {
+                if (digits == 15)
+                {
+                    ec = http_errors::invalid_response;
+                    return false;
+                }
+
+                char c = std::tolower(static_cast<unsigned char>(data[digits]));
+                chunk_size = chunk_size * 16 + (c <= '9' ? c - '0' : c - 'a' + 10);
+            }
 
-                m_response.add_header(header_name,
-                                      header_value);
+            if (digits == 0 ||
+                (digits < line_size && data[digits] != ';' && data[digits] != ' ' && data[digits] != '\t'))
+            {
+                ec = http_errors::invalid_response;
+                return false;
             }
+
+            m_read_buf.consume(line_size + 2);
+
+            m_body_remaining = chunk_size;
+            m_chunk_state = chunk_size == 0 ? ChunkState::Trailer : ChunkState::Data;
         }
 
+        return true;
+    }
+
+    // A pooled connection may have been closed by the server after its health
+    // check passed. No part of the response has been received, so it is safe
+    // to retry the request on a new connection.
+    bool retry_on_new_connection(const boost::system::error_code &ec)
+    {
+        if (!m_reused || m_response_started ||
+            (ec != asio::error::eof &&
+             ec != asio::error::connection_reset &&
+             ec != asio::error::broken_pipe))
+            return false;
+
         std::unique_lock<std::mutex>
             cancel_lock(m_cancel_mux);
 
         if (m_was_cancelled)
+            return false;
+
+        boost::system::error_code ignored_ec;
+        m_sock.close(ignored_ec);
+        m_read_buf.consume(m_read_buf.size());
+        m_parser.reset();
+        m_reused = false;
+
+        return true;
+    }
+
+    // Returns the connection to the pool if the response has been read
+    // in full and nothing else has been received, otherwise closes it.
+    void release_connection(const boost::system::error_code &ec)
+    {
+        std::unique_lock<std::mutex>
+            cancel_lock(m_cancel_mux);
+
+        if (!m_sock.is_open())
+            return;
+
+        if (ec.value() == 0 && m_keep_alive && !m_was_cancelled &&
+            m_read_buf.size() == 0)
         {
-            cancel_lock.unlock();
-            on_finish(boost::system::error_code(
-                asio::error::operation_aborted));
+            m_pool.CheckIn(get_pool_key(), m_sock);
             return;
         }
 
-        // Now we want to read the response body.
-        asio::async_read(m_sock,
-                         m_response.get_response_buf(),
-                         [this](
-                             const boost::system::error_code &ec,
-                             std::size_t bytes_transferred)
-                         {
-                             on_response_body_received(ec,
-                                                       bytes_transferred);
-                         });
-
-        return;
+        boost::system::error_code ignored_ec;
+        m_sock.close(ignored_ec);
     }
 
-    void on_response_body_received(
-        const boost::system::error_code &ec,
-        std::size_t bytes_transferred)
+    // Called when the first bytes of the response are received.
+    void start_response()
     {
-        if (ec == asio::error::eof)
-            on_finish(boost::system::error_code());
-        else
-            on_finish(ec);
+        if (!m_response_started)
+        {
+            m_tracer.End(m_trace, RequestTracer::Wait);
+            m_tracer.Begin(m_trace, RequestTracer::Read);
+        }
+
+        m_response_started = true;
     }
 
-    void on_finish(const boost::system::error_code &ec)
+    void on_finish(boost::system::error_code ec)
     {
+        if (retry_on_new_connection(ec))
+        {
+            open_connection();
+            return;
+        }
+
+        m_wheel.Cancel(m_deadline);
+
+        m_tracer.End(m_trace, RequestTracer::Read);
+        m_tracer.Finish(m_trace);
+
+        if (ec == asio::error::operation_aborted && m_timed_out)
+            ec = asio::error::timed_out;
+
+        release_connection(ec);
+
         if (ec.value() != 0)
         {
             std::cout << "Error occured! Error code = "
@@ -531,24 +2640,85 @@ private:
     // Callback to be called when request completes.
     Callback m_callback;
 
+    // Callback the body is streamed to, if any, and
+    // the most body data to read at a time.
+    BodyCallback m_body_callback;
+    std::size_t m_body_window;
+
+    std::chrono::milliseconds m_connect_timeout;
+    std::chrono::milliseconds m_read_timeout;
+
     // Buffer containing the request line.
     std::string m_request_buf;
 
     asio::ip::tcp::socket m_sock;
     asio::ip::tcp::resolver m_resolver;
+    std::vector<asio::ip::tcp::endpoint> m_endpoints;
+
+    // Connection attempts in progress, the next endpoint to try
+    // and the error to report if all the attempts fail.
+    std::chrono::milliseconds m_connection_attempt_delay;
+    std::vector<std::shared_ptr<ConnectAttempt>> m_attempts;
+    std::size_t m_next_endpoint;
+    boost::system::error_code m_connect_error;
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+    asio::steady_timer *m_connected_event = nullptr; // Resumes a coroutine awaiting the connection.
+#endif
+
+    // Whether the connection has been taken from the pool and whether
+    // any part of the response has been received on it.
+    bool m_reused;
+    bool m_response_started;
+
+    HTTPParser m_parser;
+
+    // Data received from the server that has not been parsed yet; the
+    // decoded body is moved from it to the response.
+    asio::streambuf m_read_buf;
+
+    bool m_keep_alive;
+    BodyFraming m_body_framing;
+    std::uint64_t m_body_remaining; // Of the body or of the current chunk.
+    ChunkState m_chunk_state;
 
     HTTPResponse m_response;
 
     bool m_was_cancelled;
+    bool m_timed_out;
     std::mutex m_cancel_mux;
 
     asio::io_service &m_ios;
+
+    // Shared by all the requests of the client.
+    ResolverCache &m_resolver_cache;
+    ConnectionPool &m_pool;
+    const SocketProfile &m_socket_profile;
+    RequestTracer &m_tracer;
+
+    // Phase timestamps of the request, sampled if it turns out slow.
+    RequestTracer::Trace m_trace;
+
+    // Deadline of the current step, shared wheel of the client.
+    TimerWheel &m_wheel;
+    TimerWheel::Timer m_attempt_timer; // Starts the next connection attempt.
+    TimerWheel::Timer m_deadline;      // Declared last to be cancelled first.
 };
 
 class HTTPClient
 {
 public:
-    HTTPClient()
+    // The deadlines of all the requests and the idle timeouts of the pooled
+    // connections share a single timing wheel driven by the client's I/O
+    // thread. Resolved host names are cached for dns_ttl; a zero dns_ttl
+    // disables the cache and a zero max_idle_per_host the pooling.
+    HTTPClient(std::chrono::seconds dns_ttl = std::chrono::seconds(60),
+               unsigned int max_idle_per_host = 8,
+               std::chrono::milliseconds idle_timeout = std::chrono::seconds(30)) : m_wheel(m_ios),
+                                                                                   m_resolver_cache(dns_ttl),
+                                                                                   m_pool(m_wheel,
+                                                                                          max_idle_per_host,
+                                                                                          idle_timeout),
+                                                                                   m_tracer("http-client")
     {
         m_work.reset(new boost::asio::io_service::work(m_ios));
 
@@ -560,11 +2730,36 @@ public:
     create_request(unsigned int id)
     {
         return std::shared_ptr<HTTPRequest>(
-            new HTTPRequest(m_ios, id));
+            new HTTPRequest(m_ios, m_wheel, m_resolver_cache, m_pool, m_socket_profile, m_tracer, id));
+    }
+
+    // Sets the options of the sockets the requests open and outputs the values
+    // in effect. Must be called before any request is created.
+    void set_socket_profile(const SocketProfile &profile)
+    {
+        m_socket_profile = profile;
+        m_socket_profile.Log(std::cout);
+    }
+
+    // Requests taking at least the threshold, from being executed to the
+    // callback being called, are traced. Zero, the default, disables the tracing.
+    void set_slow_request_threshold(std::chrono::microseconds threshold)
+    {
+        m_tracer.SetSlowThreshold(threshold);
+    }
+
+    // Outputs the traces of the slow requests in the Chrome trace event format.
+    void dump_slow_requests(std::ostream &os) const
+    {
+        m_tracer.Dump(os);
     }
 
     void close()
     {
+        // Stop pooling the connections, whose idle timeouts
+        // would keep the I/O thread running otherwise.
+        m_pool.Close();
+
         // Destroy the work object.
         m_work.reset(NULL);
 
@@ -574,6 +2769,11 @@ public:
 
 private:
     asio::io_service m_ios;
+    TimerWheel m_wheel;
+    ResolverCache m_resolver_cache;
+    ConnectionPool m_pool;
+    SocketProfile m_socket_profile;
+    RequestTracer m_tracer;
     std::unique_ptr<boost::asio::io_service::work> m_work;
     std::unique_ptr<std::thread> m_thread;
 };
@@ -585,8 +2785,14 @@ void handler(const HTTPRequest &request,
     if (ec.value() == 0)
     {
         std::cout << "Request #" << request.get_id()
-                  << " has completed. Response: "
-                  << response.get_response().rdbuf();
+                  << " has completed. Response: ";
+
+        // The body of a streamed response is not buffered, and writing
+        // an empty stream buffer would set std::cout's failbit.
+        if (response.get_response().rdbuf()->in_avail() > 0)
+            std::cout << response.get_response().rdbuf();
+        else
+            std::cout << std::endl;
     }
     else if (ec == asio::error::operation_aborted)
     {
@@ -605,6 +2811,16 @@ void handler(const HTTPRequest &request,
     return;
 }
 
+void body_handler(const HTTPRequest &request,
+                  const HTTPResponse &response,
+                  const char *data,
+                  std::size_t size)
+{
+    std::cout << "Request #" << request.get_id()
+              << " has received " << size
+              << " bytes of the response body." << std::endl;
+}
+
 int main()
 {
     try
@@ -633,6 +2849,32 @@ int main()
 
         request_two->cancel();
 
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+        // The same request run as a coroutine.
+        std::shared_ptr<HTTPRequest> request_three =
+            client.create_request(3);
+
+        request_three->set_host("localhost");
+        request_three->set_uri("/index.html");
+        request_three->set_port(3333);
+        request_three->set_callback(handler);
+
+        request_three->execute_co();
+#endif
+
+        // The body of this response is streamed to
+        // body_handler() as it is received.
+        std::shared_ptr<HTTPRequest> request_four =
+            client.create_request(4);
+
+        request_four->set_host("localhost");
+        request_four->set_uri("/index.html");
+        request_four->set_port(3333);
+        request_four->set_callback(handler);
+        request_four->set_body_callback(body_handler);
+
+        request_four->execute();
+
         // Do nothing for 15 seconds, letting the
         // request complete.
         std::this_thread::sleep_for(std::chrono::seconds(15));
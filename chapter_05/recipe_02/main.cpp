@@ -1,12 +1,810 @@
+#include <boost/predef.h> // Tools to identify the OS.
+
 #include <boost/asio.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/utility/string_view.hpp>
+#include <boost/noncopyable.hpp>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if BOOST_OS_LINUX
+#include <sys/sendfile.h> // sendfile().
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/tcp.h>
+#include <cerrno>
+#endif
 
 #include <fstream>
 #include <atomic>
 #include <thread>
+#include <mutex>
+#include <chrono>
+#include <ctime>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <stdexcept>
+#include <vector>
+#include <array>
+#include <list>
+#include <unordered_map>
+#include <cctype>
+#include <cstring>
 #include <iostream>
 
-using namespace boost;
+using namespace boost;
+
+// Log-linear latency histogram in the spirit of HdrHistogram. Values are
+// recorded in microseconds; below 64 every value has a bucket of its own,
+// above that every power of two is split into 32 buckets, so a reported
+// percentile is within about 3% of the recorded value. Recording is a
+// relaxed atomic increment, so readers may merge a histogram at any time.
+class LatencyHistogram
+{
+public:
+    static const unsigned int SUB_BUCKET_BITS = 5;
+    static const unsigned int SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+    static const unsigned int MAX_MAGNITUDE = 35; // About 9.5 hours.
+    static const unsigned int BUCKET_COUNT = (MAX_MAGNITUDE - SUB_BUCKET_BITS + 2) * SUB_BUCKET_COUNT;
+
+    LatencyHistogram()
+    {
+        for (auto &bucket : m_buckets)
+        {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void Record(std::uint64_t value_us)
+    {
+        m_buckets[GetBucketIndex(value_us)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Adds the counts of this histogram to the plain array of counts.
+    void MergeInto(std::vector<std::uint64_t> &counts) const
+    {
+        counts.resize(BUCKET_COUNT, 0);
+
+        for (std::size_t i = 0; i < BUCKET_COUNT; i++)
+        {
+            counts[i] += m_buckets[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    // Returns the value at the given percentile of the merged counts.
+    static std::uint64_t GetPercentile(const std::vector<std::uint64_t> &counts,
+                                       double percentile)
+    {
+        std::uint64_t total = 0;
+        for (std::uint64_t count : counts)
+        {
+            total += count;
+        }
+
+        if (total == 0)
+            return 0;
+
+        std::uint64_t rank = static_cast<std::uint64_t>(percentile / 100.0 * total + 0.5);
+        if (rank == 0)
+            rank = 1;
+
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < counts.size(); i++)
+        {
+            seen += counts[i];
+            if (seen >= rank)
+                return GetBucketValue(i);
+        }
+
+        return GetBucketValue(counts.size() - 1);
+    }
+
+private:
+    static unsigned int GetMagnitude(std::uint64_t value)
+    {
+        unsigned int magnitude = 0;
+        while (value >>= 1)
+            magnitude++;
+
+        return magnitude;
+    }
+
+    static std::size_t GetBucketIndex(std::uint64_t value)
+    {
+        if (value < 2 * SUB_BUCKET_COUNT)
+            return static_cast<std::size_t>(value);
+
+        unsigned int magnitude = GetMagnitude(value);
+        if (magnitude > MAX_MAGNITUDE)
+            return BUCKET_COUNT - 1;
+
+        unsigned int shift = magnitude - SUB_BUCKET_BITS;
+        return (magnitude - SUB_BUCKET_BITS) * SUB_BUCKET_COUNT +
+               static_cast<std::size_t>(value >> shift);
+    }
+
+    // Middle of the range of values counted by the bucket.
+    static std::uint64_t GetBucketValue(std::size_t index)
+    {
+        if (index < 2 * SUB_BUCKET_COUNT)
+            return index;
+
+        unsigned int shift = static_cast<unsigned int>(index / SUB_BUCKET_COUNT) - 1;
+        std::uint64_t lowest = static_cast<std::uint64_t>(index % SUB_BUCKET_COUNT + SUB_BUCKET_COUNT)
+                               << shift;
+
+        return lowest + ((std::uint64_t(1) << shift) >> 1);
+    }
+
+private:
+    std::atomic<std::uint64_t> m_buckets[BUCKET_COUNT];
+};
+
+// Latency histograms and counters of the server. They are split into
+// stripes and every thread records into the stripe it is assigned when it
+// records for the first time, so recording takes no lock and threads rarely
+// share cache lines. The stripes are merged on demand when dumped.
+class ServerStats
+{
+public:
+    enum Metric
+    {
+        AcceptToFirstByte, // From accepting the connection to receiving the first request.
+        Read,              // Reading a request.
+        Process,           // Processing the requests.
+        Write,             // Sending the responses.
+        METRIC_COUNT
+    };
+
+    enum Counter
+    {
+        Connections,
+        BytesIn,
+        BytesOut,
+        CacheHits,
+        CacheMisses,
+        COUNTER_COUNT
+    };
+
+    void Record(Metric metric, std::chrono::steady_clock::duration latency)
+    {
+        std::int64_t us =
+            std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+
+        GetStripe().m_histograms[metric].Record(us > 0 ? static_cast<std::uint64_t>(us) : 0);
+    }
+
+    void Add(Counter counter, std::uint64_t value)
+    {
+        GetStripe().m_counters[counter].fetch_add(value, std::memory_order_relaxed);
+    }
+
+    // Merges the statistics of all the threads and outputs them.
+    void Dump(std::ostream &os) const
+    {
+        static const char *metric_names[METRIC_COUNT] =
+            {"accept_to_first_byte", "read", "process", "write"};
+        static const char *counter_names[COUNTER_COUNT] =
+            {"connections", "bytes_in", "bytes_out", "cache_hits", "cache_misses"};
+
+        std::vector<std::uint64_t> counts[METRIC_COUNT];
+        std::uint64_t counters[COUNTER_COUNT] = {};
+
+        for (const Stripe &stripe : m_stripes)
+        {
+            for (int m = 0; m < METRIC_COUNT; m++)
+            {
+                stripe.m_histograms[m].MergeInto(counts[m]);
+            }
+
+            for (int c = 0; c < COUNTER_COUNT; c++)
+            {
+                counters[c] += stripe.m_counters[c].load(std::memory_order_relaxed);
+            }
+        }
+
+        for (int c = 0; c < COUNTER_COUNT; c++)
+        {
+            os << counter_names[c] << "=" << counters[c]
+               << (c + 1 < COUNTER_COUNT ? " " : "\n");
+        }
+
+        for (int m = 0; m < METRIC_COUNT; m++)
+        {
+            std::uint64_t total = 0;
+            for (std::uint64_t count : counts[m])
+            {
+                total += count;
+            }
+
+            os << metric_names[m] << "_us count=" << total
+               << " p50=" << LatencyHistogram::GetPercentile(counts[m], 50.0)
+               << " p99=" << LatencyHistogram::GetPercentile(counts[m], 99.0)
+               << " p999=" << LatencyHistogram::GetPercentile(counts[m], 99.9)
+               << " max=" << LatencyHistogram::GetPercentile(counts[m], 100.0)
+               << "\n";
+        }
+    }
+
+private:
+    static const unsigned int STRIPE_COUNT = 16;
+
+    struct Stripe
+    {
+        Stripe()
+        {
+            for (auto &counter : m_counters)
+            {
+                counter.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        LatencyHistogram m_histograms[METRIC_COUNT];
+        std::atomic<std::uint64_t> m_counters[COUNTER_COUNT];
+        char m_padding[64]; // Keeps the counters off the next stripe's cache line.
+    };
+
+    Stripe &GetStripe()
+    {
+        static std::atomic<unsigned int> next_stripe(0);
+        thread_local unsigned int stripe = next_stripe.fetch_add(1) % STRIPE_COUNT;
+
+        return m_stripes[stripe];
+    }
+
+private:
+    Stripe m_stripes[STRIPE_COUNT];
+};
+
+// Headers of an HTTP message kept as slices of the buffer the message head
+// was parsed from, in a flat array searched linearly; messages rarely carry
+// more than a few dozen headers. The slices are offsets into the buffer, so
+// the buffer may be moved as long as rebase() is called afterwards.
+class HTTPHeaders
+{
+    friend class HTTPParser;
+
+public:
+    static const std::size_t MAX_HEADERS = 64;
+
+    HTTPHeaders() : m_base(nullptr),
+                    m_count(0)
+    {
+    }
+
+    std::size_t size() const
+    {
+        return m_count;
+    }
+
+    boost::string_view name(std::size_t i) const
+    {
+        return view(m_names[i]);
+    }
+
+    boost::string_view value(std::size_t i) const
+    {
+        return view(m_values[i]);
+    }
+
+    // Value of the first header with the name, compared case-insensitively,
+    // without the surrounding whitespace. Empty if there is no such header.
+    boost::string_view find(boost::string_view name) const
+    {
+        for (std::size_t i = 0; i < m_count; i++)
+        {
+            if (equals_no_case(view(m_names[i]), name))
+                return view(m_values[i]);
+        }
+
+        return boost::string_view();
+    }
+
+    // Points the slices to a copy of the buffer they were parsed from.
+    void rebase(const char *base)
+    {
+        m_base = base;
+    }
+
+    static bool equals_no_case(boost::string_view a, boost::string_view b)
+    {
+        if (a.size() != b.size())
+            return false;
+
+        for (std::size_t i = 0; i < a.size(); i++)
+        {
+            if (std::tolower(static_cast<unsigned char>(a[i])) !=
+                std::tolower(static_cast<unsigned char>(b[i])))
+                return false;
+        }
+
+        return true;
+    }
+
+private:
+    struct Span
+    {
+        std::uint32_t m_offset;
+        std::uint32_t m_size;
+    };
+
+    boost::string_view view(const Span &span) const
+    {
+        return boost::string_view(m_base + span.m_offset, span.m_size);
+    }
+
+private:
+    const char *m_base;
+    Span m_names[MAX_HEADERS];
+    Span m_values[MAX_HEADERS];
+    std::size_t m_count;
+};
+
+// Incremental parser of the head of an HTTP/1.1 request or response: the
+// start line and the headers up to the empty line. It works in place on the
+// bytes received so far and is resumable; each call to parse() scans only the
+// bytes that have arrived since the previous call. The results are slices of
+// the buffer passed to the last call, valid while the buffer is unchanged.
+class HTTPParser
+{
+public:
+    enum class Kind
+    {
+        Request,
+        Response
+    };
+
+    enum class Result
+    {
+        Done,     // The whole head has been parsed.
+        NeedMore, // The head is incomplete, call again once more data arrives.
+        Invalid   // The head is malformed or has too many headers.
+    };
+
+    explicit HTTPParser(Kind kind) : m_kind(kind)
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        m_data = nullptr;
+        m_pos = 0;
+        m_scan = 0;
+        m_start_line_done = false;
+        m_done = false;
+        m_status_code = 0;
+        m_headers.m_base = nullptr;
+        m_headers.m_count = 0;
+    }
+
+    // data and size designate all the bytes of the message received so far.
+    // The buffer may have been moved since the previous call.
+    Result parse(const char *data, std::size_t size)
+    {
+        m_data = data;
+        m_headers.m_base = data;
+
+        while (!m_done)
+        {
+            const char *line_end = find_byte(data + m_scan, data + size, '\n');
+            if (line_end == data + size)
+            {
+                m_scan = size;
+                return Result::NeedMore;
+            }
+
+            std::size_t line_begin = m_pos;
+            std::size_t line_size = (line_end - data) - line_begin;
+            if (line_size > 0 && data[line_begin + line_size - 1] == '\r')
+                line_size--;
+
+            m_pos = m_scan = (line_end - data) + 1;
+
+            if (!m_start_line_done)
+            {
+                // Empty lines preceding a request are ignored.
+                if (line_size == 0 && m_kind == Kind::Request)
+                    continue;
+
+                if (!parse_start_line(line_begin, line_size))
+                    return Result::Invalid;
+
+                m_start_line_done = true;
+            }
+            else if (line_size == 0)
+            {
+                m_done = true;
+            }
+            else if (!parse_header(line_begin, line_size))
+            {
+                return Result::Invalid;
+            }
+        }
+
+        return Result::Done;
+    }
+
+    // Size of the head including the empty line, once parsed.
+    std::size_t head_size() const
+    {
+        return m_pos;
+    }
+
+    // Request line.
+    boost::string_view method() const
+    {
+        return view(m_first);
+    }
+
+    boost::string_view uri() const
+    {
+        return view(m_second);
+    }
+
+    // Status line.
+    unsigned int status_code() const
+    {
+        return m_status_code;
+    }
+
+    boost::string_view reason() const
+    {
+        return view(m_third);
+    }
+
+    boost::string_view version() const
+    {
+        return m_kind == Kind::Request ? view(m_third) : view(m_first);
+    }
+
+    const HTTPHeaders &headers() const
+    {
+        return m_headers;
+    }
+
+private:
+    typedef HTTPHeaders::Span Span;
+
+    boost::string_view view(const Span &span) const
+    {
+        return boost::string_view(m_data + span.m_offset, span.m_size);
+    }
+
+    static Span make_span(std::size_t offset, std::size_t size)
+    {
+        Span span;
+        span.m_offset = static_cast<std::uint32_t>(offset);
+        span.m_size = static_cast<std::uint32_t>(size);
+
+        return span;
+    }
+
+    // Returns the first occurrence of c in [begin, end), or end. Compares
+    // 16 bytes at a time with SSE2 where it is available.
+    static const char *find_byte(const char *begin, const char *end, char c)
+    {
+#if defined(__SSE2__)
+        const __m128i pattern = _mm_set1_epi8(c);
+
+        while (end - begin >= 16)
+        {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(begin));
+            int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, pattern));
+            if (mask != 0)
+                return begin + __builtin_ctz(mask);
+
+            begin += 16;
+        }
+#endif
+        const void *found = std::memchr(begin, c, end - begin);
+
+        return found != nullptr ? static_cast<const char *>(found) : end;
+    }
+
+    // "METHOD SP URI SP VERSION" or "VERSION SP CODE [SP REASON]".
+    bool parse_start_line(std::size_t begin, std::size_t size)
+    {
+        const char *line = m_data + begin;
+        const char *line_end = line + size;
+
+        const char *first_space = find_byte(line, line_end, ' ');
+        if (first_space == line || first_space == line_end)
+            return false;
+
+        m_first = make_span(begin, first_space - line);
+
+        if (m_kind == Kind::Request)
+        {
+            const char *uri = first_space + 1;
+            const char *second_space = find_byte(uri, line_end, ' ');
+            if (second_space == uri || second_space == line_end ||
+                second_space + 1 == line_end)
+                return false;
+
+            m_second = make_span(uri - m_data, second_space - uri);
+            m_third = make_span(second_space + 1 - m_data, line_end - second_space - 1);
+
+            return view(m_third).starts_with("HTTP/");
+        }
+
+        if (!view(m_first).starts_with("HTTP/"))
+            return false;
+
+        const char *code = first_space + 1;
+        if (line_end - code < 3 ||
+            (line_end - code > 3 && code[3] != ' '))
+            return false;
+
+        m_status_code = 0;
+        for (int i = 0; i < 3; i++)
+        {
+            if (code[i] < '0' || code[i] > '9')
+                return false;
+
+            m_status_code = m_status_code * 10 + (code[i] - '0');
+        }
+
+        m_second = make_span(code - m_data, 3);
+
+        const char *reason = line_end - code > 3 ? code + 4 : line_end;
+        m_third = make_span(reason - m_data, line_end - reason);
+
+        return true;
+    }
+
+    // "NAME: VALUE", the value surrounded by optional whitespace.
+    bool parse_header(std::size_t begin, std::size_t size)
+    {
+        if (m_headers.m_count == HTTPHeaders::MAX_HEADERS)
+            return false;
+
+        const char *line = m_data + begin;
+        const char *line_end = line + size;
+
+        // A line beginning with whitespace continues the previous header's
+        // value (obsolete line folding), which is no longer allowed.
+        if (line[0] == ' ' || line[0] == '\t')
+            return false;
+
+        const char *colon = find_byte(line, line_end, ':');
+        if (colon == line || colon == line_end ||
+            colon[-1] == ' ' || colon[-1] == '\t')
+            return false;
+
+        const char *value = colon + 1;
+        while (value < line_end && (*value == ' ' || *value == '\t'))
+            value++;
+
+        const char *value_end = line_end;
+        while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+            value_end--;
+
+        m_headers.m_names[m_headers.m_count] = make_span(begin, colon - line);
+        m_headers.m_values[m_headers.m_count] = make_span(value - m_data, value_end - value);
+        m_headers.m_count++;
+
+        return true;
+    }
+
+private:
+    Kind m_kind;
+
+    const char *m_data; // Buffer passed to the last call.
+    std::size_t m_pos;  // Beginning of the first line not parsed yet.
+    std::size_t m_scan; // Where to continue looking for the end of the line.
+    bool m_start_line_done;
+    bool m_done;
+
+    // Method, URI and version of a request;
+    // version, status code and reason of a response.
+    Span m_first;
+    Span m_second;
+    Span m_third;
+    unsigned int m_status_code;
+
+    HTTPHeaders m_headers;
+};
+
+// Size-bounded LRU cache of the files served, keyed by resource path. An
+// entry holds the whole response to a GET of the file, the file's bytes next
+// to the prebuilt status line and headers, so a hit is sent with one gather
+// write. The cache is split into shards, each with a lock and an LRU list of
+// its own, so that threads serving different resources rarely contend. A hit
+// compares the file's mtime and size with the cached ones at most once per
+// REVALIDATE_INTERVAL; other hits make no file system calls.
+class ResourceCache : public boost::noncopyable
+{
+public:
+    // The mtime is kept in nanoseconds where the system provides them, so
+    // that a file rewritten within the second it was cached is noticed; the
+    // size catches most such rewrites elsewhere.
+    struct FileVersion
+    {
+        std::int64_t m_mtime_ns;
+        std::uintmax_t m_size;
+
+        bool operator==(const FileVersion &other) const
+        {
+            return m_mtime_ns == other.m_mtime_ns && m_size == other.m_size;
+        }
+    };
+
+    struct Resource
+    {
+        std::string m_head; // Status line and headers including the empty line.
+        std::string m_body;
+        FileVersion m_version;
+    };
+
+    static bool GetFileVersion(const std::string &file_path,
+                               FileVersion &version)
+    {
+#if BOOST_OS_LINUX
+        struct stat st;
+        if (::stat(file_path.c_str(), &st) != 0)
+            return false;
+
+        version.m_mtime_ns = static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+                             st.st_mtim.tv_nsec;
+        version.m_size = static_cast<std::uintmax_t>(st.st_size);
+#else
+        boost::system::error_code ec;
+        std::time_t mtime = boost::filesystem::last_write_time(file_path, ec);
+        if (ec.value() != 0)
+            return false;
+
+        version.m_size = boost::filesystem::file_size(file_path, ec);
+        if (ec.value() != 0)
+            return false;
+
+        version.m_mtime_ns = static_cast<std::int64_t>(mtime) * 1000000000;
+#endif
+        return true;
+    }
+
+    // Files larger than max_resource_size are not cached.
+    ResourceCache(std::size_t capacity_bytes,
+                  std::size_t max_resource_size) : m_shard_capacity(capacity_bytes / SHARD_COUNT),
+                                                   m_max_resource_size(max_resource_size)
+    {
+    }
+
+    std::size_t GetMaxResourceSize() const
+    {
+        return m_max_resource_size;
+    }
+
+    // Returns the cached resource, or nullptr if the resource is not cached
+    // or its file, found under the root directory, has been modified since
+    // it was cached. The file's path is only built to revalidate the entry,
+    // so a hit allocates nothing.
+    std::shared_ptr<const Resource> Find(const std::string &path,
+                                         const char *root)
+    {
+        Shard &shard = GetShard(path);
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+        std::unique_lock<std::mutex> lock(shard.m_guard);
+
+        auto it = shard.m_index.find(path);
+        if (it == shard.m_index.end())
+            return nullptr;
+
+        // Move the entry to the front of the LRU list.
+        shard.m_lru.splice(shard.m_lru.begin(), shard.m_lru, it->second);
+
+        Entry &entry = *it->second;
+        std::shared_ptr<const Resource> resource = entry.m_resource;
+
+        if (now - entry.m_checked_at < REVALIDATE_INTERVAL)
+            return resource;
+
+        // Other threads keep using the entry while this one checks the file.
+        entry.m_checked_at = now;
+        lock.unlock();
+
+        FileVersion version;
+        if (GetFileVersion(std::string(root) + path, version) &&
+            version == resource->m_version)
+            return resource;
+
+        Remove(path, resource);
+        return nullptr;
+    }
+
+    void Insert(const std::string &path,
+                std::shared_ptr<const Resource> resource)
+    {
+        std::size_t size = GetSize(path, *resource);
+        if (size > m_shard_capacity)
+            return;
+
+        Shard &shard = GetShard(path);
+        std::unique_lock<std::mutex> lock(shard.m_guard);
+
+        auto it = shard.m_index.find(path);
+        if (it != shard.m_index.end())
+        {
+            shard.m_size -= GetSize(path, *it->second->m_resource);
+            shard.m_lru.erase(it->second);
+            shard.m_index.erase(it);
+        }
+
+        while (shard.m_size + size > m_shard_capacity)
+        {
+            // Evict the least recently used entry.
+            Entry &lru = shard.m_lru.back();
+            shard.m_size -= GetSize(lru.m_path, *lru.m_resource);
+            shard.m_index.erase(lru.m_path);
+            shard.m_lru.pop_back();
+        }
+
+        shard.m_lru.push_front(Entry{path, std::move(resource), std::chrono::steady_clock::now()});
+        shard.m_index.emplace(path, shard.m_lru.begin());
+        shard.m_size += size;
+    }
+
+private:
+    static const unsigned int SHARD_COUNT = 16;
+    static constexpr std::chrono::seconds REVALIDATE_INTERVAL{1};
+
+    struct Entry
+    {
+        std::string m_path;
+        std::shared_ptr<const Resource> m_resource;
+        std::chrono::steady_clock::time_point m_checked_at;
+    };
+
+    struct Shard
+    {
+        Shard() : m_size(0)
+        {
+        }
+
+        std::list<Entry> m_lru; // Most recently used first.
+        std::unordered_map<std::string, std::list<Entry>::iterator> m_index;
+        std::size_t m_size;
+        std::mutex m_guard;
+    };
+
+    static std::size_t GetSize(const std::string &path, const Resource &resource)
+    {
+        return path.size() + resource.m_head.size() + resource.m_body.size();
+    }
+
+    Shard &GetShard(const std::string &path)
+    {
+        return m_shards[std::hash<std::string>()(path) % SHARD_COUNT];
+    }
+
+    // Removes the entry unless it has been replaced meanwhile.
+    void Remove(const std::string &path,
+                const std::shared_ptr<const Resource> &resource)
+    {
+        Shard &shard = GetShard(path);
+        std::unique_lock<std::mutex> lock(shard.m_guard);
+
+        auto it = shard.m_index.find(path);
+        if (it == shard.m_index.end() || it->second->m_resource != resource)
+            return;
+
+        shard.m_size -= GetSize(path, *resource);
+        shard.m_lru.erase(it->second);
+        shard.m_index.erase(it);
+    }
+
+private:
+    std::size_t m_shard_capacity;
+    std::size_t m_max_resource_size;
+    Shard m_shards[SHARD_COUNT];
+};
+
+constexpr std::chrono::seconds ResourceCache::REVALIDATE_INTERVAL;
 
 class Service
 {
@@ -14,69 +812,108 @@ class Service
         http_status_table;
 
 public:
-    Service(std::shared_ptr<boost::asio::ip::tcp::socket> sock) : m_sock(sock),
-                                                                  m_request(4096),
-                                                                  m_response_status_code(200), // Assume success.
-                                                                  m_resource_size_bytes(0){};
+    Service(std::shared_ptr<boost::asio::ip::tcp::socket> sock,
+            ServerStats &stats,
+            ResourceCache &cache) : m_sock(sock),
+                                  m_request(MAX_REQUEST_SIZE),
+                                  m_parser(HTTPParser::Kind::Request),
+                                  m_response_status_code(200), // Assume success.
+                                  m_resource_size_bytes(0),
+                                  m_file_fd(-1),
+                                  m_file_offset(0),
+                                  m_cache(cache),
+                                  m_stats(stats),
+                                  m_accepted_at(std::chrono::steady_clock::now()){};
 
     void start_handling()
     {
-        asio::async_read_until(*m_sock.get(),
-                               m_request,
-                               "\r\n",
-                               [this](
-                                   const boost::system::error_code &ec,
-                                   std::size_t bytes_transferred)
-                               {
-                                   on_request_line_received(ec,
-                                                            bytes_transferred);
-                               });
+        read_request();
     }
 
 private:
-    void on_request_line_received(
+    // The request is parsed as its bytes arrive, in
+    // place in a buffer of MAX_REQUEST_SIZE bytes.
+    static const std::size_t MAX_REQUEST_SIZE = 4096;
+
+    // Files up to this size are read into memory and sent with a gather
+    // write together with the headers; larger ones are sent with sendfile().
+    static const std::size_t MAX_BUFFERED_FILE_SIZE = 64 * 1024;
+    static const std::size_t SENDFILE_CHUNK_SIZE = 1024 * 1024;
+
+    void read_request()
+    {
+        m_sock->async_read_some(m_request.prepare(MAX_REQUEST_SIZE - m_request.size()),
+                                [this](
+                                    const boost::system::error_code &ec,
+                                    std::size_t bytes_transferred)
+                                {
+                                    on_request_data_received(ec,
+                                                             bytes_transferred);
+                                });
+    }
+
+    void on_request_data_received(
         const boost::system::error_code &ec,
         std::size_t bytes_transferred)
     {
+        m_request.commit(bytes_transferred);
+
         if (ec.value() != 0)
         {
             std::cout << "Error occured! Error code = "
                       << ec.value()
                       << ". Message: " << ec.message();
 
-            if (ec == asio::error::not_found)
-            {
-                // No delimiter has been fonud in the
-                // request message.
+            // In case of any error - close the
+            // socket and clean up.
+            on_finish();
+            return;
+        }
 
-                m_response_status_code = 413;
-                send_response();
+        if (m_request.size() == bytes_transferred)
+        {
+            m_first_byte_received_at = std::chrono::steady_clock::now();
+            m_stats.Record(ServerStats::AcceptToFirstByte,
+                           m_first_byte_received_at - m_accepted_at);
+        }
+        m_stats.Add(ServerStats::BytesIn, bytes_transferred);
 
-                return;
+        HTTPParser::Result result = m_parser.parse(
+            asio::buffer_cast<const char *>(m_request.data()),
+            m_request.size());
+
+        if (result == HTTPParser::Result::NeedMore)
+        {
+            if (m_request.size() < MAX_REQUEST_SIZE)
+            {
+                read_request();
             }
             else
             {
-                // In case of any other error �
-                // close the socket and clean up.
-                on_finish();
-                return;
+                // The headers do not fit into the buffer.
+                m_response_status_code = 413;
+                send_response();
             }
+
+            return;
         }
 
-        // Parse the request line.
-        std::string request_line;
-        std::istream request_stream(&m_request);
-        std::getline(request_stream, request_line, '\r');
-        // Remove symbol '\n' from the buffer.
-        request_stream.get();
+        if (result == HTTPParser::Result::Invalid)
+        {
+            m_response_status_code = 400;
+            send_response();
+
+            return;
+        }
 
-        // Parse the request line.
-        std::string request_method;
-        std::istringstream request_line_stream(request_line);
-        request_line_stream >> request_method;
+        // The request is read from the moment its first byte arrives.
+        std::chrono::steady_clock::time_point headers_received_at =
+            std::chrono::steady_clock::now();
+        m_stats.Record(ServerStats::Read,
+                       headers_received_at - m_first_byte_received_at);
 
         // We only support GET method.
-        if (request_method.compare("GET") != 0)
+        if (m_parser.method() != "GET")
         {
             // Unsupported method.
             m_response_status_code = 501;
@@ -85,95 +922,43 @@ private:
             return;
         }
 
-        request_line_stream >> m_requested_resource;
-
-        std::string request_http_version;
-        request_line_stream >> request_http_version;
-
-        if (request_http_version.compare("HTTP/1.1") != 0)
+        if (m_parser.version() != "HTTP/1.1")
         {
-            // Unsupported HTTP version or bad request.
+            // Unsupported HTTP version.
             m_response_status_code = 505;
             send_response();
 
             return;
         }
 
-        // At this point the request line is successfully
-        // received and parsed. Now read the request headers.
-        asio::async_read_until(*m_sock.get(),
-                               m_request,
-                               "\r\n\r\n",
-                               [this](
-                                   const boost::system::error_code &ec,
-                                   std::size_t bytes_transferred)
-                               {
-                                   on_headers_received(ec,
-                                                       bytes_transferred);
-                               });
-
-        return;
-    }
+        m_requested_resource.assign(m_parser.uri().data(),
+                                    m_parser.uri().size());
 
-    void on_headers_received(const boost::system::error_code &ec,
-                             std::size_t bytes_transferred)
-    {
-        if (ec.value() != 0)
-        {
-            std::cout << "Error occured! Error code = "
-                      << ec.value()
-                      << ". Message: " << ec.message();
+        // Now we have all we need to process the request.
+        process_request();
 
-            if (ec == asio::error::not_found)
-            {
-                // No delimiter has been fonud in the
-                // request message.
+        m_stats.Record(ServerStats::Process,
+                       std::chrono::steady_clock::now() - headers_received_at);
 
-                m_response_status_code = 413;
-                send_response();
-                return;
-            }
-            else
-            {
-                // In case of any other error - close the
-                // socket and clean up.
-                on_finish();
-                return;
-            }
-        }
+        send_response();
+    }
 
-        // Parse and store headers.
-        std::istream request_stream(&m_request);
-        std::string header_name, header_value;
+    void process_request()
+    {
+        const char *root = "D:\\http_root";
 
-        while (!request_stream.eof())
+        m_cached_resource = m_cache.Find(m_requested_resource, root);
+        if (m_cached_resource != nullptr)
         {
-            std::getline(request_stream, header_name, ':');
-            if (!request_stream.eof())
-            {
-                std::getline(request_stream,
-                             header_value,
-                             '\r');
-
-                // Remove symbol \n from the stream.
-                request_stream.get();
-                m_request_headers[header_name] =
-                    header_value;
-            }
+            m_stats.Add(ServerStats::CacheHits, 1);
+            return;
         }
 
-        // Now we have all we need to process the request.
-        process_request();
-        send_response();
-
-        return;
-    }
+        m_stats.Add(ServerStats::CacheMisses, 1);
 
-    void process_request()
-    {
         // Read file.
         std::string resource_file_path =
-            std::string("D:\\http_root") +
+            std::string(root) +
             m_requested_resource;
 
         if (!boost::filesystem::exists(resource_file_path))
@@ -184,6 +969,47 @@ private:
             return;
         }
 
+        boost::system::error_code ec;
+        m_resource_size_bytes = static_cast<std::size_t>(
+            boost::filesystem::file_size(resource_file_path, ec));
+
+        if (ec.value() != 0)
+        {
+            m_resource_size_bytes = 0;
+            m_response_status_code = 500;
+
+            return;
+        }
+
+        if (m_resource_size_bytes <= m_cache.GetMaxResourceSize())
+        {
+            load_resource(resource_file_path);
+            return;
+        }
+
+#if BOOST_OS_LINUX
+        if (m_resource_size_bytes > MAX_BUFFERED_FILE_SIZE)
+        {
+            // Larger files are sent from the page cache by
+            // send_file() after the status line and the headers.
+            m_file_fd = ::open(resource_file_path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (m_file_fd == -1)
+            {
+                m_resource_size_bytes = 0;
+                m_response_status_code = 500;
+
+                return;
+            }
+
+            m_response_headers += std::string("content-length") +
+                                  ": " +
+                                  std::to_string(m_resource_size_bytes) +
+                                  "\r\n";
+
+            return;
+        }
+#endif
+
         std::ifstream resource_fstream(
             resource_file_path,
             std::ifstream::binary);
@@ -192,21 +1018,15 @@ private:
         {
             // Could not open file.
             // Something bad has happened.
+            m_resource_size_bytes = 0;
             m_response_status_code = 500;
 
             return;
         }
 
-        // Find out file size.
-        resource_fstream.seekg(0, std::ifstream::end);
-        m_resource_size_bytes =
-            static_cast<std::size_t>(
-                resource_fstream.tellg());
-
         m_resource_buffer.reset(
             new char[m_resource_size_bytes]);
 
-        resource_fstream.seekg(std::ifstream::beg);
         resource_fstream.read(m_resource_buffer.get(),
                               m_resource_size_bytes);
 
@@ -216,11 +1036,68 @@ private:
                               "\r\n";
     }
 
+    // Reads the file and its mtime and size into a new cache
+    // entry, building the status line and the headers once.
+    void load_resource(const std::string &resource_file_path)
+    {
+        std::shared_ptr<ResourceCache::Resource> resource =
+            std::make_shared<ResourceCache::Resource>();
+
+        bool has_version = ResourceCache::GetFileVersion(resource_file_path,
+                                                         resource->m_version);
+
+        std::ifstream resource_fstream(
+            resource_file_path,
+            std::ifstream::binary);
+
+        if (!has_version || !resource_fstream.is_open())
+        {
+            m_resource_size_bytes = 0;
+            m_response_status_code = 500;
+
+            return;
+        }
+
+        resource->m_body.resize(m_resource_size_bytes);
+        resource_fstream.read(&resource->m_body[0], m_resource_size_bytes);
+
+        if (static_cast<std::size_t>(resource_fstream.gcount()) != m_resource_size_bytes)
+        {
+            // The file has been truncated meanwhile.
+            m_resource_size_bytes = 0;
+            m_response_status_code = 500;
+
+            return;
+        }
+
+        resource->m_head = std::string("HTTP/1.1 ") +
+                           http_status_table.at(200) +
+                           "\r\n" +
+                           "content-length: " +
+                           std::to_string(m_resource_size_bytes) +
+                           "\r\n\r\n";
+
+        m_cache.Insert(m_requested_resource, resource);
+        m_cached_resource = std::move(resource);
+    }
+
     void send_response()
     {
         m_sock->shutdown(
             asio::ip::tcp::socket::shutdown_receive);
 
+        m_response_started_at = std::chrono::steady_clock::now();
+
+        if (m_cached_resource != nullptr)
+        {
+            std::array<asio::const_buffer, 2> response_buffers =
+                {asio::buffer(m_cached_resource->m_head),
+                 asio::buffer(m_cached_resource->m_body)};
+
+            write_response(response_buffers);
+            return;
+        }
+
         auto status_line =
             http_status_table.at(m_response_status_code);
 
@@ -240,13 +1117,19 @@ private:
                 asio::buffer(m_response_headers));
         }
 
-        if (m_resource_size_bytes > 0)
+        if (m_resource_buffer != nullptr && m_resource_size_bytes > 0)
         {
             response_buffers.push_back(
                 asio::buffer(m_resource_buffer.get(),
                              m_resource_size_bytes));
         }
 
+        write_response(response_buffers);
+    }
+
+    template <typename ConstBufferSequence>
+    void write_response(const ConstBufferSequence &response_buffers)
+    {
         // Initiate asynchronous write operation.
         asio::async_write(*m_sock.get(),
                           response_buffers,
@@ -254,14 +1137,81 @@ private:
                               const boost::system::error_code &ec,
                               std::size_t bytes_transferred)
                           {
+#if BOOST_OS_LINUX
+                              if (ec.value() == 0 && m_file_fd != -1)
+                              {
+                                  m_stats.Add(ServerStats::BytesOut, bytes_transferred);
+                                  send_file();
+                                  return;
+                              }
+#endif
                               on_response_sent(ec,
                                                bytes_transferred);
                           });
     }
 
+#if BOOST_OS_LINUX
+    // Sends the file with sendfile(), which copies it from the page cache to
+    // the socket without passing it through user space. At most
+    // SENDFILE_CHUNK_SIZE bytes are sent at a time; when the socket's send
+    // buffer is full, waits for it to become writable again.
+    void send_file()
+    {
+        boost::system::error_code ec;
+        m_sock->non_blocking(true, ec);
+
+        std::size_t bytes_sent = 0;
+
+        while (ec.value() == 0 && m_file_offset < static_cast<off_t>(m_resource_size_bytes))
+        {
+            std::size_t chunk_size =
+                m_resource_size_bytes - static_cast<std::size_t>(m_file_offset);
+            if (chunk_size > SENDFILE_CHUNK_SIZE)
+                chunk_size = SENDFILE_CHUNK_SIZE;
+
+            ssize_t n = ::sendfile(m_sock->native_handle(), m_file_fd, &m_file_offset, chunk_size);
+            if (n > 0)
+            {
+                bytes_sent += static_cast<std::size_t>(n);
+                continue;
+            }
+
+            if (n == 0)
+            {
+                // The file has been truncated meanwhile.
+                ec = asio::error::eof;
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                m_stats.Add(ServerStats::BytesOut, bytes_sent);
+
+                m_sock->async_wait(asio::ip::tcp::socket::wait_write,
+                                   [this](const boost::system::error_code &ec)
+                                   {
+                                       if (ec.value() != 0)
+                                           on_response_sent(ec, 0);
+                                       else
+                                           send_file();
+                                   });
+                return;
+            }
+            else if (errno != EINTR)
+            {
+                ec = boost::system::error_code(errno, asio::error::get_system_category());
+            }
+        }
+
+        on_response_sent(ec, bytes_sent);
+    }
+#endif
+
     void on_response_sent(const boost::system::error_code &ec,
                           std::size_t bytes_transferred)
     {
+        m_stats.Record(ServerStats::Write,
+                       std::chrono::steady_clock::now() - m_response_started_at);
+        m_stats.Add(ServerStats::BytesOut, bytes_transferred);
+
         if (ec.value() != 0)
         {
             std::cout << "Error occured! Error code = "
@@ -277,49 +1227,334 @@ private:
     // Here we perform the cleanup.
     void on_finish()
     {
+#if BOOST_OS_LINUX
+        if (m_file_fd != -1)
+            ::close(m_file_fd);
+#endif
+
         delete this;
     }
 
 private:
     std::shared_ptr<boost::asio::ip::tcp::socket> m_sock;
     boost::asio::streambuf m_request;
-    std::map<std::string, std::string> m_request_headers;
+    HTTPParser m_parser;
     std::string m_requested_resource;
 
     std::unique_ptr<char[]> m_resource_buffer;
+    std::shared_ptr<const ResourceCache::Resource> m_cached_resource;
     unsigned int m_response_status_code;
     std::size_t m_resource_size_bytes;
+
+    // File sent with sendfile() and how much of it has been sent.
+    int m_file_fd;
+    off_t m_file_offset;
     std::string m_response_headers;
     std::string m_response_status_line;
+
+    ResourceCache &m_cache;
+
+    // Statistics of the server and the points in
+    // time the latencies are measured from.
+    ServerStats &m_stats;
+    std::chrono::steady_clock::time_point m_accepted_at;
+    std::chrono::steady_clock::time_point m_first_byte_received_at;
+    std::chrono::steady_clock::time_point m_response_started_at;
 };
 
 const std::map<unsigned int, std::string>
     Service::http_status_table =
         {
             {200, "200 OK"},
+            {400, "400 Bad Request"},
             {404, "404 Not Found"},
             {413, "413 Request Entity Too Large"},
             {500, "500 Server Error"},
             {501, "501 Not Implemented"},
             {505, "505 HTTP Version Not Supported"}};
 
+// Integer socket option meeting the Boost.Asio requirements for socket
+// options, for the options it provides no class for, such as SO_REUSEPORT.
+template <int Level, int Name>
+class IntegerSocketOption
+{
+public:
+    IntegerSocketOption() : m_value(0)
+    {
+    }
+
+    explicit IntegerSocketOption(int value) : m_value(value)
+    {
+    }
+
+    int value() const
+    {
+        return m_value;
+    }
+
+    template <typename Protocol>
+    int level(const Protocol &) const
+    {
+        return Level;
+    }
+
+    template <typename Protocol>
+    int name(const Protocol &) const
+    {
+        return Name;
+    }
+
+    template <typename Protocol>
+    int *data(const Protocol &)
+    {
+        return &m_value;
+    }
+
+    template <typename Protocol>
+    const int *data(const Protocol &) const
+    {
+        return &m_value;
+    }
+
+    template <typename Protocol>
+    std::size_t size(const Protocol &) const
+    {
+        return sizeof(m_value);
+    }
+
+    template <typename Protocol>
+    void resize(const Protocol &, std::size_t size)
+    {
+        if (size != sizeof(m_value))
+            throw std::length_error("IntegerSocketOption resize");
+    }
+
+private:
+    int m_value;
+};
+
+// Socket options applied to the listening sockets and every accepted connection.
+// Zero and false leave the system defaults in place, so a default
+// constructed profile changes nothing. The options are applied on a best
+// effort basis: one the system refuses or does not support is skipped,
+// which Log() makes visible by printing the values in effect.
+struct SocketProfile
+{
+    std::string name = "default";
+
+    bool no_delay = false;           // TCP_NODELAY: disable Nagle's algorithm.
+    int receive_buffer_size = 0;     // SO_RCVBUF in bytes.
+    int send_buffer_size = 0;        // SO_SNDBUF in bytes.
+    bool keep_alive = false;         // SO_KEEPALIVE together with the three below.
+    int keep_alive_idle_sec = 0;     // TCP_KEEPIDLE
+    int keep_alive_interval_sec = 0; // TCP_KEEPINTVL
+    int keep_alive_count = 0;        // TCP_KEEPCNT
+    bool quick_ack = false;          // TCP_QUICKACK, only in effect until the kernel leaves the quick ack mode.
+    int fast_open = 0;               // TCP_FASTOPEN queue length of a listener.
+    int busy_poll_us = 0;            // SO_BUSY_POLL; raising it above net.core.busy_read needs CAP_NET_ADMIN.
+
+    // Small request/response exchanges: segments go out at once, acks are
+    // not delayed, and the receiving thread spins briefly on the device queue.
+    static SocketProfile LowLatencyRpc()
+    {
+        SocketProfile profile;
+        profile.name = "low-latency-rpc";
+        profile.no_delay = true;
+        profile.keep_alive = true;
+        profile.keep_alive_idle_sec = 60;
+        profile.keep_alive_interval_sec = 10;
+        profile.keep_alive_count = 5;
+        profile.quick_ack = true;
+        profile.fast_open = 256;
+        profile.busy_poll_us = 50;
+
+        return profile;
+    }
+
+    // Large transfers: buffers big enough to keep a long fat pipe full.
+    static SocketProfile BulkTransfer()
+    {
+        SocketProfile profile;
+        profile.name = "bulk-transfer";
+        profile.receive_buffer_size = 4 * 1024 * 1024;
+        profile.send_buffer_size = 4 * 1024 * 1024;
+        profile.keep_alive = true;
+        profile.keep_alive_idle_sec = 60;
+        profile.keep_alive_interval_sec = 10;
+        profile.keep_alive_count = 5;
+
+        return profile;
+    }
+
+    // Called before the listening socket is bound. The buffer sizes are
+    // inherited by the accepted sockets and have to be set before listening
+    // for the TCP window scale to be negotiated accordingly.
+    void ApplyToListener(asio::ip::tcp::acceptor &acceptor) const
+    {
+        boost::system::error_code ignored_ec;
+
+        if (receive_buffer_size > 0)
+            acceptor.set_option(asio::socket_base::receive_buffer_size(receive_buffer_size), ignored_ec);
+
+        if (send_buffer_size > 0)
+            acceptor.set_option(asio::socket_base::send_buffer_size(send_buffer_size), ignored_ec);
+
+#if defined(TCP_FASTOPEN)
+        if (fast_open > 0)
+            acceptor.set_option(IntegerSocketOption<IPPROTO_TCP, TCP_FASTOPEN>(fast_open), ignored_ec);
+#endif
+    }
+
+    // Called for an accepted socket.
+    void ApplyToConnection(asio::ip::tcp::socket &sock) const
+    {
+        boost::system::error_code ignored_ec;
+
+        if (no_delay)
+            sock.set_option(asio::ip::tcp::no_delay(true), ignored_ec);
+
+        if (receive_buffer_size > 0)
+            sock.set_option(asio::socket_base::receive_buffer_size(receive_buffer_size), ignored_ec);
+
+        if (send_buffer_size > 0)
+            sock.set_option(asio::socket_base::send_buffer_size(send_buffer_size), ignored_ec);
+
+        if (keep_alive)
+            sock.set_option(asio::socket_base::keep_alive(true), ignored_ec);
+
+#if BOOST_OS_LINUX
+        if (keep_alive && keep_alive_idle_sec > 0)
+            sock.set_option(IntegerSocketOption<IPPROTO_TCP, TCP_KEEPIDLE>(keep_alive_idle_sec), ignored_ec);
+
+        if (keep_alive && keep_alive_interval_sec > 0)
+            sock.set_option(IntegerSocketOption<IPPROTO_TCP, TCP_KEEPINTVL>(keep_alive_interval_sec), ignored_ec);
+
+        if (keep_alive && keep_alive_count > 0)
+            sock.set_option(IntegerSocketOption<IPPROTO_TCP, TCP_KEEPCNT>(keep_alive_count), ignored_ec);
+
+        if (quick_ack)
+            sock.set_option(IntegerSocketOption<IPPROTO_TCP, TCP_QUICKACK>(1), ignored_ec);
+
+        if (busy_poll_us > 0)
+            sock.set_option(IntegerSocketOption<SOL_SOCKET, SO_BUSY_POLL>(busy_poll_us), ignored_ec);
+#endif
+    }
+
+    // Applies the profile to a scratch socket and outputs the values
+    // the system has put into effect next to the requested ones.
+    void Log(std::ostream &os) const
+    {
+        asio::io_service ios;
+        asio::ip::tcp::socket probe(ios);
+        boost::system::error_code ec;
+
+        probe.open(asio::ip::tcp::v4(), ec);
+        if (ec.value() != 0)
+        {
+            os << "Socket profile " << name << ": cannot open a socket. Message: "
+               << ec.message() << std::endl;
+            return;
+        }
+
+        ApplyToConnection(probe);
+
+        os << "Socket profile " << name << ':';
+
+        asio::ip::tcp::no_delay no_delay_value;
+        probe.get_option(no_delay_value, ec);
+        LogValue(os, "no_delay", ec ? -1 : no_delay_value.value(), no_delay);
+
+        asio::socket_base::receive_buffer_size receive_buffer_size_value;
+        probe.get_option(receive_buffer_size_value, ec);
+        LogValue(os, "receive_buffer_size", ec ? -1 : receive_buffer_size_value.value(), receive_buffer_size);
+
+        asio::socket_base::send_buffer_size send_buffer_size_value;
+        probe.get_option(send_buffer_size_value, ec);
+        LogValue(os, "send_buffer_size", ec ? -1 : send_buffer_size_value.value(), send_buffer_size);
+
+        asio::socket_base::keep_alive keep_alive_value;
+        probe.get_option(keep_alive_value, ec);
+        LogValue(os, "keep_alive", ec ? -1 : keep_alive_value.value(), keep_alive);
+
+#if BOOST_OS_LINUX
+        LogValue(os, "keep_alive_idle_sec", GetInteger<IPPROTO_TCP, TCP_KEEPIDLE>(probe), keep_alive_idle_sec);
+        LogValue(os, "keep_alive_interval_sec", GetInteger<IPPROTO_TCP, TCP_KEEPINTVL>(probe), keep_alive_interval_sec);
+        LogValue(os, "keep_alive_count", GetInteger<IPPROTO_TCP, TCP_KEEPCNT>(probe), keep_alive_count);
+        LogValue(os, "quick_ack", GetInteger<IPPROTO_TCP, TCP_QUICKACK>(probe), quick_ack);
+        LogValue(os, "busy_poll_us", GetInteger<SOL_SOCKET, SO_BUSY_POLL>(probe), busy_poll_us);
+#endif
+        os << " fast_open=" << fast_open;
+
+        os << std::endl;
+    }
+
+private:
+    template <int Level, int Name>
+    static int GetInteger(asio::ip::tcp::socket &sock)
+    {
+        IntegerSocketOption<Level, Name> option;
+        boost::system::error_code ec;
+        sock.get_option(option, ec);
+
+        return ec ? -1 : option.value();
+    }
+
+    // A value of -1 means the option could not be read.
+    static void LogValue(std::ostream &os, const char *option, int effective, int requested)
+    {
+        os << ' ' << option << '=' << effective;
+        if (requested != 0 && effective != requested)
+            os << " (requested " << requested << ')';
+    }
+};
+
 class Acceptor
 {
 public:
-    Acceptor(asio::io_service &ios, unsigned short port_num) : m_ios(ios),
-                                                               m_acceptor(m_ios,
-                                                                          asio::ip::tcp::endpoint(
-                                                                              asio::ip::address_v4::any(),
-                                                                              port_num)),
-                                                               m_isStopped(false)
+    // In the SO_REUSEPORT mode num_listeners listening sockets are bound
+    // to the same port and the kernel spreads new connections across them.
+    // The socket profile is applied to the listening sockets before they
+    // are bound and to every accepted socket.
+    Acceptor(asio::io_service &ios,
+             unsigned short port_num,
+             ServerStats &stats,
+             ResourceCache &cache,
+             unsigned int num_listeners = 1,
+             unsigned int accepts_per_listener = 1,
+             const SocketProfile &socket_profile = SocketProfile()) : m_ios(ios),
+                                                                      m_stats(stats),
+                                                                      m_cache(cache),
+                                                                      m_isStopped(false),
+                                                                      m_accepts_per_listener(accepts_per_listener),
+                                                                      m_socket_profile(socket_profile)
     {
+        assert(num_listeners > 0);
+        assert(accepts_per_listener > 0);
+
+        asio::ip::tcp::endpoint ep(asio::ip::address_v4::any(),
+                                   port_num);
+
+        for (unsigned int i = 0; i < num_listeners; i++)
+        {
+            m_listeners.emplace_back(
+                new Listener(m_ios, ep, num_listeners > 1, m_socket_profile));
+        }
     }
 
     // Start accepting incoming connection requests.
     void Start()
     {
-        m_acceptor.listen();
-        InitAccept();
+        for (auto &listener : m_listeners)
+        {
+            listener->m_acceptor.listen();
+
+            // Keep several accept operations outstanding on
+            // each listening socket.
+            for (unsigned int i = 0; i < m_accepts_per_listener; i++)
+            {
+                InitAccept(*listener);
+            }
+        }
     }
 
     // Stop accepting incoming connection requests.
@@ -329,27 +1564,64 @@ public:
     }
 
 private:
-    void InitAccept()
+    // Listening socket together with the strand serializing
+    // the accept operations outstanding on it.
+    struct Listener
+    {
+        Listener(asio::io_service &ios,
+                 const asio::ip::tcp::endpoint &ep,
+                 bool reuse_port,
+                 const SocketProfile &profile) : m_acceptor(ios),
+                                                 m_strand(ios)
+        {
+            m_acceptor.open(ep.protocol());
+            m_acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+
+            if (reuse_port)
+            {
+#ifdef SO_REUSEPORT
+                typedef IntegerSocketOption<SOL_SOCKET, SO_REUSEPORT>
+                    reuse_port_option;
+                m_acceptor.set_option(reuse_port_option(1));
+#else
+                throw system::system_error(asio::error::operation_not_supported);
+#endif
+            }
+
+            profile.ApplyToListener(m_acceptor);
+
+            m_acceptor.bind(ep);
+        }
+
+        asio::ip::tcp::acceptor m_acceptor;
+        asio::io_service::strand m_strand;
+    };
+
+    void InitAccept(Listener &listener)
     {
         std::shared_ptr<asio::ip::tcp::socket>
             sock(new asio::ip::tcp::socket(m_ios));
 
-        m_acceptor.async_accept(*sock.get(),
-                                [this, sock](
-                                    const boost::system::error_code &error)
-                                {
-                                    onAccept(error, sock);
-                                });
+        listener.m_acceptor.async_accept(*sock.get(),
+                                         listener.m_strand.wrap(
+                                             [this, &listener, sock](
+                                                 const boost::system::error_code &error)
+                                             {
+                                                 onAccept(error, listener, sock);
+                                             }));
     }
 
     void onAccept(const boost::system::error_code &ec,
+                  Listener &listener,
                   std::shared_ptr<asio::ip::tcp::socket> sock)
     {
         if (ec.value() == 0)
         {
-            (new Service(sock))->start_handling();
+            m_stats.Add(ServerStats::Connections, 1);
+            m_socket_profile.ApplyToConnection(*sock);
+            (new Service(sock, m_stats, m_cache))->start_handling();
         }
-        else
+        else if (ec != asio::error::operation_aborted)
         {
             std::cout << "Error occured! Error code = "
                       << ec.value()
@@ -360,39 +1632,63 @@ private:
         // acceptor has not been stopped yet.
         if (!m_isStopped.load())
         {
-            InitAccept();
+            InitAccept(listener);
         }
         else
         {
             // Stop accepting incoming connections
-            // and free allocated resources.
-            m_acceptor.close();
+            // and free allocated resources. Other accept
+            // operations outstanding on this socket
+            // complete with operation_aborted.
+            boost::system::error_code ignored_ec;
+            listener.m_acceptor.close(ignored_ec);
         }
     }
 
 private:
     asio::io_service &m_ios;
-    asio::ip::tcp::acceptor m_acceptor;
+    ServerStats &m_stats;
+    ResourceCache &m_cache;
+    std::vector<std::unique_ptr<Listener>> m_listeners;
     std::atomic<bool> m_isStopped;
+    unsigned int m_accepts_per_listener;
+    SocketProfile m_socket_profile;
 };
 
 class Server
 {
 public:
-    Server()
+    // Up to cache_capacity bytes of files no larger than
+    // max_cached_file_size are kept in memory.
+    Server(std::size_t cache_capacity = 64 * 1024 * 1024,
+           std::size_t max_cached_file_size = 1024 * 1024) : m_cache(cache_capacity,
+                                                                     max_cached_file_size)
     {
         m_work.reset(new asio::io_service::work(m_ios));
     }
 
     // Start the server.
+    // Passing num_listeners greater than one opens that many
+    // SO_REUSEPORT listening sockets on the same port.
     void Start(unsigned short port_num,
-               unsigned int thread_pool_size)
+               unsigned int thread_pool_size,
+               unsigned int num_listeners = 1,
+               unsigned int accepts_per_listener = 1,
+               const SocketProfile &socket_profile = SocketProfile())
     {
 
         assert(thread_pool_size > 0);
 
+        socket_profile.Log(std::cout);
+
         // Create and strat Acceptor.
-        acc.reset(new Acceptor(m_ios, port_num));
+        acc.reset(new Acceptor(m_ios,
+                               port_num,
+                               m_stats,
+                               m_cache,
+                               num_listeners,
+                               accepts_per_listener,
+                               socket_profile));
         acc->Start();
 
         // Create specified number of threads and
@@ -407,6 +1703,12 @@ public:
         }
     }
 
+    // Outputs the latency percentiles and counters gathered so far.
+    void DumpStats(std::ostream &os) const
+    {
+        m_stats.Dump(os);
+    }
+
     // Stop the server.
     void Stop()
     {
@@ -422,6 +1724,8 @@ public:
 private:
     asio::io_service m_ios;
     std::unique_ptr<asio::io_service::work> m_work;
+    ServerStats m_stats;
+    ResourceCache m_cache;
     std::unique_ptr<Acceptor> acc;
     std::vector<std::unique_ptr<std::thread>> m_thread_pool;
 };
@@ -444,7 +1748,12 @@ int main()
 
         srv.Start(port_num, thread_pool_size);
 
-        std::this_thread::sleep_for(std::chrono::seconds(60));
+        // Dump the statistics every 10 seconds for a minute.
+        for (int i = 0; i < 6; i++)
+        {
+            std::this_thread::sleep_for(std::chrono::seconds(10));
+            srv.DumpStats(std::cout);
+        }
 
         srv.Stop();
     }
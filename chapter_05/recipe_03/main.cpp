@@ -1,52 +1,179 @@
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
 #include <iostream>
 
 using namespace boost;
 
+// TLS sessions negotiated with the servers, one per endpoint. A client
+// reconnecting to a server offers the session it negotiated last, which the
+// server resumes by its session ID or from the session ticket it issued,
+// skipping the key exchange of a full handshake. May be shared by any number
+// of clients on any threads.
+class SSLSessionCache : public boost::noncopyable
+{
+public:
+    SSLSessionCache() : m_full_handshakes(0),
+                        m_resumed_handshakes(0)
+    {
+    }
+
+    ~SSLSessionCache()
+    {
+        for (auto &session : m_sessions)
+        {
+            SSL_SESSION_free(session.second);
+        }
+    }
+
+    // Offers the last session negotiated with the endpoint, if any,
+    // in the handshake about to be performed on the connection.
+    void apply(const asio::ip::tcp::endpoint &ep, SSL *ssl)
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        auto it = m_sessions.find(ep);
+        if (it != m_sessions.end())
+            SSL_set_session(ssl, it->second);
+    }
+
+    // Counts the handshake completed on the connection.
+    void count_handshake(SSL *ssl)
+    {
+        if (SSL_session_reused(ssl))
+            m_resumed_handshakes++;
+        else
+            m_full_handshakes++;
+    }
+
+    // Remembers the session of the connection if the server lets it be
+    // resumed. With TLS 1.3 the server sends the tickets after the
+    // handshake, so this is called once the connection has been used.
+    void store(const asio::ip::tcp::endpoint &ep, SSL *ssl)
+    {
+        SSL_SESSION *session = SSL_get1_session(ssl);
+        if (session == nullptr)
+            return;
+
+        if (!SSL_SESSION_is_resumable(session))
+        {
+            SSL_SESSION_free(session);
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        SSL_SESSION *&cached = m_sessions[ep];
+        if (cached != nullptr)
+            SSL_SESSION_free(cached);
+        cached = session;
+    }
+
+    // Forgets the session of an endpoint whose server refused it.
+    void remove(const asio::ip::tcp::endpoint &ep)
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        auto it = m_sessions.find(ep);
+        if (it == m_sessions.end())
+            return;
+
+        SSL_SESSION_free(it->second);
+        m_sessions.erase(it);
+    }
+
+    std::uint64_t get_full_handshakes() const
+    {
+        return m_full_handshakes.load();
+    }
+
+    std::uint64_t get_resumed_handshakes() const
+    {
+        return m_resumed_handshakes.load();
+    }
+
+private:
+    std::map<asio::ip::tcp::endpoint, SSL_SESSION *> m_sessions;
+    std::mutex m_guard;
+
+    std::atomic<std::uint64_t> m_full_handshakes;
+    std::atomic<std::uint64_t> m_resumed_handshakes;
+};
+
 class SyncSSLClient
 {
 public:
+    // The sessions negotiated with the server are kept in session_cache,
+    // so that reconnecting resumes the previous session.
     SyncSSLClient(const std::string &raw_ip_address,
-                  unsigned short port_num) : m_ep(asio::ip::address::from_string(raw_ip_address),
-                                                  port_num),
-                                             m_ssl_context(asio::ssl::context::sslv3_client),
-                                             m_ssl_stream(m_ios, m_ssl_context)
+                  unsigned short port_num,
+                  SSLSessionCache &session_cache) : m_ep(asio::ip::address::from_string(raw_ip_address),
+                                                         port_num),
+                                                    m_ssl_context(asio::ssl::context::sslv23_client),
+                                                    m_session_cache(session_cache)
     {
+    }
+
+    // May be called again after close() to reconnect.
+    void connect()
+    {
+        // A stream cannot be reused once shut down,
+        // so every connection gets a new one.
+        m_ssl_stream.reset(new asio::ssl::stream<asio::ip::tcp::socket>(m_ios, m_ssl_context));
+
         // Set verification mode and designate that
         // we want to perform verification.
-        m_ssl_stream.set_verify_mode(asio::ssl::verify_peer);
+        m_ssl_stream->set_verify_mode(asio::ssl::verify_peer);
 
         // Set verification callback.
-        m_ssl_stream.set_verify_callback([this](
-                                             bool preverified,
-                                             asio::ssl::verify_context &context) -> bool
-                                         { return on_peer_verify(preverified, context); });
-    }
+        m_ssl_stream->set_verify_callback([this](
+                                              bool preverified,
+                                              asio::ssl::verify_context &context) -> bool
+                                          { return on_peer_verify(preverified, context); });
 
-    void connect()
-    {
         // Connect the TCP socket.
-        m_ssl_stream.lowest_layer().connect(m_ep);
+        m_ssl_stream->lowest_layer().connect(m_ep);
 
-        // Perform the SSL handshake.
-        m_ssl_stream.handshake(asio::ssl::stream_base::client);
+        // Perform the SSL handshake, offering the session
+        // negotiated with the server last time.
+        m_session_cache.apply(m_ep, m_ssl_stream->native_handle());
+
+        boost::system::error_code ec;
+        m_ssl_stream->handshake(asio::ssl::stream_base::client, ec);
+        if (ec.value() != 0)
+        {
+            // The cached session may be the reason.
+            m_session_cache.remove(m_ep);
+            throw system::system_error(ec);
+        }
+
+        m_session_cache.count_handshake(m_ssl_stream->native_handle());
     }
 
     void close()
     {
+        // By now the server has sent its session tickets.
+        m_session_cache.store(m_ep, m_ssl_stream->native_handle());
+
         // We ignore any errors that might occur
         // during shutdown as we anyway can't
         // do anything about them.
         boost::system::error_code ec;
 
-        m_ssl_stream.shutdown(ec); // Shutown SSL.
+        m_ssl_stream->shutdown(ec); // Shutown SSL.
 
         // Shut down the socket.
-        m_ssl_stream.lowest_layer().shutdown(
+        m_ssl_stream->lowest_layer().shutdown(
             boost::asio::ip::tcp::socket::shutdown_both, ec);
 
-        m_ssl_stream.lowest_layer().close(ec);
+        m_ssl_stream->lowest_layer().close(ec);
     }
 
     std::string emulate_long_computation_op(
@@ -70,13 +197,13 @@ private:
 
     void send_request(const std::string &request)
     {
-        asio::write(m_ssl_stream, asio::buffer(request));
+        asio::write(*m_ssl_stream, asio::buffer(request));
     }
 
     std::string receive_response()
     {
         asio::streambuf buf;
-        asio::read_until(m_ssl_stream, buf, '\n');
+        asio::read_until(*m_ssl_stream, buf, '\n');
 
         std::string response;
         std::istream input(&buf);
@@ -90,7 +217,9 @@ private:
     asio::ip::tcp::endpoint m_ep;
 
     asio::ssl::context m_ssl_context;
-    asio::ssl::stream<asio::ip::tcp::socket> m_ssl_stream;
+    std::unique_ptr<asio::ssl::stream<asio::ip::tcp::socket>> m_ssl_stream;
+
+    SSLSessionCache &m_session_cache;
 };
 
 int main()
@@ -100,22 +229,32 @@ int main()
 
     try
     {
-        SyncSSLClient client(raw_ip_address, port_num);
+        SSLSessionCache session_cache;
+        SyncSSLClient client(raw_ip_address, port_num, session_cache);
+
+        // The second and the third connections
+        // resume the session of the first one.
+        for (int i = 0; i < 3; i++)
+        {
+            // Sync connect.
+            client.connect();
 
-        // Sync connect.
-        client.connect();
+            std::cout << "Sending request to the server... "
+                      << std::endl;
 
-        std::cout << "Sending request to the server... "
-                  << std::endl;
+            std::string response =
+                client.emulate_long_computation_op(10);
 
-        std::string response =
-            client.emulate_long_computation_op(10);
+            std::cout << "Response received: " << response
+                      << std::endl;
 
-        std::cout << "Response received: " << response
-                  << std::endl;
+            // Close the connection and free resources.
+            client.close();
+        }
 
-        // Close the connection and free resources.
-        client.close();
+        std::cout << "Full handshakes: " << session_cache.get_full_handshakes()
+                  << ". Resumed handshakes: " << session_cache.get_resumed_handshakes()
+                  << "." << std::endl;
     }
     catch (system::system_error &e)
     {
@@ -1,58 +1,423 @@
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
 
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
 #include <iostream>
 
 using namespace boost;
 
+typedef asio::ssl::stream<asio::ip::tcp::socket> ssl_stream_t;
+
+// Numbers of the handshakes that resumed a previous session
+// and of those that negotiated a new one.
+struct HandshakeStats
+{
+    HandshakeStats() : m_full(0),
+                       m_resumed(0)
+    {
+    }
+
+    std::atomic<std::uint64_t> m_full;
+    std::atomic<std::uint64_t> m_resumed;
+};
+
+// Keys protecting the session tickets the server issues, which let clients
+// resume their sessions without the server keeping any state. A new key is
+// generated every rotation interval; the previous one is kept for another
+// interval so that recently issued tickets remain valid, and tickets
+// protected by it are replaced by new ones when used.
+class TicketKeys : public boost::noncopyable
+{
+public:
+    TicketKeys(asio::io_service &ios,
+               std::chrono::seconds rotation_interval) : m_timer(ios),
+                                                         m_rotation_interval(rotation_interval)
+    {
+        generate_key(m_current);
+        m_previous = m_current;
+    }
+
+    // Makes the context protect its tickets with these keys.
+    void install(SSL_CTX *ctx)
+    {
+        if (ex_data_index() < 0 || SSL_CTX_set_ex_data(ctx, ex_data_index(), this) != 1)
+            throw system::system_error(asio::error::no_memory, "SSL_CTX_set_ex_data");
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, on_ticket_key);
+#else
+        SSL_CTX_set_tlsext_ticket_key_cb(ctx, on_ticket_key);
+#endif
+
+        schedule_rotation();
+    }
+
+private:
+    struct Key
+    {
+        unsigned char m_name[16];
+        unsigned char m_aes_key[32];
+        unsigned char m_hmac_key[32];
+    };
+
+    // The context's app data slot belongs to asio::ssl::context, which
+    // keeps its verify callback there, so the keys get a slot of their own.
+    static int ex_data_index()
+    {
+        static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        return index;
+    }
+
+    static void generate_key(Key &key)
+    {
+        if (RAND_bytes(key.m_name, sizeof(key.m_name)) != 1 ||
+            RAND_bytes(key.m_aes_key, sizeof(key.m_aes_key)) != 1 ||
+            RAND_bytes(key.m_hmac_key, sizeof(key.m_hmac_key)) != 1)
+            throw system::system_error(asio::error::no_memory, "RAND_bytes");
+    }
+
+    void schedule_rotation()
+    {
+        m_timer.expires_after(m_rotation_interval);
+        m_timer.async_wait([this](const boost::system::error_code &ec)
+                           {
+                               if (ec.value() != 0)
+                                   return;
+
+                               Key key;
+                               generate_key(key);
+
+                               std::unique_lock<std::mutex> lock(m_guard);
+                               m_previous = m_current;
+                               m_current = key;
+                               lock.unlock();
+
+                               schedule_rotation();
+                           });
+    }
+
+    // Returns 1 when the ticket is to be protected with the key or has been
+    // decrypted with it, 2 when it has been decrypted with the previous key
+    // and should be replaced, and 0 when the key is unknown, in which case a
+    // full handshake is performed.
+    int select_key(unsigned char *key_name, unsigned char *iv, EVP_CIPHER_CTX *cipher_ctx,
+                   unsigned char *hmac_key, int enc)
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+        Key key = m_current;
+        int result = 1;
+
+        if (!enc && std::memcmp(key_name, key.m_name, sizeof(key.m_name)) != 0)
+        {
+            if (std::memcmp(key_name, m_previous.m_name, sizeof(m_previous.m_name)) != 0)
+                return 0;
+
+            key = m_previous;
+            result = 2;
+        }
+        lock.unlock();
+
+        if (enc)
+        {
+            std::memcpy(key_name, key.m_name, sizeof(key.m_name));
+            if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1 ||
+                EVP_EncryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), nullptr, key.m_aes_key, iv) != 1)
+                return -1;
+        }
+        else if (EVP_DecryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), nullptr, key.m_aes_key, iv) != 1)
+        {
+            return -1;
+        }
+
+        std::memcpy(hmac_key, key.m_hmac_key, sizeof(key.m_hmac_key));
+        return result;
+    }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    static int on_ticket_key(SSL *ssl, unsigned char *key_name, unsigned char *iv,
+                             EVP_CIPHER_CTX *cipher_ctx, EVP_MAC_CTX *mac_ctx, int enc)
+    {
+        TicketKeys *keys = static_cast<TicketKeys *>(
+            SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ex_data_index()));
+
+        unsigned char hmac_key[32];
+        int result = keys->select_key(key_name, iv, cipher_ctx, hmac_key, enc);
+        if (result <= 0)
+            return result;
+
+        char digest[] = "SHA256";
+        OSSL_PARAM params[] = {
+            OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, hmac_key, sizeof(hmac_key)),
+            OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+            OSSL_PARAM_construct_end()};
+
+        return EVP_MAC_CTX_set_params(mac_ctx, params) == 1 ? result : -1;
+    }
+#else
+    static int on_ticket_key(SSL *ssl, unsigned char *key_name, unsigned char *iv,
+                             EVP_CIPHER_CTX *cipher_ctx, HMAC_CTX *hmac_ctx, int enc)
+    {
+        TicketKeys *keys = static_cast<TicketKeys *>(
+            SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ex_data_index()));
+
+        unsigned char hmac_key[32];
+        int result = keys->select_key(key_name, iv, cipher_ctx, hmac_key, enc);
+        if (result <= 0)
+            return result;
+
+        return HMAC_Init_ex(hmac_ctx, hmac_key, sizeof(hmac_key), EVP_sha256(), nullptr) == 1 ? result : -1;
+    }
+#endif
+
+private:
+    asio::steady_timer m_timer;
+    std::chrono::seconds m_rotation_interval;
+
+    Key m_current;
+    Key m_previous;
+    std::mutex m_guard;
+};
+
+// Handles a single client. The handshake, reading the request and sending
+// the response are asynchronous, so a slow client only occupies the event
+// loop while one of its operations completes.
 class Service
 {
 public:
-    Service() {}
+    // When crypto_ios is not null, the handshake is performed
+    // by the threads running it rather than by the I/O threads.
+    Service(std::shared_ptr<ssl_stream_t> ssl_stream,
+            HandshakeStats &stats,
+            asio::io_service *crypto_ios) : m_ssl_stream(ssl_stream),
+                                            m_stats(stats),
+                                            m_crypto_ios(crypto_ios),
+                                            m_strand(ssl_stream->get_executor()),
+                                            m_shutdown_timer(ssl_stream->get_executor()),
+                                            m_pending_shutdown_ops(0)
+    {
+    }
 
-    void handle_client(
-        asio::ssl::stream<asio::ip::tcp::socket> &ssl_stream)
+    void start_handling()
     {
-        try
+        if (m_crypto_ios == nullptr)
         {
-            // Blocks until the handshake completes.
-            ssl_stream.handshake(
-                asio::ssl::stream_base::server);
-
-            asio::streambuf request;
-            asio::read_until(ssl_stream, request, '\n');
-
-            // Emulate request processing.
-            int i = 0;
-            while (i != 1000000)
-                i++;
-            std::this_thread::sleep_for(
-                std::chrono::milliseconds(500));
-
-            // Sending response.
-            std::string response = "Response\n";
-            asio::write(ssl_stream, asio::buffer(response));
+            m_ssl_stream->async_handshake(asio::ssl::stream_base::server,
+                                          [this](
+                                              const boost::system::error_code &ec)
+                                          {
+                                              on_handshake_complete(ec);
+                                          });
+            return;
         }
-        catch (system::system_error &e)
+
+        // The socket still waits for data on the I/O threads, but the steps
+        // of the handshake, where OpenSSL does its computations, run where
+        // the completion handler is bound to run. The first step runs where
+        // the handshake is started, so it is started on the crypto pool too.
+        asio::post(*m_crypto_ios,
+                   [this]()
+                   {
+                       m_ssl_stream->async_handshake(asio::ssl::stream_base::server,
+                                                     asio::bind_executor(m_crypto_ios->get_executor(),
+                                                                         [this](
+                                                                             const boost::system::error_code &ec)
+                                                                         {
+                                                                             // Hand the connection back to the I/O threads.
+                                                                             asio::post(m_ssl_stream->get_executor(),
+                                                                                        [this, ec]()
+                                                                                        {
+                                                                                            on_handshake_complete(ec);
+                                                                                        });
+                                                                         }));
+                   });
+    }
+
+private:
+    void on_handshake_complete(const boost::system::error_code &ec)
+    {
+        if (ec.value() != 0)
         {
             std::cout << "Error occured! Error code = "
-                      << e.code() << ". Message: "
-                      << e.what();
+                      << ec.value()
+                      << ". Message: " << ec.message();
+
+            on_finish();
+            return;
         }
+
+        if (SSL_session_reused(m_ssl_stream->native_handle()))
+            m_stats.m_resumed++;
+        else
+            m_stats.m_full++;
+
+        asio::async_read_until(*m_ssl_stream.get(),
+                               m_request,
+                               '\n',
+                               [this](
+                                   const boost::system::error_code &ec,
+                                   std::size_t bytes_transferred)
+                               {
+                                   on_request_received(ec,
+                                                       bytes_transferred);
+                               });
     }
+
+    void on_request_received(const boost::system::error_code &ec,
+                             std::size_t bytes_transferred)
+    {
+        if (ec.value() != 0)
+        {
+            std::cout << "Error occured! Error code = "
+                      << ec.value()
+                      << ". Message: " << ec.message();
+
+            on_finish();
+            return;
+        }
+
+        // Process the request.
+        m_response = process_request(m_request);
+
+        asio::async_write(*m_ssl_stream.get(),
+                          asio::buffer(m_response),
+                          [this](
+                              const boost::system::error_code &ec,
+                              std::size_t bytes_transferred)
+                          {
+                              on_response_sent(ec, bytes_transferred);
+                          });
+    }
+
+    void on_response_sent(const boost::system::error_code &ec,
+                          std::size_t bytes_transferred)
+    {
+        if (ec.value() != 0)
+        {
+            std::cout << "Error occured! Error code = "
+                      << ec.value()
+                      << ". Message: " << ec.message();
+
+            on_finish();
+            return;
+        }
+
+        // OpenSSL drops the session from the cache unless the connection
+        // is shut down cleanly. Errors are ignored, since many clients close
+        // the connection without answering the close_notify alert. A client
+        // that neither answers nor closes the connection would keep the
+        // Service alive, so the socket is closed when the timer expires.
+        // The timer and the shutdown complete on the strand, so closing
+        // the socket never races with the shutdown's steps.
+        asio::dispatch(m_strand,
+                       [this]()
+                       {
+                           m_pending_shutdown_ops = 2;
+
+                           m_shutdown_timer.expires_after(SHUTDOWN_TIMEOUT);
+                           m_shutdown_timer.async_wait(
+                               asio::bind_executor(m_strand,
+                                                   [this](
+                                                       const boost::system::error_code &ec)
+                                                   {
+                                                       if (ec != asio::error::operation_aborted)
+                                                       {
+                                                           boost::system::error_code ignored_ec;
+                                                           m_ssl_stream->lowest_layer().close(ignored_ec);
+                                                       }
+
+                                                       on_shutdown_op_complete();
+                                                   }));
+
+                           m_ssl_stream->async_shutdown(
+                               asio::bind_executor(m_strand,
+                                                   [this](
+                                                       const boost::system::error_code &ec)
+                                                   {
+                                                       m_shutdown_timer.cancel();
+                                                       on_shutdown_op_complete();
+                                                   }));
+                       });
+    }
+
+    // The Service is destroyed once both the timer
+    // and the shutdown have completed.
+    void on_shutdown_op_complete()
+    {
+        if (--m_pending_shutdown_ops == 0)
+            on_finish();
+    }
+
+    // Here we perform the cleanup.
+    void on_finish()
+    {
+        delete this;
+    }
+
+    std::string process_request(asio::streambuf &request)
+    {
+        // Emulate request processing.
+        int i = 0;
+        while (i != 1000000)
+            i++;
+        std::this_thread::sleep_for(
+            std::chrono::milliseconds(500));
+
+        // Prepare and return the response message.
+        std::string response = "Response\n";
+        return response;
+    }
+
+private:
+    static constexpr std::chrono::seconds SHUTDOWN_TIMEOUT{5};
+
+    std::shared_ptr<ssl_stream_t> m_ssl_stream;
+    std::string m_response;
+    asio::streambuf m_request;
+
+    HandshakeStats &m_stats;
+    asio::io_service *m_crypto_ios;
+
+    asio::strand<ssl_stream_t::executor_type> m_strand;
+    asio::steady_timer m_shutdown_timer;
+    unsigned int m_pending_shutdown_ops;
 };
 
+constexpr std::chrono::seconds Service::SHUTDOWN_TIMEOUT;
+
 class Acceptor
 {
 public:
-    Acceptor(asio::io_service &ios, unsigned short port_num) : m_ios(ios),
-                                                               m_acceptor(m_ios,
-                                                                          asio::ip::tcp::endpoint(
-                                                                              asio::ip::address_v4::any(),
-                                                                              port_num)),
-                                                               m_ssl_context(asio::ssl::context::sslv23_server)
+    Acceptor(asio::io_service &ios,
+             unsigned short port_num,
+             HandshakeStats &stats,
+             asio::io_service *crypto_ios) : m_ios(ios),
+                                      m_acceptor(m_ios,
+                                                 asio::ip::tcp::endpoint(
+                                                     asio::ip::address_v4::any(),
+                                                     port_num)),
+                                      m_ssl_context(asio::ssl::context::sslv23_server),
+                                      m_ticket_keys(ios, TICKET_KEY_ROTATION_INTERVAL),
+                                      m_stats(stats),
+                                      m_crypto_ios(crypto_ios),
+                                      m_is_stopped(false)
     {
         // Setting up the context.
         m_ssl_context.set_options(
@@ -69,22 +434,79 @@ public:
                                            boost::asio::ssl::context::pem);
         m_ssl_context.use_tmp_dh_file("dhparams.pem");
 
-        // Start listening for incoming connection requests.
+        // Let the clients resume their sessions, either by the session ID
+        // kept in the context's cache, which OpenSSL locks internally, or
+        // by a session ticket.
+        SSL_CTX *ctx = m_ssl_context.native_handle();
+        static const unsigned char session_id_context[] = "chapter_05/recipe_04";
+
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(ctx, SESSION_CACHE_SIZE);
+        SSL_CTX_set_timeout(ctx, SESSION_TIMEOUT_SEC);
+        SSL_CTX_set_session_id_context(ctx, session_id_context, sizeof(session_id_context) - 1);
+
+        m_ticket_keys.install(ctx);
+    }
+
+    // Start accepting incoming connection requests.
+    void start()
+    {
         m_acceptor.listen();
+        init_accept();
     }
 
-    void accept()
+    // Stop accepting incoming connection requests.
+    void stop()
     {
-        asio::ssl::stream<asio::ip::tcp::socket>
-            ssl_stream(m_ios, m_ssl_context);
+        m_is_stopped.store(true);
+    }
+
+private:
+    static const long SESSION_CACHE_SIZE = 20480;
+    static const long SESSION_TIMEOUT_SEC = 300;
+    static constexpr std::chrono::seconds TICKET_KEY_ROTATION_INTERVAL{3600};
 
-        m_acceptor.accept(ssl_stream.lowest_layer());
+    void init_accept()
+    {
+        std::shared_ptr<ssl_stream_t>
+            ssl_stream(new ssl_stream_t(m_ios, m_ssl_context));
 
-        Service svc;
-        svc.handle_client(ssl_stream);
+        m_acceptor.async_accept(ssl_stream->lowest_layer(),
+                                [this, ssl_stream](
+                                    const boost::system::error_code &error)
+                                {
+                                    on_accept(error, ssl_stream);
+                                });
+    }
+
+    void on_accept(const boost::system::error_code &ec,
+                   std::shared_ptr<ssl_stream_t> ssl_stream)
+    {
+        if (ec.value() == 0)
+        {
+            (new Service(ssl_stream, m_stats, m_crypto_ios))->start_handling();
+        }
+        else
+        {
+            std::cout << "Error occured! Error code = "
+                      << ec.value()
+                      << ". Message: " << ec.message();
+        }
+
+        // Init next async accept operation if
+        // acceptor has not been stopped yet.
+        if (!m_is_stopped.load())
+        {
+            init_accept();
+        }
+        else
+        {
+            // Stop accepting incoming connections
+            // and free allocated resources.
+            m_acceptor.close();
+        }
     }
 
-private:
     std::string get_password(std::size_t max_length,
                              asio::ssl::context::password_purpose purpose) const
     {
@@ -95,42 +517,97 @@ private:
     asio::io_service &m_ios;
     asio::ip::tcp::acceptor m_acceptor;
 
+    // Shared by the SSL streams of all the clients. It is only read
+    // once set up, so the threads of the pool may use it concurrently.
     asio::ssl::context m_ssl_context;
+    TicketKeys m_ticket_keys;
+
+    HandshakeStats &m_stats;
+    asio::io_service *m_crypto_ios;
+    std::atomic<bool> m_is_stopped;
 };
 
+constexpr std::chrono::seconds Acceptor::TICKET_KEY_ROTATION_INTERVAL;
+
 class Server
 {
 public:
-    Server() : m_stop(false) {}
+    Server()
+    {
+        m_work.reset(new asio::io_service::work(m_ios));
+        m_crypto_work.reset(new asio::io_service::work(m_crypto_ios));
+    }
 
-    void start(unsigned short port_num)
+    // Start the server. The I/O of all the clients is spread across
+    // thread_pool_size threads running the event loop. A non-zero
+    // crypto_pool_size moves the handshakes to a pool of that many
+    // threads, where new handshakes queue up during a surge of
+    // connections without delaying the I/O of the connected clients.
+    void start(unsigned short port_num,
+               unsigned int thread_pool_size,
+               unsigned int crypto_pool_size = 0)
     {
-        m_thread.reset(new std::thread([this, port_num]()
-                                       { run(port_num); }));
+        assert(thread_pool_size > 0);
+
+        // Create and start Acceptor.
+        m_acceptor.reset(new Acceptor(m_ios,
+                                      port_num,
+                                      m_stats,
+                                      crypto_pool_size > 0 ? &m_crypto_ios : nullptr));
+        m_acceptor->start();
+
+        for (unsigned int i = 0; i < crypto_pool_size; i++)
+        {
+            std::unique_ptr<std::thread> th(
+                new std::thread([this]()
+                                { m_crypto_ios.run(); }));
+
+            m_thread_pool.push_back(std::move(th));
+        }
+
+        // Create specified number of threads and
+        // add them to the pool.
+        for (unsigned int i = 0; i < thread_pool_size; i++)
+        {
+            std::unique_ptr<std::thread> th(
+                new std::thread([this]()
+                                { m_ios.run(); }));
+
+            m_thread_pool.push_back(std::move(th));
+        }
     }
 
-    void stop()
+    const HandshakeStats &get_handshake_stats() const
     {
-        m_stop.store(true);
-        m_thread->join();
+        return m_stats;
     }
 
-private:
-    void run(unsigned short port_num)
+    // Stop the server.
+    void stop()
     {
-        Acceptor acc(m_ios, port_num);
+        m_acceptor->stop();
+        m_ios.stop();
+        m_crypto_ios.stop();
 
-        while (!m_stop.load())
+        for (auto &th : m_thread_pool)
         {
-            acc.accept();
+            th->join();
         }
     }
 
-    std::unique_ptr<std::thread> m_thread;
-    std::atomic<bool> m_stop;
+private:
     asio::io_service m_ios;
+    std::unique_ptr<asio::io_service::work> m_work;
+    asio::io_service m_crypto_ios;
+    std::unique_ptr<asio::io_service::work> m_crypto_work;
+    HandshakeStats m_stats;
+    std::unique_ptr<Acceptor> m_acceptor;
+    std::vector<std::unique_ptr<std::thread>> m_thread_pool;
 };
 
+const unsigned int DEFAULT_THREAD_POOL_SIZE = 2;
+const unsigned int DEFAULT_CRYPTO_POOL_SIZE = 1;
+
 int main()
 {
     unsigned short port_num = 3333;
@@ -138,11 +615,30 @@ int main()
     try
     {
         Server srv;
-        srv.start(port_num);
+
+        unsigned int thread_pool_size =
+            std::thread::hardware_concurrency() * 2;
+
+        if (thread_pool_size == 0)
+            thread_pool_size = DEFAULT_THREAD_POOL_SIZE;
+
+        // One thread per processor for the handshakes.
+        unsigned int crypto_pool_size =
+            std::thread::hardware_concurrency();
+
+        if (crypto_pool_size == 0)
+            crypto_pool_size = DEFAULT_CRYPTO_POOL_SIZE;
+
+        srv.start(port_num, thread_pool_size, crypto_pool_size);
 
         std::this_thread::sleep_for(std::chrono::seconds(60));
 
         srv.stop();
+
+        const HandshakeStats &stats = srv.get_handshake_stats();
+        std::cout << "Full handshakes: " << stats.m_full.load()
+                  << ". Resumed handshakes: " << stats.m_resumed.load()
+                  << "." << std::endl;
     }
     catch (system::system_error &e)
     {
@@ -1,4 +1,11 @@
 #include <boost/asio.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 using namespace boost;
 
@@ -44,11 +51,419 @@ void CompositeBuffersScatterInput()
     // represented by contiguous block of memory.
 }
 
+// Shared pool of fixed-size memory blocks (slabs) in a few size classes.
+// A released slab is kept on the free list of its class to be handed out
+// again instead of being freed, up to max_free_per_class slabs per class.
+class BufferPool : public boost::noncopyable
+{
+public:
+    static const unsigned int SIZE_CLASS_COUNT = 3;
+
+    // 512 bytes, 4KB and 32KB.
+    static std::size_t GetClassSize(unsigned int size_class)
+    {
+        return std::size_t(512) << (3 * size_class);
+    }
+
+    // Owns a slab until it is moved from or destroyed,
+    // then returns it to the pool it came from.
+    class Slab
+    {
+    public:
+        Slab() : m_pool(nullptr),
+                 m_data(nullptr),
+                 m_size_class(0)
+        {
+        }
+
+        Slab(Slab &&other) : m_pool(other.m_pool),
+                             m_data(other.m_data),
+                             m_size_class(other.m_size_class)
+        {
+            other.m_pool = nullptr;
+            other.m_data = nullptr;
+        }
+
+        Slab &operator=(Slab &&other)
+        {
+            if (this != &other)
+            {
+                Reset();
+                std::swap(m_pool, other.m_pool);
+                std::swap(m_data, other.m_data);
+                m_size_class = other.m_size_class;
+            }
+
+            return *this;
+        }
+
+        Slab(const Slab &) = delete;
+        Slab &operator=(const Slab &) = delete;
+
+        ~Slab()
+        {
+            Reset();
+        }
+
+        char *Data() const
+        {
+            return m_data;
+        }
+
+        std::size_t Size() const
+        {
+            return m_data != nullptr ? GetClassSize(m_size_class) : 0;
+        }
+
+        void Reset()
+        {
+            if (m_pool != nullptr)
+                m_pool->Release(m_data, m_size_class);
+
+            m_pool = nullptr;
+            m_data = nullptr;
+        }
+
+    private:
+        friend class BufferPool;
+
+        Slab(BufferPool *pool, char *data, unsigned int size_class) : m_pool(pool),
+                                                                      m_data(data),
+                                                                      m_size_class(size_class)
+        {
+        }
+
+        BufferPool *m_pool;
+        char *m_data;
+        unsigned int m_size_class;
+    };
+
+    BufferPool(std::size_t max_free_per_class = 256) : m_max_free_per_class(max_free_per_class),
+                                                       m_allocated(0),
+                                                       m_reused(0)
+    {
+    }
+
+    // All the slabs must have been returned by now.
+    ~BufferPool()
+    {
+        for (auto &free_list : m_free)
+        {
+            for (char *data : free_list)
+            {
+                delete[] data;
+            }
+        }
+    }
+
+    // Returns a slab of the smallest class holding size bytes,
+    // or of the largest class if none does.
+    Slab Acquire(std::size_t size)
+    {
+        unsigned int size_class = 0;
+        while (size_class < SIZE_CLASS_COUNT - 1 && GetClassSize(size_class) < size)
+        {
+            size_class++;
+        }
+
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        std::vector<char *> &free_list = m_free[size_class];
+        if (!free_list.empty())
+        {
+            char *data = free_list.back();
+            free_list.pop_back();
+            m_reused++;
+
+            return Slab(this, data, size_class);
+        }
+
+        m_allocated++;
+        lock.unlock();
+
+        return Slab(this, new char[GetClassSize(size_class)], size_class);
+    }
+
+    // Number of slabs currently allocated, in use or free, and of
+    // slabs handed out from the free lists so far.
+    std::size_t GetAllocatedCount()
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        return m_allocated;
+    }
+
+    std::size_t GetReusedCount()
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        return m_reused;
+    }
+
+private:
+    void Release(char *data, unsigned int size_class)
+    {
+        std::unique_lock<std::mutex> lock(m_guard);
+
+        std::vector<char *> &free_list = m_free[size_class];
+        if (free_list.size() < m_max_free_per_class)
+        {
+            free_list.push_back(data);
+            return;
+        }
+
+        m_allocated--;
+        lock.unlock();
+
+        delete[] data;
+    }
+
+private:
+    std::size_t m_max_free_per_class;
+    std::vector<char *> m_free[SIZE_CLASS_COUNT];
+    std::size_t m_allocated;
+    std::size_t m_reused;
+    std::mutex m_guard;
+};
+
+// Message held in a chain of pooled slabs, so that a large message never
+// needs one contiguous allocation. Data() describes the message as a
+// composite buffer for a single gather write; Prepare() describes free space
+// at its end as a composite buffer for a single scatter read, and Commit()
+// appends the bytes read into it.
+class SlabChain : public boost::noncopyable
+{
+public:
+    SlabChain(BufferPool &pool) : m_pool(pool),
+                                  m_begin(0),
+                                  m_size(0)
+    {
+    }
+
+    std::size_t Size() const
+    {
+        return m_size;
+    }
+
+    void Append(const void *data, std::size_t size)
+    {
+        const char *src = static_cast<const char *>(data);
+
+        for (auto &buffer : Prepare(size))
+        {
+            std::memcpy(asio::buffer_cast<char *>(buffer), src, asio::buffer_size(buffer));
+            src += asio::buffer_size(buffer);
+        }
+
+        Commit(size);
+    }
+
+    std::vector<asio::const_buffer> Data() const
+    {
+        std::vector<asio::const_buffer> buffers;
+        std::size_t offset = m_begin;
+        std::size_t left = m_size;
+
+        for (const auto &slab : m_slabs)
+        {
+            if (left == 0)
+                break;
+
+            std::size_t size = slab.Size() - offset;
+            if (size > left)
+                size = left;
+
+            buffers.push_back(asio::const_buffer(slab.Data() + offset, size));
+            offset = 0;
+            left -= size;
+        }
+
+        return buffers;
+    }
+
+    // Grows the chain to have room for size more bytes
+    // and returns exactly size bytes of that room.
+    std::vector<asio::mutable_buffer> Prepare(std::size_t size)
+    {
+        // Slabs are sized after the room still missing, so
+        // that small messages do not take up large slabs.
+        std::size_t capacity = GetCapacity();
+        while (capacity < m_begin + m_size + size)
+        {
+            m_slabs.push_back(m_pool.Acquire(m_begin + m_size + size - capacity));
+            capacity += m_slabs.back().Size();
+        }
+
+        std::vector<asio::mutable_buffer> buffers;
+        std::size_t offset = m_begin + m_size;
+
+        for (const auto &slab : m_slabs)
+        {
+            if (size == 0)
+                break;
+
+            if (offset >= slab.Size())
+            {
+                offset -= slab.Size();
+                continue;
+            }
+
+            std::size_t chunk = slab.Size() - offset;
+            if (chunk > size)
+                chunk = size;
+
+            buffers.push_back(asio::mutable_buffer(slab.Data() + offset, chunk));
+            offset = 0;
+            size -= chunk;
+        }
+
+        return buffers;
+    }
+
+    // Makes size bytes written into the room returned by Prepare() part of the message.
+    void Commit(std::size_t size)
+    {
+        m_size += size;
+    }
+
+    // Drops size bytes from the front of the message,
+    // returning the slabs emptied to the pool.
+    void Consume(std::size_t size)
+    {
+        if (size >= m_size)
+        {
+            Clear();
+            return;
+        }
+
+        m_size -= size;
+        m_begin += size;
+
+        std::size_t emptied = 0;
+        while (m_begin >= m_slabs[emptied].Size())
+        {
+            m_begin -= m_slabs[emptied].Size();
+            emptied++;
+        }
+
+        m_slabs.erase(m_slabs.begin(), m_slabs.begin() + emptied);
+    }
+
+    void Clear()
+    {
+        m_slabs.clear();
+        m_begin = 0;
+        m_size = 0;
+    }
+
+private:
+    std::size_t GetCapacity() const
+    {
+        std::size_t capacity = 0;
+        for (const auto &slab : m_slabs)
+        {
+            capacity += slab.Size();
+        }
+
+        return capacity;
+    }
+
+private:
+    BufferPool &m_pool;
+    std::vector<BufferPool::Slab> m_slabs;
+    std::size_t m_begin; // Offset of the message in the first slab.
+    std::size_t m_size;
+};
+
+// Sends messages of a known size over a loopback connection, each with
+// one gather write from a chain of pooled slabs, and receives them with
+// one scatter read into another chain. After the first message, all
+// the slabs are taken from the pool's free lists.
+void PooledSlabChainsOverLoopback()
+{
+    const std::size_t MESSAGE_SIZE = 1024 * 1024;
+    const unsigned int MESSAGE_COUNT = 8;
+
+    try
+    {
+        asio::io_service ios;
+        BufferPool pool;
+
+        asio::ip::tcp::acceptor acceptor(ios,
+                                         asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+        asio::ip::tcp::socket receiver(ios);
+        asio::ip::tcp::socket sender(ios);
+
+        sender.connect(acceptor.local_endpoint());
+        acceptor.accept(receiver);
+
+        std::vector<char> pattern(MESSAGE_SIZE);
+        for (std::size_t i = 0; i < pattern.size(); i++)
+        {
+            pattern[i] = static_cast<char>(i % 251);
+        }
+
+        for (unsigned int i = 0; i < MESSAGE_COUNT; i++)
+        {
+            SlabChain outgoing(pool);
+            SlabChain incoming(pool);
+
+            outgoing.Append(pattern.data(), pattern.size());
+
+            asio::async_write(sender, outgoing.Data(),
+                              [](const boost::system::error_code &ec, std::size_t)
+                              {
+                                  if (ec.value() != 0)
+                                      std::cout << "Error occured! Error code = "
+                                                << ec.value() << ". Message: " << ec.message() << std::endl;
+                              });
+
+            asio::async_read(receiver, incoming.Prepare(MESSAGE_SIZE),
+                             [&incoming](const boost::system::error_code &ec, std::size_t bytes_transferred)
+                             {
+                                 if (ec.value() != 0)
+                                 {
+                                     std::cout << "Error occured! Error code = "
+                                               << ec.value() << ". Message: " << ec.message() << std::endl;
+                                     return;
+                                 }
+
+                                 incoming.Commit(bytes_transferred);
+                             });
+
+            ios.run();
+            ios.reset();
+
+            std::size_t offset = 0;
+            bool intact = incoming.Size() == MESSAGE_SIZE;
+            for (const auto &buffer : incoming.Data())
+            {
+                intact = intact && std::memcmp(asio::buffer_cast<const char *>(buffer),
+                                               pattern.data() + offset,
+                                               asio::buffer_size(buffer)) == 0;
+                offset += asio::buffer_size(buffer);
+            }
+
+            std::cout << "Message " << i + 1 << ": " << incoming.Size() << " bytes in "
+                      << incoming.Data().size() << " slabs, " << (intact ? "intact" : "corrupted")
+                      << ". Slabs allocated: " << pool.GetAllocatedCount()
+                      << ", reused: " << pool.GetReusedCount() << std::endl;
+        }
+    }
+    catch (system::system_error &e)
+    {
+        std::cout << "Error occured! Error code = " << e.code()
+                  << ". Message: " << e.what();
+    }
+}
+
 int main()
 {
     CompositeBuffersGatherOutput();
 
     CompositeBuffersScatterInput();
 
+    PooledSlabChainsOverLoopback();
+
     return 0;
 }
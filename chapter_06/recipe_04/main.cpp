@@ -1,11 +1,359 @@
 #include <boost/asio.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <iostream>
+#include <istream>
+#include <streambuf>
+#include <string>
+#include <vector>
 
 using namespace boost;
 
+// Stream buffer over a TCP socket with large put and get areas of their own
+// size. Output is sent when the put area fills up or the stream is flushed,
+// so many small insertions are batched into a few large writes. Reads and
+// writes larger than the buffers bypass them and move the data straight
+// between the socket and the caller's memory. Every socket operation is
+// interrupted once the timeout elapses, failing the stream with
+// asio::error::timed_out.
+class BufferedSocketStreambuf : public std::streambuf
+{
+public:
+    BufferedSocketStreambuf(std::size_t send_buffer_size,
+                            std::size_t receive_buffer_size) : m_sock(m_ios),
+                                                               m_send_buffer(send_buffer_size),
+                                                               m_receive_buffer(receive_buffer_size),
+                                                               m_timeout(0)
+    {
+        reset_buffers();
+    }
+
+    // Pending output is sent before the socket is closed.
+    ~BufferedSocketStreambuf()
+    {
+        close();
+    }
+
+    // Resolves the host and connects to the first endpoint that accepts.
+    bool connect(const std::string &host, const std::string &service)
+    {
+        close();
+
+        asio::ip::tcp::resolver resolver(m_ios);
+        asio::ip::tcp::resolver::results_type endpoints;
+
+        run_operation(
+            [&](auto handler)
+            {
+                resolver.async_resolve(host, service,
+                                       [&endpoints, handler](const boost::system::error_code &ec,
+                                                             asio::ip::tcp::resolver::results_type results) mutable
+                                       {
+                                           endpoints = results;
+                                           handler(ec, 0);
+                                       });
+            },
+            [&resolver]()
+            { resolver.cancel(); });
+
+        if (m_error.value() != 0)
+            return false;
+
+        run_operation(
+            [&](auto handler)
+            {
+                asio::async_connect(m_sock, endpoints,
+                                    [handler](const boost::system::error_code &ec,
+                                              const asio::ip::tcp::endpoint &) mutable
+                                    { handler(ec, 0); });
+            },
+            [this]()
+            { cancel_socket(); });
+
+        return m_error.value() == 0;
+    }
+
+    // Sends the pending output and closes the socket.
+    void close()
+    {
+        if (m_sock.is_open())
+            sync();
+
+        boost::system::error_code ignored_ec;
+        m_sock.close(ignored_ec);
+        reset_buffers();
+    }
+
+    // The socket, e.g. to be connected by an acceptor.
+    asio::ip::tcp::socket &socket()
+    {
+        return m_sock;
+    }
+
+    // Limits every single read, write, resolve or connect
+    // operation to the timeout. Zero means no limit.
+    void set_timeout(std::chrono::milliseconds timeout)
+    {
+        m_timeout = timeout;
+    }
+
+    // The error of the last operation.
+    const boost::system::error_code &error() const
+    {
+        return m_error;
+    }
+
+protected:
+    int_type overflow(int_type c) override
+    {
+        if (!flush_output())
+            return traits_type::eof();
+
+        if (traits_type::eq_int_type(c, traits_type::eof()))
+            return traits_type::not_eof(c);
+
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+
+        return c;
+    }
+
+    // Called when the stream is flushed.
+    int sync() override
+    {
+        return flush_output() ? 0 : -1;
+    }
+
+    std::streamsize xsputn(const char *s, std::streamsize n) override
+    {
+        if (n <= epptr() - pptr())
+        {
+            std::memcpy(pptr(), s, static_cast<std::size_t>(n));
+            pbump(static_cast<int>(n));
+            return n;
+        }
+
+        // The data does not fit, the pending output and the data go out
+        // together with a single gather write instead of being copied.
+        std::vector<asio::const_buffer> buffers;
+        buffers.push_back(asio::buffer(pbase(), pptr() - pbase()));
+        buffers.push_back(asio::buffer(s, static_cast<std::size_t>(n)));
+
+        std::size_t pending = pptr() - pbase();
+        std::size_t written = write(buffers);
+        setp(m_send_buffer.data(), m_send_buffer.data() + m_send_buffer.size());
+
+        return written > pending ? static_cast<std::streamsize>(written - pending) : 0;
+    }
+
+    int_type underflow() override
+    {
+        if (gptr() < egptr())
+            return traits_type::to_int_type(*gptr());
+
+        std::size_t received = read_some(asio::buffer(m_receive_buffer));
+        if (received == 0)
+            return traits_type::eof();
+
+        setg(m_receive_buffer.data(), m_receive_buffer.data(), m_receive_buffer.data() + received);
+
+        return traits_type::to_int_type(*gptr());
+    }
+
+    // Used by std::istream::read(). What is left in the get area is copied
+    // out; the rest of a large read is received straight into the caller's memory.
+    std::streamsize xsgetn(char *s, std::streamsize n) override
+    {
+        std::streamsize buffered = std::min<std::streamsize>(n, egptr() - gptr());
+        std::memcpy(s, gptr(), static_cast<std::size_t>(buffered));
+        gbump(static_cast<int>(buffered));
+
+        std::streamsize done = buffered;
+        while (done < n)
+        {
+            std::streamsize left = n - done;
+            if (left < static_cast<std::streamsize>(m_receive_buffer.size()))
+            {
+                // Small remainders are read through the get area, so that
+                // whatever arrives with them is kept for the next read.
+                if (traits_type::eq_int_type(underflow(), traits_type::eof()))
+                    break;
+
+                std::streamsize chunk = std::min<std::streamsize>(left, egptr() - gptr());
+                std::memcpy(s + done, gptr(), static_cast<std::size_t>(chunk));
+                gbump(static_cast<int>(chunk));
+                done += chunk;
+                continue;
+            }
+
+            std::size_t received = read_some(asio::buffer(s + done, static_cast<std::size_t>(left)));
+            if (received == 0)
+                break;
+
+            done += static_cast<std::streamsize>(received);
+        }
+
+        return done;
+    }
+
+private:
+    void reset_buffers()
+    {
+        setp(m_send_buffer.data(), m_send_buffer.data() + m_send_buffer.size());
+        setg(m_receive_buffer.data(), m_receive_buffer.data(), m_receive_buffer.data());
+    }
+
+    bool flush_output()
+    {
+        std::size_t pending = pptr() - pbase();
+        if (pending == 0)
+            return true;
+
+        std::size_t written = write(asio::buffer(pbase(), pending));
+        setp(m_send_buffer.data(), m_send_buffer.data() + m_send_buffer.size());
+
+        return written == pending;
+    }
+
+    template <typename ConstBufferSequence>
+    std::size_t write(const ConstBufferSequence &buffers)
+    {
+        return run_operation(
+            [&](auto handler)
+            { asio::async_write(m_sock, buffers, handler); },
+            [this]()
+            { cancel_socket(); });
+    }
+
+    std::size_t read_some(const asio::mutable_buffer &buffer)
+    {
+        return run_operation(
+            [&](auto handler)
+            { m_sock.async_read_some(buffer, handler); },
+            [this]()
+            { cancel_socket(); });
+    }
+
+    void cancel_socket()
+    {
+        boost::system::error_code ignored_ec;
+        m_sock.cancel(ignored_ec);
+    }
+
+    // Runs an asynchronous operation to completion on the calling thread.
+    // If the timeout elapses first, the operation is cancelled and the
+    // socket, whose state is unknown by then, is closed.
+    template <typename Initiation, typename Cancellation>
+    std::size_t run_operation(Initiation initiate, Cancellation cancel)
+    {
+        boost::system::error_code ec = asio::error::would_block;
+        std::size_t transferred = 0;
+
+        m_ios.restart();
+        initiate([&ec, &transferred](const boost::system::error_code &result, std::size_t n)
+                 {
+                     ec = result;
+                     transferred = n;
+                 });
+
+        if (m_timeout.count() > 0)
+            m_ios.run_for(m_timeout);
+        else
+            m_ios.run();
+
+        if (!m_ios.stopped())
+        {
+            cancel();
+            m_ios.run();
+
+            ec = asio::error::timed_out;
+            boost::system::error_code ignored_ec;
+            m_sock.close(ignored_ec);
+        }
+
+        m_error = ec;
+        return transferred;
+    }
+
+private:
+    asio::io_service m_ios;
+    asio::ip::tcp::socket m_sock;
+    std::vector<char> m_send_buffer;
+    std::vector<char> m_receive_buffer;
+    std::chrono::milliseconds m_timeout;
+    boost::system::error_code m_error;
+};
+
+// Drop-in replacement for asio::ip::tcp::iostream for bulk transfers. It
+// offers the same connect(), close(), error() and socket() methods, but its
+// buffers are large and sized by the caller, and output only goes out when
+// a buffer is full or the stream is flushed explicitly.
+class BufferedTCPStream : public std::iostream
+{
+public:
+    static const std::size_t DEFAULT_BUFFER_SIZE = 1024 * 1024;
+
+    explicit BufferedTCPStream(std::size_t send_buffer_size = DEFAULT_BUFFER_SIZE,
+                               std::size_t receive_buffer_size = DEFAULT_BUFFER_SIZE) : std::iostream(nullptr),
+                                                                                        m_buf(send_buffer_size,
+                                                                                              receive_buffer_size)
+    {
+        init(&m_buf);
+    }
+
+    BufferedTCPStream(const std::string &host,
+                      const std::string &service,
+                      std::size_t send_buffer_size = DEFAULT_BUFFER_SIZE,
+                      std::size_t receive_buffer_size = DEFAULT_BUFFER_SIZE) : BufferedTCPStream(send_buffer_size,
+                                                                                                 receive_buffer_size)
+    {
+        connect(host, service);
+    }
+
+    void connect(const std::string &host, const std::string &service)
+    {
+        clear();
+        if (!m_buf.connect(host, service))
+            setstate(std::ios_base::failbit);
+    }
+
+    void close()
+    {
+        m_buf.close();
+        if (m_buf.error().value() != 0)
+            setstate(std::ios_base::failbit);
+    }
+
+    BufferedSocketStreambuf *rdbuf()
+    {
+        return &m_buf;
+    }
+
+    asio::ip::tcp::socket &socket()
+    {
+        return m_buf.socket();
+    }
+
+    void set_timeout(std::chrono::milliseconds timeout)
+    {
+        m_buf.set_timeout(timeout);
+    }
+
+    const boost::system::error_code &error() const
+    {
+        return m_buf.error();
+    }
+
+private:
+    BufferedSocketStreambuf m_buf;
+};
+
 int main()
 {
-    asio::ip::tcp::iostream stream("localhost", "5000");
+    BufferedTCPStream stream;
+    stream.set_timeout(std::chrono::seconds(5));
+    stream.connect("localhost", "5000");
     if (!stream)
     {
         std::cout << "Error occurred! Error code = "
@@ -16,6 +364,12 @@ int main()
         return -1;
     }
 
+    // The records are batched in the send buffer
+    // and go out with the explicit flush.
+    for (int i = 0; i < 3; i++)
+    {
+        stream << "Record " << i << ".\n";
+    }
     stream << "Request.";
     stream.flush();
 